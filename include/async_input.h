@@ -0,0 +1,80 @@
+
+#ifndef _ASYNC_INPUT_H
+#define _ASYNC_INPUT_H
+
+#include <atomic>
+#include <thread>
+
+#include "input.h"
+#include "pixel_upload_ring.h"
+#include "spsc_ring.h"
+
+// Runs another Input's GrabFrame() on a capture thread and hands the frames
+// to WaitForFrame() on the GL thread through a lock-free ring.
+// Every slot of the ring has its own persistently mapped upload buffers, once WaitForFrame() has seen it,
+// so the capture thread writes the pixels straight into memory the textures are updated from.
+class AsyncInput : public Input
+{
+	private:
+		Input *input;
+
+		// a frame and the upload buffers its pixels are captured to
+		struct Slot
+		{
+			InputFrame frame;
+			PixelUploadRing depth_upload{1};
+			PixelUploadRing color_upload{1};
+		};
+
+		SPSCRing<Slot> ring;
+		// the slot uploaded by the last WaitForFrame(), only handed back to the producer when the GPU is done with it
+		Slot *uploading;
+		std::thread capture_thread;
+		std::atomic<bool> running;
+
+		std::atomic<bool> latest_frame_wins;
+		std::atomic<uint64_t> captured_frames;
+		std::atomic<uint64_t> dropped_frames;
+		std::atomic<uint64_t> failed_frames;
+
+		void CaptureLoop();
+
+		// consumer side: blocks until a frame is queued, nullptr if the input failed meanwhile
+		Slot *NextFrame();
+		// consumer side: maps the upload buffers of the uploading slot for its next frame, waiting for the GPU, and ends reading it
+		void ReleaseUploading();
+
+	public:
+		// takes ownership of input, ring_capacity frames can be queued besides the one being uploaded
+		explicit AsyncInput(Input *input, size_t ring_capacity = 3);
+		~AsyncInput() override;
+
+		bool WaitForFrame(Frame *frame) override;
+		bool GrabFrame(InputFrame *frame) override;
+
+		float GetPpx() override			{ return input->GetPpx(); }
+		float GetPpy() override			{ return input->GetPpy(); }
+		float GetFx() override			{ return input->GetFx(); }
+		float GetFy() override			{ return input->GetFy(); }
+
+		float GetPpxColor() override	{ return input->GetPpxColor(); }
+		float GetPpyColor() override	{ return input->GetPpyColor(); }
+		float GetFxColor() override		{ return input->GetFxColor(); }
+		float GetFyColor() override		{ return input->GetFyColor(); }
+
+		void setFilterActive(bool set) override	{ input->setFilterActive(set); }
+		void setColorActive(bool set) override	{ input->setColorActive(set); }
+
+		Input *GetInput()						{ return input; }
+
+		// When processing falls behind, the capture thread overwrites the oldest queued frame
+		// and WaitForFrame() skips to the newest one. Otherwise capture waits until a slot is free.
+		bool GetLatestFrameWins()				{ return latest_frame_wins; }
+		void SetLatestFrameWins(bool v)			{ latest_frame_wins = v; }
+
+		uint64_t GetCapturedFrames()			{ return captured_frames; }
+		uint64_t GetDroppedFrames()				{ return dropped_frames; }
+		size_t GetQueuedFrames()				{ return ring.GetSize(); }
+};
+
+#endif //_ASYNC_INPUT_H
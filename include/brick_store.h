@@ -0,0 +1,88 @@
+
+#ifndef _BRICK_STORE_H
+#define _BRICK_STORE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "voxel_hash_model.h"
+
+// On-disk store for the blocks a VoxelHashModel evicts, see VoxelHashModel::SetBrickStore().
+// Every block has one fixed size record in a single file, the index from block coordinates
+// to records is kept in memory. Prefetch() reads records on a background thread ahead of Read().
+// The background thread reads through its own file handle without holding the mutex,
+// so Read() and Write() only wait for it while it takes a block from the queue or stores one.
+class BrickStore
+{
+	private:
+		bool colors_active;
+		size_t record_size;
+
+		// version is bumped by every Write(), so a record read ahead meanwhile can be told apart
+		struct Record
+		{
+			size_t record;
+			uint64_t version;
+		};
+
+		std::fstream file;
+		// only used by the prefetch thread
+		std::ifstream prefetch_file;
+		std::unordered_map<Eigen::Vector3i, Record, VoxelBlockHash> index;
+		size_t record_count;
+		uint64_t write_count;
+
+		size_t max_prefetched;
+		std::unordered_map<Eigen::Vector3i, std::vector<uint8_t>, VoxelBlockHash> prefetched;
+		std::deque<Eigen::Vector3i> prefetch_queue;
+
+		std::atomic<uint64_t> bytes_read;
+		std::atomic<uint64_t> bytes_written;
+
+		std::thread prefetch_thread;
+		std::mutex mutex;
+		std::condition_variable cond;
+		bool running;
+
+		void PrefetchLoop();
+		// reads from file, so mutex must be held if it is not prefetch_file
+		bool ReadRecord(std::istream &stream, size_t record, uint8_t *data);
+
+	public:
+		// creates or truncates filename, max_prefetched bounds the blocks read ahead
+		BrickStore(const std::string &filename, bool colors_active, size_t max_prefetched = 4096);
+		~BrickStore();
+
+		BrickStore(const BrickStore &) = delete;
+		BrickStore &operator=(const BrickStore &) = delete;
+
+		bool IsOpen()					{ return file.is_open(); }
+		bool GetColorsActive()			{ return colors_active; }
+
+		bool Contains(const Eigen::Vector3i &block);
+		size_t GetBlockCount();
+		size_t GetPrefetchedCount();
+		uint64_t GetBytesRead()			{ return bytes_read; }
+		uint64_t GetBytesWritten()		{ return bytes_written; }
+
+		// color is ignored without colors
+		bool Write(const Eigen::Vector3i &block, const float *tsdf, const uint8_t *weights, const uint8_t *color);
+
+		// Returns false if the block was never written. Blocks that were prefetched come from memory.
+		bool Read(const Eigen::Vector3i &block, float *tsdf, uint8_t *weights, uint8_t *color);
+
+		// queues the stored blocks among blocks to be read in the background, never blocks
+		void Prefetch(const std::vector<Eigen::Vector3i> &blocks);
+};
+
+#endif //_BRICK_STORE_H
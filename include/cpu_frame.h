@@ -0,0 +1,77 @@
+
+#ifndef _CPU_FRAME_H
+#define _CPU_FRAME_H
+
+#include <cstdint>
+#include <vector>
+
+#include <Eigen/Core>
+
+class ThreadPool;
+
+// CPU counterpart of Frame for running without a GPU.
+// ProcessFrame() computes the same vertex and normal maps as Frame's compute shader,
+// stored as one row major float plane per component (infinity where there is no depth).
+class CPUFrame
+{
+	private:
+		ThreadPool *thread_pool;
+
+		int depth_width;
+		int depth_height;
+		float depth_scale;
+		std::vector<uint16_t> depth;
+
+		Eigen::Vector2f intrinsics_focal_length;
+		Eigen::Vector2f intrinsics_center;
+
+		int color_width;
+		int color_height;
+		std::vector<uint8_t> color;
+
+		Eigen::Vector2f intrinsics_color_focal_length;
+		Eigen::Vector2f intrinsics_color_center;
+
+		std::vector<float> vertex_x, vertex_y, vertex_z;
+		std::vector<float> normal_x, normal_y, normal_z;
+
+		void DeprojectRows(int y_begin, int y_end);
+		void NormalRows(int y_begin, int y_end);
+		void NormalAt(int x, int y);
+
+	public:
+		// thread_pool may be nullptr to run on the calling thread only
+		explicit CPUFrame(ThreadPool *thread_pool = nullptr);
+
+		void SetDepthMap(int width, int height, const uint16_t *data, float depth_scale, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center);
+
+		// rgb, 3 bytes per pixel like Frame::SetColorMap(), only used for integration
+		void SetColorMap(int width, int height, const uint8_t *data, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center);
+
+		int GetDepthWidth()		{ return depth_width; }
+		int GetDepthHeight()	{ return depth_height; }
+		float GetDepthScale()	{ return depth_scale; }
+		const uint16_t *GetDepthMap()	{ return depth.data(); }
+
+		Eigen::Vector2f GetIntrinsicsFocalLength()	{ return intrinsics_focal_length; }
+		Eigen::Vector2f GetIntrinsicsCenter()		{ return intrinsics_center; }
+
+		int GetColorWidth()		{ return color_width; }
+		int GetColorHeight()	{ return color_height; }
+		// nullptr without a color map
+		const uint8_t *GetColorMap()	{ return color.empty() ? nullptr : color.data(); }
+
+		Eigen::Vector2f GetIntrinsicsColorFocalLength()	{ return intrinsics_color_focal_length; }
+		Eigen::Vector2f GetIntrinsicsColorCenter()		{ return intrinsics_color_center; }
+
+		const float *GetVertexX()	{ return vertex_x.data(); }
+		const float *GetVertexY()	{ return vertex_y.data(); }
+		const float *GetVertexZ()	{ return vertex_z.data(); }
+		const float *GetNormalX()	{ return normal_x.data(); }
+		const float *GetNormalY()	{ return normal_y.data(); }
+		const float *GetNormalZ()	{ return normal_z.data(); }
+
+		void ProcessFrame();
+};
+
+#endif //_CPU_FRAME_H
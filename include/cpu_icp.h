@@ -0,0 +1,77 @@
+
+#ifndef _CPU_ICP_H
+#define _CPU_ICP_H
+
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include "icp_solver.h"
+
+class CPUFrame;
+class CameraTransform;
+class ThreadPool;
+
+// CPU counterpart of ICP for tracking without a GPU.
+// Uses the same projective association, thresholds and solver, with the
+// equation system summed into one accumulator per thread pool thread.
+class CPUICP
+{
+	private:
+		ThreadPool *thread_pool;
+
+		// padded to a cache line so threads don't share one
+		struct alignas(64) Accumulator
+		{
+			float values[ICP_REDUCE_VALUES];
+		};
+		std::vector<Accumulator> accumulators;
+		float values[ICP_REDUCE_VALUES];
+
+		float distance_threshold;
+		float angle_threshold;
+
+		ICPConvergenceCriteria convergence_criteria;
+		float error;
+		unsigned int iterations;
+		bool converged;
+
+		Eigen::Vector3f last_rot_delta;
+		Eigen::Vector3f last_translation_delta;
+
+		void AccumulateRows(CPUFrame *frame, CPUFrame *prediction, const Eigen::Affine3f &prediction_transform,
+				const Eigen::Affine3f &transform_current, int y_begin, int y_end, float *accumulator);
+
+	public:
+		// thread_pool may be nullptr to run on the calling thread only
+		explicit CPUICP(ThreadPool *thread_pool = nullptr);
+
+		// prediction holds the vertex and normal maps of the model in the camera space of prediction_transform,
+		// e.g. the CPUFrame of the last frame for frame to frame tracking
+		void SearchCorrespondences(CPUFrame *frame, CPUFrame *prediction, const Eigen::Affine3f &prediction_transform, const CameraTransform &cam_transform_current);
+		void SolveMatrix(CameraTransform *cam_transform);
+
+		// same as in ICP, but there is only one level
+		void ResetConvergence();
+		bool GetConverged()					{ return converged; }
+		unsigned int GetIterations()		{ return iterations; }
+		float GetError()					{ return error; }
+
+		ICPConvergenceCriteria GetConvergenceCriteria()				{ return convergence_criteria; }
+		void SetConvergenceCriteria(const ICPConvergenceCriteria &v)	{ convergence_criteria = v; }
+
+		// values summed by the last SearchCorrespondences(), see ICP_REDUCE_VALUES
+		const float *GetValues()			{ return values; }
+
+		float GetDistanceThreshold()		{ return distance_threshold; }
+		float GetAngleThreshold()			{ return angle_threshold; }
+
+		void SetDistanceThreshold(float v)	{ distance_threshold = v; }
+		void SetAngleThreshold(float v)		{ angle_threshold = v; }
+
+		Eigen::Vector3f GetLastRotDelta()	{ return last_rot_delta; }
+		Eigen::Vector3f GetLastTranslationDelta() { return last_translation_delta; }
+};
+
+#endif //_CPU_ICP_H
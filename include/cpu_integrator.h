@@ -0,0 +1,72 @@
+
+#ifndef _CPU_INTEGRATOR_H
+#define _CPU_INTEGRATOR_H
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include <cstdint>
+
+class CPUFrame;
+class CPUModel;
+class VoxelHashModel;
+class CameraTransform;
+class ThreadPool;
+
+// CPU counterpart of PC_Integrator for fusion without a GPU.
+// Updates the tsdf, weights and colors of a CPUModel in place with the same
+// truncation and running average as the integration shader.
+// With a VoxelHashModel, the blocks around the depth are allocated first
+// and only allocated blocks are integrated. If it pages to a BrickStore, the blocks
+// in view of the next frame are read ahead while the caller prepares that frame.
+class CPUIntegrator
+{
+	private:
+		CPUModel *model;
+		VoxelHashModel *hash_model;
+		ThreadPool *thread_pool;
+
+		unsigned int max_weight;
+
+		// the pose of the last frame, to predict the next one for the brick store prefetch
+		Eigen::Affine3f last_transform;
+		bool last_transform_valid;
+
+		struct Params
+		{
+			Eigen::Matrix4f modelview;
+			Eigen::Vector3f cam_pos;
+			Eigen::Vector3f cam_dir;
+			float min_truncation;
+			float max_truncation;
+			// largest depth of the frame
+			float max_depth;
+			Eigen::Vector3f world_min;
+			Eigen::Vector3f world_max;
+		};
+
+		bool ComputeBounds(CPUFrame *frame, const Eigen::Affine3f &transform, Params *params);
+		void IntegrateSlices(CPUFrame *frame, const Params &params, const Eigen::Vector3i &box_min, const Eigen::Vector3i &box_max, int z_begin, int z_end);
+		void IntegrateBlocks(CPUFrame *frame, const Params &params, const int *indices, int count);
+		// color is nullptr without colors
+		void IntegrateVoxel(CPUFrame *frame, const Params &params, float wx, float wy, float wz, float *tsdf, uint8_t *weight, uint8_t *color);
+		void IntegrateColor(CPUFrame *frame, const Eigen::Vector3f &v, uint8_t *color);
+#ifdef __AVX2__
+		// 8 voxels along x at once with AVX2, the arrays start at the first one
+		void IntegrateRow8(CPUFrame *frame, const Params &params, const float *wx, float wy, float wz, float *tsdf, uint8_t *weights, uint8_t *color);
+#endif
+
+	public:
+		// thread_pool may be nullptr to run on the calling thread only
+		explicit CPUIntegrator(CPUModel *model, ThreadPool *thread_pool = nullptr);
+		explicit CPUIntegrator(VoxelHashModel *hash_model, ThreadPool *thread_pool = nullptr);
+
+		// Frame only needs its depth map (and color map if the model has colors), ProcessFrame() is not required.
+		// Returns false if a VoxelHashModel ran out of blocks, the allocated ones are still integrated.
+		bool Integrate(CPUFrame *frame, const CameraTransform &camera_transform);
+
+		unsigned int GetMaxWeight()			{ return max_weight; }
+		void SetMaxWeight(unsigned int v)	{ max_weight = v; }
+};
+
+#endif //_CPU_INTEGRATOR_H
@@ -4,12 +4,21 @@
 
 //#include <pcl/point_types.h>
 //#include <pcl/point_cloud.h>
+#include <algorithm>
+#include <cstdint>
 #include <vector>
 
 #include "window.h"
+#include "pixel_upload_ring.h"
 
 #include <Eigen/Core>
 
+// number of levels of the depth, vertex and normal pyramid, each level has half the resolution of the previous one
+#define FRAME_PYRAMID_LEVELS 3
+
+// samples further apart than this (in meters) are not averaged when building a pyramid level
+#define FRAME_PYRAMID_MAX_DIFF 0.03
+
 class Frame
 {
 	private:
@@ -22,41 +31,80 @@ class Frame
 		int depth_width;
 		int depth_height;
 		float depth_scale;
+		int pyramid_levels;
+
+		uint64_t timestamp_us;
+
+		int color_width;
+		int color_height;
+
+		PixelUploadRing depth_upload;
+		PixelUploadRing color_upload;
 
 		Eigen::Vector2f intrinsics_focal_length;
 		Eigen::Vector2f intrinsics_center;
 		Eigen::Vector2f intrinsics_color_focal_length;
 		Eigen::Vector2f intrinsics_color_center;
-		GLuint camera_intrinsics_buffer;
+		GLuint camera_intrinsics_buffers[FRAME_PYRAMID_LEVELS];
 		GLuint camera_intrinsics_colorbuffer;
 
+		GLuint depth_range_buffer;
+
 		GLuint process_program;
 		GLint depth_scale_uniform;
+		GLint level_uniform;
+
+		GLuint downsample_program;
+		GLint downsample_depth_scale_uniform;
+		GLint downsample_level_uniform;
+
+		void UploadIntrinsics(GLuint buffer, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center, int width, int height);
 
 	public:
 		Frame();
 		~Frame();
 
+		// data is copied into the next slot of a persistently mapped upload buffer, from which the texture is updated asynchronously
 		void SetDepthMap(int width, int height, GLushort *data, float depth_scale, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center);
 		void SetColorMap(int width, int height, GLushort *data, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center);
+
+		// Same for an image that was written to the slot returned by the last upload->Map() already, nothing is copied.
+		void SetDepthMap(int width, int height, PixelUploadRing *upload, float depth_scale, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center);
+		void SetColorMap(int width, int height, PixelUploadRing *upload, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center);
+
+		// capture time given by the Input, 0 if it has none
+		uint64_t GetTimestamp()				{ return timestamp_us; }
+		void SetTimestamp(uint64_t v)		{ timestamp_us = v; }
+
 		GLuint GetDepthTex()	{ return depth_tex; }
-		int GetDepthWidth()		{ return depth_width; }
-		int GetDepthHeight()	{ return depth_height; }
 		float GetDepthScale()	{ return depth_scale; }
 
+		// depth, vertex and normal textures have one mip level per pyramid level
+		int GetPyramidLevels()				{ return pyramid_levels; }
+		int GetDepthWidth(int level = 0)	{ return depth_width > 0 ? std::max(1, depth_width >> level) : 0; }
+		int GetDepthHeight(int level = 0)	{ return depth_height > 0 ? std::max(1, depth_height >> level) : 0; }
+
+		// std430 { uint max_depth_bits; }, the largest valid depth in meters as float bits, written by ProcessFrame().
+		// Infinity after SetDepthMap() until the frame is processed.
+		GLuint GetDepthRangeBuffer()	{ return depth_range_buffer; }
+
 		GLuint GetVertexTex()	{ return vertex_tex; }
 		GLuint GetNormalTex()	{ return normal_tex; }
 		GLuint GetColorTex()	{ return color_tex; }
 
-		Eigen::Vector2f GetIntrinsicsFocalLength()	{ return intrinsics_focal_length; }
-		Eigen::Vector2f GetIntrinsicsCenter()		{ return intrinsics_center; }
-		GLuint GetCameraIntrinsicsBuffer()			{ return camera_intrinsics_buffer; }
+		Eigen::Vector2f GetIntrinsicsFocalLength(int level = 0)	{ return intrinsics_focal_length / (float)(1 << level); }
+		Eigen::Vector2f GetIntrinsicsCenter(int level = 0)
+		{
+			return (intrinsics_center + Eigen::Vector2f(0.5f, 0.5f)) / (float)(1 << level) - Eigen::Vector2f(0.5f, 0.5f);
+		}
+		GLuint GetCameraIntrinsicsBuffer(int level = 0)			{ return camera_intrinsics_buffers[level]; }
 
 		Eigen::Vector2f GetIntrinsicsColorFocalLength() { return intrinsics_color_focal_length; }
 		Eigen::Vector2f GetIntrinsicsColorCenter() { return intrinsics_color_center; }
 		GLuint GetCameraIntrinsicsColorBuffer() { return camera_intrinsics_colorbuffer; }
 
 
+		// builds the depth pyramid and computes vertex and normal maps for all levels
 		void ProcessFrame();
 };
 
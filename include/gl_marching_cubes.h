@@ -0,0 +1,110 @@
+
+#ifndef _GL_MARCHING_CUBES_H
+#define _GL_MARCHING_CUBES_H
+
+#include "window.h"
+#include "mesh.h"
+
+class GLModel;
+class MeshWriter;
+
+// Marching cubes on the textures of a GLModel in compute shaders, without copying the volume to the CPU.
+// The cells are classified first, then the voxels that have a triangle in their cell or own a vertex
+// on one of their three edges are compacted with a prefix sum. Every edge crossing becomes one vertex
+// shared by the triangles around it like in Marching_Cubes::ExtractMesh(). Only the finished vertices,
+// indices and face colors are read back.
+class GLMarchingCubes
+{
+	private:
+		GLModel *model;
+
+		GLuint classify_program;
+		GLint classify_iso_uniform;
+		GLint classify_observed_only_uniform;
+
+		GLuint scan_program;
+		GLint scan_count_uniform;
+		GLint scan_in_offset_uniform;
+		GLint scan_out_offset_uniform;
+		GLint scan_sums_offset_uniform;
+		GLint scan_predicate_uniform;
+
+		GLuint scan_add_program;
+		GLint scan_add_count_uniform;
+		GLint scan_add_offset_uniform;
+		GLint scan_add_sums_offset_uniform;
+
+		GLuint compact_program;
+		GLint compact_count_uniform;
+
+		GLuint generate_program;
+		GLint generate_iso_uniform;
+		GLint generate_first_uniform;
+		GLint generate_count_uniform;
+		GLint generate_triangle_end_uniform;
+		GLint generate_vertex_base_uniform;
+		GLint generate_triangle_base_uniform;
+
+		// a shader storage buffer that only grows
+		struct StorageBuffer
+		{
+			GLuint buffer;
+			size_t capacity;
+		};
+
+		// edgeTable, the triangle count of each case and triTable
+		GLuint tables_buffer;
+
+		// per voxel: the case of its cell and the edges it owns a vertex on, and its index among the active voxels
+		StorageBuffer flags;
+		StorageBuffer active_index;
+		// per active voxel: voxel index and flags, offset of its first triangle and of its first vertex
+		StorageBuffer active_voxels;
+		StorageBuffer triangle_offsets;
+		StorageBuffer vertex_offsets;
+		// block sums of all levels of a prefix sum
+		StorageBuffer scan_sums;
+
+		StorageBuffer vertices;
+		StorageBuffer indices;
+		StorageBuffer colors;
+
+		// results of the last Classify()
+		unsigned int active_count;
+		unsigned int vertex_count;
+		unsigned int triangle_count;
+
+		void CreateBuffer(StorageBuffer *buffer, const char *label);
+		// grows buffer to at least bytes, the contents are lost then
+		void Reserve(StorageBuffer *buffer, size_t bytes);
+
+		// Exclusive prefix sum of count values, in may be out. With predicate, the values are 1 if not 0.
+		// Returns the sum of all values, which waits for the GPU.
+		unsigned int Scan(GLuint in, GLuint out, unsigned int count, bool predicate);
+
+		// classifies and compacts the voxels and sums up the offsets, returns the number of active voxels
+		unsigned int Classify(double iso, bool observed_only);
+		// the offset of an active voxel in a summed up buffer, total past the last one, waits for the GPU
+		unsigned int ReadOffset(StorageBuffer *buffer, unsigned int slot, unsigned int total);
+		// the first active voxel in slice z or after it
+		unsigned int FirstActiveVoxel(int z);
+		// Adds the vertices of the active voxels [first, end) and the triangles of the cells of those
+		// before triangle_end to mesh, numbered from its current vertex count.
+		void Generate(double iso, unsigned int first, unsigned int end, unsigned int triangle_end, Mesh *mesh);
+
+	public:
+		GLMarchingCubes(GLModel *model);
+		~GLMarchingCubes();
+
+		GLMarchingCubes(const GLMarchingCubes &) = delete;
+		GLMarchingCubes &operator=(const GLMarchingCubes &) = delete;
+
+		// Adds the surface of the whole volume to mesh, the vertices are in world space.
+		// observed_only skips cells with a corner of weight 0 like Marching_Cubes::ExtractMesh().
+		void ExtractMesh(double iso, Mesh *mesh, bool observed_only = false);
+		// Writes the same surface to a writer after Begin() in slabs of MC_STREAM_SLAB_SLICES slices,
+		// only one slab is read back at a time.
+		void StreamMesh(double iso, MeshWriter *writer, bool observed_only = false);
+};
+
+#endif //_GL_MARCHING_CUBES_H
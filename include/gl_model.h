@@ -14,20 +14,76 @@ class GLModel: public Model
 
 		GLuint params_buffer;
 
+		// texel of voxel (0, 0, 0), see Shift()
+		Eigen::Vector3i ring_offset;
+		bool rolling;
+		// the origin given on construction, restored by Reset()
+		Eigen::Vector3f reset_origin;
+
 		bool colorsActive;
+		bool packedVoxels;
 		void Init();
+		void UploadParams();
+		void ClearTexels(const Eigen::Vector3i &texel, const Eigen::Vector3i &size);
+		// moves the texels of tex to where they belong without the ring offset
+		void UnwrapTexture(GLuint tex);
+
+		// copy between a texture and x fastest voxels, across the ring offset
+		void WriteTexture(GLuint tex, GLenum format, GLenum type, size_t texel_size, const void *data);
+		void ReadTexture(GLuint tex, GLenum format, GLenum type, size_t texel_size, const Eigen::Vector3i &begin, const Eigen::Vector3i &end, void *data);
 
 	public:
-		GLModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, bool colorsActive);
-		GLModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, Eigen::Vector3f modelOrigin, bool colorsActive);
+		// With packedVoxels, tsdf and weight share one GL_RG16_SNORM texture in the layout of PackedVoxel
+		// and there is no weight texture. Halves the memory and the image accesses of integration.
+		GLModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, bool colorsActive, bool packedVoxels = false);
+		GLModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, Eigen::Vector3f modelOrigin, bool colorsActive, bool packedVoxels = false);
 		~GLModel() override;
 
+		// also moves the volume back to the origin it was constructed with
 		void Reset() override;
 		void CopyFrom(CPUModel *cpu_model);
 		void CopyTo(CPUModel *cpu_model);
 
+		// With rolling, the textures wrap around at their borders instead of clamping,
+		// which Shift() needs. Sampling at the border of the volume blends in the opposite side then.
+		// Turning it off rearranges the texels of a shifted volume, so the ring offset is 0 again.
+		void SetRolling(bool rolling);
+		bool GetRolling()						{ return rolling; }
+
+		// Moves the volume by whole voxels without copying: voxel v afterwards is voxel v + voxels before,
+		// so the origin moves by voxels * cell size. Only the addressing changes, the voxels that wrapped
+		// around to the other side still hold the old values until ClearVoxels().
+		void Shift(const Eigen::Vector3i &voxels);
+
+		Eigen::Vector3i GetRingOffset()			{ return ring_offset; }
+		Eigen::Vector3i VoxelToTexel(const Eigen::Vector3i &voxel);
+
+		// a box of voxels that is contiguous in the textures
+		struct TexelBox
+		{
+			Eigen::Vector3i voxel;
+			Eigen::Vector3i texel;
+			Eigen::Vector3i size;
+		};
+
+		// Splits the voxels in [begin, end) at the texture borders, returns the number of boxes written.
+		int GetTexelBoxes(const Eigen::Vector3i &begin, const Eigen::Vector3i &end, TexelBox boxes[8]);
+
+		// Writes the voxels in [begin, end) x fastest to the arrays, color may be nullptr.
+		// With a GL_PIXEL_PACK_BUFFER bound, the pointers are offsets into it and the copy is asynchronous,
+		// but packed voxels are unpacked on the CPU and need ReadPackedVoxels() for that.
+		void ReadVoxels(const Eigen::Vector3i &begin, const Eigen::Vector3i &end, float *tsdf, uint8_t *weights, uint8_t *color);
+		void ReadPackedVoxels(const Eigen::Vector3i &begin, const Eigen::Vector3i &end, PackedVoxel *voxels, uint8_t *color);
+
+		// resets the voxels in [begin, end) like Reset()
+		void ClearVoxels(const Eigen::Vector3i &begin, const Eigen::Vector3i &end);
+
+		bool GetPackedVoxels()		{ return packedVoxels; }
+
 		GLuint GetColorTex()		{ return color_tex; }
+		// the packed voxels with GetPackedVoxels()
 		GLuint GetTSDFTex()			{ return tsdf_tex; }
+		// 0 with GetPackedVoxels()
 		GLuint GetWeightTex()		{ return weight_tex; }
 		GLuint GetParamsBuffer()	{ return params_buffer; }
 };
@@ -3,6 +3,9 @@
 #define _ICP_H
 
 #include "window.h"
+#include "frame.h"
+#include "pose_buffer.h"
+#include "icp_solver.h"
 
 #include <Eigen/Core>
 
@@ -18,22 +21,43 @@ class ICP
 		GLuint corr_program;
 		GLint corr_distance_sq_threshold_uniform;
 		GLint corr_angle_cos_threshold_uniform;
-		GLint corr_modelview_prev_uniform;
 		GLint corr_projection_prev_uniform;
-		GLint corr_transform_current_uniform;
 		GLint corr_image_res_uniform;
+		GLint corr_level_uniform;
 
 		GLuint residuals_buffer;
-		unsigned int residuals_count;
+		// one partial sum of the equation system per corr_program workgroup
+		unsigned int block_count;
+		unsigned int block_capacity;
 
 		GLuint reduce_program;
-		GLint reduce_residuals_count_uniform;
+		GLint reduce_block_count_uniform;
+		GLint reduce_level_uniform;
 
 		GLuint matrix_buffer;
 
+		GLuint solve_program;
+		GLint solve_det_threshold_uniform;
+		GLint solve_level_uniform;
+		GLint solve_min_rot_delta_uniform;
+		GLint solve_min_translation_delta_uniform;
+		GLint solve_min_residual_reduction_uniform;
+
+		// pose given to SearchCorrespondences() on the CPU
+		PoseBuffer current_pose;
+
+		void ReduceEquation(PoseBuffer *pose, int level);
+
 		float distance_threshold;
 		float angle_threshold;
 
+		ICPConvergenceCriteria convergence_criteria;
+
+		// state of the CameraTransform path per pyramid level, the PoseBuffer path keeps it in the pose
+		float error[FRAME_PYRAMID_LEVELS];
+		unsigned int iterations[FRAME_PYRAMID_LEVELS];
+		bool converged[FRAME_PYRAMID_LEVELS];
+
 		Eigen::Vector3f last_rot_delta;
 		Eigen::Vector3f last_translation_delta;
 
@@ -47,8 +71,28 @@ class ICP
 		ICP();
 		virtual ~ICP();
 
-		void SearchCorrespondences(Frame *frame, Renderer *renderer, const CameraTransform &cam_transform_current);
-		void SolveMatrix(CameraTransform *cam_transform);
+		// level selects the Frame/Renderer pyramid level to match, 0 is the full resolution
+		void SearchCorrespondences(Frame *frame, Renderer *renderer, const CameraTransform &cam_transform_current, int level = 0);
+		void SolveMatrix(CameraTransform *cam_transform, int level = 0);
+
+		// Same as above, but the pose stays on the GPU: it is read from and the update is applied to pose.
+		// No CPU-GPU synchronization happens and GetLastRotDelta()/GetLastTranslationDelta() are not updated,
+		// the deltas are in the pose buffer instead.
+		void SearchCorrespondences(Frame *frame, Renderer *renderer, PoseBuffer *pose_current, int level = 0);
+		void SolveMatrix(PoseBuffer *pose, int level = 0);
+
+		// Starts the iterations of a new frame. Once SolveMatrix() found a level converged, further iterations
+		// on it have no effect: GetConverged() tells when to stop on the CPU, with a PoseBuffer the GPU skips
+		// them by itself and the state is read back with the pose.
+		void ResetConvergence();
+		void ResetConvergence(PoseBuffer *pose);
+
+		bool GetConverged(int level)			{ return converged[level]; }
+		unsigned int GetIterations(int level)	{ return iterations[level]; }
+		float GetError(int level)				{ return error[level]; }
+
+		ICPConvergenceCriteria GetConvergenceCriteria()				{ return convergence_criteria; }
+		void SetConvergenceCriteria(const ICPConvergenceCriteria &v)	{ convergence_criteria = v; }
 
 		float GetDistanceThreshold()		{ return distance_threshold; }
 		float GetAngleThreshold()			{ return angle_threshold; }
@@ -0,0 +1,72 @@
+
+#ifndef _ICP_SOLVER_H
+#define _ICP_SOLVER_H
+
+#include <Eigen/Geometry>
+
+// components of a point-to-plane residual: cross(s, n), n and dot(n, d - s)
+#define ICP_RESIDUAL_COMPONENTS 7
+#define ICP_MATRIX_ROWS (ICP_RESIDUAL_COMPONENTS-1)
+
+// unique values of the 6x6 normal equations: upper triangle of A in row major order, followed by b
+#define ICP_EQUATION_VALUES (ICP_MATRIX_ROWS * (ICP_MATRIX_ROWS + 1) / 2 + ICP_MATRIX_ROWS)
+
+// summed per iteration: the equation system, followed by the squared residuals and the number of correspondences
+#define ICP_REDUCE_VALUES (ICP_EQUATION_VALUES + 2)
+#define ICP_REDUCE_ERROR ICP_EQUATION_VALUES
+#define ICP_REDUCE_COUNT (ICP_EQUATION_VALUES + 1)
+
+// The iterations on a pyramid level stop once an update is below both minimum deltas,
+// or the mean squared residual went down by less than min_residual_reduction (relative to the previous iteration).
+struct ICPConvergenceCriteria
+{
+	float min_rot_delta = 0.0001f;
+	float min_translation_delta = 0.0001f;
+	float min_residual_reduction = 0.01f;
+};
+
+// Shared by the GPU and CPU ICP to turn the summed equation system into a pose update.
+class ICPSolver
+{
+	public:
+		// adds the products of one residual to values, see ICP_REDUCE_VALUES
+		static inline void Accumulate(float *values, const float *residual)
+		{
+			int value = 0;
+			for(int row=0; row<ICP_MATRIX_ROWS; row++)
+			{
+				for(int col=row; col<ICP_MATRIX_ROWS; col++)
+					values[value++] += residual[row] * residual[col];
+			}
+			for(int row=0; row<ICP_MATRIX_ROWS; row++)
+				values[value++] += residual[row] * residual[ICP_MATRIX_ROWS];
+			values[ICP_REDUCE_ERROR] += residual[ICP_MATRIX_ROWS] * residual[ICP_MATRIX_ROWS];
+			values[ICP_REDUCE_COUNT] += 1.0f;
+		}
+
+		// mean squared point-to-plane residual of the summed values
+		static float MeanError(const float *values)
+		{
+			return values[ICP_REDUCE_COUNT] > 0.0f ? values[ICP_REDUCE_ERROR] / values[ICP_REDUCE_COUNT] : 0.0f;
+		}
+
+		// error_prev is the MeanError() of the previous iteration on the same level, 0 for the first one
+		static bool Converged(const ICPConvergenceCriteria &criteria, float error_prev, float error,
+				const Eigen::Vector3f &rot_delta, const Eigen::Vector3f &translation_delta)
+		{
+			if(error_prev > 0.0f && error_prev - error < criteria.min_residual_reduction * error_prev)
+				return true;
+			return rot_delta.norm() < criteria.min_rot_delta && translation_delta.norm() < criteria.min_translation_delta;
+		}
+
+		// level is the pyramid level the correspondences were searched on
+		static float DeterminantThreshold(int level);
+
+		// Solves the equation system, false if it is too badly conditioned to be trusted.
+		static bool Solve(const float *equation, int level, Eigen::Vector3f *rot_delta, Eigen::Vector3f *translation_delta);
+
+		// applies a solved update to transform
+		static void ApplyDelta(Eigen::Affine3f *transform, const Eigen::Vector3f &rot_delta, const Eigen::Vector3f &translation_delta);
+};
+
+#endif //_ICP_SOLVER_H
@@ -2,14 +2,72 @@
 #ifndef _INPUT_H
 #define _INPUT_H
 
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <Eigen/Core>
+
 class Frame;
 
+// Depth (and optionally color) images in CPU memory, filled by Input::GrabFrame() without touching GL.
+struct InputFrame
+{
+	uint64_t timestamp_us = 0;
+
+	int depth_width = 0;
+	int depth_height = 0;
+	float depth_scale = 1.0f;
+	Eigen::Vector2f depth_focal_length;
+	Eigen::Vector2f depth_center;
+	const uint16_t *depth = nullptr;
+
+	// color is RGB8, nullptr if color is not active
+	int color_width = 0;
+	int color_height = 0;
+	Eigen::Vector2f color_focal_length;
+	Eigen::Vector2f color_center;
+	const uint8_t *color = nullptr;
+
+	// backing memory for inputs that can not hand out pointers to their own buffers
+	std::vector<uint16_t> depth_storage;
+	std::vector<uint8_t> color_storage;
+
+	// Memory given by the consumer for the pixels, AsyncInput points it to persistently mapped upload buffers
+	// so the capture thread writes straight into them. Sizes are in bytes, nullptr if there is none.
+	uint16_t *depth_buffer = nullptr;
+	size_t depth_buffer_size = 0;
+	uint8_t *color_buffer = nullptr;
+	size_t color_buffer_size = 0;
+
+	// where an input that copies the pixels puts them: the buffers above if they fit, the storage otherwise
+	uint16_t *WritableDepth(size_t count)
+	{
+		if(depth_buffer && count * sizeof(uint16_t) <= depth_buffer_size)
+			return depth_buffer;
+		depth_storage.resize(count);
+		return depth_storage.data();
+	}
+	uint8_t *WritableColor(size_t bytes)
+	{
+		if(color_buffer && bytes <= color_buffer_size)
+			return color_buffer;
+		color_storage.resize(bytes);
+		return color_storage.data();
+	}
+};
+
 class Input
 {
 	public:
 		virtual ~Input() {}
 
 		virtual bool WaitForFrame(Frame *frame) =0;
+
+		// Same as WaitForFrame(), but only captures into CPU memory.
+		// Does not require a GL context, so it may be called from any thread.
+		virtual bool GrabFrame(InputFrame *frame) =0;
+
 		virtual float GetPpx() = 0;
 		virtual float GetPpy() = 0;
 		virtual float GetFx() = 0;
@@ -2,34 +2,61 @@
 #define _MARCHING_CUBES_H
 
 #include "model.h"
+#include "voxel_hash_model.h"
 #include "mesh.h"
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 
+#include <functional>
+#include <vector>
+
+// slices per slab and vertices per chunk of hash blocks handed to the MeshWriter at once by process_mc()
+#define MC_STREAM_SLAB_SLICES 16
+#define MC_STREAM_CHUNK_VERTICES (1 << 16)
+
+class ThreadPool;
+
+// the classic tables by Paul Bourke, also used by GLMarchingCubes
+extern int edgeTable[256];
+extern int triTable[256][16];
+
 class Marching_Cubes {
 
 private:
 	CPUModel* model;
-	int resolutionX;
-	int resolutionY;
-	int resolutionZ;
+	VoxelHashModel* hash_model;
+	ThreadPool* thread_pool;
 
-	int IDX(int x, int y, int z) //3d index -> 1d index
-	{
-		return	(z * resolutionY * resolutionX) + (resolutionX * y) + x;
-	}
+	// Cells of the slices [z_begin, z_end) with one vertex per edge crossing. The vertices on the planes z_begin and z_end
+	// are returned in bottom and top, indexed like the edge caches, to weld neighboring slabs.
+	void ExtractSlab(int z_begin, int z_end, double iso, bool observed_only, Mesh* mesh, std::vector<unsigned int>* bottom, std::vector<unsigned int>* top);
+	// Slabs of grain slices, window of them at a time on the thread pool. Each slab is passed to emit in z order
+	// with the index of each of its vertices in the whole mesh, the new ones numbered on in the order of the slab.
+	void ExtractSlabs(double iso, bool observed_only, int grain, int window, const std::function<void(Mesh&, std::vector<unsigned int>&)>& emit);
 
 public:
-	Marching_Cubes(CPUModel* model);
+	// thread_pool may be nullptr to extract on the calling thread only
+	Marching_Cubes(CPUModel* model, ThreadPool* thread_pool = nullptr);
+	// only the allocated blocks are visited, the vertices are in world space instead of grid space
+	Marching_Cubes(VoxelHashModel* hash_model);
 	~Marching_Cubes();
 
 	struct MC_Triangle;
 	struct MC_Gridcell;
 	struct MC_Gridcell_2;
 
+	// writes the mesh to filename as it is extracted, see MeshWriter for the formats
 	void process_mc(const std::string &filename);
+	// All cells of the CPUModel, in slabs along z on the thread pool. Each edge crossing becomes one vertex
+	// shared by the triangles around it, the vertices are in grid space.
+	// observed_only skips cells with a corner of weight 0 like ProcessHashBlock().
+	void ExtractMesh(double iso, Mesh* mesh, bool observed_only = false);
+	// Like ExtractMesh(), but thin slabs are handed to writer while extracting, between its Begin() and Close().
+	// The memory used is bounded by the size of a slab instead of the whole surface.
+	void StreamMesh(double iso, MeshWriter* writer, bool observed_only = false);
 	bool ProcessVolumeCell(CPUModel* model, int x, int y, int z, double iso, Mesh* mesh);
-	int Polygonise(MC_Gridcell grid, double isolevel, MC_Triangle* triangles);
+	bool ProcessHashBlock(int index, double iso, Mesh* mesh);
+	int Polygonise(const MC_Gridcell& grid, double isolevel, MC_Triangle* triangles);
 	Eigen::Vector3f VertexInterp(double isolevel, const Eigen::Vector3f& p1, const Eigen::Vector3f& p2, double valp1, double valp2);
 
 };
@@ -9,6 +9,8 @@
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 
+#include "mesh_writer.h"
+
 typedef Eigen::Vector3f Vertex;
 
 struct Triangle
@@ -47,6 +49,21 @@ public:
 		return fId;
 	}
 
+	// adds the vertices and faces of other, with the indices offset past the vertices already here
+	void Append(Mesh& other)
+	{
+		unsigned int base = (unsigned int)m_vertices.size();
+		m_vertices.insert(m_vertices.end(), other.m_vertices.begin(), other.m_vertices.end());
+		m_triangles.reserve(m_triangles.size() + other.m_triangles.size());
+		for (auto& t : other.m_triangles)
+		{
+			m_triangles.push_back(t);
+			m_triangles.back().idx0 += base;
+			m_triangles.back().idx1 += base;
+			m_triangles.back().idx2 += base;
+		}
+	}
+
 	std::vector<Vertex>& GetVertices()
 	{
 		return m_vertices;
@@ -57,45 +74,11 @@ public:
 		return m_triangles;
 	}
 
+	// the format follows the extension of filename, see MeshWriter
 	bool WriteMesh(const std::string& filename, bool color_active)
 	{
-		// Write off file
-		std::ofstream outFile(filename);
-		if (!outFile.is_open()) return false;
-
-		// write header
-		outFile << "OFF" << std::endl;
-		outFile << m_vertices.size() << " " << m_triangles.size() << " 0" << std::endl;
-
-		// save vertices
-		for (unsigned int i = 0; i < m_vertices.size(); i++)
-		{
-			outFile << m_vertices[i].x() << " " << m_vertices[i].y() << " " << m_vertices[i].z() << std::endl;
-		}
-
-		if (color_active) 
-		{
-			// save faces
-			for (unsigned int i = 0; i < m_triangles.size(); i++)
-			{
-				outFile << "3 " << m_triangles[i].idx0 << " " << m_triangles[i].idx1 << " " << m_triangles[i].idx2 <<
-					" " << m_triangles[i].color[0] << " " << m_triangles[i].color[1] << " " << m_triangles[i].color[2] << std::endl;
-			}
-		}
-		else
-		{
-			// save faces
-			for (unsigned int i = 0; i < m_triangles.size(); i++)
-			{
-				outFile << "3 " << m_triangles[i].idx0 << " " << m_triangles[i].idx1 << " " << m_triangles[i].idx2 << std::endl;
-			}
-		}
-		
-
-		// close file
-		outFile.close();
-
-		return true;
+		MeshWriter writer(filename, color_active);
+		return writer.Write(*this) && writer.Close();
 	}
 
 private:
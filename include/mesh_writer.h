@@ -0,0 +1,93 @@
+
+#ifndef _MESH_WRITER_H
+#define _MESH_WRITER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+class Mesh;
+
+// Writes a Mesh as ASCII OFF, binary PLY or binary STL, depending on the extension of the filename.
+// Everything is serialized into a large buffer first which goes to the file in a few big writes.
+// PLY gets per-vertex colors averaged from the faces around each vertex, STL has no colors.
+//
+// A mesh can also be streamed in chunks between Begin() and Close() with bounded memory.
+// The element counts in the header are patched in Close(). OFF and PLY need all vertices before the faces,
+// so the faces are spooled to a temporary file and appended to the vertices in Close().
+class MeshWriter
+{
+	public:
+		enum Format
+		{
+			FORMAT_OFF,
+			FORMAT_PLY,
+			FORMAT_STL
+		};
+
+	private:
+		Format format;
+		bool color_active;
+
+		std::ofstream file;
+		std::vector<char> buffer;
+		size_t used;
+
+		// faces while streaming OFF or PLY
+		std::FILE *face_file;
+		std::vector<char> face_buffer;
+		size_t face_used;
+		bool face_error;
+
+		bool streaming;
+		size_t vertex_count;
+		size_t face_count;
+		std::streamoff vertex_count_offset;
+		std::streamoff face_count_offset;
+
+		void Flush();
+		void FlushFaces();
+		// room for bytes at the end of the buffer, flushes it if needed
+		char *Reserve(size_t bytes);
+		// room in the face spool while streaming OFF or PLY, the file buffer otherwise
+		char *ReserveFace(size_t bytes);
+		void Put(const void *data, size_t bytes);
+
+		// the counts are zero padded to a fixed width while streaming so they can be patched
+		void PutHeader(size_t vertices, size_t faces);
+		void PutVertex(const float *position, const uint32_t *color_sum);
+		void PutFace(const unsigned int *indices, const int *color);
+		void PutSTLFace(const float *v0, const float *v1, const float *v2);
+
+	public:
+		MeshWriter(const std::string &filename, bool color_active);
+		~MeshWriter();
+
+		MeshWriter(const MeshWriter &) = delete;
+		MeshWriter &operator=(const MeshWriter &) = delete;
+
+		// .ply and .stl, anything else is OFF
+		static Format FormatFromFilename(const std::string &filename);
+
+		bool IsOpen()				{ return file.is_open(); }
+		Format GetFormat()			{ return format; }
+		size_t GetVertexCount()		{ return vertex_count; }
+		size_t GetFaceCount()		{ return face_count; }
+
+		// the whole mesh at once
+		bool Write(Mesh &mesh);
+
+		// starts streaming, writes the header with placeholder counts
+		bool Begin();
+		// Writes the faces of chunk and its vertices that are new. indices holds the index of each vertex of chunk
+		// in the whole mesh, the new ones are numbered on from the vertices written so far in the order of chunk.
+		// The colors of the vertices only come from the faces of the chunk that adds them.
+		bool WriteChunk(Mesh &chunk, const std::vector<unsigned int> &indices);
+
+		// flushes the buffer and finishes a stream, returns false if any write failed
+		bool Close();
+};
+
+#endif //_MESH_WRITER_H
@@ -2,9 +2,25 @@
 #define _MODEL_H
 
 #include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include <cstdint>
+#include <vector>
+
+class CameraTransform;
+class ThreadPool;
 
 #define DEBUG = 0;
 
+// One voxel of the packed format, the same 32 bits as a GL_RG16_SNORM texel:
+// the tsdf divided by Model::GetPackedTSDFScale() and the weight divided by PACKED_WEIGHT_SCALE, both as snorm16.
+#define PACKED_WEIGHT_SCALE 32767.0f
+struct PackedVoxel
+{
+	int16_t tsdf;
+	int16_t weight;
+};
+
 class Model
 {
 	public:
@@ -24,6 +40,12 @@ class Model
 		float GetMinTruncation()			{ return min_truncation; }
 		bool GetColorsActive()				{ return colorsActive; }
 
+		// the truncation band maps to [-1, 1] in PackedVoxel
+		float GetPackedTSDFScale();
+		PackedVoxel PackVoxel(float tsdf, uint8_t weight);
+		float UnpackTSDF(PackedVoxel voxel);
+		uint8_t UnpackWeight(PackedVoxel voxel);
+
 		Eigen::Vector3f GridToWorld(Eigen::Vector3f pos);
 		Eigen::Vector3f WorldToGrid(Eigen::Vector3f pos);
 		Eigen::Vector3i GridToTexel(Eigen::Vector3f pos);
@@ -47,6 +69,20 @@ class Model
 		bool colorsActive;
 };
 
+// Voxels of a bricked CPUModel are stored in CPU_MODEL_BRICK_SIZE^3 bricks, x fastest inside a brick
+// and between bricks, so the neighbors in y and z are mostly in the same few cache lines.
+#define CPU_MODEL_BRICK_SIZE 8
+#define CPU_MODEL_BRICK_VOXELS (CPU_MODEL_BRICK_SIZE * CPU_MODEL_BRICK_SIZE * CPU_MODEL_BRICK_SIZE)
+
+// Range of the tsdf over a brick and the first voxels of its +x, +y and +z neighbors, so it covers
+// every cell that starts in the brick, and whether any of these voxels has a weight.
+struct BrickSummary
+{
+	float min;
+	float max;
+	bool observed;
+};
+
 class CPUModel: public Model
 {
 	private:
@@ -54,25 +90,70 @@ class CPUModel: public Model
 		uint8_t *weights;
 		uint8_t *color;
 
-		int IDX(int x, int y, int z) //3d index -> 1d index
-		{
-			return	(z * resolutionY * resolutionX) + (resolutionX * y) + x;
-		}
+		bool bricked;
+		// bricks per axis, the resolution rounded up
+		int bricksX;
+		int bricksY;
+		int bricksZ;
+		size_t voxelCount;
+
+		std::vector<BrickSummary> summary;
 
 		void Init();
+		void UpdateBrickSummary(int bx, int by, int bz);
+		void RaycastRows(const Eigen::Affine3f &transform, int width, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center,
+				float depth_scale, float max_depth, uint16_t *depth, int y_begin, int y_end);
 
 	public:
-		CPUModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, bool colorsActive);
-		CPUModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, Eigen::Vector3f modelOrigin, bool colorsActive);
+		CPUModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, bool colorsActive, bool bricked = false);
+		CPUModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, Eigen::Vector3f modelOrigin, bool colorsActive, bool bricked = false);
 		~CPUModel() override;
 
 		void Reset() override;
 
+		bool GetBricked()					{ return bricked; }
+		int GetBricksX()					{ return bricksX; }
+		int GetBricksY()					{ return bricksY; }
+		int GetBricksZ()					{ return bricksZ; }
+		// voxels in GetData() and GetWeights(), including the padding of the bricks
+		size_t GetVoxelCount()				{ return voxelCount; }
+
+		// 3d index -> index into GetData() and GetWeights(), 4 times that into GetColor()
+		size_t IDX(int x, int y, int z)
+		{
+			if (!bricked)
+				return ((size_t)z * resolutionY + y) * resolutionX + x;
+			const size_t brick = ((size_t)(z / CPU_MODEL_BRICK_SIZE) * bricksY + y / CPU_MODEL_BRICK_SIZE) * bricksX + x / CPU_MODEL_BRICK_SIZE;
+			return brick * CPU_MODEL_BRICK_VOXELS
+					+ ((z % CPU_MODEL_BRICK_SIZE) * CPU_MODEL_BRICK_SIZE + y % CPU_MODEL_BRICK_SIZE) * CPU_MODEL_BRICK_SIZE + x % CPU_MODEL_BRICK_SIZE;
+		}
+
 		float *GetData()					{ return tsdf; }
 		uint8_t *GetWeights()				{ return weights; }
 		uint8_t *GetColor()					{ return color; }
 		void GenerateSphere(float radius, Eigen::Vector3f center);
 
+		// The methods that write voxels keep the brick summaries up to date,
+		// after writing to GetData() or GetWeights() directly they have to be updated here.
+		const BrickSummary &GetBrickSummary(int bx, int by, int bz)	{ return summary[((size_t)bz * bricksY + by) * bricksX + bx]; }
+		void UpdateSummary(ThreadPool *thread_pool = nullptr);
+		// only the bricks covering the voxels in [begin, end)
+		void UpdateSummary(const Eigen::Vector3i &begin, const Eigen::Vector3i &end, ThreadPool *thread_pool = nullptr);
+
+		// Renders the depth of the zero crossings seen from camera_transform, 0 where nothing was hit.
+		// Bricks without a crossing are skipped by their summary. thread_pool may be nullptr.
+		void Raycast(const CameraTransform &camera_transform, int width, int height, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center,
+				float depth_scale, float max_depth, uint16_t *depth, ThreadPool *thread_pool = nullptr);
+
+		// Converts from and to arrays in x fastest linear order, like GLModel::CopyTo() and CopyFrom() use.
+		// color is ignored without colors.
+		void FromLinear(const float *linear_tsdf, const uint8_t *linear_weights, const uint8_t *linear_color);
+		void ToLinear(float *linear_tsdf, uint8_t *linear_weights, uint8_t *linear_color);
+
+		// converts the tsdf and weights from and to an array of PackedVoxel in linear order
+		void Pack(PackedVoxel *voxels);
+		void Unpack(const PackedVoxel *voxels);
+
 		void DebugToLog();
 };
 
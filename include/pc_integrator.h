@@ -6,11 +6,29 @@
 #include "frame.h"
 #include "gl_model.h"
 #include "input.h"
+#include "pose_buffer.h"
+
+#include <string>
 
 class GLModel;
 class Window;
 class CameraTransform;
 
+// workgroup layout of the integration shader
+struct IntegrationKernel
+{
+	int local_size_x = 8;
+	int local_size_y = 8;
+	int local_size_z = 4;
+
+	// voxels integrated by each invocation along z, local_size_z voxels apart
+	int voxels_per_invocation = 1;
+
+	// Step the voxel position along z instead of transforming every voxel.
+	// Saves a matrix multiplication per voxel, but the result is no longer bit-identical.
+	bool incremental_z = false;
+};
+
 class PC_Integrator
 {
 	private:
@@ -19,9 +37,6 @@ class PC_Integrator
 
 		GLuint computeHandle;
 		GLint depth_map_uniform;
-		GLint cam_modelview_uniform;
-		GLint cam_pos_uniform;
-		GLint cam_dir_uniform;
 		GLint weight_tex_uniform;
 		GLint tsdf_tex_uniform;
 		GLint color_tex_uniform;
@@ -31,13 +46,23 @@ class PC_Integrator
 		GLint max_weight_uniform;
 		GLint activateColors_uniform;
 
+		// computes the voxel box to integrate and its dispatch size
+		GLuint bounds_program;
+		GLint bounds_min_truncation_uniform;
+		GLuint integrate_box_buffer;
+
+		IntegrationKernel kernel;
+
 		int resolutionX;
 		int resolutionY;
 		int resolutionZ;
 		float cellSize;
 		unsigned int max_weight;
 
-		GLuint genComputeProg();
+		// pose given to integrate() on the CPU
+		PoseBuffer camera_pose;
+
+		GLuint genComputeProg(const std::string &header);
 		GLuint genTexture2D(int resolutionX, int resolutionY, float* data);
 
 	public:
@@ -45,6 +70,11 @@ class PC_Integrator
 		~PC_Integrator();
 		
 		void integrate(Frame* frame, CameraTransform *camera_transform);
+		void integrate(Frame* frame, PoseBuffer *pose);
+
+		// recompiles the shaders
+		void SetKernel(const IntegrationKernel &kernel);
+		IntegrationKernel GetKernel()		{ return kernel; }
 
 		unsigned int GetMaxWeight()			{ return max_weight; }
 		void SetMaxWeight(unsigned int v)	{ max_weight = v; }
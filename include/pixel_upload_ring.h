@@ -0,0 +1,49 @@
+
+#ifndef _PIXEL_UPLOAD_RING_H
+#define _PIXEL_UPLOAD_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "window.h"
+
+#define PIXEL_UPLOAD_RING_SLOTS 3
+
+// Persistently mapped pixel unpack buffer, split into slots that are used round robin.
+// Every slot is guarded by a fence, so the CPU only waits if it gets more uploads ahead
+// of the GPU than there are slots and texture uploads never wait for the CPU.
+class PixelUploadRing
+{
+	private:
+		GLuint buffer = 0;
+		uint8_t *mapped = nullptr;
+		size_t slot_size = 0;
+
+		std::vector<GLsync> fences;
+		unsigned int current_slot = 0;
+		bool mapped_slot_pending = false;
+
+		void WaitForSlot(unsigned int slot);
+		void Release();
+
+	public:
+		explicit PixelUploadRing(unsigned int slot_count = PIXEL_UPLOAD_RING_SLOTS) : fences(slot_count, nullptr) {}
+		~PixelUploadRing();
+
+		PixelUploadRing(const PixelUploadRing &) = delete;
+		PixelUploadRing &operator=(const PixelUploadRing &) = delete;
+
+		// Returns the next slot of at least size bytes for writing, waiting for the GPU if it still reads from it.
+		// The memory stays valid until the next call to Map() and may be written from any thread meanwhile.
+		void *Map(size_t size);
+
+		// Binds the buffer as GL_PIXEL_UNPACK_BUFFER and returns the offset of the mapped slot
+		// to be passed as the data pointer to glTexSubImage*().
+		const void *BeginUpload();
+
+		// Unbinds the buffer and fences the slot after the texture upload commands were issued.
+		void EndUpload();
+};
+
+#endif //_PIXEL_UPLOAD_RING_H
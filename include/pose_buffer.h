@@ -0,0 +1,83 @@
+
+#ifndef _POSE_BUFFER_H
+#define _POSE_BUFFER_H
+
+#include <cstdint>
+
+#include "window.h"
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#define POSE_READBACK_SLOTS 3
+
+// pyramid levels the ICP state in the pose has room for
+#define POSE_ICP_LEVELS 4
+
+// a pose as read back to the CPU
+struct PoseReadback
+{
+	// as given to PoseBuffer::RequestReadback()
+	uint64_t timestamp_us;
+
+	Eigen::Affine3f transform;
+	Eigen::Vector3f rot_delta;
+	Eigen::Vector3f translation_delta;
+
+	// per pyramid level since the last PoseBuffer::ResetICPState(), see ICP
+	float icp_error[POSE_ICP_LEVELS];
+	unsigned int icp_iterations[POSE_ICP_LEVELS];
+	bool icp_converged[POSE_ICP_LEVELS];
+};
+
+// Camera pose in a uniform buffer, see glsl_common_pose.inl.
+// Shaders read the pose directly from here, so a pose computed on the GPU never has to
+// make a round trip through the CPU. Readbacks to the CPU are fenced and never block the GPU.
+class PoseBuffer
+{
+	private:
+		GLuint buffer;
+
+		GLuint readback_buffer;
+		const uint8_t *readback_mapped;
+		GLsync readback_fences[POSE_READBACK_SLOTS] = {};
+		uint64_t readback_timestamps[POSE_READBACK_SLOTS] = {};
+		unsigned int readback_next;
+		unsigned int readback_pending;
+
+		// created on the first Transform()
+		GLuint transform_program = 0;
+		GLint transform_motion_uniform = -1;
+
+		void DropReadbacks();
+
+	public:
+		PoseBuffer();
+		~PoseBuffer();
+
+		PoseBuffer(const PoseBuffer &) = delete;
+		PoseBuffer &operator=(const PoseBuffer &) = delete;
+
+		GLuint GetBuffer()		{ return buffer; }
+
+		// sets transform and resets the deltas and ICP state, readbacks still in flight are dropped
+		void Upload(const Eigen::Affine3f &transform);
+
+		// resets only the ICP state, to start the iterations of a new frame
+		void ResetICPState();
+
+		// copies other on the GPU, readbacks still in flight are dropped
+		void CopyFrom(PoseBuffer *other);
+
+		// transform = transform * motion on the GPU, motion is in camera space
+		void Transform(const Eigen::Affine3f &motion);
+
+		// copies the pose as it will be after all GPU commands issued so far, timestamp_us is passed through
+		void RequestReadback(uint64_t timestamp_us = 0);
+
+		// Returns the newest pose whose readback has finished.
+		// false if none has finished yet, or with wait if none was requested.
+		bool FetchReadback(PoseReadback *readback, bool wait = false);
+};
+
+#endif //_POSE_BUFFER_H
@@ -0,0 +1,45 @@
+
+#ifndef _POSE_PREDICTOR_H
+#define _POSE_PREDICTOR_H
+
+#include <cstdint>
+#include <deque>
+
+#include <Eigen/Geometry>
+
+// no prediction across gaps longer than this, e.g. after the input stalled
+#define POSE_PREDICTOR_MAX_GAP_US 250000
+
+// Extrapolates the camera pose from the last tracked poses, assuming constant velocity in camera space.
+// Used to give ICP an initial guess closer to the answer than the pose of the last frame.
+class PosePredictor
+{
+	private:
+		struct Sample
+		{
+			uint64_t timestamp_us;
+			Eigen::Affine3f transform;
+		};
+
+		std::deque<Sample> history;
+		size_t history_size;
+
+	public:
+		// velocity is averaged over the last history_size poses, at least 2
+		explicit PosePredictor(size_t history_size = 3);
+
+		void Reset()							{ history.clear(); }
+
+		// Poses have to be added in order of their timestamps. A pose with the same timestamp as the last one is ignored,
+		// an older one starts a new history.
+		void AddPose(uint64_t timestamp_us, const Eigen::Affine3f &transform);
+
+		// Motion of the camera (in its own space) from from_us to to_us, at the current velocity.
+		// The identity if there is not enough history or the timestamps are not usable.
+		Eigen::Affine3f PredictMotion(uint64_t from_us, uint64_t to_us) const;
+
+		// pose at timestamp_us, extrapolated from the last added pose (the identity if there is none)
+		Eigen::Affine3f Predict(uint64_t timestamp_us) const;
+};
+
+#endif //_POSE_PREDICTOR_H
@@ -5,8 +5,12 @@
 
 #include <librealsense2/rs.hpp>
 
+#include <string>
+
 #include "input.h"
 
+class SequenceWriter;
+
 class RealSenseInput : public Input
 {
 	private:
@@ -21,11 +25,17 @@ class RealSenseInput : public Input
 		bool filters_active = false;
 		bool color_active = false;
 
+		SequenceWriter *recorder = nullptr;
+
+		// waits for the next frameset, applies the filters and records it if requested
+		bool CaptureFrames(rs2::frame &depth, rs2::frame &color, uint64_t *timestamp_us);
+
 	public:
 		RealSenseInput(const rs2::config &config = rs2::config());
 		~RealSenseInput();
 
 		bool WaitForFrame(Frame *frame) override;
+		bool GrabFrame(InputFrame *frame) override;
 
 		float GetPpx() { return intrinsics.ppx; }
 		float GetPpy() { return intrinsics.ppy; }
@@ -41,6 +51,11 @@ class RealSenseInput : public Input
 		void setColorActive(bool set) { color_active = set; }
 		bool GetFilterActive() { return filters_active; }
 		bool GetColorActive() { return color_active; }
+
+		// writes every following frame to a sequence that can be replayed with SequenceInput
+		void StartRecording(const std::string &filename);
+		void StopRecording();
+		bool GetRecording() { return recorder != nullptr; }
 };
 
 #endif //INPUT_H
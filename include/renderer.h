@@ -4,6 +4,8 @@
 
 #include <Eigen/Core>
 
+#include "pose_buffer.h"
+
 class GLModel;
 class Window;
 class CameraTransform;
@@ -19,9 +21,7 @@ class Renderer
 		GLuint ibo = 0;
 
 		GLuint program = 0;
-		GLint mvp_matrix_uniform = -1;
-		GLint modelview_matrix_uniform = -1;
-		GLint cam_pos_uniform = -1;
+		GLint projection_matrix_uniform = -1;
 		GLint tsdf_tex_uniform = -1;
 		GLint color_grid_tex_uniform = -1;
 		GLint enable_color_uniform = -1;
@@ -29,7 +29,10 @@ class Renderer
 		GLint drift_correction_uniform = -1;
 
 		GLuint box_program = 0;
-		GLint box_mvp_matrix_uniform = -1;
+		GLint box_projection_matrix_uniform = -1;
+
+		GLuint downsample_program = 0;
+		GLint downsample_level_uniform = -1;
 
 		GLuint fbo;
 		GLuint color_tex;
@@ -42,24 +45,34 @@ class Renderer
 		bool enable_color = false;
 		bool enable_lighting = true;
 
-		Eigen::Matrix4f modelview_matrix;
 		Eigen::Matrix4f projection_matrix;
 
+		// pose given to Render() on the CPU
+		PoseBuffer camera_pose;
+
+		// pose of the last rendered prediction
+		PoseBuffer prediction_pose;
+
 		Eigen::Vector3f drift_correction;
 
 		void InitResources();
+		void DownsamplePrediction();
 
 	public:
 		explicit Renderer(Window *window);
 		~Renderer();
 
+		// world space model prediction, with FRAME_PYRAMID_LEVELS mip levels matching Frame's pyramid
 		GLuint GetVertexTex()						{ return vertex_tex; }
 		GLuint GetNormalTex()						{ return normal_tex; }
-		Eigen::Matrix4f GetModelviewMatrix()		{ return modelview_matrix; }
+		PoseBuffer *GetPredictionPose()				{ return &prediction_pose; }
 		Eigen::Matrix4f GetProjectionMatrix()		{ return projection_matrix; }
 
 		void Render(GLModel *model, Frame *frame, CameraTransform *camera_transform);
 
+		// renders with a pose that is read directly from the GPU buffer
+		void Render(GLModel *model, Frame *frame, PoseBuffer *pose);
+
 		bool GetEnableColor()						{ return enable_color; }
 		bool GetEnableLighting()					{ return enable_lighting; }
 
@@ -0,0 +1,94 @@
+
+#ifndef _ROLLING_VOLUME_H
+#define _ROLLING_VOLUME_H
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "gl_model.h"
+#include "mesh.h"
+
+class MeshWriter;
+
+// Moves a GLModel along with the camera for scans larger than the volume, in constant memory.
+// Once the camera is further than the threshold from the center of the volume along an axis,
+// the volume is re-centered there by GLModel::Shift(). The slices that leave the volume are read back
+// asynchronously, meshed on a worker thread and cleared. The meshes are spooled to a temporary file
+// in world space and only read back one slab at a time when exporting.
+class RollingVolume
+{
+	private:
+		GLModel *model;
+		float threshold;
+
+		// a slab being read back to the pixel pack buffer
+		struct Readback
+		{
+			GLuint buffer;
+			GLsync fence;
+			Eigen::Vector3i size;
+			Eigen::Vector3f origin;
+		};
+		std::deque<Readback> readbacks;
+
+		std::thread worker;
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::deque<CPUModel *> slabs;
+		bool running;
+		bool busy;
+
+		// Only written by the worker, read and reset after Flush() when it is idle. Each slab is its vertex
+		// and triangle count, the vertices, then per triangle its indices and color.
+		std::FILE *spool;
+		bool spool_error;
+		// guarded by mutex
+		size_t triangle_count;
+
+		// bytes per voxel in the readback without colors
+		size_t VoxelSize();
+		// moves the volume by voxels along axis and extracts the slices leaving it
+		void ShiftAxis(int axis, int voxels);
+		void FinishReadback(const Readback &readback);
+		void WorkerLoop();
+		void ExtractMesh(CPUModel *slab, Mesh *out);
+		bool SpoolMesh(Mesh &slab_mesh);
+		// writes the spooled slabs to a writer after Begin()
+		bool ReplaySpool(MeshWriter *writer);
+
+	public:
+		// threshold in meters from the center of the volume
+		RollingVolume(GLModel *model, float threshold);
+		~RollingVolume();
+
+		RollingVolume(const RollingVolume &) = delete;
+		RollingVolume &operator=(const RollingVolume &) = delete;
+
+		float GetThreshold()			{ return threshold; }
+		void SetThreshold(float v)		{ threshold = v; }
+
+		// Shifts the volume if camera_position is past the threshold, returns true if it did.
+		bool Update(const Eigen::Vector3f &camera_position);
+
+		// hands the finished readbacks to the worker, never blocks
+		void Poll();
+
+		// waits until all slabs extracted so far are meshed
+		void Flush();
+
+		// drops the spooled mesh of the slabs extracted so far
+		void Reset();
+
+		// slabs still being read back or meshed
+		size_t GetPendingSlabs();
+		size_t GetTriangleCount();
+
+		// writes the mesh of the extracted slabs together with the current volume
+		bool ExportMesh(const std::string &filename);
+};
+
+#endif //_ROLLING_VOLUME_H
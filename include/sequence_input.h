@@ -0,0 +1,135 @@
+
+#ifndef _SEQUENCE_INPUT_H
+#define _SEQUENCE_INPUT_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+#include <Eigen/Core>
+
+#include "input.h"
+
+// On-disk layout of a recorded sequence (little endian):
+//   SequenceHeader
+//   frame_count * { uint64_t timestamp_us; uint16_t depth[depth_width * depth_height]; uint8_t color[color_width * color_height * 3]; padding to 8 bytes }
+// All frames have the same size, so frame i is found at sizeof(SequenceHeader) + i * FrameStride().
+
+#define SEQUENCE_MAGIC "RSFSEQ01"
+#define SEQUENCE_VERSION 1
+
+struct SequenceHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t frame_count;
+
+	uint32_t depth_width;
+	uint32_t depth_height;
+	uint32_t color_width;		// 0 if the sequence has no color stream
+	uint32_t color_height;
+
+	float depth_scale;
+	float depth_fx, depth_fy, depth_ppx, depth_ppy;
+	float color_fx, color_fy, color_ppx, color_ppy;
+
+	uint32_t reserved[3];
+
+	size_t DepthSize() const	{ return (size_t)depth_width * depth_height * sizeof(uint16_t); }
+	size_t ColorSize() const	{ return (size_t)color_width * color_height * 3; }
+	size_t FrameStride() const	{ return (sizeof(uint64_t) + DepthSize() + ColorSize() + 7) & ~(size_t)7; }
+};
+
+static_assert(sizeof(SequenceHeader) == 80, "SequenceHeader must be tightly packed");
+
+class SequenceInput : public Input
+{
+	private:
+		using clock = std::chrono::steady_clock;
+
+		const uint8_t *data = nullptr;
+		size_t data_size = 0;
+#ifdef _WIN32
+		void *file_handle = nullptr;
+		void *mapping_handle = nullptr;
+#else
+		int fd = -1;
+#endif
+
+		SequenceHeader header;
+
+		// also touched from the GUI while an AsyncInput captures on its own thread
+		std::atomic<uint32_t> current_frame{0};
+
+		std::atomic<bool> realtime{true};
+		std::atomic<bool> loop{true};
+		bool color_active = false;
+
+		// the GUI restarts the pacing while NextRecord() runs on the capture thread
+		std::mutex playback_mutex;
+		bool playback_started = false;
+		clock::time_point playback_start;
+		uint64_t playback_start_timestamp = 0;
+
+		void Unmap();
+
+		// returns the next frame record or nullptr at the end, pacing playback if realtime
+		const uint8_t *NextRecord(uint64_t *timestamp);
+
+	public:
+		explicit SequenceInput(const std::string &filename);
+		~SequenceInput() override;
+
+		bool WaitForFrame(Frame *frame) override;
+		bool GrabFrame(InputFrame *frame) override;
+
+		float GetPpx() override			{ return header.depth_ppx; }
+		float GetPpy() override			{ return header.depth_ppy; }
+		float GetFx() override			{ return header.depth_fx; }
+		float GetFy() override			{ return header.depth_fy; }
+
+		float GetPpxColor() override	{ return header.color_ppx; }
+		float GetPpyColor() override	{ return header.color_ppy; }
+		float GetFxColor() override		{ return header.color_fx; }
+		float GetFyColor() override		{ return header.color_fy; }
+
+		void setFilterActive(bool set) override	{}
+		void setColorActive(bool set) override	{ color_active = set && header.color_width > 0; }
+
+		uint32_t GetFrameCount()		{ return header.frame_count; }
+		uint32_t GetCurrentFrame()		{ return current_frame; }
+
+		// realtime: sleep until the recorded timestamp of each frame is due, otherwise replay as fast as possible
+		bool GetRealtime()				{ return realtime; }
+		void SetRealtime(bool v);
+
+		// loop: restart at the first frame instead of failing after the last one
+		bool GetLoop()					{ return loop; }
+		void SetLoop(bool v)			{ loop = v; }
+
+		void Rewind();
+};
+
+class SequenceWriter
+{
+	private:
+		FILE *file;
+		SequenceHeader header;
+
+	public:
+		SequenceWriter(const std::string &filename, int depth_width, int depth_height, float depth_scale,
+				const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center);
+		~SequenceWriter();
+
+		void SetColorFormat(int width, int height, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center);
+
+		// color may be nullptr if the color format has not been set
+		bool WriteFrame(uint64_t timestamp_us, const uint16_t *depth, const uint8_t *color);
+
+		uint32_t GetFrameCount()		{ return header.frame_count; }
+};
+
+#endif //_SEQUENCE_INPUT_H
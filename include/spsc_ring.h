@@ -0,0 +1,89 @@
+
+#ifndef _SPSC_RING_H
+#define _SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+// Bounded lock-free ring for exactly one producer and one consumer thread.
+// Slots are preallocated and reused, the producer fills a slot between BeginWrite() and EndWrite(),
+// the consumer reads it between BeginRead() and EndRead().
+// When the ring is full, the producer may drop the oldest queued slot with DropOldest() instead of waiting.
+template<class T>
+class SPSCRing
+{
+	private:
+		static constexpr size_t none = std::numeric_limits<size_t>::max();
+
+		// one more than the capacity, for the slot the consumer is reading
+		std::vector<T> slots;
+
+		// head is only written by the producer. tail is advanced by the consumer when it takes a slot
+		// and by the producer when it drops one, so both go through compare_exchange.
+		// Both count up indefinitely, the slot index is the counter modulo the number of slots.
+		alignas(64) std::atomic<size_t> head;
+		alignas(64) std::atomic<size_t> tail;
+
+		// counter of the slot between BeginRead() and EndRead(), none otherwise
+		alignas(64) std::atomic<size_t> reading;
+
+	public:
+		explicit SPSCRing(size_t capacity) : slots(capacity + 1), head(0), tail(0), reading(none) {}
+
+		size_t GetCapacity() const	{ return slots.size() - 1; }
+		size_t GetSize() const		{ return head.load() - tail.load(); }
+
+		// producer: returns the next free slot or nullptr if the ring is full
+		T *BeginWrite()
+		{
+			size_t h = head.load(std::memory_order_relaxed);
+			if(h - tail.load() >= GetCapacity())
+				return nullptr;
+			// a slot dropped while the consumer still reads it is only reused once it is done
+			size_t r = reading.load();
+			if(r != none && r % slots.size() == h % slots.size())
+				return nullptr;
+			return &slots[h % slots.size()];
+		}
+
+		// producer: publishes the slot returned by BeginWrite()
+		void EndWrite()
+		{
+			head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		// producer: if the ring is full, discards the oldest queued slot so BeginWrite() can succeed.
+		// Returns false if nothing was dropped, because there was room or the consumer took the slot first.
+		bool DropOldest()
+		{
+			size_t t = tail.load();
+			if(head.load(std::memory_order_relaxed) - t < GetCapacity())
+				return false;
+			return tail.compare_exchange_strong(t, t + 1);
+		}
+
+		// consumer: takes the oldest queued slot or returns nullptr if the ring is empty
+		T *BeginRead()
+		{
+			size_t t = tail.load();
+			while(head.load(std::memory_order_acquire) != t)
+			{
+				// announce the slot before taking it, so the producer won't refill it after dropping it
+				reading.store(t);
+				if(tail.compare_exchange_strong(t, t + 1))
+					return &slots[t % slots.size()];
+			}
+			reading.store(none);
+			return nullptr;
+		}
+
+		// consumer: hands the slot returned by BeginRead() back to the producer
+		void EndRead()
+		{
+			reading.store(none);
+		}
+};
+
+#endif //_SPSC_RING_H
@@ -0,0 +1,53 @@
+
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for the CPU backends.
+// The calling thread takes part in every job as thread index 0.
+class ThreadPool
+{
+	public:
+		// begin and end of a chunk and the index of the thread running it, in [0, GetThreadCount())
+		using RangeFunc = std::function<void(int begin, int end, unsigned int thread_index)>;
+
+	private:
+		std::vector<std::thread> workers;
+
+		std::mutex mutex;
+		std::condition_variable job_available;
+		std::condition_variable job_done;
+		uint64_t job_generation = 0;
+		unsigned int workers_busy = 0;
+		bool terminate = false;
+
+		const RangeFunc *job_func = nullptr;
+		int job_end = 0;
+		int job_grain = 1;
+		std::atomic<int> job_next;
+
+		void WorkerLoop(unsigned int thread_index);
+		void RunChunks(unsigned int thread_index);
+
+	public:
+		// thread_count 0 uses one thread per hardware thread
+		explicit ThreadPool(unsigned int thread_count = 0);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool &) = delete;
+		ThreadPool &operator=(const ThreadPool &) = delete;
+
+		unsigned int GetThreadCount()		{ return static_cast<unsigned int>(workers.size()) + 1; }
+
+		// Splits [begin, end) into chunks of grain elements, runs them on all threads and returns once all are done.
+		void ParallelFor(int begin, int end, int grain, const RangeFunc &func);
+};
+
+#endif //_THREAD_POOL_H
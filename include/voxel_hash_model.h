@@ -0,0 +1,123 @@
+
+#ifndef _VOXEL_HASH_MODEL_H
+#define _VOXEL_HASH_MODEL_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+class CPUFrame;
+class CameraTransform;
+class ThreadPool;
+class BrickStore;
+
+#define VOXEL_BLOCK_SIZE 8
+#define VOXEL_BLOCK_VOXELS (VOXEL_BLOCK_SIZE * VOXEL_BLOCK_SIZE * VOXEL_BLOCK_SIZE)
+
+// spatial hash of block coordinates, see Teschner et al. "Optimized Spatial Hashing for Collision Detection of Deformable Objects"
+struct VoxelBlockHash
+{
+	size_t operator()(const Eigen::Vector3i &v) const
+	{
+		return ((size_t)v.x() * 73856093) ^ ((size_t)v.y() * 19349663) ^ ((size_t)v.z() * 83492791);
+	}
+};
+
+// Sparse TSDF volume of VOXEL_BLOCK_SIZE^3 voxel blocks, allocated on demand around the observed surfaces.
+// Voxel (x, y, z) is at world position (x, y, z) * cell_size, without bounds.
+// Blocks live in a pool that grows up to max_blocks, freed blocks are reused.
+// Inside a block, voxels are stored x fastest like in CPUModel, see VoxelIndex().
+// With a BrickStore, the pool is a cache: once it is full, the least recently used blocks
+// are written to the store and read back when they are allocated again.
+class VoxelHashModel
+{
+	private:
+		ThreadPool *thread_pool;
+		BrickStore *brick_store;
+
+		float cell_size;
+		float max_truncation;
+		float min_truncation;
+		bool colors_active;
+
+		int max_blocks;
+
+		// block pool
+		std::vector<float> tsdf;
+		std::vector<uint8_t> weights;
+		std::vector<uint8_t> color;
+		std::vector<Eigen::Vector3i> block_coords;
+		std::vector<int> free_blocks;
+		// AllocateBlocks() call that last touched each pool block
+		std::vector<uint64_t> last_used;
+		uint64_t allocation_count;
+
+		std::unordered_map<Eigen::Vector3i, int, VoxelBlockHash> blocks;
+
+		// moves the least recently used blocks to the brick store, false if all are in use by the current frame
+		bool EvictBlocks();
+
+		void RaycastRows(const Eigen::Affine3f &transform, int width, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center,
+				float depth_scale, float max_depth, uint16_t *depth, int y_begin, int y_end);
+
+	public:
+		// thread_pool may be nullptr to run on the calling thread only
+		VoxelHashModel(float cell_size, float max_truncation, float min_truncation, bool colors_active, int max_blocks = 1 << 18, ThreadPool *thread_pool = nullptr);
+
+		void Reset();
+
+		// Blocks that don't fit into max_blocks are evicted to store, nullptr to fail allocations instead.
+		// The store must outlive the model or be unset before, Reset() doesn't clear it.
+		void SetBrickStore(BrickStore *store)		{ brick_store = store; }
+		BrickStore *GetBrickStore()					{ return brick_store; }
+
+		// Queues the stored blocks in the view frustum of pose up to max_depth to be read ahead,
+		// for a pose predicted for the next frame.
+		void Prefetch(const Eigen::Affine3f &pose, int width, int height, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center, float max_depth);
+
+		// writes all resident blocks to the brick store, e.g. before reading it elsewhere
+		void WriteToBrickStore();
+
+		float GetCellSize()				{ return cell_size; }
+		float GetMaxTruncation()		{ return max_truncation; }
+		float GetMinTruncation()		{ return min_truncation; }
+		bool GetColorsActive()			{ return colors_active; }
+		int GetMaxBlocks()				{ return max_blocks; }
+
+		int GetBlockCount()				{ return (int)blocks.size(); }
+		// bytes of the block pool, including freed blocks
+		size_t GetMemorySize();
+
+		static Eigen::Vector3i VoxelToBlock(const Eigen::Vector3i &voxel);
+		static int VoxelIndex(int x, int y, int z)		{ return (z * VOXEL_BLOCK_SIZE + y) * VOXEL_BLOCK_SIZE + x; }
+
+		// pool index of the block, or -1
+		int FindBlock(const Eigen::Vector3i &block);
+		// Pool index of the new or existing block, or -1 once max_blocks are in use and none can be evicted.
+		// A block that was evicted before is read back from the brick store.
+		int AllocateBlock(const Eigen::Vector3i &block);
+		void FreeBlock(const Eigen::Vector3i &block);
+
+		// Allocates all blocks within the truncation band around the depth of frame, seen from transform.
+		// Returns false if the pool ran out of blocks. Counts as one use for the brick store LRU.
+		bool AllocateBlocks(CPUFrame *frame, const Eigen::Affine3f &transform);
+
+		// pool indices of all allocated blocks, without the ones only in the brick store
+		void GetBlocks(std::vector<int> *indices);
+
+		Eigen::Vector3i GetBlockCoords(int index)	{ return block_coords[index]; }
+		float *GetBlockTSDF(int index)				{ return tsdf.data() + (size_t)index * VOXEL_BLOCK_VOXELS; }
+		uint8_t *GetBlockWeights(int index)			{ return weights.data() + (size_t)index * VOXEL_BLOCK_VOXELS; }
+		// rgba per voxel, nullptr without colors
+		uint8_t *GetBlockColor(int index)			{ return colors_active ? color.data() + (size_t)index * VOXEL_BLOCK_VOXELS * 4 : nullptr; }
+
+		// Renders the depth of the zero crossings seen from camera_transform, 0 where nothing was hit.
+		// Only allocated blocks are marched through, the rest of each ray skips ahead block by block.
+		void Raycast(const CameraTransform &camera_transform, int width, int height, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center,
+				float depth_scale, float max_depth, uint16_t *depth);
+};
+
+#endif //_VOXEL_HASH_MODEL_H
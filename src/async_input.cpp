@@ -0,0 +1,177 @@
+
+#include "async_input.h"
+#include "frame.h"
+
+#include <chrono>
+#include <iostream>
+
+// how long either side sleeps while the ring is full or empty
+#define ASYNC_INPUT_POLL_INTERVAL std::chrono::microseconds(200)
+
+AsyncInput::AsyncInput(Input *input, size_t ring_capacity)
+	: input(input),
+	ring(ring_capacity),
+	uploading(nullptr),
+	running(true),
+	latest_frame_wins(true),
+	captured_frames(0),
+	dropped_frames(0),
+	failed_frames(0)
+{
+	capture_thread = std::thread(&AsyncInput::CaptureLoop, this);
+}
+
+AsyncInput::~AsyncInput()
+{
+	running = false;
+	capture_thread.join();
+	delete input;
+}
+
+void AsyncInput::CaptureLoop()
+{
+	while(running)
+	{
+		Slot *slot = ring.BeginWrite();
+		if(!slot && latest_frame_wins && ring.DropOldest())
+		{
+			// the consumer fell behind, replace its oldest frame with a new one
+			dropped_frames++;
+			slot = ring.BeginWrite();
+		}
+		if(!slot)
+		{
+			// wait for the consumer, which either wants every frame or still reads the slot to be reused
+			std::this_thread::sleep_for(ASYNC_INPUT_POLL_INTERVAL);
+			continue;
+		}
+
+		if(!input->GrabFrame(&slot->frame))
+		{
+			failed_frames++;
+			// don't spin on an input that has run dry
+			std::this_thread::sleep_for(ASYNC_INPUT_POLL_INTERVAL);
+			continue;
+		}
+
+		captured_frames++;
+		ring.EndWrite();
+	}
+}
+
+AsyncInput::Slot *AsyncInput::NextFrame()
+{
+	uint64_t failed_before = failed_frames;
+
+	while(true)
+	{
+		Slot *slot = ring.BeginRead();
+		if(!slot)
+		{
+			// the producer could not capture anything since we started waiting
+			if(failed_frames != failed_before)
+				return nullptr;
+			std::this_thread::sleep_for(ASYNC_INPUT_POLL_INTERVAL);
+			continue;
+		}
+
+		if(!latest_frame_wins || ring.GetSize() == 0)
+			return slot;
+
+		// a newer frame is queued already
+		ring.EndRead();
+		dropped_frames++;
+	}
+}
+
+void AsyncInput::ReleaseUploading()
+{
+	if(!uploading)
+		return;
+
+	// Map() waits for the texture upload from the slot, the memory stays the same unless the image grew
+	InputFrame &slot_frame = uploading->frame;
+	slot_frame.depth_buffer_size = (size_t)slot_frame.depth_width * slot_frame.depth_height * sizeof(uint16_t);
+	slot_frame.depth_buffer = static_cast<uint16_t *>(uploading->depth_upload.Map(slot_frame.depth_buffer_size));
+	if(slot_frame.color)
+	{
+		slot_frame.color_buffer_size = (size_t)slot_frame.color_width * slot_frame.color_height * 3;
+		slot_frame.color_buffer = static_cast<uint8_t *>(uploading->color_upload.Map(slot_frame.color_buffer_size));
+	}
+
+	uploading = nullptr;
+	ring.EndRead();
+}
+
+bool AsyncInput::WaitForFrame(Frame *frame)
+{
+	ReleaseUploading();
+
+	Slot *slot = NextFrame();
+	if(!slot)
+		return false;
+
+	// Pixels the producer wrote to the mapped buffers of the slot are uploaded from there. Otherwise, on the
+	// first frame of a slot or after the image grew, they are copied to the upload buffers of the frame.
+	const InputFrame &slot_frame = slot->frame;
+	frame->SetTimestamp(slot_frame.timestamp_us);
+	if(slot_frame.depth == slot_frame.depth_buffer)
+	{
+		frame->SetDepthMap(slot_frame.depth_width, slot_frame.depth_height, &slot->depth_upload, slot_frame.depth_scale,
+				slot_frame.depth_focal_length, slot_frame.depth_center);
+	}
+	else
+	{
+		frame->SetDepthMap(slot_frame.depth_width, slot_frame.depth_height, (GLushort *)slot_frame.depth, slot_frame.depth_scale,
+				slot_frame.depth_focal_length, slot_frame.depth_center);
+	}
+	if(slot_frame.color && slot_frame.color == slot_frame.color_buffer)
+	{
+		frame->SetColorMap(slot_frame.color_width, slot_frame.color_height, &slot->color_upload,
+				slot_frame.color_focal_length, slot_frame.color_center);
+	}
+	else if(slot_frame.color)
+	{
+		frame->SetColorMap(slot_frame.color_width, slot_frame.color_height, (GLushort *)slot_frame.color,
+				slot_frame.color_focal_length, slot_frame.color_center);
+	}
+
+	uploading = slot;
+	return true;
+}
+
+bool AsyncInput::GrabFrame(InputFrame *frame)
+{
+	// needs the GL context only if WaitForFrame() was called before
+	ReleaseUploading();
+
+	Slot *next = NextFrame();
+	if(!next)
+		return false;
+	const InputFrame *slot = &next->frame;
+
+	// the slot goes back to the producer, so the caller gets its own copy
+	frame->timestamp_us = slot->timestamp_us;
+	frame->depth_width = slot->depth_width;
+	frame->depth_height = slot->depth_height;
+	frame->depth_scale = slot->depth_scale;
+	frame->depth_focal_length = slot->depth_focal_length;
+	frame->depth_center = slot->depth_center;
+	frame->depth_storage.assign(slot->depth, slot->depth + (size_t)slot->depth_width * slot->depth_height);
+	frame->depth = frame->depth_storage.data();
+
+	frame->color_width = slot->color_width;
+	frame->color_height = slot->color_height;
+	frame->color_focal_length = slot->color_focal_length;
+	frame->color_center = slot->color_center;
+	if(slot->color)
+	{
+		frame->color_storage.assign(slot->color, slot->color + (size_t)slot->color_width * slot->color_height * 3);
+		frame->color = frame->color_storage.data();
+	}
+	else
+		frame->color = nullptr;
+
+	ring.EndRead();
+	return true;
+}
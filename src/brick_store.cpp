@@ -0,0 +1,182 @@
+
+#include "brick_store.h"
+
+#include <cstring>
+#include <iterator>
+#include <unordered_set>
+
+BrickStore::BrickStore(const std::string &filename, bool colors_active, size_t max_prefetched) :
+	colors_active(colors_active),
+	record_size(VOXEL_BLOCK_VOXELS * (sizeof(float) + 1 + (colors_active ? 4 : 0))),
+	record_count(0),
+	write_count(0),
+	max_prefetched(max_prefetched),
+	bytes_read(0),
+	bytes_written(0),
+	running(true)
+{
+	file.open(filename, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+	// unbuffered, so it never holds on to a record that was written since
+	prefetch_file.rdbuf()->pubsetbuf(nullptr, 0);
+	prefetch_file.open(filename, std::ios::in | std::ios::binary);
+	prefetch_thread = std::thread(&BrickStore::PrefetchLoop, this);
+}
+
+BrickStore::~BrickStore()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		running = false;
+	}
+	cond.notify_all();
+	prefetch_thread.join();
+}
+
+bool BrickStore::Contains(const Eigen::Vector3i &block)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	return index.find(block) != index.end();
+}
+
+size_t BrickStore::GetBlockCount()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	return index.size();
+}
+
+size_t BrickStore::GetPrefetchedCount()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	return prefetched.size();
+}
+
+bool BrickStore::ReadRecord(std::istream &stream, size_t record, uint8_t *data)
+{
+	stream.seekg((std::streamoff)(record * record_size));
+	stream.read(reinterpret_cast<char *>(data), (std::streamsize)record_size);
+	if(!stream)
+	{
+		stream.clear();
+		return false;
+	}
+	bytes_read += record_size;
+	return true;
+}
+
+bool BrickStore::Write(const Eigen::Vector3i &block, const float *tsdf, const uint8_t *weights, const uint8_t *color)
+{
+	std::vector<uint8_t> data(record_size);
+	memcpy(data.data(), tsdf, VOXEL_BLOCK_VOXELS * sizeof(float));
+	memcpy(data.data() + VOXEL_BLOCK_VOXELS * sizeof(float), weights, VOXEL_BLOCK_VOXELS);
+	if(colors_active)
+		memcpy(data.data() + VOXEL_BLOCK_VOXELS * (sizeof(float) + 1), color, VOXEL_BLOCK_VOXELS * 4);
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	// a block read ahead before is outdated now
+	prefetched.erase(block);
+
+	auto it = index.find(block);
+	size_t record = it != index.end() ? it->second.record : record_count;
+	file.seekp((std::streamoff)(record * record_size));
+	file.write(reinterpret_cast<const char *>(data.data()), (std::streamsize)record_size);
+	// the prefetch thread reads through another handle
+	file.flush();
+	if(!file)
+	{
+		file.clear();
+		return false;
+	}
+	if(it == index.end())
+	{
+		index.emplace(block, Record{ record, ++write_count });
+		record_count++;
+	}
+	else
+		it->second.version = ++write_count;
+	bytes_written += record_size;
+	return true;
+}
+
+bool BrickStore::Read(const Eigen::Vector3i &block, float *tsdf, uint8_t *weights, uint8_t *color)
+{
+	std::vector<uint8_t> data;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		auto pit = prefetched.find(block);
+		if(pit != prefetched.end())
+		{
+			data = std::move(pit->second);
+			prefetched.erase(pit);
+		}
+		else
+		{
+			auto it = index.find(block);
+			if(it == index.end())
+				return false;
+			data.resize(record_size);
+			if(!ReadRecord(file, it->second.record, data.data()))
+				return false;
+		}
+	}
+
+	memcpy(tsdf, data.data(), VOXEL_BLOCK_VOXELS * sizeof(float));
+	memcpy(weights, data.data() + VOXEL_BLOCK_VOXELS * sizeof(float), VOXEL_BLOCK_VOXELS);
+	if(colors_active && color)
+		memcpy(color, data.data() + VOXEL_BLOCK_VOXELS * (sizeof(float) + 1), VOXEL_BLOCK_VOXELS * 4);
+	return true;
+}
+
+void BrickStore::Prefetch(const std::vector<Eigen::Vector3i> &blocks)
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		// blocks read ahead that are not predicted anymore make room for the new ones
+		std::unordered_set<Eigen::Vector3i, VoxelBlockHash> requested(blocks.begin(), blocks.end());
+		for(auto it = prefetched.begin(); it != prefetched.end();)
+			it = requested.find(it->first) == requested.end() ? prefetched.erase(it) : std::next(it);
+		prefetch_queue.clear();
+
+		for(const auto &block : blocks)
+		{
+			if(prefetch_queue.size() + prefetched.size() >= max_prefetched)
+				break;
+			if(index.find(block) != index.end() && prefetched.find(block) == prefetched.end())
+				prefetch_queue.push_back(block);
+		}
+	}
+	cond.notify_all();
+}
+
+void BrickStore::PrefetchLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while(true)
+	{
+		cond.wait(lock, [this] { return !running || !prefetch_queue.empty(); });
+		if(!running)
+			return;
+
+		Eigen::Vector3i block = prefetch_queue.front();
+		prefetch_queue.pop_front();
+
+		// may have been read or queued twice meanwhile
+		auto it = index.find(block);
+		if(it == index.end() || prefetched.find(block) != prefetched.end())
+			continue;
+		const Record record = it->second;
+
+		lock.unlock();
+		std::vector<uint8_t> data(record_size);
+		bool ok = ReadRecord(prefetch_file, record.record, data.data());
+		lock.lock();
+
+		// dropped if the block was written since or there is no room left
+		if(!ok || prefetched.size() >= max_prefetched)
+			continue;
+		it = index.find(block);
+		if(it != index.end() && it->second.version == record.version && prefetched.find(block) == prefetched.end())
+			prefetched.emplace(block, std::move(data));
+	}
+}
@@ -0,0 +1,269 @@
+
+#include "cpu_frame.h"
+#include "thread_pool.h"
+
+#include <cmath>
+#include <limits>
+
+#include <Eigen/Geometry>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// rows per thread pool chunk
+#define CPU_FRAME_ROW_GRAIN 16
+
+static const float inf = std::numeric_limits<float>::infinity();
+
+CPUFrame::CPUFrame(ThreadPool *thread_pool) :
+	thread_pool(thread_pool),
+	depth_width(0),
+	depth_height(0),
+	depth_scale(1.0f),
+	intrinsics_focal_length(0.0f, 0.0f),
+	intrinsics_center(0.0f, 0.0f),
+	color_width(0),
+	color_height(0),
+	intrinsics_color_focal_length(0.0f, 0.0f),
+	intrinsics_color_center(0.0f, 0.0f)
+{
+}
+
+void CPUFrame::SetDepthMap(int width, int height, const uint16_t *data, float depth_scale, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center)
+{
+	size_t size = (size_t)width * height;
+	if(width != depth_width || height != depth_height)
+	{
+		depth_width = width;
+		depth_height = height;
+		depth.resize(size);
+		for(auto *plane : { &vertex_x, &vertex_y, &vertex_z, &normal_x, &normal_y, &normal_z })
+			plane->resize(size);
+	}
+
+	depth.assign(data, data + size);
+	this->depth_scale = depth_scale;
+	intrinsics_focal_length = focal_length;
+	intrinsics_center = center;
+}
+
+void CPUFrame::SetColorMap(int width, int height, const uint8_t *data, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center)
+{
+	color_width = width;
+	color_height = height;
+	color.assign(data, data + (size_t)width * height * 3);
+	intrinsics_color_focal_length = focal_length;
+	intrinsics_color_center = center;
+}
+
+// same as DeprojectImageToCamera() in glsl_common_projection.inl
+void CPUFrame::DeprojectRows(int y_begin, int y_end)
+{
+	const float fx = intrinsics_focal_length.x();
+	const float fy = intrinsics_focal_length.y();
+	const float cx = intrinsics_center.x();
+	const float cy = intrinsics_center.y();
+
+	for(int y=y_begin; y<y_end; y++)
+	{
+		size_t row = (size_t)y * depth_width;
+		const float v_y = ((float)y - cy) / fy;
+		int x = 0;
+
+#ifdef __AVX2__
+		const __m256 sign = _mm256_set1_ps(-0.0f);
+		const __m256 inf8 = _mm256_set1_ps(inf);
+		const __m256 zero8 = _mm256_setzero_ps();
+		const __m256 lane = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+		const __m256 scale8 = _mm256_set1_ps(depth_scale);
+		const __m256 cx8 = _mm256_set1_ps(cx);
+		const __m256 fx8 = _mm256_set1_ps(fx);
+		const __m256 v_y8 = _mm256_set1_ps(v_y);
+
+		for(; x + 8 <= depth_width; x += 8)
+		{
+			__m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i *>(depth.data() + row + x));
+			__m256 d = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(raw)), scale8);
+			__m256 invalid = _mm256_cmp_ps(d, zero8, _CMP_EQ_OQ);
+
+			__m256 v_x = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_set1_ps((float)x), lane), cx8), fx8);
+			__m256 px = _mm256_mul_ps(v_x, d);
+			__m256 py = _mm256_xor_ps(_mm256_mul_ps(v_y8, d), sign);
+			__m256 pz = _mm256_xor_ps(d, sign);
+
+			_mm256_storeu_ps(vertex_x.data() + row + x, _mm256_blendv_ps(px, inf8, invalid));
+			_mm256_storeu_ps(vertex_y.data() + row + x, _mm256_blendv_ps(py, inf8, invalid));
+			_mm256_storeu_ps(vertex_z.data() + row + x, _mm256_blendv_ps(pz, inf8, invalid));
+		}
+#endif
+
+		for(; x<depth_width; x++)
+		{
+			float d = (float)depth[row + x] * depth_scale;
+			if(d == 0.0f)
+			{
+				vertex_x[row + x] = inf;
+				vertex_y[row + x] = inf;
+				vertex_z[row + x] = inf;
+				continue;
+			}
+			const float v_x = ((float)x - cx) / fx;
+			vertex_x[row + x] = v_x * d;
+			vertex_y[row + x] = -(v_y * d);
+			vertex_z[row + x] = -d;
+		}
+	}
+}
+
+// same as the normal estimation in Frame's process shader,
+// neighbours outside of the image count as missing depth
+void CPUFrame::NormalAt(int x, int y)
+{
+	size_t i = (size_t)y * depth_width + x;
+	const Eigen::Vector3f pos(vertex_x[i], vertex_y[i], vertex_z[i]);
+	if(pos.z() == inf)
+	{
+		normal_x[i] = normal_y[i] = normal_z[i] = inf;
+		return;
+	}
+
+	auto neighbour = [&](int nx, int ny, Eigen::Vector3f &v) {
+		if(nx < 0 || ny < 0 || nx >= depth_width || ny >= depth_height)
+			return false;
+		size_t n = (size_t)ny * depth_width + nx;
+		if(vertex_z[n] == inf)
+			return false;
+		v = Eigen::Vector3f(vertex_x[n], vertex_y[n], vertex_z[n]);
+		return true;
+	};
+
+	Eigen::Vector3f v, dx, dy;
+	dx = neighbour(x + 1, y, v) ? Eigen::Vector3f(v - pos) : Eigen::Vector3f(1.0f, 0.0f, 0.0f);
+	dy = neighbour(x, y - 1, v) ? Eigen::Vector3f(v - pos) : Eigen::Vector3f(0.0f, 1.0f, 0.0f);
+	Eigen::Vector3f normal = dx.cross(dy);
+
+	dx = neighbour(x - 1, y, v) ? Eigen::Vector3f(pos - v) : Eigen::Vector3f(-1.0f, 0.0f, 0.0f);
+	dy = neighbour(x, y + 1, v) ? Eigen::Vector3f(pos - v) : Eigen::Vector3f(0.0f, -1.0f, 0.0f);
+	normal += dx.cross(dy);
+
+	normal /= std::sqrt(normal.dot(normal));
+	normal_x[i] = normal.x();
+	normal_y[i] = normal.y();
+	normal_z[i] = normal.z();
+}
+
+#ifdef __AVX2__
+struct Vec8
+{
+	__m256 x, y, z;
+};
+
+static inline Vec8 Load8(const float *x, const float *y, const float *z, size_t i)
+{
+	return { _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), _mm256_loadu_ps(z + i) };
+}
+
+static inline Vec8 Sub8(const Vec8 &a, const Vec8 &b)
+{
+	return { _mm256_sub_ps(a.x, b.x), _mm256_sub_ps(a.y, b.y), _mm256_sub_ps(a.z, b.z) };
+}
+
+static inline Vec8 Cross8(const Vec8 &a, const Vec8 &b)
+{
+	return {
+		_mm256_sub_ps(_mm256_mul_ps(a.y, b.z), _mm256_mul_ps(a.z, b.y)),
+		_mm256_sub_ps(_mm256_mul_ps(a.z, b.x), _mm256_mul_ps(a.x, b.z)),
+		_mm256_sub_ps(_mm256_mul_ps(a.x, b.y), _mm256_mul_ps(a.y, b.x))
+	};
+}
+
+// v where the neighbour has depth, the constant fallback direction elsewhere
+static inline Vec8 Select8(const Vec8 &v, const Vec8 &neighbour, float fx, float fy, float fz)
+{
+	__m256 missing = _mm256_cmp_ps(neighbour.z, _mm256_set1_ps(inf), _CMP_EQ_OQ);
+	return {
+		_mm256_blendv_ps(v.x, _mm256_set1_ps(fx), missing),
+		_mm256_blendv_ps(v.y, _mm256_set1_ps(fy), missing),
+		_mm256_blendv_ps(v.z, _mm256_set1_ps(fz), missing)
+	};
+}
+#endif
+
+void CPUFrame::NormalRows(int y_begin, int y_end)
+{
+	for(int y=y_begin; y<y_end; y++)
+	{
+		int x = 0;
+
+#ifdef __AVX2__
+		// border rows and columns go through NormalAt(), everything else 8 pixels at a time
+		if(y > 0 && y < depth_height - 1)
+		{
+			NormalAt(0, y);
+			x = 1;
+
+			const float *vx = vertex_x.data();
+			const float *vy = vertex_y.data();
+			const float *vz = vertex_z.data();
+			const __m256 inf8 = _mm256_set1_ps(inf);
+
+			for(; x + 8 < depth_width; x += 8)
+			{
+				size_t i = (size_t)y * depth_width + x;
+				Vec8 pos = Load8(vx, vy, vz, i);
+
+				Vec8 n = Load8(vx, vy, vz, i + 1);
+				Vec8 dx = Select8(Sub8(n, pos), n, 1.0f, 0.0f, 0.0f);
+				n = Load8(vx, vy, vz, i - depth_width);
+				Vec8 dy = Select8(Sub8(n, pos), n, 0.0f, 1.0f, 0.0f);
+				Vec8 normal = Cross8(dx, dy);
+
+				n = Load8(vx, vy, vz, i - 1);
+				dx = Select8(Sub8(pos, n), n, -1.0f, 0.0f, 0.0f);
+				n = Load8(vx, vy, vz, i + depth_width);
+				dy = Select8(Sub8(pos, n), n, 0.0f, -1.0f, 0.0f);
+				Vec8 c = Cross8(dx, dy);
+				normal.x = _mm256_add_ps(normal.x, c.x);
+				normal.y = _mm256_add_ps(normal.y, c.y);
+				normal.z = _mm256_add_ps(normal.z, c.z);
+
+				__m256 len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(
+						_mm256_mul_ps(normal.x, normal.x),
+						_mm256_mul_ps(normal.y, normal.y)),
+						_mm256_mul_ps(normal.z, normal.z)));
+
+				__m256 missing = _mm256_cmp_ps(pos.z, inf8, _CMP_EQ_OQ);
+				_mm256_storeu_ps(normal_x.data() + i, _mm256_blendv_ps(_mm256_div_ps(normal.x, len), inf8, missing));
+				_mm256_storeu_ps(normal_y.data() + i, _mm256_blendv_ps(_mm256_div_ps(normal.y, len), inf8, missing));
+				_mm256_storeu_ps(normal_z.data() + i, _mm256_blendv_ps(_mm256_div_ps(normal.z, len), inf8, missing));
+			}
+		}
+#endif
+
+		for(; x<depth_width; x++)
+			NormalAt(x, y);
+	}
+}
+
+void CPUFrame::ProcessFrame()
+{
+	if(depth_width == 0 || depth_height == 0)
+		return;
+
+	// normals read the neighbouring rows, so all vertices have to be done first
+	if(thread_pool)
+	{
+		thread_pool->ParallelFor(0, depth_height, CPU_FRAME_ROW_GRAIN, [this](int begin, int end, unsigned int) {
+			DeprojectRows(begin, end);
+		});
+		thread_pool->ParallelFor(0, depth_height, CPU_FRAME_ROW_GRAIN, [this](int begin, int end, unsigned int) {
+			NormalRows(begin, end);
+		});
+	}
+	else
+	{
+		DeprojectRows(0, depth_height);
+		NormalRows(0, depth_height);
+	}
+}
@@ -0,0 +1,175 @@
+
+#include "cpu_icp.h"
+#include "cpu_frame.h"
+#include "camera_transform.h"
+#include "thread_pool.h"
+
+#include <cmath>
+#include <cstring>
+
+// rows per thread pool chunk
+#define CPU_ICP_ROW_GRAIN 8
+
+CPUICP::CPUICP(ThreadPool *thread_pool) :
+	thread_pool(thread_pool),
+	accumulators(thread_pool ? thread_pool->GetThreadCount() : 1)
+{
+	memset(values, 0, sizeof(values));
+
+	distance_threshold = 0.1f;
+	angle_threshold = 0.5f;
+
+	last_rot_delta = Eigen::Vector3f(0.0f, 0.0f, 0.0f);
+	last_translation_delta = Eigen::Vector3f(0.0f, 0.0f, 0.0f);
+
+	ResetConvergence();
+}
+
+void CPUICP::ResetConvergence()
+{
+	error = 0.0f;
+	iterations = 0;
+	converged = false;
+}
+
+// same as CreateResidual() in ICP's corr_shader_code
+void CPUICP::AccumulateRows(CPUFrame *frame, CPUFrame *prediction, const Eigen::Affine3f &prediction_transform,
+		const Eigen::Affine3f &transform_current, int y_begin, int y_end, float *accumulator)
+{
+	const int width = frame->GetDepthWidth();
+	const float *vx = frame->GetVertexX();
+	const float *vy = frame->GetVertexY();
+	const float *vz = frame->GetVertexZ();
+	const float *nx = frame->GetNormalX();
+	const float *ny = frame->GetNormalY();
+	const float *nz = frame->GetNormalZ();
+
+	const int prediction_width = prediction->GetDepthWidth();
+	const int prediction_height = prediction->GetDepthHeight();
+	const float *pvx = prediction->GetVertexX();
+	const float *pvy = prediction->GetVertexY();
+	const float *pvz = prediction->GetVertexZ();
+	const float *pnx = prediction->GetNormalX();
+	const float *pny = prediction->GetNormalY();
+	const float *pnz = prediction->GetNormalZ();
+	const Eigen::Vector2f focal_length = prediction->GetIntrinsicsFocalLength();
+	const Eigen::Vector2f center = prediction->GetIntrinsicsCenter();
+
+	// current camera to prediction camera
+	const Eigen::Affine3f current_to_prediction = prediction_transform.inverse() * transform_current;
+	const Eigen::Matrix3f rot_current = transform_current.linear();
+	const Eigen::Matrix3f rot_prediction = prediction_transform.linear();
+	const float distance_sq_threshold = distance_threshold * distance_threshold;
+
+	float residual[ICP_RESIDUAL_COMPONENTS];
+
+	for(int y=y_begin; y<y_end; y++)
+	{
+		// summed per row first, so the float accumulator does not lose the small values
+		float row_values[ICP_REDUCE_VALUES] = {};
+
+		for(int x=0; x<width; x++)
+		{
+			size_t i = (size_t)y * width + x;
+			if(std::isinf(vx[i]))
+				continue;
+
+			const Eigen::Vector3f vertex_current_camera(vx[i], vy[i], vz[i]);
+			Eigen::Vector3f vertex_current_camera_prev = current_to_prediction * vertex_current_camera;
+			if(vertex_current_camera_prev.z() > 0.0f)
+				continue;
+
+			// see ProjectCameraToImage() in glsl_common_projection.inl
+			float px = (vertex_current_camera_prev.x() / -vertex_current_camera_prev.z()) * focal_length.x() + center.x();
+			float py = (-vertex_current_camera_prev.y() / -vertex_current_camera_prev.z()) * focal_length.y() + center.y();
+			if(!(px >= 0.0f && py >= 0.0f && px < (float)prediction_width && py < (float)prediction_height))
+				continue;
+			size_t p = (size_t)py * prediction_width + (size_t)px;
+			if(std::isinf(pvx[p]))
+				continue;
+
+			Eigen::Vector3f vertex_current_world = transform_current * vertex_current_camera;
+			Eigen::Vector3f vertex_prev_world = prediction_transform * Eigen::Vector3f(pvx[p], pvy[p], pvz[p]);
+
+			Eigen::Vector3f dir_world = vertex_prev_world - vertex_current_world;
+			if(dir_world.squaredNorm() > distance_sq_threshold)
+				continue;
+
+			Eigen::Vector3f normal_prev_world = rot_prediction * Eigen::Vector3f(pnx[p], pny[p], pnz[p]);
+			Eigen::Vector3f normal_current_world = rot_current * Eigen::Vector3f(nx[i], ny[i], nz[i]);
+			if(normal_current_world.dot(normal_prev_world) < angle_threshold)
+				continue;
+
+			Eigen::Vector3f c = vertex_current_world.cross(normal_prev_world);
+			residual[0] = c.x();
+			residual[1] = c.y();
+			residual[2] = c.z();
+			residual[3] = normal_prev_world.x();
+			residual[4] = normal_prev_world.y();
+			residual[5] = normal_prev_world.z();
+			residual[6] = normal_prev_world.dot(dir_world);
+
+			bool finite = true;
+			for(float r : residual)
+				finite = finite && std::isfinite(r);
+			if(finite)
+				ICPSolver::Accumulate(row_values, residual);
+		}
+
+		for(int v=0; v<ICP_REDUCE_VALUES; v++)
+			accumulator[v] += row_values[v];
+	}
+}
+
+void CPUICP::SearchCorrespondences(CPUFrame *frame, CPUFrame *prediction, const Eigen::Affine3f &prediction_transform, const CameraTransform &cam_transform_current)
+{
+	if(converged)
+		return;
+
+	for(auto &accumulator : accumulators)
+		memset(accumulator.values, 0, sizeof(accumulator.values));
+
+	const Eigen::Affine3f transform_current = cam_transform_current.GetTransform();
+	if(thread_pool)
+	{
+		thread_pool->ParallelFor(0, frame->GetDepthHeight(), CPU_ICP_ROW_GRAIN, [&](int begin, int end, unsigned int thread_index) {
+			AccumulateRows(frame, prediction, prediction_transform, transform_current, begin, end, accumulators[thread_index].values);
+		});
+	}
+	else
+		AccumulateRows(frame, prediction, prediction_transform, transform_current, 0, frame->GetDepthHeight(), accumulators[0].values);
+
+	memset(values, 0, sizeof(values));
+	for(auto &accumulator : accumulators)
+	{
+		for(int v=0; v<ICP_REDUCE_VALUES; v++)
+			values[v] += accumulator.values[v];
+	}
+}
+
+void CPUICP::SolveMatrix(CameraTransform *cam_transform)
+{
+	if(converged)
+		return;
+
+	float error_prev = error;
+	error = ICPSolver::MeanError(values);
+	iterations++;
+
+	// there is no pyramid on the CPU, so everything happens on the full resolution
+	Eigen::Vector3f rot_delta, translation_delta;
+	if(!ICPSolver::Solve(values, 0, &rot_delta, &translation_delta))
+	{
+		converged = true;
+		return;
+	}
+
+	last_rot_delta = rot_delta;
+	last_translation_delta = translation_delta;
+
+	Eigen::Affine3f transform = cam_transform->GetTransform();
+	ICPSolver::ApplyDelta(&transform, rot_delta, translation_delta);
+	cam_transform->SetTransform(transform);
+
+	converged = ICPSolver::Converged(convergence_criteria, error_prev, error, rot_delta, translation_delta);
+}
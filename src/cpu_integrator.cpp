@@ -0,0 +1,379 @@
+
+#include "cpu_integrator.h"
+#include "cpu_frame.h"
+#include "model.h"
+#include "voxel_hash_model.h"
+#include "camera_transform.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// z slices per thread pool chunk
+#define CPU_INTEGRATOR_SLICE_GRAIN 2
+
+// VoxelHashModel blocks per thread pool chunk
+#define CPU_INTEGRATOR_BLOCK_GRAIN 16
+
+CPUIntegrator::CPUIntegrator(CPUModel *model, ThreadPool *thread_pool) :
+	model(model),
+	hash_model(nullptr),
+	thread_pool(thread_pool),
+	max_weight(255),
+	last_transform_valid(false)
+{
+}
+
+CPUIntegrator::CPUIntegrator(VoxelHashModel *hash_model, ThreadPool *thread_pool) :
+	model(nullptr),
+	hash_model(hash_model),
+	thread_pool(thread_pool),
+	max_weight(255),
+	last_transform_valid(false)
+{
+}
+
+// same as bounds_shader_code in pc_integrator.cpp, but the largest depth is searched here
+bool CPUIntegrator::ComputeBounds(CPUFrame *frame, const Eigen::Affine3f &transform, Params *params)
+{
+	const int width = frame->GetDepthWidth();
+	const int height = frame->GetDepthHeight();
+	const uint16_t *depth = frame->GetDepthMap();
+	const uint16_t max_depth_raw = width > 0 && height > 0 ? *std::max_element(depth, depth + (size_t)width * height) : 0;
+	if(max_depth_raw == 0)
+		return false;
+
+	params->max_depth = (float)max_depth_raw * frame->GetDepthScale();
+	const float far = params->max_depth - params->min_truncation;
+	const Eigen::Vector2f focal_length = frame->GetIntrinsicsFocalLength();
+	const Eigen::Vector2f center = frame->GetIntrinsicsCenter();
+
+	params->world_min = transform.translation();
+	params->world_max = params->world_min;
+	for(float y : { -1.0f, (float)height + 1.0f })
+	{
+		for(float x : { -1.0f, (float)width + 1.0f })
+		{
+			Eigen::Vector2f v = (Eigen::Vector2f(x, y) - center).cwiseQuotient(focal_length);
+			Eigen::Vector3f p = transform * Eigen::Vector3f(v.x() * far, -v.y() * far, -far);
+			params->world_min = params->world_min.cwiseMin(p);
+			params->world_max = params->world_max.cwiseMax(p);
+		}
+	}
+	return true;
+}
+
+bool CPUIntegrator::Integrate(CPUFrame *frame, const CameraTransform &camera_transform)
+{
+	const Eigen::Affine3f &transform = camera_transform.GetTransform();
+
+	Params params;
+	params.modelview = transform.inverse().matrix();
+	params.cam_pos = transform.translation();
+	params.cam_dir = (transform.linear() * Eigen::Vector3f(0.0f, 0.0f, -1.0f)).normalized();
+	params.min_truncation = model ? model->GetMinTruncation() : hash_model->GetMinTruncation();
+	params.max_truncation = model ? model->GetMaxTruncation() : hash_model->GetMaxTruncation();
+	if(!ComputeBounds(frame, transform, &params))
+		return true;
+
+	if(hash_model)
+	{
+		bool allocated = hash_model->AllocateBlocks(frame, transform);
+
+		std::vector<int> indices;
+		hash_model->GetBlocks(&indices);
+		auto func = [this, frame, &params, &indices](int begin, int end, unsigned int) {
+			IntegrateBlocks(frame, params, indices.data() + begin, end - begin);
+		};
+		if(thread_pool)
+			thread_pool->ParallelFor(0, (int)indices.size(), CPU_INTEGRATOR_BLOCK_GRAIN, func);
+		else
+			func(0, (int)indices.size(), 0);
+
+		// the next frame is assumed to move the camera as much as this one did
+		if(hash_model->GetBrickStore())
+		{
+			Eigen::Affine3f next = last_transform_valid ? transform * (last_transform.inverse() * transform) : transform;
+			hash_model->Prefetch(next, frame->GetDepthWidth(), frame->GetDepthHeight(), frame->GetIntrinsicsFocalLength(), frame->GetIntrinsicsCenter(),
+					params.max_depth - params.min_truncation);
+		}
+		last_transform = transform;
+		last_transform_valid = true;
+		return allocated;
+	}
+
+	// voxel i is at origin + i * cell_size, one voxel of margin against rounding
+	const Eigen::Vector3i res(model->GetResolutionX(), model->GetResolutionY(), model->GetResolutionZ());
+	const Eigen::Vector3f origin = model->GetModelOrigin();
+	const float cell_size = model->GetCellSize();
+	Eigen::Vector3i box_min, box_max;
+	for(int i=0; i<3; i++)
+	{
+		box_min[i] = std::max(0, std::min(res[i], (int)std::floor((params.world_min[i] - origin[i]) / cell_size) - 1));
+		box_max[i] = std::max(0, std::min(res[i], (int)std::ceil((params.world_max[i] - origin[i]) / cell_size) + 2));
+	}
+	if((box_max - box_min).minCoeff() <= 0)
+		return true;
+
+	auto func = [this, frame, &params, &box_min, &box_max](int begin, int end, unsigned int) {
+		IntegrateSlices(frame, params, box_min, box_max, begin, end);
+	};
+	if(thread_pool)
+		thread_pool->ParallelFor(box_min.z(), box_max.z(), CPU_INTEGRATOR_SLICE_GRAIN, func);
+	else
+		func(box_min.z(), box_max.z(), 0);
+	model->UpdateSummary(box_min, box_max, thread_pool);
+	return true;
+}
+
+// The projection follows glsl_common_projection.inl operation by operation,
+// IntegrateRow8() does the same arithmetic in the same order.
+void CPUIntegrator::IntegrateVoxel(CPUFrame *frame, const Params &params, float wx, float wy, float wz, float *tsdf, uint8_t *weight, uint8_t *color)
+{
+	const Eigen::Matrix4f &m = params.modelview;
+	const float vx = m(0, 0) * wx + m(0, 1) * wy + m(0, 2) * wz + m(0, 3);
+	const float vy = m(1, 0) * wx + m(1, 1) * wy + m(1, 2) * wz + m(1, 3);
+	const float vz = m(2, 0) * wx + m(2, 1) * wy + m(2, 2) * wz + m(2, 3);
+	if(!(vz <= 0.0f))
+		return;
+
+	const Eigen::Vector2f focal_length = frame->GetIntrinsicsFocalLength();
+	const Eigen::Vector2f center = frame->GetIntrinsicsCenter();
+	const float px = vx / -vz * focal_length.x() + center.x();
+	const float py = -vy / -vz * focal_length.y() + center.y();
+
+	// pixels past the image read as no depth on the GPU
+	const int width = frame->GetDepthWidth();
+	const int height = frame->GetDepthHeight();
+	if(!(px > -1.0f && px < (float)width && py > -1.0f && py < (float)height))
+		return;
+
+	const float depth = (float)frame->GetDepthMap()[(int)py * width + (int)px] * frame->GetDepthScale();
+	if(depth == 0.0f)
+		return;
+
+	const Eigen::Vector3f &cam_pos = params.cam_pos;
+	const Eigen::Vector3f &cam_dir = params.cam_dir;
+	const float sdf = depth - (cam_dir.x() * (wx - cam_pos.x()) + cam_dir.y() * (wy - cam_pos.y()) + cam_dir.z() * (wz - cam_pos.z()));
+	if(sdf < params.min_truncation)
+		return;
+
+	const float tsdf_new = std::min(std::max(sdf, params.min_truncation), params.max_truncation);
+
+	const unsigned int w_last = *weight;
+	*tsdf = (*tsdf * (float)w_last + tsdf_new) / (float)(w_last + 1);
+	*weight = (uint8_t)std::min(max_weight, w_last + 1);
+
+	if(color)
+		IntegrateColor(frame, Eigen::Vector3f(vx, vy, vz), color);
+}
+
+// The shader stores the color of the current frame with the weight of the color map's alpha (always 1) plus one,
+// limited to max_weight, as alpha. The running average is computed, but not used.
+void CPUIntegrator::IntegrateColor(CPUFrame *frame, const Eigen::Vector3f &v, uint8_t *color)
+{
+	const uint8_t *color_map = frame->GetColorMap();
+	if(!color_map)
+		return;
+
+	const Eigen::Vector2f focal_length = frame->GetIntrinsicsColorFocalLength();
+	const Eigen::Vector2f center = frame->GetIntrinsicsColorCenter();
+	const float px = v.x() / -v.z() * focal_length.x() + center.x();
+	const float py = -v.y() / -v.z() * focal_length.y() + center.y();
+	if(!(px > -1.0f && px < (float)frame->GetColorWidth() && py > -1.0f && py < (float)frame->GetColorHeight()))
+		return;
+
+	const uint8_t *rgb = color_map + ((size_t)(int)py * frame->GetColorWidth() + (int)px) * 3;
+	color[0] = rgb[0];
+	color[1] = rgb[1];
+	color[2] = rgb[2];
+	color[3] = (uint8_t)std::min(max_weight, 255u);
+}
+
+#ifdef __AVX2__
+void CPUIntegrator::IntegrateRow8(CPUFrame *frame, const Params &params, const float *wx_in, float wy, float wz, float *tsdf_row, uint8_t *weights_row, uint8_t *color_row)
+{
+	const Eigen::Matrix4f &m = params.modelview;
+	const int width = frame->GetDepthWidth();
+	const int height = frame->GetDepthHeight();
+	const uint16_t *depth_map = frame->GetDepthMap();
+	const Eigen::Vector2f focal_length = frame->GetIntrinsicsFocalLength();
+	const Eigen::Vector2f center = frame->GetIntrinsicsCenter();
+
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 zero8 = _mm256_setzero_ps();
+	const __m256 min_truncation8 = _mm256_set1_ps(params.min_truncation);
+	const __m256 max_truncation8 = _mm256_set1_ps(params.max_truncation);
+	const __m256 wy8 = _mm256_set1_ps(wy);
+	const __m256 wz8 = _mm256_set1_ps(wz);
+	const __m256 wx = _mm256_loadu_ps(wx_in);
+
+	auto Dot4 = [&](int row) {
+		__m256 r = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m(row, 0)), wx), _mm256_mul_ps(_mm256_set1_ps(m(row, 1)), wy8));
+		r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_set1_ps(m(row, 2)), wz8));
+		return _mm256_add_ps(r, _mm256_set1_ps(m(row, 3)));
+	};
+
+	__m256 vx = Dot4(0);
+	__m256 vy = Dot4(1);
+	__m256 vz = Dot4(2);
+
+	__m256 neg_vz = _mm256_xor_ps(vz, sign);
+	__m256 px = _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(vx, neg_vz), _mm256_set1_ps(focal_length.x())), _mm256_set1_ps(center.x()));
+	__m256 py = _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(_mm256_xor_ps(vy, sign), neg_vz), _mm256_set1_ps(focal_length.y())), _mm256_set1_ps(center.y()));
+
+	__m256 mask = _mm256_cmp_ps(vz, zero8, _CMP_LE_OQ);
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(px, _mm256_set1_ps(-1.0f), _CMP_GT_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(px, _mm256_set1_ps((float)width), _CMP_LT_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(py, _mm256_set1_ps(-1.0f), _CMP_GT_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(py, _mm256_set1_ps((float)height), _CMP_LT_OQ));
+	int mask_bits = _mm256_movemask_ps(mask);
+	if(mask_bits == 0)
+		return;
+
+	// no gather, a 32 bit gather of the last 16 bit depth texel would read past the depth map
+	alignas(32) int pixel[8];
+	alignas(32) float depth_raw[8];
+	_mm256_store_si256(reinterpret_cast<__m256i *>(pixel),
+			_mm256_add_epi32(_mm256_mullo_epi32(_mm256_cvttps_epi32(py), _mm256_set1_epi32(width)), _mm256_cvttps_epi32(px)));
+	for(int i=0; i<8; i++)
+		depth_raw[i] = (mask_bits & (1 << i)) ? (float)depth_map[pixel[i]] : 0.0f;
+	__m256 depth = _mm256_mul_ps(_mm256_load_ps(depth_raw), _mm256_set1_ps(frame->GetDepthScale()));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(depth, zero8, _CMP_NEQ_OQ));
+
+	__m256 dist = _mm256_add_ps(
+			_mm256_mul_ps(_mm256_set1_ps(params.cam_dir.x()), _mm256_sub_ps(wx, _mm256_set1_ps(params.cam_pos.x()))),
+			_mm256_mul_ps(_mm256_set1_ps(params.cam_dir.y()), _mm256_set1_ps(wy - params.cam_pos.y())));
+	dist = _mm256_add_ps(dist, _mm256_mul_ps(_mm256_set1_ps(params.cam_dir.z()), _mm256_set1_ps(wz - params.cam_pos.z())));
+	__m256 sdf = _mm256_sub_ps(depth, dist);
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(sdf, min_truncation8, _CMP_GE_OQ));
+	mask_bits = _mm256_movemask_ps(mask);
+	if(mask_bits == 0)
+		return;
+
+	__m256 tsdf = _mm256_min_ps(_mm256_max_ps(sdf, min_truncation8), max_truncation8);
+
+	__m256i w_last = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(weights_row)));
+	__m256 w_last_f = _mm256_cvtepi32_ps(w_last);
+	__m256 tsdf_last = _mm256_loadu_ps(tsdf_row);
+	__m256 tsdf_avg = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(tsdf_last, w_last_f), tsdf), _mm256_add_ps(w_last_f, _mm256_set1_ps(1.0f)));
+	_mm256_maskstore_ps(tsdf_row, _mm256_castps_si256(mask), tsdf_avg);
+
+	alignas(32) int w_now[8];
+	_mm256_store_si256(reinterpret_cast<__m256i *>(w_now),
+			_mm256_min_epu32(_mm256_add_epi32(w_last, _mm256_set1_epi32(1)), _mm256_set1_epi32((int)max_weight)));
+
+	alignas(32) float v[3][8];
+	if(color_row)
+	{
+		_mm256_store_ps(v[0], vx);
+		_mm256_store_ps(v[1], vy);
+		_mm256_store_ps(v[2], vz);
+	}
+
+	for(int i=0; i<8; i++)
+	{
+		if(!(mask_bits & (1 << i)))
+			continue;
+		weights_row[i] = (uint8_t)w_now[i];
+		if(color_row)
+			IntegrateColor(frame, Eigen::Vector3f(v[0][i], v[1][i], v[2][i]), color_row + i * 4);
+	}
+}
+#endif
+
+// The voxel positions follow glsl_common_grid.inl.
+void CPUIntegrator::IntegrateSlices(CPUFrame *frame, const Params &params, const Eigen::Vector3i &box_min, const Eigen::Vector3i &box_max, int z_begin, int z_end)
+{
+	const int res_x = model->GetResolutionX();
+	const int res_y = model->GetResolutionY();
+	const Eigen::Vector3f res((float)res_x, (float)res_y, (float)model->GetResolutionZ());
+	const Eigen::Vector3f origin = model->GetModelOrigin();
+	const float cell_size = model->GetCellSize();
+
+	for(int z=z_begin; z<z_end; z++)
+	{
+		const float wz = (float)z / res.z() * res.z() * cell_size + origin.z();
+		for(int y=box_min.y(); y<box_max.y(); y++)
+		{
+			const float wy = (float)y / res.y() * res.y() * cell_size + origin.y();
+
+			// the voxels are contiguous along the whole row, or only inside a brick for bricked models
+			for(int run_begin=box_min.x(); run_begin<box_max.x();)
+			{
+				const int run_end = model->GetBricked() ? std::min(box_max.x(), (run_begin / CPU_MODEL_BRICK_SIZE + 1) * CPU_MODEL_BRICK_SIZE) : box_max.x();
+				const size_t first = model->IDX(run_begin, y, z);
+				float *tsdf = model->GetData() + first;
+				uint8_t *weights = model->GetWeights() + first;
+				uint8_t *color = model->GetColorsActive() ? model->GetColor() + first * 4 : nullptr;
+
+				int x = run_begin;
+#ifdef __AVX2__
+				for(; x + 8 <= run_end; x += 8)
+				{
+					alignas(32) float wx[8];
+					for(int i=0; i<8; i++)
+						wx[i] = (float)(x + i) / res.x() * res.x() * cell_size + origin.x();
+					const int i = x - run_begin;
+					IntegrateRow8(frame, params, wx, wy, wz, tsdf + i, weights + i, color ? color + i * 4 : nullptr);
+				}
+#endif
+				for(; x<run_end; x++)
+				{
+					const float wx = (float)x / res.x() * res.x() * cell_size + origin.x();
+					const int i = x - run_begin;
+					IntegrateVoxel(frame, params, wx, wy, wz, tsdf + i, weights + i, color ? color + i * 4 : nullptr);
+				}
+				run_begin = run_end;
+			}
+		}
+	}
+}
+
+static_assert(VOXEL_BLOCK_SIZE == 8, "IntegrateRow8() integrates a row of a block");
+
+void CPUIntegrator::IntegrateBlocks(CPUFrame *frame, const Params &params, const int *indices, int count)
+{
+	const float cell_size = hash_model->GetCellSize();
+	const float block_extent = cell_size * VOXEL_BLOCK_SIZE;
+
+	for(int b=0; b<count; b++)
+	{
+		const int index = indices[b];
+		const Eigen::Vector3i first_voxel = hash_model->GetBlockCoords(index) * VOXEL_BLOCK_SIZE;
+		const Eigen::Vector3f block_min = first_voxel.cast<float>() * cell_size;
+		const Eigen::Vector3f block_max = block_min + Eigen::Vector3f::Constant(block_extent);
+		if((block_max.array() < params.world_min.array()).any() || (block_min.array() > params.world_max.array()).any())
+			continue;
+
+		float *tsdf = hash_model->GetBlockTSDF(index);
+		uint8_t *weights = hash_model->GetBlockWeights(index);
+		uint8_t *color = hash_model->GetBlockColor(index);
+
+		alignas(32) float wx[VOXEL_BLOCK_SIZE];
+		for(int x=0; x<VOXEL_BLOCK_SIZE; x++)
+			wx[x] = (float)(first_voxel.x() + x) * cell_size;
+
+		for(int z=0; z<VOXEL_BLOCK_SIZE; z++)
+		{
+			const float wz = (float)(first_voxel.z() + z) * cell_size;
+			for(int y=0; y<VOXEL_BLOCK_SIZE; y++)
+			{
+				const float wy = (float)(first_voxel.y() + y) * cell_size;
+				const int row = VoxelHashModel::VoxelIndex(0, y, z);
+#ifdef __AVX2__
+				IntegrateRow8(frame, params, wx, wy, wz, tsdf + row, weights + row, color ? color + row * 4 : nullptr);
+#else
+				for(int x=0; x<VOXEL_BLOCK_SIZE; x++)
+					IntegrateVoxel(frame, params, wx[x], wy, wz, tsdf + row + x, weights + row + x, color ? color + (row + x) * 4 : nullptr);
+#endif
+			}
+		}
+	}
+}
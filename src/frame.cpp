@@ -2,62 +2,106 @@
 #include "frame.h"
 #include "shader_common.h"
 
+#include <cstring>
+
+#define STRHELPER(x) #x
+#define TOSTR(x) STRHELPER(x)
+
+// edge length of the square workgroups of the process shader, each loads a tile of (PROCESS_LOCAL_SIZE+2)^2 texels
+#ifndef PROCESS_LOCAL_SIZE
+#define PROCESS_LOCAL_SIZE 16
+#endif
+
 static const char *process_shader_code =
 "#version 450 core\n"
+"#define LOCAL_SIZE " TOSTR(PROCESS_LOCAL_SIZE) "\n"
 #include "glsl_common_depth.inl"
 #include "glsl_common_projection.inl"
 R"glsl(
 
-layout(local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
+#define TILE_SIZE (LOCAL_SIZE + 2)
+
+layout(local_size_x = LOCAL_SIZE, local_size_y = LOCAL_SIZE, local_size_z = 1) in;
 
 uniform float depth_scale;
+uniform int level;
 
 layout(binding = 0) uniform usampler2D depth_tex;
 
 layout(rgba32f, binding = 0) uniform image2D vertex_out;
 layout(rgba32f, binding = 1) uniform image2D normal_out;
 
-vec3 VertexForCoords(ivec2 coords, inout float depth)
+// largest valid depth of level 0, as float bits (which order like uints for positive floats)
+layout(std430, binding = 0) buffer depth_range_out
+{
+	uint max_depth_bits;
+};
+
+// deprojected vertices of the workgroup plus a one texel apron, w is the depth
+shared vec4 tile[TILE_SIZE * TILE_SIZE];
+
+shared uint max_depth_bits_shared;
+
+vec4 TileVertex(ivec2 tile_coords)
 {
-	depth = ReadDepth(depth_tex, coords, depth_scale);
-	return DeprojectImageToCamera(vec2(coords), depth);
+	return tile[tile_coords.y * TILE_SIZE + tile_coords.x];
 }
 
 void main()
 {
+	ivec2 size = ivec2(camera_intrinsics.res);
+	ivec2 tile_origin = ivec2(gl_WorkGroupID.xy) * LOCAL_SIZE - ivec2(1);
+
+	if(gl_LocalInvocationIndex == 0)
+		max_depth_bits_shared = 0;
+
+	for(uint i = gl_LocalInvocationIndex; i < TILE_SIZE * TILE_SIZE; i += LOCAL_SIZE * LOCAL_SIZE)
+	{
+		ivec2 c = tile_origin + ivec2(i % TILE_SIZE, i / TILE_SIZE);
+		float depth = 0.0;
+		if(all(greaterThanEqual(c, ivec2(0))) && all(lessThan(c, size)))
+			depth = ReadDepth(depth_tex, c, level, depth_scale);
+		tile[i] = vec4(DeprojectImageToCamera(vec2(c), depth), depth);
+	}
+
+	barrier();
+
 	ivec2 coords = ivec2(gl_GlobalInvocationID.xy);
+	bool inside = all(lessThan(coords, size));
 
-	float depth = 0.0;
-	vec3 pos = VertexForCoords(coords, depth);
+	ivec2 t = ivec2(gl_LocalInvocationID.xy) + ivec2(1);
+	vec4 v = TileVertex(t);
+	vec3 pos = v.xyz;
+
+	// one global atomic per workgroup
+	if(level == 0)
+	{
+		if(inside)
+			atomicMax(max_depth_bits_shared, floatBitsToUint(v.w));
+		barrier();
+		if(gl_LocalInvocationIndex == 0)
+			atomicMax(max_depth_bits, max_depth_bits_shared);
+	}
+
+	if(!inside)
+		return;
 
 	vec3 normal;
-	if(depth != 0.0)
+	if(v.w != 0.0)
 	{
-		vec3 dx = VertexForCoords(coords + ivec2(1, 0), depth);
-		if(depth == 0.0)
-			dx = vec3(1.0, 0.0, 0.0);
-		else
-			dx -= pos;
-
-		vec3 dy = VertexForCoords(coords + ivec2(0, -1), depth);
-		if(depth == 0.0)
-			dy = vec3(0.0, 1.0, 0.0);
-		else
-			dy -= pos;
+		v = TileVertex(t + ivec2(1, 0));
+		vec3 dx = v.w == 0.0 ? vec3(1.0, 0.0, 0.0) : v.xyz - pos;
+
+		v = TileVertex(t + ivec2(0, -1));
+		vec3 dy = v.w == 0.0 ? vec3(0.0, 1.0, 0.0) : v.xyz - pos;
 
 		normal = cross(dx, dy);
 
-		dx = VertexForCoords(coords - ivec2(1, 0), depth);
-		if(depth == 0.0)
-			dx = vec3(-1.0, 0.0, 0.0);
-		else
-			dx = pos - dx;
+		v = TileVertex(t - ivec2(1, 0));
+		dx = v.w == 0.0 ? vec3(-1.0, 0.0, 0.0) : pos - v.xyz;
 
-		dy = VertexForCoords(coords - ivec2(0, -1), depth);
-		if(depth == 0.0)
-			dy = vec3(0.0, -1.0, 0.0);
-		else
-			dy = pos - dy;
+		v = TileVertex(t - ivec2(0, -1));
+		dy = v.w == 0.0 ? vec3(0.0, -1.0, 0.0) : pos - v.xyz;
 
 		normal += cross(dx, dy);
 
@@ -74,46 +118,118 @@ void main()
 }
 )glsl";
 
-Frame::Frame() :
-	//cloud(new pcl::PointCloud<pcl::PointXYZ>)
-	depth_width(0),
-	depth_height(0),
-	depth_scale(1.0f)
+static const char *downsample_shader_code =
+"#version 450 core\n"
+"#define MAX_DIFF " TOSTR(FRAME_PYRAMID_MAX_DIFF) "\n"
+#include "glsl_common_depth.inl"
+R"glsl(
+
+layout(local_size_x = 16, local_size_y = 16, local_size_z = 1) in;
+
+uniform float depth_scale;
+uniform int level;
+
+layout(binding = 0) uniform usampler2D depth_tex;
+
+layout(r16ui, binding = 0) uniform uimage2D depth_out;
+
+// averages the valid depths of a 2x2 block that are close to the nearest one of them,
+// so depth discontinuities stay sharp
+void main()
 {
-	glGenTextures(1, &depth_tex);
-	glBindTexture(GL_TEXTURE_2D, depth_tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	ivec2 coords = ivec2(gl_GlobalInvocationID.xy);
+	if(any(greaterThanEqual(coords, imageSize(depth_out))))
+		return;
 
-	glGenTextures(1, &vertex_tex);
-	glBindTexture(GL_TEXTURE_2D, vertex_tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	ivec2 src_size = textureSize(depth_tex, level - 1);
+	float d[4];
+	float nearest = 1.0 / 0.0;
+	for(int i=0; i<4; i++)
+	{
+		ivec2 c = min(coords * 2 + ivec2(i & 1, i >> 1), src_size - ivec2(1));
+		d[i] = ReadDepth(depth_tex, c, level - 1, depth_scale);
+		if(d[i] != 0.0)
+			nearest = min(nearest, d[i]);
+	}
 
-	glGenTextures(1, &normal_tex);
-	glBindTexture(GL_TEXTURE_2D, normal_tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	float sum = 0.0;
+	float count = 0.0;
+	for(int i=0; i<4; i++)
+	{
+		if(d[i] != 0.0 && d[i] - nearest <= MAX_DIFF)
+		{
+			sum += d[i];
+			count += 1.0;
+		}
+	}
 
-	glGenTextures(1, &color_tex);
-	glBindTexture(GL_TEXTURE_2D, color_tex);
+	uint depth_raw = count > 0.0 ? uint(round(sum / (count * depth_scale))) : 0u;
+	imageStore(depth_out, coords, uvec4(depth_raw));
+}
+)glsl";
+
+static GLuint CreateTexture2D(GLenum internal_format, int levels, int width, int height, const char *label)
+{
+	GLuint tex;
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_NEAREST_MIPMAP_NEAREST : GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexStorage2D(GL_TEXTURE_2D, levels, internal_format, width, height);
+	glObjectLabel(GL_TEXTURE, tex, -1, label);
+	return tex;
+}
 
+static GLuint CreateIntrinsicsBuffer()
+{
+	// see glsl_common_projection.inl
+	uint32_t buf[8] = {};
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferStorage(GL_UNIFORM_BUFFER, sizeof(buf), buf, GL_DYNAMIC_STORAGE_BIT);
+	return buffer;
+}
+
+Frame::Frame() :
+	//cloud(new pcl::PointCloud<pcl::PointXYZ>)
+	depth_tex(0),
+	vertex_tex(0),
+	normal_tex(0),
+	color_tex(0),
+	depth_width(0),
+	depth_height(0),
+	depth_scale(1.0f),
+	pyramid_levels(0),
+	timestamp_us(0),
+	color_width(0),
+	color_height(0),
+	intrinsics_focal_length(0.0f, 0.0f),
+	intrinsics_center(0.0f, 0.0f),
+	intrinsics_color_focal_length(0.0f, 0.0f),
+	intrinsics_color_center(0.0f, 0.0f)
+{
+	// all textures use immutable storage and are (re)created once the resolution is known
 
-	glGenBuffers(1, &camera_intrinsics_buffer);
-	glGenBuffers(1, &camera_intrinsics_colorbuffer);
+	for(auto &buffer : camera_intrinsics_buffers)
+		buffer = CreateIntrinsicsBuffer();
+	camera_intrinsics_colorbuffer = CreateIntrinsicsBuffer();
+
+	glGenBuffers(1, &depth_range_buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, depth_range_buffer);
+	glBufferStorage(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t), nullptr, GL_DYNAMIC_STORAGE_BIT);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	glObjectLabel(GL_BUFFER, depth_range_buffer, -1, "Frame::depth_range_buffer");
 
 	process_program = CreateComputeShader(process_shader_code);
 	depth_scale_uniform = glGetUniformLocation(process_program, "depth_scale");
+	level_uniform = glGetUniformLocation(process_program, "level");
+
+	downsample_program = CreateComputeShader(downsample_shader_code);
+	downsample_depth_scale_uniform = glGetUniformLocation(downsample_program, "depth_scale");
+	downsample_level_uniform = glGetUniformLocation(downsample_program, "level");
 }
 
 Frame::~Frame()
@@ -122,68 +238,109 @@ Frame::~Frame()
 	glDeleteTextures(1, &vertex_tex);
 	glDeleteTextures(1, &normal_tex);
 	glDeleteTextures(1, &color_tex);
-	glDeleteBuffers(1, &camera_intrinsics_buffer);
+	glDeleteBuffers(FRAME_PYRAMID_LEVELS, camera_intrinsics_buffers);
 	glDeleteBuffers(1, &camera_intrinsics_colorbuffer);
+	glDeleteBuffers(1, &depth_range_buffer);
 	glDeleteProgram(process_program);
+	glDeleteProgram(downsample_program);
+}
+
+void Frame::UploadIntrinsics(GLuint buffer, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center, int width, int height)
+{
+	uint32_t buf[8];
+	*((float *)(buf + 0)) = focal_length.x();
+	*((float *)(buf + 1)) = focal_length.y();
+	*((float *)(buf + 2)) = center.x();
+	*((float *)(buf + 3)) = center.y();
+	*(buf + 4) = (uint32_t)width;
+	*(buf + 5) = (uint32_t)height;
+	*(buf + 6) = 0;
+	*(buf + 7) = 0;
+
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(buf), buf);
 }
 
 void Frame::SetDepthMap(int width, int height, GLushort *data, float depth_scale, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center)
+{
+	size_t size = (size_t)width * height * sizeof(GLushort);
+	memcpy(depth_upload.Map(size), data, size);
+	SetDepthMap(width, height, &depth_upload, depth_scale, focal_length, center);
+}
+
+void Frame::SetDepthMap(int width, int height, PixelUploadRing *upload, float depth_scale, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center)
 {
 	this->depth_scale = depth_scale;
-	glBindTexture(GL_TEXTURE_2D, depth_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI, width, height, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, data);
 
-	if(width != depth_width || height != depth_height)
+	bool resized = width != depth_width || height != depth_height;
+	if(resized)
 	{
-		glBindTexture(GL_TEXTURE_2D, vertex_tex);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
-		glObjectLabel(GL_TEXTURE, vertex_tex, -1, "Frame::vertex_tex");
+		glDeleteTextures(1, &depth_tex);
+		glDeleteTextures(1, &vertex_tex);
+		glDeleteTextures(1, &normal_tex);
+
+		pyramid_levels = 1;
+		while(pyramid_levels < FRAME_PYRAMID_LEVELS && std::max(width, height) >> pyramid_levels > 0)
+			pyramid_levels++;
 
-		glBindTexture(GL_TEXTURE_2D, normal_tex);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
-		glObjectLabel(GL_TEXTURE, normal_tex, -1, "Frame::normal_tex");
+		depth_tex = CreateTexture2D(GL_R16UI, pyramid_levels, width, height, "Frame::depth_tex");
+		vertex_tex = CreateTexture2D(GL_RGBA32F, pyramid_levels, width, height, "Frame::vertex_tex");
+		normal_tex = CreateTexture2D(GL_RGBA32F, pyramid_levels, width, height, "Frame::normal_tex");
 
 		this->depth_width = width;
 		this->depth_height = height;
 	}
 
-	intrinsics_focal_length = focal_length;
-	intrinsics_center = center;
+	glBindTexture(GL_TEXTURE_2D, depth_tex);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED_INTEGER, GL_UNSIGNED_SHORT, upload->BeginUpload());
+	upload->EndUpload();
 
-	uint32_t buf[8];
-	*((float *)(buf + 0)) = intrinsics_focal_length.x();
-	*((float *)(buf + 1)) = intrinsics_focal_length.y();
-	*((float *)(buf + 2)) = intrinsics_center.x();
-	*((float *)(buf + 3)) = intrinsics_center.y();
-	*(buf + 4) = (uint32_t)depth_width;
-	*(buf + 5) = (uint32_t)depth_height;
-	*(buf + 6) = 0;
-	*(buf + 7) = 0;
+	// unknown until ProcessFrame()
+	static const uint32_t infinity_bits = 0x7f800000;
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glClearNamedBufferData(depth_range_buffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &infinity_bits);
 
-	glBindBuffer(GL_UNIFORM_BUFFER, camera_intrinsics_buffer);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(buf), buf, GL_DYNAMIC_DRAW);
+	if(resized || focal_length != intrinsics_focal_length || center != intrinsics_center)
+	{
+		intrinsics_focal_length = focal_length;
+		intrinsics_center = center;
+		for(int level=0; level<pyramid_levels; level++)
+		{
+			UploadIntrinsics(camera_intrinsics_buffers[level], GetIntrinsicsFocalLength(level), GetIntrinsicsCenter(level),
+					GetDepthWidth(level), GetDepthHeight(level));
+		}
+	}
 }
 
 void Frame::SetColorMap(int width, int height, GLushort *data, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center)
 {
-	glBindTexture(GL_TEXTURE_2D, color_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+	size_t size = (size_t)width * height * 3;
+	memcpy(color_upload.Map(size), data, size);
+	SetColorMap(width, height, &color_upload, focal_length, center);
+}
 
-	intrinsics_color_focal_length = focal_length;
-	intrinsics_color_center = center;
+void Frame::SetColorMap(int width, int height, PixelUploadRing *upload, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center)
+{
+	bool resized = width != color_width || height != color_height;
+	if(resized)
+	{
+		glDeleteTextures(1, &color_tex);
+		color_tex = CreateTexture2D(GL_RGB8, 1, width, height, "Frame::color_tex");
 
-	uint32_t buf[8];
-	*((float *)(buf + 0)) = intrinsics_color_focal_length.x();
-	*((float *)(buf + 1)) = intrinsics_color_focal_length.y();
-	*((float *)(buf + 2)) = intrinsics_color_center.x();
-	*((float *)(buf + 3)) = intrinsics_color_center.y();
-	*(buf + 4) = (uint32_t)width;
-	*(buf + 5) = (uint32_t)height;
-	*(buf + 6) = 0;
-	*(buf + 7) = 0;
+		color_width = width;
+		color_height = height;
+	}
 
-	glBindBuffer(GL_UNIFORM_BUFFER, camera_intrinsics_colorbuffer);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(buf), buf, GL_DYNAMIC_DRAW);
+	glBindTexture(GL_TEXTURE_2D, color_tex);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, upload->BeginUpload());
+	upload->EndUpload();
+
+	if(resized || focal_length != intrinsics_color_focal_length || center != intrinsics_color_center)
+	{
+		intrinsics_color_focal_length = focal_length;
+		intrinsics_color_center = center;
+		UploadIntrinsics(camera_intrinsics_colorbuffer, intrinsics_color_focal_length, intrinsics_color_center, color_width, color_height);
+	}
 }
 
 void Frame::ProcessFrame()
@@ -191,17 +348,41 @@ void Frame::ProcessFrame()
 	if(depth_width == 0 || depth_height == 0)
 		return;
 
-	glUseProgram(process_program);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, depth_tex);
+
+	glUseProgram(downsample_program);
+	glUniform1f(downsample_depth_scale_uniform, depth_scale);
+	for(int level=1; level<pyramid_levels; level++)
+	{
+		glUniform1i(downsample_level_uniform, level);
+		glBindImageTexture(0, depth_tex, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R16UI);
+		glDispatchCompute(
+				(static_cast<GLuint>(GetDepthWidth(level)) + 15) / 16,
+				(static_cast<GLuint>(GetDepthHeight(level)) + 15) / 16,
+				1);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	}
 
+	glUseProgram(process_program);
 	glUniform1f(depth_scale_uniform, depth_scale);
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, depth_tex);
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glClearNamedBufferData(depth_range_buffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, depth_range_buffer);
 
-	glBindImageTexture(0, vertex_tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
-	glBindImageTexture(1, normal_tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+	for(int level=0; level<pyramid_levels; level++)
+	{
+		glUniform1i(level_uniform, level);
 
-	glBindBufferBase(GL_UNIFORM_BUFFER, 1, camera_intrinsics_buffer);
+		glBindImageTexture(0, vertex_tex, level, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+		glBindImageTexture(1, normal_tex, level, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
 
-	glDispatchCompute(static_cast<GLuint>(depth_width), static_cast<GLuint>(depth_height), 1);
-}
\ No newline at end of file
+		glBindBufferBase(GL_UNIFORM_BUFFER, 1, camera_intrinsics_buffers[level]);
+
+		glDispatchCompute(
+				(static_cast<GLuint>(GetDepthWidth(level)) + PROCESS_LOCAL_SIZE - 1) / PROCESS_LOCAL_SIZE,
+				(static_cast<GLuint>(GetDepthHeight(level)) + PROCESS_LOCAL_SIZE - 1) / PROCESS_LOCAL_SIZE,
+				1);
+	}
+}
@@ -0,0 +1,751 @@
+
+#include "gl_marching_cubes.h"
+#include "gl_model.h"
+#include "marching_cubes.h"
+#include "mesh_writer.h"
+#include "shader_common.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define STRHELPER(x) #x
+#define TOSTR(x) STRHELPER(x)
+
+// invocations of the passes over voxels or active voxels
+#define MC_GROUP_SIZE 64
+
+// cells along z classified by each invocation
+#define CLASSIFY_SLICES 8
+
+// a scan workgroup sums SCAN_GROUP_SIZE * SCAN_ITEMS values
+#define SCAN_GROUP_SIZE 256
+#define SCAN_ITEMS 16
+#define SCAN_BLOCK (SCAN_GROUP_SIZE * SCAN_ITEMS)
+
+// 1D dispatches are split into rows of this many workgroups, see GroupIndex()
+#define MAX_GROUPS_X 32768
+
+// flags of a voxel: the case of its cell in the low byte, then one bit per axis of the edges it owns a vertex on
+#define FLAGS_EDGE_SHIFT 8
+
+static const char *common_code = R"glsl(
+#define FLAGS_EDGE_SHIFT )glsl" TOSTR(FLAGS_EDGE_SHIFT) R"glsl(
+
+uint GroupIndex()
+{
+	return gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+}
+
+uint VoxelIndex(ivec3 voxel)
+{
+	return (uint(voxel.z) * grid_params.res.y + uint(voxel.y)) * grid_params.res.x + uint(voxel.x);
+}
+
+ivec3 IndexToVoxel(uint index)
+{
+	return ivec3(index % grid_params.res.x, (index / grid_params.res.x) % grid_params.res.y, index / (grid_params.res.x * grid_params.res.y));
+}
+
+// same as in marching_cubes.cpp
+const ivec3 cell_corners[8] = ivec3[](
+	ivec3(1, 0, 0), ivec3(0, 0, 0), ivec3(0, 1, 0), ivec3(1, 1, 0),
+	ivec3(1, 0, 1), ivec3(0, 0, 1), ivec3(0, 1, 1), ivec3(1, 1, 1));
+
+// the voxel owning each edge of a cell relative to the cell and the axis of the edge
+const ivec4 edge_lattice[12] = ivec4[](
+	ivec4(0, 0, 0, 0), ivec4(0, 0, 0, 1), ivec4(0, 1, 0, 0), ivec4(1, 0, 0, 1),
+	ivec4(0, 0, 1, 0), ivec4(0, 0, 1, 1), ivec4(0, 1, 1, 0), ivec4(1, 0, 1, 1),
+	ivec4(1, 0, 0, 2), ivec4(0, 0, 0, 2), ivec4(0, 1, 0, 2), ivec4(1, 1, 0, 2));
+
+layout(std430, binding = 0) readonly buffer tables_in
+{
+	int edge_table[256];
+	int triangle_count[256];
+	int tri_table[256 * 16];
+};
+
+layout(binding = 0) uniform sampler3D tsdf_tex;
+#ifndef PACKED_VOXELS
+layout(binding = 1) uniform usampler3D weight_tex;
+#endif
+#ifdef COLORS_ACTIVE
+layout(binding = 2) uniform sampler3D color_tex;
+#endif
+
+float Value(ivec3 voxel)
+{
+	return texelFetch(tsdf_tex, TexelToTexture(voxel), 0).x * grid_params.tsdf_scale;
+}
+
+bool Observed(ivec3 voxel)
+{
+#ifdef PACKED_VOXELS
+	return texelFetch(tsdf_tex, TexelToTexture(voxel), 0).y > 0.0;
+#else
+	return texelFetch(weight_tex, TexelToTexture(voxel), 0).x > 0u;
+#endif
+}
+)glsl";
+
+static const char *classify_shader_code = R"glsl(
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+uniform float iso;
+uniform bool observed_only;
+
+layout(std430, binding = 1) buffer flags_out
+{
+	uint flags[];
+};
+
+// The cell at each voxel sets its case on the voxel and marks the edges it needs a vertex on at the voxels owning them.
+// Every invocation walks CLASSIFY_SLICES cells up along z, the corners on top of a cell are the bottom of the next.
+void main()
+{
+	ivec3 first = ivec3(gl_GlobalInvocationID.xy, gl_GlobalInvocationID.z * CLASSIFY_SLICES);
+	ivec3 cells = ivec3(grid_params.res) - 1;
+	if(any(greaterThanEqual(first, cells)))
+		return;
+
+	float values[8];
+	for(int c=0; c<4; c++)
+		values[c] = Value(first + cell_corners[c]);
+
+	int last = min(first.z + CLASSIFY_SLICES, cells.z);
+	for(ivec3 cell = first; cell.z < last; cell.z++)
+	{
+		int cube_index = 0;
+		for(int c=0; c<8; c++)
+		{
+			if(c >= 4)
+				values[c] = Value(cell + cell_corners[c]);
+			if(values[c] < iso)
+				cube_index |= 1 << c;
+		}
+		// corners 4 to 7 are above 0 to 3
+		for(int c=0; c<4; c++)
+			values[c] = values[c + 4];
+
+		int edges = edge_table[cube_index];
+		if(edges == 0)
+			continue;
+
+		bool observed = true;
+		for(int c=0; c<8 && observed_only && observed; c++)
+			observed = Observed(cell + cell_corners[c]);
+		if(!observed)
+			continue;
+
+		atomicOr(flags[VoxelIndex(cell)], uint(cube_index));
+		for(int e=0; e<12; e++)
+		{
+			if((edges & (1 << e)) != 0)
+				atomicOr(flags[VoxelIndex(cell + edge_lattice[e].xyz)], 1u << (FLAGS_EDGE_SHIFT + edge_lattice[e].w));
+		}
+	}
+}
+)glsl";
+
+static const char *scan_shader_code = R"glsl(
+layout(local_size_x = SCAN_GROUP_SIZE) in;
+
+uniform uint count;
+uniform uint in_offset;
+uniform uint out_offset;
+uniform uint sums_offset;
+uniform bool predicate;
+
+layout(std430, binding = 0) buffer scan_in
+{
+	uint values_in[];
+};
+
+layout(std430, binding = 1) buffer scan_out
+{
+	uint values_out[];
+};
+
+layout(std430, binding = 2) buffer scan_sums
+{
+	uint sums[];
+};
+
+shared uint partial[SCAN_GROUP_SIZE];
+
+// Exclusive prefix sum of a block of SCAN_BLOCK values, the sum of the block goes to sums.
+// Every invocation reads its values before it writes them, so in and out may be the same.
+void main()
+{
+	uint group = GroupIndex();
+	uint lid = gl_LocalInvocationID.x;
+	uint first = group * SCAN_BLOCK + lid * SCAN_ITEMS;
+
+	uint values[SCAN_ITEMS];
+	uint sum = 0u;
+	for(int i=0; i<SCAN_ITEMS; i++)
+	{
+		uint index = first + uint(i);
+		uint value = index < count ? values_in[in_offset + index] : 0u;
+		if(predicate)
+			value = value != 0u ? 1u : 0u;
+		values[i] = sum;
+		sum += value;
+	}
+
+	partial[lid] = sum;
+	barrier();
+	for(uint stride=1u; stride<SCAN_GROUP_SIZE; stride*=2u)
+	{
+		uint add = lid >= stride ? partial[lid - stride] : 0u;
+		barrier();
+		partial[lid] += add;
+		barrier();
+	}
+
+	uint prefix = lid > 0u ? partial[lid - 1u] : 0u;
+	for(int i=0; i<SCAN_ITEMS; i++)
+	{
+		uint index = first + uint(i);
+		if(index < count)
+			values_out[out_offset + index] = prefix + values[i];
+	}
+	if(lid == SCAN_GROUP_SIZE - 1u)
+		sums[sums_offset + group] = partial[lid];
+}
+)glsl";
+
+static const char *scan_add_shader_code = R"glsl(
+layout(local_size_x = SCAN_GROUP_SIZE) in;
+
+uniform uint count;
+uniform uint offset;
+uniform uint sums_offset;
+
+layout(std430, binding = 1) buffer scan_out
+{
+	uint values[];
+};
+
+layout(std430, binding = 2) buffer scan_sums
+{
+	uint sums[];
+};
+
+// adds the prefix sum of the blocks before to every value of a block
+void main()
+{
+	uint group = GroupIndex();
+	uint first = group * SCAN_BLOCK + gl_LocalInvocationID.x;
+	uint add = sums[sums_offset + group];
+	for(int i=0; i<SCAN_ITEMS; i++)
+	{
+		uint index = first + uint(i * SCAN_GROUP_SIZE);
+		if(index < count)
+			values[offset + index] += add;
+	}
+}
+)glsl";
+
+static const char *compact_shader_code = R"glsl(
+layout(local_size_x = MC_GROUP_SIZE) in;
+
+uniform uint count;
+
+layout(std430, binding = 1) readonly buffer flags_in
+{
+	uint flags[];
+};
+
+layout(std430, binding = 2) readonly buffer active_index_in
+{
+	uint active_index[];
+};
+
+layout(std430, binding = 3) writeonly buffer active_voxels_out
+{
+	uvec2 active_voxels[];
+};
+
+layout(std430, binding = 4) writeonly buffer triangle_offsets_out
+{
+	uint triangle_offsets[];
+};
+
+layout(std430, binding = 5) writeonly buffer vertex_offsets_out
+{
+	uint vertex_offsets[];
+};
+
+// moves the active voxels to the front with their triangle and vertex counts, which are summed up next
+void main()
+{
+	uint index = GroupIndex() * MC_GROUP_SIZE + gl_LocalInvocationID.x;
+	if(index >= count)
+		return;
+	uint voxel_flags = flags[index];
+	if(voxel_flags == 0u)
+		return;
+
+	uint slot = active_index[index];
+	active_voxels[slot] = uvec2(index, voxel_flags);
+	triangle_offsets[slot] = uint(triangle_count[voxel_flags & 0xffu]);
+	vertex_offsets[slot] = uint(bitCount(voxel_flags >> FLAGS_EDGE_SHIFT));
+}
+)glsl";
+
+static const char *generate_shader_code = R"glsl(
+layout(local_size_x = MC_GROUP_SIZE) in;
+
+uniform float iso;
+uniform uint first;
+uniform uint count;
+uniform uint triangle_end;
+uniform uint vertex_base;
+uniform uint triangle_base;
+
+layout(std430, binding = 1) readonly buffer flags_in
+{
+	uint flags[];
+};
+
+layout(std430, binding = 2) readonly buffer active_index_in
+{
+	uint active_index[];
+};
+
+layout(std430, binding = 3) readonly buffer active_voxels_in
+{
+	uvec2 active_voxels[];
+};
+
+layout(std430, binding = 4) readonly buffer triangle_offsets_in
+{
+	uint triangle_offsets[];
+};
+
+layout(std430, binding = 5) readonly buffer vertex_offsets_in
+{
+	uint vertex_offsets[];
+};
+
+layout(std430, binding = 6) writeonly buffer vertices_out
+{
+	float vertices[];
+};
+
+layout(std430, binding = 7) writeonly buffer indices_out
+{
+	uint indices[];
+};
+
+layout(std430, binding = 8) writeonly buffer colors_out
+{
+	uint colors[];
+};
+
+// the vertices of a voxel are in the order of their axes after the ones of the voxels before
+uint VertexIndex(ivec3 voxel, int axis)
+{
+	uint index = VoxelIndex(voxel);
+	uint edges = flags[index] >> FLAGS_EDGE_SHIFT;
+	return vertex_offsets[active_index[index]] + uint(bitCount(edges & ((1u << axis) - 1u)));
+}
+
+// Writes the vertices on the edges of the active voxels [first, first + count) and the triangles of the cells
+// before triangle_end among them. The outputs start at vertex_base and triangle_base, the indices at vertex_base.
+void main()
+{
+	uint local_slot = GroupIndex() * MC_GROUP_SIZE + gl_LocalInvocationID.x;
+	if(local_slot >= count)
+		return;
+	uint slot = first + local_slot;
+	ivec3 voxel = IndexToVoxel(active_voxels[slot].x);
+	uint voxel_flags = active_voxels[slot].y;
+
+	uint vertex = vertex_offsets[slot] - vertex_base;
+	float value = Value(voxel);
+	for(int axis=0; axis<3; axis++)
+	{
+		if((voxel_flags & (1u << (FLAGS_EDGE_SHIFT + axis))) == 0u)
+			continue;
+		ivec3 other = voxel;
+		other[axis]++;
+		vec3 pos = vec3(voxel);
+		pos[axis] += (iso - value) / (Value(other) - value);
+		pos = grid_params.origin + pos * grid_params.cell_size;
+		vertices[vertex * 3u + 0u] = pos.x;
+		vertices[vertex * 3u + 1u] = pos.y;
+		vertices[vertex * 3u + 2u] = pos.z;
+		vertex++;
+	}
+
+	if(slot >= triangle_end)
+		return;
+
+	int cube_index = int(voxel_flags & 0xffu);
+	uint triangle = triangle_offsets[slot] - triangle_base;
+#ifdef COLORS_ACTIVE
+	uint color = packUnorm4x8(texelFetch(color_tex, TexelToTexture(voxel), 0));
+#endif
+	for(int i=0; tri_table[cube_index * 16 + i] != -1; i+=3)
+	{
+		for(int j=0; j<3; j++)
+		{
+			ivec4 lattice = edge_lattice[tri_table[cube_index * 16 + i + j]];
+			indices[triangle * 3u + uint(j)] = VertexIndex(voxel + lattice.xyz, lattice.w) - vertex_base;
+		}
+#ifdef COLORS_ACTIVE
+		colors[triangle] = color;
+#endif
+		triangle++;
+	}
+}
+)glsl";
+
+static void DispatchGroups(unsigned int groups)
+{
+	if(groups == 0)
+		return;
+	const unsigned int x = std::min(groups, (unsigned int)MAX_GROUPS_X);
+	glDispatchCompute(x, (groups + x - 1) / x, 1);
+}
+
+GLMarchingCubes::GLMarchingCubes(GLModel *model) :
+	model(model),
+	active_count(0),
+	vertex_count(0),
+	triangle_count(0)
+{
+	std::string header = "#version 450 core\n";
+	header += "#define MC_GROUP_SIZE " TOSTR(MC_GROUP_SIZE) "\n";
+	header += "#define CLASSIFY_SLICES " TOSTR(CLASSIFY_SLICES) "\n";
+	header += "#define SCAN_GROUP_SIZE " TOSTR(SCAN_GROUP_SIZE) "\n";
+	header += "#define SCAN_ITEMS " TOSTR(SCAN_ITEMS) "\n";
+	header += "#define SCAN_BLOCK " TOSTR(SCAN_BLOCK) "\n";
+	if(model->GetPackedVoxels())
+		header += "#define PACKED_VOXELS\n";
+	if(model->GetColorsActive())
+		header += "#define COLORS_ACTIVE\n";
+
+	static const char *grid_code =
+#include "glsl_common_grid.inl"
+		;
+	const std::string common = header + grid_code + common_code;
+
+	classify_program = CreateComputeShader((common + classify_shader_code).c_str());
+	classify_iso_uniform = glGetUniformLocation(classify_program, "iso");
+	classify_observed_only_uniform = glGetUniformLocation(classify_program, "observed_only");
+	glObjectLabel(GL_PROGRAM, classify_program, -1, "GLMarchingCubes::classify_program");
+
+	scan_program = CreateComputeShader((common + scan_shader_code).c_str());
+	scan_count_uniform = glGetUniformLocation(scan_program, "count");
+	scan_in_offset_uniform = glGetUniformLocation(scan_program, "in_offset");
+	scan_out_offset_uniform = glGetUniformLocation(scan_program, "out_offset");
+	scan_sums_offset_uniform = glGetUniformLocation(scan_program, "sums_offset");
+	scan_predicate_uniform = glGetUniformLocation(scan_program, "predicate");
+	glObjectLabel(GL_PROGRAM, scan_program, -1, "GLMarchingCubes::scan_program");
+
+	scan_add_program = CreateComputeShader((common + scan_add_shader_code).c_str());
+	scan_add_count_uniform = glGetUniformLocation(scan_add_program, "count");
+	scan_add_offset_uniform = glGetUniformLocation(scan_add_program, "offset");
+	scan_add_sums_offset_uniform = glGetUniformLocation(scan_add_program, "sums_offset");
+	glObjectLabel(GL_PROGRAM, scan_add_program, -1, "GLMarchingCubes::scan_add_program");
+
+	compact_program = CreateComputeShader((common + compact_shader_code).c_str());
+	compact_count_uniform = glGetUniformLocation(compact_program, "count");
+	glObjectLabel(GL_PROGRAM, compact_program, -1, "GLMarchingCubes::compact_program");
+
+	generate_program = CreateComputeShader((common + generate_shader_code).c_str());
+	generate_iso_uniform = glGetUniformLocation(generate_program, "iso");
+	generate_first_uniform = glGetUniformLocation(generate_program, "first");
+	generate_count_uniform = glGetUniformLocation(generate_program, "count");
+	generate_triangle_end_uniform = glGetUniformLocation(generate_program, "triangle_end");
+	generate_vertex_base_uniform = glGetUniformLocation(generate_program, "vertex_base");
+	generate_triangle_base_uniform = glGetUniformLocation(generate_program, "triangle_base");
+	glObjectLabel(GL_PROGRAM, generate_program, -1, "GLMarchingCubes::generate_program");
+
+	std::vector<int> tables(256 + 256 + 256 * 16);
+	for(int i=0; i<256; i++)
+	{
+		tables[i] = edgeTable[i];
+		int triangles = 0;
+		while(triTable[i][triangles * 3] != -1)
+			triangles++;
+		tables[256 + i] = triangles;
+		std::copy(triTable[i], triTable[i] + 16, tables.begin() + 512 + i * 16);
+	}
+	glCreateBuffers(1, &tables_buffer);
+	glNamedBufferStorage(tables_buffer, tables.size() * sizeof(int), tables.data(), 0);
+	glObjectLabel(GL_BUFFER, tables_buffer, -1, "GLMarchingCubes::tables_buffer");
+
+	CreateBuffer(&flags, "GLMarchingCubes::flags");
+	CreateBuffer(&active_index, "GLMarchingCubes::active_index");
+	CreateBuffer(&active_voxels, "GLMarchingCubes::active_voxels");
+	CreateBuffer(&triangle_offsets, "GLMarchingCubes::triangle_offsets");
+	CreateBuffer(&vertex_offsets, "GLMarchingCubes::vertex_offsets");
+	CreateBuffer(&scan_sums, "GLMarchingCubes::scan_sums");
+	CreateBuffer(&vertices, "GLMarchingCubes::vertices");
+	CreateBuffer(&indices, "GLMarchingCubes::indices");
+	CreateBuffer(&colors, "GLMarchingCubes::colors");
+}
+
+GLMarchingCubes::~GLMarchingCubes()
+{
+	glDeleteProgram(classify_program);
+	glDeleteProgram(scan_program);
+	glDeleteProgram(scan_add_program);
+	glDeleteProgram(compact_program);
+	glDeleteProgram(generate_program);
+	glDeleteBuffers(1, &tables_buffer);
+	for(StorageBuffer *buffer : { &flags, &active_index, &active_voxels, &triangle_offsets, &vertex_offsets, &scan_sums, &vertices, &indices, &colors })
+		glDeleteBuffers(1, &buffer->buffer);
+}
+
+void GLMarchingCubes::CreateBuffer(StorageBuffer *buffer, const char *label)
+{
+	glCreateBuffers(1, &buffer->buffer);
+	buffer->capacity = 0;
+	Reserve(buffer, 16);
+	glObjectLabel(GL_BUFFER, buffer->buffer, -1, label);
+}
+
+void GLMarchingCubes::Reserve(StorageBuffer *buffer, size_t bytes)
+{
+	if(bytes <= buffer->capacity)
+		return;
+	glNamedBufferData(buffer->buffer, bytes, nullptr, GL_DYNAMIC_COPY);
+	buffer->capacity = bytes;
+}
+
+unsigned int GLMarchingCubes::Scan(GLuint in, GLuint out, unsigned int count, bool predicate)
+{
+	if(count == 0)
+		return 0;
+
+	// Every level sums up the blocks of the level before, until a single block is left.
+	// The block sums of all levels follow each other in scan_sums.
+	std::vector<unsigned int> level_counts;
+	std::vector<unsigned int> sums_offsets;
+	unsigned int sums_size = 0;
+	for(unsigned int n = count;;)
+	{
+		unsigned int blocks = (n + SCAN_BLOCK - 1) / SCAN_BLOCK;
+		level_counts.push_back(n);
+		sums_offsets.push_back(sums_size);
+		sums_size += blocks;
+		if(blocks == 1)
+			break;
+		n = blocks;
+	}
+	Reserve(&scan_sums, sums_size * sizeof(uint32_t));
+
+	glUseProgram(scan_program);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, scan_sums.buffer);
+	for(size_t level=0; level<level_counts.size(); level++)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, level == 0 ? in : scan_sums.buffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, level == 0 ? out : scan_sums.buffer);
+		glUniform1ui(scan_count_uniform, level_counts[level]);
+		glUniform1ui(scan_in_offset_uniform, level == 0 ? 0 : sums_offsets[level - 1]);
+		glUniform1ui(scan_out_offset_uniform, level == 0 ? 0 : sums_offsets[level - 1]);
+		glUniform1ui(scan_sums_offset_uniform, sums_offsets[level]);
+		glUniform1i(scan_predicate_uniform, level == 0 && predicate ? 1 : 0);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		DispatchGroups((level_counts[level] + SCAN_BLOCK - 1) / SCAN_BLOCK);
+	}
+
+	// the top level is one block, the ones below get the sums of the blocks before them added from the top down
+	glUseProgram(scan_add_program);
+	for(size_t level=level_counts.size()-1; level-->0;)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, level == 0 ? out : scan_sums.buffer);
+		glUniform1ui(scan_add_count_uniform, level_counts[level]);
+		glUniform1ui(scan_add_offset_uniform, level == 0 ? 0 : sums_offsets[level - 1]);
+		glUniform1ui(scan_add_sums_offset_uniform, sums_offsets[level]);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		DispatchGroups((level_counts[level] + SCAN_BLOCK - 1) / SCAN_BLOCK);
+	}
+
+	uint32_t total;
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glGetNamedBufferSubData(scan_sums.buffer, sums_offsets.back() * sizeof(uint32_t), sizeof(total), &total);
+	return total;
+}
+
+unsigned int GLMarchingCubes::Classify(double iso, bool observed_only)
+{
+	const Eigen::Vector3i res(model->GetResolutionX(), model->GetResolutionY(), model->GetResolutionZ());
+	const unsigned int voxel_count = (unsigned int)res.x() * res.y() * res.z();
+	active_count = 0;
+	vertex_count = 0;
+	triangle_count = 0;
+	if(res.minCoeff() < 2)
+		return 0;
+
+	glBindBufferBase(GL_UNIFORM_BUFFER, 0, model->GetParamsBuffer());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, tables_buffer);
+	glBindTextureUnit(0, model->GetTSDFTex());
+	if(!model->GetPackedVoxels())
+		glBindTextureUnit(1, model->GetWeightTex());
+	if(model->GetColorsActive())
+		glBindTextureUnit(2, model->GetColorTex());
+
+	// classify the cells
+	Reserve(&flags, voxel_count * sizeof(uint32_t));
+	glClearNamedBufferData(flags.buffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	glUseProgram(classify_program);
+	glUniform1f(classify_iso_uniform, (float)iso);
+	glUniform1i(classify_observed_only_uniform, observed_only ? 1 : 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, flags.buffer);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+	glDispatchCompute((res.x() + 7) / 8, (res.y() + 7) / 8, (res.z() + CLASSIFY_SLICES - 1) / CLASSIFY_SLICES);
+
+	// compact the active voxels
+	Reserve(&active_index, voxel_count * sizeof(uint32_t));
+	active_count = Scan(flags.buffer, active_index.buffer, voxel_count, true);
+	if(active_count == 0)
+	{
+		glUseProgram(0);
+		return 0;
+	}
+
+	Reserve(&active_voxels, active_count * 2 * sizeof(uint32_t));
+	Reserve(&triangle_offsets, active_count * sizeof(uint32_t));
+	Reserve(&vertex_offsets, active_count * sizeof(uint32_t));
+	glUseProgram(compact_program);
+	glUniform1ui(compact_count_uniform, voxel_count);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, tables_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, flags.buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, active_index.buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, active_voxels.buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, triangle_offsets.buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, vertex_offsets.buffer);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	DispatchGroups((voxel_count + MC_GROUP_SIZE - 1) / MC_GROUP_SIZE);
+
+	triangle_count = Scan(triangle_offsets.buffer, triangle_offsets.buffer, active_count, false);
+	vertex_count = Scan(vertex_offsets.buffer, vertex_offsets.buffer, active_count, false);
+	glUseProgram(0);
+	return active_count;
+}
+
+unsigned int GLMarchingCubes::ReadOffset(StorageBuffer *buffer, unsigned int slot, unsigned int total)
+{
+	if(slot >= active_count)
+		return total;
+	uint32_t offset;
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glGetNamedBufferSubData(buffer->buffer, slot * sizeof(uint32_t), sizeof(offset), &offset);
+	return offset;
+}
+
+unsigned int GLMarchingCubes::FirstActiveVoxel(int z)
+{
+	const Eigen::Vector3i res(model->GetResolutionX(), model->GetResolutionY(), model->GetResolutionZ());
+	if(z >= res.z())
+		return active_count;
+	// the active index of a voxel counts the active voxels before it
+	uint32_t slot;
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glGetNamedBufferSubData(active_index.buffer, (size_t)z * res.x() * res.y() * sizeof(uint32_t), sizeof(slot), &slot);
+	return slot;
+}
+
+void GLMarchingCubes::Generate(double iso, unsigned int first, unsigned int end, unsigned int triangle_end, Mesh *mesh)
+{
+	if(first >= end)
+		return;
+
+	const unsigned int vertex_base = ReadOffset(&vertex_offsets, first, vertex_count);
+	const unsigned int chunk_vertices = ReadOffset(&vertex_offsets, end, vertex_count) - vertex_base;
+	const unsigned int triangle_base = ReadOffset(&triangle_offsets, first, triangle_count);
+	const unsigned int chunk_triangles = ReadOffset(&triangle_offsets, triangle_end, triangle_count) - triangle_base;
+
+	Reserve(&vertices, chunk_vertices * 3 * sizeof(float));
+	Reserve(&indices, chunk_triangles * 3 * sizeof(uint32_t));
+	if(model->GetColorsActive())
+		Reserve(&colors, chunk_triangles * sizeof(uint32_t));
+	glBindBufferBase(GL_UNIFORM_BUFFER, 0, model->GetParamsBuffer());
+	glBindTextureUnit(0, model->GetTSDFTex());
+	if(model->GetColorsActive())
+		glBindTextureUnit(2, model->GetColorTex());
+	glUseProgram(generate_program);
+	glUniform1f(generate_iso_uniform, (float)iso);
+	glUniform1ui(generate_first_uniform, first);
+	glUniform1ui(generate_count_uniform, end - first);
+	glUniform1ui(generate_triangle_end_uniform, triangle_end);
+	glUniform1ui(generate_vertex_base_uniform, vertex_base);
+	glUniform1ui(generate_triangle_base_uniform, triangle_base);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, tables_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, flags.buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, active_index.buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, active_voxels.buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, triangle_offsets.buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, vertex_offsets.buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, vertices.buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, indices.buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, colors.buffer);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	DispatchGroups((end - first + MC_GROUP_SIZE - 1) / MC_GROUP_SIZE);
+	glUseProgram(0);
+
+	// only the compact mesh is read back
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	std::vector<Vertex> &mesh_vertices = mesh->GetVertices();
+	const unsigned int base = (unsigned int)mesh_vertices.size();
+	mesh_vertices.resize(base + chunk_vertices);
+	glGetNamedBufferSubData(vertices.buffer, 0, chunk_vertices * 3 * sizeof(float), mesh_vertices.data() + base);
+
+	std::vector<uint32_t> triangle_indices(chunk_triangles * 3);
+	std::vector<uint32_t> triangle_colors(model->GetColorsActive() ? chunk_triangles : 0);
+	glGetNamedBufferSubData(indices.buffer, 0, triangle_indices.size() * sizeof(uint32_t), triangle_indices.data());
+	if(model->GetColorsActive())
+		glGetNamedBufferSubData(colors.buffer, 0, triangle_colors.size() * sizeof(uint32_t), triangle_colors.data());
+
+	mesh->GetTriangles().reserve(mesh->GetTriangles().size() + chunk_triangles);
+	for(unsigned int i=0; i<chunk_triangles; i++)
+	{
+		int color[3] = { 0, 0, 0 };
+		if(model->GetColorsActive())
+			for(int j=0; j<3; j++)
+				color[j] = (int)((triangle_colors[i] >> (8 * j)) & 0xff);
+		mesh->AddFace(base + triangle_indices[i * 3], base + triangle_indices[i * 3 + 1], base + triangle_indices[i * 3 + 2], color);
+	}
+}
+
+void GLMarchingCubes::ExtractMesh(double iso, Mesh *mesh, bool observed_only)
+{
+	if(Classify(iso, observed_only) == 0)
+		return;
+	Generate(iso, 0, active_count, active_count, mesh);
+}
+
+void GLMarchingCubes::StreamMesh(double iso, MeshWriter *writer, bool observed_only)
+{
+	if(Classify(iso, observed_only) == 0)
+		return;
+
+	// The cells of a slab have their vertices on the voxels of its slices and of the slice above it,
+	// those on the slice above are written by this slab already and skipped by the next one.
+	const int cell_slices = model->GetResolutionZ() - 1;
+	const size_t vertex_base = writer->GetVertexCount();
+	Mesh chunk;
+	std::vector<unsigned int> chunk_indices;
+	for(int z_begin = 0; z_begin < cell_slices; z_begin += MC_STREAM_SLAB_SLICES)
+	{
+		const int z_end = std::min(z_begin + MC_STREAM_SLAB_SLICES, cell_slices);
+		const unsigned int first = FirstActiveVoxel(z_begin);
+		const unsigned int end = FirstActiveVoxel(z_end + 1);
+		if(first >= end)
+			continue;
+
+		chunk.Clear();
+		Generate(iso, first, end, FirstActiveVoxel(z_end), &chunk);
+		const unsigned int first_vertex = ReadOffset(&vertex_offsets, first, vertex_count);
+		chunk_indices.resize(chunk.GetVertices().size());
+		for(size_t i=0; i<chunk_indices.size(); i++)
+			chunk_indices[i] = (unsigned int)(vertex_base + first_vertex + i);
+		writer->WriteChunk(chunk, chunk_indices);
+	}
+}
@@ -1,25 +1,32 @@
 
 #include "gl_model.h"
 
+#include <algorithm>
+#include <vector>
 
-GLModel::GLModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, bool colorsActive)
+
+GLModel::GLModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, bool colorsActive, bool packedVoxels)
 	: Model(resolutionX, resolutionY, resolutionZ, cellSize, max_truncation, min_truncation, colorsActive)
 {
 	this->colorsActive = colorsActive;
+	this->packedVoxels = packedVoxels;
 	Init();
 }
 
-GLModel::GLModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, Eigen::Vector3f modelOrigin, bool colorsActive)
+GLModel::GLModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, Eigen::Vector3f modelOrigin, bool colorsActive, bool packedVoxels)
 	: Model(resolutionX, resolutionY, resolutionZ, cellSize, max_truncation, min_truncation, modelOrigin, colorsActive)
 {
 	this->colorsActive = colorsActive;
+	this->packedVoxels = packedVoxels;
 	Init();
 }
 
 GLModel::~GLModel()
 {
 	glDeleteTextures(1, &tsdf_tex);
-	glDeleteTextures(1, &weight_tex);
+	if (!packedVoxels) {
+		glDeleteTextures(1, &weight_tex);
+	}
 	glDeleteBuffers(1, &params_buffer);
 	if (colorsActive) {
 		glDeleteTextures(1, &color_tex);
@@ -36,17 +43,24 @@ void GLModel::Init()
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, resolutionX, resolutionY, resolutionZ, 0, GL_RED, GL_FLOAT, nullptr);
+	if (packedVoxels) {
+		// the weight is in the green channel, see PackedVoxel
+		glTexImage3D(GL_TEXTURE_3D, 0, GL_RG16_SNORM, resolutionX, resolutionY, resolutionZ, 0, GL_RG, GL_SHORT, nullptr);
+		weight_tex = 0;
+	}
+	else {
+		glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, resolutionX, resolutionY, resolutionZ, 0, GL_RED, GL_FLOAT, nullptr);
 
-	glActiveTexture(GL_TEXTURE1);
-	glGenTextures(1, &weight_tex);
-	glBindTexture(GL_TEXTURE_3D, weight_tex);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexImage3D(GL_TEXTURE_3D, 0, GL_R8UI, resolutionX, resolutionY, resolutionZ, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+		glActiveTexture(GL_TEXTURE1);
+		glGenTextures(1, &weight_tex);
+		glBindTexture(GL_TEXTURE_3D, weight_tex);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+		glTexImage3D(GL_TEXTURE_3D, 0, GL_R8UI, resolutionX, resolutionY, resolutionZ, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+	}
 
 	if (colorsActive) {
 		glActiveTexture(GL_TEXTURE2);
@@ -59,11 +73,24 @@ void GLModel::Init()
 		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 		glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA8, resolutionX, resolutionY, resolutionZ, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 	}
+	else {
+		color_tex = 0;
+	}
+
+	ring_offset = Eigen::Vector3i::Zero();
+	rolling = false;
+	reset_origin = modelOrigin;
 
-	// see glsl_common_grid.inl
 	glGenBuffers(1, &params_buffer);
-	glBindBuffer(GL_UNIFORM_BUFFER, params_buffer);
-	uint32_t buf[8];
+	UploadParams();
+
+	Reset();
+}
+
+void GLModel::UploadParams()
+{
+	// see glsl_common_grid.inl
+	uint32_t buf[12];
 	buf[0] = static_cast<uint32_t>(resolutionX);
 	buf[1] = static_cast<uint32_t>(resolutionY);
 	buf[2] = static_cast<uint32_t>(resolutionZ);
@@ -71,23 +98,207 @@ void GLModel::Init()
 	*((float *)(buf + 4)) = modelOrigin.x();
 	*((float *)(buf + 5)) = modelOrigin.y();
 	*((float *)(buf + 6)) = modelOrigin.z();
-	buf[7] = 0;
+	*((float *)(buf + 7)) = packedVoxels ? GetPackedTSDFScale() : 1.0f;
+	buf[8] = static_cast<uint32_t>(ring_offset.x());
+	buf[9] = static_cast<uint32_t>(ring_offset.y());
+	buf[10] = static_cast<uint32_t>(ring_offset.z());
+	buf[11] = 0;
+	glBindBuffer(GL_UNIFORM_BUFFER, params_buffer);
 	glBufferData(GL_UNIFORM_BUFFER, sizeof(buf), buf, GL_STATIC_DRAW);
+}
 
-	Reset();
+void GLModel::SetRolling(bool rolling)
+{
+	this->rolling = rolling;
+	GLint wrap = rolling ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+	GLuint textures[] = { tsdf_tex, weight_tex, colorsActive ? color_tex : 0 };
+	for(GLuint texture : textures)
+	{
+		if(!texture)
+			continue;
+		glTextureParameteri(texture, GL_TEXTURE_WRAP_S, wrap);
+		glTextureParameteri(texture, GL_TEXTURE_WRAP_T, wrap);
+		glTextureParameteri(texture, GL_TEXTURE_WRAP_R, wrap);
+	}
+
+	// clamping only works with the voxels at their own texels
+	if(!rolling && ring_offset != Eigen::Vector3i::Zero())
+	{
+		glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+		for(GLuint texture : textures)
+		{
+			if(texture)
+				UnwrapTexture(texture);
+		}
+		ring_offset = Eigen::Vector3i::Zero();
+		UploadParams();
+	}
 }
 
-void GLModel::Reset()
+void GLModel::UnwrapTexture(GLuint tex)
+{
+	GLint internal_format;
+	glGetTextureLevelParameteriv(tex, 0, GL_TEXTURE_INTERNAL_FORMAT, &internal_format);
+
+	GLuint tmp;
+	glCreateTextures(GL_TEXTURE_3D, 1, &tmp);
+	glTextureStorage3D(tmp, 1, internal_format, resolutionX, resolutionY, resolutionZ);
+	glObjectLabel(GL_TEXTURE, tmp, -1, "GLModel::UnwrapTexture tmp");
+
+	TexelBox boxes[8];
+	int count = GetTexelBoxes(Eigen::Vector3i::Zero(), Eigen::Vector3i(resolutionX, resolutionY, resolutionZ), boxes);
+	for(int i=0; i<count; i++)
+	{
+		const TexelBox &b = boxes[i];
+		glCopyImageSubData(tex, GL_TEXTURE_3D, 0, b.texel.x(), b.texel.y(), b.texel.z(),
+				tmp, GL_TEXTURE_3D, 0, b.voxel.x(), b.voxel.y(), b.voxel.z(), b.size.x(), b.size.y(), b.size.z());
+	}
+	glCopyImageSubData(tmp, GL_TEXTURE_3D, 0, 0, 0, 0, tex, GL_TEXTURE_3D, 0, 0, 0, 0, resolutionX, resolutionY, resolutionZ);
+
+	glDeleteTextures(1, &tmp);
+}
+
+void GLModel::Shift(const Eigen::Vector3i &voxels)
+{
+	Eigen::Vector3i res(resolutionX, resolutionY, resolutionZ);
+	modelOrigin += voxels.cast<float>() * cellSize;
+	for(int i=0; i<3; i++)
+		ring_offset[i] = ((ring_offset[i] + voxels[i]) % res[i] + res[i]) % res[i];
+	UploadParams();
+}
+
+Eigen::Vector3i GLModel::VoxelToTexel(const Eigen::Vector3i &voxel)
+{
+	Eigen::Vector3i res(resolutionX, resolutionY, resolutionZ);
+	Eigen::Vector3i texel;
+	for(int i=0; i<3; i++)
+		texel[i] = ((voxel[i] + ring_offset[i]) % res[i] + res[i]) % res[i];
+	return texel;
+}
+
+int GLModel::GetTexelBoxes(const Eigen::Vector3i &begin, const Eigen::Vector3i &end, TexelBox boxes[8])
+{
+	Eigen::Vector3i res(resolutionX, resolutionY, resolutionZ);
+
+	// per axis, the range is split where it wraps around
+	int count[3];
+	int split_voxel[3][2], split_texel[3][2], split_size[3][2];
+	for(int i=0; i<3; i++)
+	{
+		int size = std::min(end[i] - begin[i], res[i]);
+		if(size <= 0)
+			return 0;
+		int texel = VoxelToTexel(begin)[i];
+		int first = std::min(size, res[i] - texel);
+		split_voxel[i][0] = begin[i];
+		split_texel[i][0] = texel;
+		split_size[i][0] = first;
+		split_voxel[i][1] = begin[i] + first;
+		split_texel[i][1] = 0;
+		split_size[i][1] = size - first;
+		count[i] = first < size ? 2 : 1;
+	}
+
+	int n = 0;
+	for(int z=0; z<count[2]; z++)
+	{
+		for(int y=0; y<count[1]; y++)
+		{
+			for(int x=0; x<count[0]; x++)
+			{
+				boxes[n].voxel = Eigen::Vector3i(split_voxel[0][x], split_voxel[1][y], split_voxel[2][z]);
+				boxes[n].texel = Eigen::Vector3i(split_texel[0][x], split_texel[1][y], split_texel[2][z]);
+				boxes[n].size = Eigen::Vector3i(split_size[0][x], split_size[1][y], split_size[2][z]);
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+void GLModel::ClearVoxels(const Eigen::Vector3i &begin, const Eigen::Vector3i &end)
+{
+	// the voxels may still be read or written by shaders issued before
+	glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+	TexelBox boxes[8];
+	int count = GetTexelBoxes(begin, end, boxes);
+	for(int i=0; i<count; i++)
+		ClearTexels(boxes[i].texel, boxes[i].size);
+}
+
+void GLModel::ClearTexels(const Eigen::Vector3i &texel, const Eigen::Vector3i &size)
 {
 	float tsdf_reset[] = { max_truncation, 0.0f, 0.0f, 0.0f };
-	glClearTexImage(tsdf_tex, 0, GL_RGBA, GL_FLOAT, tsdf_reset);
-	uint16_t weight_reset[] = { 0, 0, 0, 0 };
-	glClearTexImage(weight_tex, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, weight_reset);
+	if (packedVoxels)
+		tsdf_reset[0] /= GetPackedTSDFScale();
+	glClearTexSubImage(tsdf_tex, 0, texel.x(), texel.y(), texel.z(), size.x(), size.y(), size.z(), GL_RGBA, GL_FLOAT, tsdf_reset);
+	if (!packedVoxels)
+	{
+		uint16_t weight_reset[] = { 0, 0, 0, 0 };
+		glClearTexSubImage(weight_tex, 0, texel.x(), texel.y(), texel.z(), size.x(), size.y(), size.z(), GL_RED_INTEGER, GL_UNSIGNED_BYTE, weight_reset);
+	}
 	if (colorsActive)
 	{
 		uint8_t color_reset[] = { 0, 0, 0, 0 };
-		glClearTexImage(color_tex, 0, GL_RGBA, GL_UNSIGNED_BYTE, color_reset);
+		glClearTexSubImage(color_tex, 0, texel.x(), texel.y(), texel.z(), size.x(), size.y(), size.z(), GL_RGBA, GL_UNSIGNED_BYTE, color_reset);
+	}
+}
+
+void GLModel::Reset()
+{
+	glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+	ClearTexels(Eigen::Vector3i::Zero(), Eigen::Vector3i(resolutionX, resolutionY, resolutionZ));
+
+	// all texels are cleared, so the volume can move back without copying
+	ring_offset = Eigen::Vector3i::Zero();
+	modelOrigin = reset_origin;
+	UploadParams();
+}
+
+void GLModel::WriteTexture(GLuint tex, GLenum format, GLenum type, size_t texel_size, const void *data)
+{
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, resolutionX);
+	glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, resolutionY);
+
+	TexelBox boxes[8];
+	int count = GetTexelBoxes(Eigen::Vector3i::Zero(), Eigen::Vector3i(resolutionX, resolutionY, resolutionZ), boxes);
+	for(int i=0; i<count; i++)
+	{
+		const TexelBox &b = boxes[i];
+		size_t offset = ((size_t)b.voxel.z() * resolutionY + b.voxel.y()) * resolutionX + b.voxel.x();
+		glTextureSubImage3D(tex, 0, b.texel.x(), b.texel.y(), b.texel.z(), b.size.x(), b.size.y(), b.size.z(),
+				format, type, static_cast<const uint8_t *>(data) + offset * texel_size);
 	}
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+}
+
+void GLModel::ReadTexture(GLuint tex, GLenum format, GLenum type, size_t texel_size, const Eigen::Vector3i &begin, const Eigen::Vector3i &end, void *data)
+{
+	const Eigen::Vector3i size = end - begin;
+	const size_t voxels = (size_t)size.x() * size.y() * size.z();
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glPixelStorei(GL_PACK_ROW_LENGTH, size.x());
+	glPixelStorei(GL_PACK_IMAGE_HEIGHT, size.y());
+
+	TexelBox boxes[8];
+	int count = GetTexelBoxes(begin, end, boxes);
+	for(int i=0; i<count; i++)
+	{
+		const TexelBox &b = boxes[i];
+		Eigen::Vector3i dst = b.voxel - begin;
+		size_t offset = ((size_t)dst.z() * size.y() + dst.y()) * size.x() + dst.x();
+		glGetTextureSubImage(tex, 0, b.texel.x(), b.texel.y(), b.texel.z(), b.size.x(), b.size.y(), b.size.z(),
+				format, type, (GLsizei)((voxels - offset) * texel_size), static_cast<uint8_t *>(data) + offset * texel_size);
+	}
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_PACK_IMAGE_HEIGHT, 0);
 }
 
 void GLModel::CopyFrom(CPUModel *cpu_model)
@@ -96,18 +307,28 @@ void GLModel::CopyFrom(CPUModel *cpu_model)
 	assert(cpu_model->GetResolutionY() == resolutionY);
 	assert(cpu_model->GetResolutionZ() == resolutionZ);
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_3D, tsdf_tex);
-	glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, resolutionX, resolutionY, resolutionZ, 0, GL_RED, GL_FLOAT, cpu_model->GetData());
-
-	glBindTexture(GL_TEXTURE_3D, weight_tex);
-	glTexImage3D(GL_TEXTURE_3D, 0, GL_R8UI, resolutionX, resolutionY, resolutionZ, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, cpu_model->GetWeights());
+	// the textures are in linear order
+	if (cpu_model->GetBricked())
+	{
+		CPUModel linear(resolutionX, resolutionY, resolutionZ, cellSize, max_truncation, min_truncation, modelOrigin, cpu_model->GetColorsActive());
+		cpu_model->ToLinear(linear.GetData(), linear.GetWeights(), linear.GetColor());
+		CopyFrom(&linear);
+		return;
+	}
 
-	if (colorsActive)
+	if (packedVoxels)
 	{
-		glBindTexture(GL_TEXTURE_3D, color_tex);
-		glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA8, resolutionX, resolutionY, resolutionZ, 0, GL_RGBA, GL_UNSIGNED_BYTE, cpu_model->GetColor());
+		std::vector<PackedVoxel> voxels((size_t)resolutionX * resolutionY * resolutionZ);
+		cpu_model->Pack(voxels.data());
+		WriteTexture(tsdf_tex, GL_RG, GL_SHORT, sizeof(PackedVoxel), voxels.data());
 	}
+	else
+	{
+		WriteTexture(tsdf_tex, GL_RED, GL_FLOAT, sizeof(float), cpu_model->GetData());
+		WriteTexture(weight_tex, GL_RED_INTEGER, GL_UNSIGNED_BYTE, 1, cpu_model->GetWeights());
+	}
+	if (colorsActive)
+		WriteTexture(color_tex, GL_RGBA, GL_UNSIGNED_BYTE, 4, cpu_model->GetColor());
 }
 
 void GLModel::CopyTo(CPUModel *cpu_model)
@@ -116,16 +337,54 @@ void GLModel::CopyTo(CPUModel *cpu_model)
 	assert(cpu_model->GetResolutionY() == resolutionY);
 	assert(cpu_model->GetResolutionZ() == resolutionZ);
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_3D, tsdf_tex);
-	glGetTexImage(GL_TEXTURE_3D, 0, GL_RED, GL_FLOAT, cpu_model->GetData());
+	const Eigen::Vector3i res(resolutionX, resolutionY, resolutionZ);
+	if (cpu_model->GetBricked())
+	{
+		const size_t count = (size_t)resolutionX * resolutionY * resolutionZ;
+		std::vector<float> tsdf(count);
+		std::vector<uint8_t> weights(count);
+		std::vector<uint8_t> color(cpu_model->GetColorsActive() ? count * 4 : 0);
+		ReadVoxels(Eigen::Vector3i::Zero(), res, tsdf.data(), weights.data(), cpu_model->GetColorsActive() ? color.data() : nullptr);
+		cpu_model->FromLinear(tsdf.data(), weights.data(), color.data());
+		return;
+	}
+
+	ReadVoxels(Eigen::Vector3i::Zero(), res,
+			cpu_model->GetData(), cpu_model->GetWeights(), cpu_model->GetColorsActive() ? cpu_model->GetColor() : nullptr);
+	cpu_model->UpdateSummary();
+}
 
-	glBindTexture(GL_TEXTURE_3D, weight_tex);
-	glGetTexImage(GL_TEXTURE_3D, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, cpu_model->GetWeights());
+void GLModel::ReadVoxels(const Eigen::Vector3i &begin, const Eigen::Vector3i &end, float *tsdf, uint8_t *weights, uint8_t *color)
+{
+	// the voxels may still be written by shaders issued before
+	glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
 
-	if (colorsActive && cpu_model->GetColorsActive())
+	if (packedVoxels)
 	{
-		glBindTexture(GL_TEXTURE_3D, color_tex);
-		glGetTexImage(GL_TEXTURE_3D, 0, GL_RGBA, GL_UNSIGNED_BYTE, cpu_model->GetColor());
+		const Eigen::Vector3i size = end - begin;
+		std::vector<PackedVoxel> voxels((size_t)size.x() * size.y() * size.z());
+		ReadTexture(tsdf_tex, GL_RG, GL_SHORT, sizeof(PackedVoxel), begin, end, voxels.data());
+		for (size_t i = 0; i < voxels.size(); i++)
+		{
+			tsdf[i] = UnpackTSDF(voxels[i]);
+			weights[i] = UnpackWeight(voxels[i]);
+		}
+	}
+	else
+	{
+		ReadTexture(tsdf_tex, GL_RED, GL_FLOAT, sizeof(float), begin, end, tsdf);
+		ReadTexture(weight_tex, GL_RED_INTEGER, GL_UNSIGNED_BYTE, 1, begin, end, weights);
 	}
-}
\ No newline at end of file
+	if (colorsActive && color)
+		ReadTexture(color_tex, GL_RGBA, GL_UNSIGNED_BYTE, 4, begin, end, color);
+}
+
+void GLModel::ReadPackedVoxels(const Eigen::Vector3i &begin, const Eigen::Vector3i &end, PackedVoxel *voxels, uint8_t *color)
+{
+	assert(packedVoxels);
+
+	glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+	ReadTexture(tsdf_tex, GL_RG, GL_SHORT, sizeof(PackedVoxel), begin, end, voxels);
+	if (colorsActive && color)
+		ReadTexture(color_tex, GL_RGBA, GL_UNSIGNED_BYTE, 4, begin, end, color);
+}
@@ -1,7 +1,12 @@
 R"glsl(
-float ReadDepth(usampler2D depth_tex, ivec2 pos, float depth_scale)
+float ReadDepth(usampler2D depth_tex, ivec2 pos, int lod, float depth_scale)
 {
-	uint depth_raw = texelFetch(depth_tex, pos, 0).r;
+	uint depth_raw = texelFetch(depth_tex, pos, lod).r;
 	return float(depth_raw) * depth_scale;
 }
+
+float ReadDepth(usampler2D depth_tex, ivec2 pos, float depth_scale)
+{
+	return ReadDepth(depth_tex, pos, 0, depth_scale);
+}
 )glsl"
\ No newline at end of file
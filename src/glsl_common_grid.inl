@@ -4,6 +4,9 @@ layout(std140, binding=0) uniform GridParamsBlock
 	uvec3 res;
 	float cell_size;
 	vec3 origin;
+	// the tsdf in the textures is divided by this, see PackedVoxel
+	float tsdf_scale;
+	ivec3 ring_offset;
 } grid_params;
 
 // pos is in [0.0, 1.0]
@@ -33,6 +36,20 @@ vec3 TexelToGrid(ivec3 pos)
 	return vec3(pos) / vec3(grid_params.res);
 }
 
+// texel position in [0, grid_params.res]
+// returns the texel in the textures, which are shifted by the ring offset of a rolling volume
+ivec3 TexelToTexture(ivec3 pos)
+{
+	return (pos + grid_params.ring_offset) % ivec3(grid_params.res);
+}
+
+// pos is in [0.0, 1.0]
+// returns the texture coordinates to sample at, the textures must wrap around if the ring offset is not 0
+vec3 GridToTexture(vec3 pos)
+{
+	return pos + vec3(grid_params.ring_offset) / vec3(grid_params.res);
+}
+
 vec3 GridExtent()
 {
 	return vec3(grid_params.res) * grid_params.cell_size;
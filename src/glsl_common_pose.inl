@@ -0,0 +1,31 @@
+R"glsl(
+// see PoseBuffer
+struct CameraPose
+{
+	mat4 transform;			// camera to world
+	mat4 modelview;			// world to camera
+	vec4 rot_delta;			// last ICP update, xyz are the angles around x, y and z
+	vec4 translation_delta;
+
+	// per pyramid level, see ICP
+	vec4 icp_error;			// mean squared residual of the last iteration
+	uvec4 icp_iterations;
+	uvec4 icp_converged;	// != 0 once the remaining iterations can be skipped
+};
+
+layout(std140, binding=3) uniform CameraPoseBlock
+{
+	CameraPose camera_pose;
+};
+
+vec3 CameraPosition()
+{
+	return camera_pose.transform[3].xyz;
+}
+
+// viewing direction in world space
+vec3 CameraDirection()
+{
+	return normalize(mat3(camera_pose.transform) * vec3(0.0, 0.0, -1.0));
+}
+)glsl"
\ No newline at end of file
@@ -6,15 +6,21 @@
 #include "camera_transform.h"
 #include "shader_common.h"
 #include "renderer.h"
+#include "icp_solver.h"
 
-#define RESIDUAL_COMPONENTS 7
-#define MATRIX_COLUMNS RESIDUAL_COMPONENTS
-#define MATRIX_ROWS (RESIDUAL_COMPONENTS-1)
+#define RESIDUAL_COMPONENTS ICP_RESIDUAL_COMPONENTS
+#define MATRIX_ROWS ICP_MATRIX_ROWS
+#define EQUATION_VALUES ICP_EQUATION_VALUES
+#define REDUCE_VALUES ICP_REDUCE_VALUES
+
+static_assert(FRAME_PYRAMID_LEVELS <= POSE_ICP_LEVELS, "ICP state in PoseBuffer is too small");
 
 #define STRHELPER(x) #x
 #define TOSTR(x) STRHELPER(x)
 
-#define CORR_LOCAL_SIZE 32
+// both need to be powers of two
+#define CORR_LOCAL_SIZE 16
+#define REDUCE_LOCAL_SIZE 256
 
 #define ICP_DEBUG_TEX_FORMAT_GLSL "rgba8"
 #define ICP_DEBUG_TEX_INTERNAL_FORMAT GL_RGBA8
@@ -26,22 +32,26 @@ static const char *corr_shader_code =
 "#define ICP_DEBUG_TEX\n"
 #endif
 "#define RESIDUAL_COMPONENTS " TOSTR(RESIDUAL_COMPONENTS) "\n"
-"#define COLUMNS " TOSTR(MATRIX_COLUMNS) "\n"
 "#define ROWS " TOSTR(MATRIX_ROWS) "\n"
+"#define REDUCE_VALUES " TOSTR(REDUCE_VALUES) "\n"
 "#define LOCAL_SIZE " TOSTR(CORR_LOCAL_SIZE) "\n"
 "#define LOCAL_SIZE_TOTAL (LOCAL_SIZE*LOCAL_SIZE)\n"
+#include "glsl_common_pose.inl"
 "#line " TOSTR(__LINE__) "\n" R"glsl(
 
 layout(local_size_x = LOCAL_SIZE, local_size_y = LOCAL_SIZE, local_size_z = 1) in;
 
-uniform mat4 modelview_prev;
+// camera_pose is the current estimate, prediction_pose the one the model was rendered with
+layout(std140, binding=4) uniform PredictionPoseBlock
+{
+	CameraPose prediction_pose;
+};
+
 uniform mat4 projection_prev;
 
 layout(binding = 0) uniform sampler2D vertex_tex_prev;
 layout(binding = 1) uniform sampler2D normal_tex_prev;
 
-uniform mat4 transform_current;
-
 layout(binding = 2) uniform sampler2D vertex_tex_current;
 layout(binding = 3) uniform sampler2D normal_tex_current;
 
@@ -49,6 +59,7 @@ uniform float distance_sq_threshold;
 uniform float angle_cos_threshold;
 
 uniform uvec2 image_res;
+uniform int level;
 
 layout(std430, binding = 0) buffer residuals_out
 {
@@ -89,12 +100,12 @@ float[RESIDUAL_COMPONENTS] CreateResidual(ivec2 coord)
 	if(coord.x >= image_res.x || coord.y >= image_res.y)
 		return NopResidual();
 
-	vec3 vertex_current_camera = texelFetch(vertex_tex_current, coord, 0).xyz;
+	vec3 vertex_current_camera = texelFetch(vertex_tex_current, coord, level).xyz;
 	if(isinf(vertex_current_camera.x))
 		return NopResidual();
 
-	vec3 vertex_current_world = (transform_current * vec4(vertex_current_camera, 1.0)).xyz;
-	vec3 vertex_current_camera_prev = (modelview_prev * vec4(vertex_current_world, 1.0)).xyz;
+	vec3 vertex_current_world = (camera_pose.transform * vec4(vertex_current_camera, 1.0)).xyz;
+	vec3 vertex_current_camera_prev = (prediction_pose.modelview * vec4(vertex_current_world, 1.0)).xyz;
 	vec4 vertex_current_image_prev_p = projection_prev * vec4(vertex_current_camera_prev, 1.0);
 	vec2 vertex_current_image_prev = (vertex_current_image_prev_p.xy / vertex_current_image_prev_p.w) * 0.5 + 0.5;
 	if(vertex_current_image_prev.x < 0.0 || vertex_current_image_prev.y < 0.0
@@ -104,7 +115,7 @@ float[RESIDUAL_COMPONENTS] CreateResidual(ivec2 coord)
 		return NopResidual();
 	}
 
-	vec3 vertex_prev_world = texture(vertex_tex_prev, vertex_current_image_prev).xyz;
+	vec3 vertex_prev_world = textureLod(vertex_tex_prev, vertex_current_image_prev, float(level)).xyz;
 	if(isinf(vertex_prev_world.x))
 		return NopResidual();
 
@@ -118,9 +129,9 @@ float[RESIDUAL_COMPONENTS] CreateResidual(ivec2 coord)
 		return NopResidual();
 	}
 
-	vec3 normal_prev_world = texture(normal_tex_prev, vertex_current_image_prev).xyz;
-	vec3 normal_current_camera = texelFetch(normal_tex_current, coord, 0).xyz;
-	vec3 normal_current_world = (transform_current * vec4(normal_current_camera, 0.0)).xyz;
+	vec3 normal_prev_world = textureLod(normal_tex_prev, vertex_current_image_prev, float(level)).xyz;
+	vec3 normal_current_camera = texelFetch(normal_tex_current, coord, level).xyz;
+	vec3 normal_current_world = (camera_pose.transform * vec4(normal_current_camera, 0.0)).xyz;
 	float angle_cos = dot(normal_current_world, normal_prev_world);
 	if(angle_cos < angle_cos_threshold)
 	{
@@ -143,10 +154,15 @@ float[RESIDUAL_COMPONENTS] CreateResidual(ivec2 coord)
 	return Residual(cross(s, n), n, dot(n, dir_world));
 }
 
-shared float reduce_buf_shared[LOCAL_SIZE_TOTAL];
+// products of the residual components, reduced over the whole workgroup in one tree
+shared float reduce_buf_shared[REDUCE_VALUES][LOCAL_SIZE_TOTAL];
 
 void main()
 {
+	// the solve shader decided that the remaining iterations on this level would not change anything
+	if(camera_pose.icp_converged[level] != 0u)
+		return;
+
 	ivec2 coord_global = ivec2(gl_GlobalInvocationID.xy);
 	float[RESIDUAL_COMPONENTS] residual_own = CreateResidual(coord_global);
 
@@ -159,135 +175,220 @@ void main()
 		}
 	}
 
-	uint local_id_flat = gl_LocalInvocationID.y * LOCAL_SIZE + gl_LocalInvocationID.x;
+	// A is symmetric, so only its upper triangle is summed, followed by b
+	uint local_id_flat = gl_LocalInvocationIndex;
+	uint value = 0;
 	for(uint row=0; row<ROWS; row++)
 	{
-		for(uint col=0; col<COLUMNS; col++)
-		{
-			float v = residual_own[col] * residual_own[row];
-			reduce_buf_shared[local_id_flat] = v;
+		for(uint col=row; col<ROWS; col++)
+			reduce_buf_shared[value++][local_id_flat] = residual_own[row] * residual_own[col];
+	}
+	for(uint row=0; row<ROWS; row++)
+		reduce_buf_shared[value++][local_id_flat] = residual_own[row] * residual_own[ROWS];
 
-			memoryBarrierShared();
-			barrier();
+	// squared residual and correspondence count, the normal of any correspondence is non-zero
+	reduce_buf_shared[value++][local_id_flat] = residual_own[ROWS] * residual_own[ROWS];
+	reduce_buf_shared[value++][local_id_flat] = (residual_own[3] != 0.0 || residual_own[4] != 0.0 || residual_own[5] != 0.0) ? 1.0 : 0.0;
 
-			// Tree-based summing
+	memoryBarrierShared();
+	barrier();
 
-#if LOCAL_SIZE_TOTAL >= 1024
-			if(local_id_flat < 512)
-				reduce_buf_shared[local_id_flat] = v = v + reduce_buf_shared[local_id_flat + 512];
-			memoryBarrierShared();
-			barrier();
-#endif
+	// every step halves the number of partial sums of all values, spread over all invocations
+	for(uint stride=LOCAL_SIZE_TOTAL/2; stride>0; stride>>=1)
+	{
+		for(uint i=local_id_flat; i<REDUCE_VALUES*stride; i+=LOCAL_SIZE_TOTAL)
+		{
+			uint v = i / stride;
+			uint t = i % stride;
+			reduce_buf_shared[v][t] += reduce_buf_shared[v][t + stride];
+		}
+		memoryBarrierShared();
+		barrier();
+	}
 
-#if LOCAL_SIZE_TOTAL >= 512
-			if(local_id_flat < 256)
-				reduce_buf_shared[local_id_flat] = v = v + reduce_buf_shared[local_id_flat + 256];
-			memoryBarrierShared();
-			barrier();
-#endif
+	if(local_id_flat < REDUCE_VALUES)
+	{
+		uint base = REDUCE_VALUES * uint(gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x);
+		residuals[base + local_id_flat] = reduce_buf_shared[local_id_flat][0];
+	}
+}
+)glsl";
 
-#if LOCAL_SIZE_TOTAL >= 256
-			if(local_id_flat < 128)
-				reduce_buf_shared[local_id_flat] = v = v + reduce_buf_shared[local_id_flat + 128];
-			memoryBarrierShared();
-			barrier();
-#endif
+static const char *reduce_shader_code =
+"#version 450 core\n"
+"#define REDUCE_VALUES " TOSTR(REDUCE_VALUES) "\n"
+"#define LOCAL_SIZE " TOSTR(REDUCE_LOCAL_SIZE) "\n"
+#include "glsl_common_pose.inl"
+"#line " TOSTR(__LINE__) "\n" R"glsl(
 
-#if LOCAL_SIZE_TOTAL >= 128
-			if(local_id_flat < 64)
-				reduce_buf_shared[local_id_flat] = v = v + reduce_buf_shared[local_id_flat + 64];
-			memoryBarrierShared();
-			barrier();
-#endif
+// one workgroup per value of the equation system, error and count
+layout(local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
 
-#if LOCAL_SIZE_TOTAL >= 64
-			if(local_id_flat < 32)
-				reduce_buf_shared[local_id_flat] = v = v + reduce_buf_shared[local_id_flat + 32];
-			memoryBarrierShared();
-			barrier();
-#endif
+uniform uint block_count;
+uniform int level;
 
-#if LOCAL_SIZE_TOTAL >= 32
-			if(local_id_flat < 16)
-				reduce_buf_shared[local_id_flat] = v = v + reduce_buf_shared[local_id_flat + 16];
-			memoryBarrierShared();
-			barrier();
-#endif
+layout(std430, binding = 0) buffer residuals_in
+{
+	float residuals[];
+};
 
-#if LOCAL_SIZE_TOTAL >= 16
-			if(local_id_flat < 8)
-				reduce_buf_shared[local_id_flat] = v = v + reduce_buf_shared[local_id_flat + 8];
-			memoryBarrierShared();
-			barrier();
-#endif
+layout(std430, binding = 1) buffer equation_out
+{
+	float equation[REDUCE_VALUES];
+};
 
-#if LOCAL_SIZE_TOTAL >= 8
-			if(local_id_flat < 4)
-				reduce_buf_shared[local_id_flat] = v = v + reduce_buf_shared[local_id_flat + 4];
-			memoryBarrierShared();
-			barrier();
-#endif
+shared float reduce_buf_shared[LOCAL_SIZE];
 
-#if LOCAL_SIZE_TOTAL >= 4
-			if(local_id_flat < 2)
-				reduce_buf_shared[local_id_flat] = v = v + reduce_buf_shared[local_id_flat + 2];
-			memoryBarrierShared();
-			barrier();
-#endif
+void main()
+{
+	if(camera_pose.icp_converged[level] != 0u)
+		return;
 
-#if LOCAL_SIZE_TOTAL >= 2
-			if(local_id_flat < 1)
-				v += reduce_buf_shared[local_id_flat + 1];
-#endif
+	uint value = gl_WorkGroupID.x;
+	uint local_id = gl_LocalInvocationIndex;
 
-			if(local_id_flat == 0)
-			{
-				uint base = ROWS * COLUMNS * uint(gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x);
-				residuals[base + row * COLUMNS + col] = v;
-			}
-		}
+	float sum = 0.0;
+	for(uint i=local_id; i<block_count; i+=LOCAL_SIZE)
+		sum += residuals[i * REDUCE_VALUES + value];
+	reduce_buf_shared[local_id] = sum;
+
+	memoryBarrierShared();
+	barrier();
+
+	for(uint stride=LOCAL_SIZE/2; stride>0; stride>>=1)
+	{
+		if(local_id < stride)
+			reduce_buf_shared[local_id] += reduce_buf_shared[local_id + stride];
+		memoryBarrierShared();
+		barrier();
 	}
+
+	if(local_id == 0)
+		equation[value] = reduce_buf_shared[0];
 }
 )glsl";
 
-static const char *reduce_shader_code =
+
+static const char *solve_shader_code =
 "#version 450 core\n"
-"#define COLUMNS " TOSTR(MATRIX_COLUMNS) "\n"
+"#define EQUATION_VALUES " TOSTR(EQUATION_VALUES) "\n"
+"#define REDUCE_VALUES " TOSTR(REDUCE_VALUES) "\n"
+"#define REDUCE_ERROR " TOSTR(ICP_REDUCE_ERROR) "\n"
+"#define REDUCE_COUNT " TOSTR(ICP_REDUCE_COUNT) "\n"
 "#define ROWS " TOSTR(MATRIX_ROWS) "\n"
+#include "glsl_common_pose.inl"
 "#line " TOSTR(__LINE__) "\n" R"glsl(
 
 layout(local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
 
-uniform uint residuals_count;
+uniform float det_threshold;
+uniform int level;
 
-layout(std430, binding = 0) buffer residuals_in
+// see ICPConvergenceCriteria
+uniform float min_rot_delta;
+uniform float min_translation_delta;
+uniform float min_residual_reduction;
+
+layout(std430, binding = 1) buffer equation_in
 {
-	float residuals[];
+	float equation[REDUCE_VALUES];
 };
 
-layout(std430, binding = 1) buffer matrix_out
+layout(std430, binding = 2) buffer pose_out
 {
-	float matrix[COLUMNS*ROWS];
+	CameraPose pose;
 };
 
-float GetResidualValue(uvec2 coord)
-{
-	return residuals[COLUMNS * coord.y + coord.x];
-}
+mat3 RotationX(float a)	{ return mat3(1.0, 0.0, 0.0, 0.0, cos(a), sin(a), 0.0, -sin(a), cos(a)); }
+mat3 RotationY(float a)	{ return mat3(cos(a), 0.0, -sin(a), 0.0, 1.0, 0.0, sin(a), 0.0, cos(a)); }
+mat3 RotationZ(float a)	{ return mat3(cos(a), sin(a), 0.0, -sin(a), cos(a), 0.0, 0.0, 0.0, 1.0); }
 
+// same as ICPSolver::Solve() and ApplyDelta(), but with a Cholesky decomposition as A is symmetric
 void main()
 {
-	uvec2 coord = gl_GlobalInvocationID.xy;
-	float res = 0.0;
-	for(uint i=0; i<residuals_count; i++)
+	if(pose.icp_converged[level] != 0u)
+		return;
+
+	// same as ICPSolver::MeanError() and Converged()
+	float error = equation[REDUCE_COUNT] > 0.0 ? equation[REDUCE_ERROR] / equation[REDUCE_COUNT] : 0.0;
+	float error_prev = pose.icp_error[level];
+	pose.icp_error[level] = error;
+	pose.icp_iterations[level]++;
+
+	// a system that can't be solved now won't be in the next iterations either, as the pose stays the same
+	pose.icp_converged[level] = 1u;
+
+	// same order as in corr_shader_code
+	float A[ROWS][ROWS];
+	float b[ROWS];
+	uint value = 0;
+	for(uint row=0; row<ROWS; row++)
+	{
+		for(uint col=row; col<ROWS; col++)
+			A[row][col] = A[col][row] = equation[value++];
+	}
+	for(uint row=0; row<ROWS; row++)
+		b[row] = equation[value++];
+
+	// A = L * L^T, L is stored in the lower triangle of A
+	float det = 1.0;
+	for(uint j=0; j<ROWS; j++)
+	{
+		float d = A[j][j];
+		for(uint k=0; k<j; k++)
+			d -= A[j][k] * A[j][k];
+		if(!(d > 0.0))
+			return;
+		det *= d;
+		A[j][j] = sqrt(d);
+		for(uint i=j+1; i<ROWS; i++)
+		{
+			float v = A[i][j];
+			for(uint k=0; k<j; k++)
+				v -= A[i][k] * A[j][k];
+			A[i][j] = v / A[j][j];
+		}
+	}
+
+	if(det < det_threshold || isnan(det))
+		return;
+
+	float x[ROWS];
+	for(uint i=0; i<ROWS; i++)
 	{
-		float a = GetResidualValue(uvec2(coord.y, i));
-		float b = GetResidualValue(uvec2(coord.x, i));
-		if(isnan(a) || isnan(b))
-			continue;
-		res += a * b;
+		float v = b[i];
+		for(uint k=0; k<i; k++)
+			v -= A[i][k] * x[k];
+		x[i] = v / A[i][i];
 	}
-	matrix[coord.x * ROWS + coord.y] = res;
+	for(int i=ROWS-1; i>=0; i--)
+	{
+		float v = x[i];
+		for(uint k=i+1; k<ROWS; k++)
+			v -= A[k][i] * x[k];
+		x[i] = v / A[i][i];
+	}
+
+	mat3 rot_delta = RotationZ(x[2]) * RotationY(x[1]) * RotationX(x[0]);
+	vec3 translation_delta = vec3(x[3], x[4], x[5]);
+
+	mat3 rot = rot_delta * mat3(pose.transform);
+	vec3 translation = rot_delta * pose.transform[3].xyz + translation_delta;
+
+	// keep the rotation orthonormal while the updates accumulate
+	rot[0] = normalize(rot[0]);
+	rot[1] = normalize(rot[1] - dot(rot[0], rot[1]) * rot[0]);
+	rot[2] = cross(rot[0], rot[1]);
+
+	pose.transform = mat4(vec4(rot[0], 0.0), vec4(rot[1], 0.0), vec4(rot[2], 0.0), vec4(translation, 1.0));
+	mat3 rot_inv = transpose(rot);
+	pose.modelview = mat4(vec4(rot_inv[0], 0.0), vec4(rot_inv[1], 0.0), vec4(rot_inv[2], 0.0), vec4(-(rot_inv * translation), 1.0));
+	pose.rot_delta = vec4(x[0], x[1], x[2], 0.0);
+	pose.translation_delta = vec4(translation_delta, 0.0);
+
+	bool converged = error_prev > 0.0 && error_prev - error < min_residual_reduction * error_prev;
+	converged = converged || (length(vec3(x[0], x[1], x[2])) < min_rot_delta && length(translation_delta) < min_translation_delta);
+	pose.icp_converged[level] = converged ? 1u : 0u;
 }
 )glsl";
 
@@ -297,25 +398,34 @@ ICP::ICP()
 
 	corr_distance_sq_threshold_uniform = glGetUniformLocation(corr_program, "distance_sq_threshold");
 	corr_angle_cos_threshold_uniform = glGetUniformLocation(corr_program, "angle_cos_threshold");
-	corr_modelview_prev_uniform = glGetUniformLocation(corr_program, "modelview_prev");
 	corr_projection_prev_uniform = glGetUniformLocation(corr_program, "projection_prev");
-	corr_transform_current_uniform = glGetUniformLocation(corr_program, "transform_current");
 	corr_image_res_uniform = glGetUniformLocation(corr_program, "image_res");
+	corr_level_uniform = glGetUniformLocation(corr_program, "level");
 
 	glObjectLabel(GL_PROGRAM, corr_program, -1, "ICP::corr_program");
 
 	glGenBuffers(1, &residuals_buffer);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, residuals_buffer);
 	glObjectLabel(GL_BUFFER, residuals_buffer, -1, "ICP::residuals_buffer");
-	residuals_count = 0;
+	block_count = 0;
+	block_capacity = 0;
 
 	reduce_program = CreateComputeShader(reduce_shader_code);
-	reduce_residuals_count_uniform = glGetUniformLocation(reduce_program, "residuals_count");
+	reduce_block_count_uniform = glGetUniformLocation(reduce_program, "block_count");
+	reduce_level_uniform = glGetUniformLocation(reduce_program, "level");
 	glObjectLabel(GL_PROGRAM, reduce_program, -1, "ICP::reduce_program");
 
+	solve_program = CreateComputeShader(solve_shader_code);
+	solve_det_threshold_uniform = glGetUniformLocation(solve_program, "det_threshold");
+	solve_level_uniform = glGetUniformLocation(solve_program, "level");
+	solve_min_rot_delta_uniform = glGetUniformLocation(solve_program, "min_rot_delta");
+	solve_min_translation_delta_uniform = glGetUniformLocation(solve_program, "min_translation_delta");
+	solve_min_residual_reduction_uniform = glGetUniformLocation(solve_program, "min_residual_reduction");
+	glObjectLabel(GL_PROGRAM, solve_program, -1, "ICP::solve_program");
+
 	glGenBuffers(1, &matrix_buffer);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, matrix_buffer);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * MATRIX_COLUMNS * MATRIX_ROWS, nullptr, GL_DYNAMIC_READ);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * REDUCE_VALUES, nullptr, GL_DYNAMIC_READ);
 
 	distance_threshold = 0.1f;
 	angle_threshold = 0.5f;
@@ -323,6 +433,8 @@ ICP::ICP()
 	last_rot_delta = Eigen::Vector3f(0.0f, 0.0f, 0.0f);
 	last_translation_delta = Eigen::Vector3f(0.0f, 0.0f, 0.0f);
 
+	ResetConvergence();
+
 #ifdef ICP_DEBUG_TEX
 	glGenTextures(1, &debug_tex);
 	glBindTexture(GL_TEXTURE_2D, debug_tex);
@@ -337,23 +449,35 @@ ICP::ICP()
 ICP::~ICP()
 {
 	glDeleteProgram(corr_program);
+	glDeleteProgram(reduce_program);
+	glDeleteProgram(solve_program);
 	glDeleteBuffers(1, &residuals_buffer);
+	glDeleteBuffers(1, &matrix_buffer);
 #ifdef ICP_DEBUG_TEX
 	glDeleteTextures(1, &debug_tex);
 #endif
 }
 
-void ICP::SearchCorrespondences(Frame *frame, Renderer *renderer, const CameraTransform &cam_transform_current)
+void ICP::SearchCorrespondences(Frame *frame, Renderer *renderer, const CameraTransform &cam_transform_current, int level)
+{
+	if(converged[level])
+		return;
+	current_pose.Upload(cam_transform_current.GetTransform());
+	SearchCorrespondences(frame, renderer, &current_pose, level);
+}
+
+void ICP::SearchCorrespondences(Frame *frame, Renderer *renderer, PoseBuffer *pose_current, int level)
 {
-	unsigned int width_global = (static_cast<unsigned int>(frame->GetDepthWidth()) + CORR_LOCAL_SIZE - 1) / CORR_LOCAL_SIZE;
-	unsigned int height_global = (static_cast<unsigned int>(frame->GetDepthHeight()) + CORR_LOCAL_SIZE - 1) / CORR_LOCAL_SIZE;
+	unsigned int width_global = (static_cast<unsigned int>(frame->GetDepthWidth(level)) + CORR_LOCAL_SIZE - 1) / CORR_LOCAL_SIZE;
+	unsigned int height_global = (static_cast<unsigned int>(frame->GetDepthHeight(level)) + CORR_LOCAL_SIZE - 1) / CORR_LOCAL_SIZE;
 
-	auto residuals_count_required = width_global * height_global * (RESIDUAL_COMPONENTS - 1);
+	block_count = width_global * height_global;
 
-	if (residuals_count != residuals_count_required)
+	// sized for the finest level seen so far, coarser levels use only the beginning
+	if (block_count > block_capacity)
 	{
-		residuals_count = residuals_count_required;
-		size_t residuals_buffer_size = residuals_count_required * RESIDUAL_COMPONENTS * sizeof(float);
+		block_capacity = block_count;
+		size_t residuals_buffer_size = block_capacity * REDUCE_VALUES * sizeof(float);
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, residuals_buffer);
 		glBufferData(GL_SHADER_STORAGE_BUFFER, residuals_buffer_size, nullptr, GL_DYNAMIC_COPY);
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
@@ -387,55 +511,97 @@ void ICP::SearchCorrespondences(Frame *frame, Renderer *renderer, const CameraTr
 	glUniform1f(corr_distance_sq_threshold_uniform, distance_threshold * distance_threshold);
 	glUniform1f(corr_angle_cos_threshold_uniform, angle_threshold);
 
-	glUniformMatrix4fv(corr_modelview_prev_uniform, 1, GL_FALSE, renderer->GetModelviewMatrix().data());
 	glUniformMatrix4fv(corr_projection_prev_uniform, 1, GL_FALSE, renderer->GetProjectionMatrix().data());
 
-	glUniformMatrix4fv(corr_transform_current_uniform, 1, GL_FALSE, cam_transform_current.GetTransform().matrix().data());
+	glBindBufferBase(GL_UNIFORM_BUFFER, 3, pose_current->GetBuffer());
+	glBindBufferBase(GL_UNIFORM_BUFFER, 4, renderer->GetPredictionPose()->GetBuffer());
 
-	glUniform2ui(corr_image_res_uniform, static_cast<GLuint>(frame->GetDepthWidth()), static_cast<GLuint>(frame->GetDepthHeight()));
+	glUniform2ui(corr_image_res_uniform, static_cast<GLuint>(frame->GetDepthWidth(level)), static_cast<GLuint>(frame->GetDepthHeight(level)));
+	glUniform1i(corr_level_uniform, level);
 
 
 	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 	glDispatchCompute(width_global, height_global, 1);
 }
 
-#include <iostream>
-#include <Eigen/Dense>
-
-void ICP::SolveMatrix(CameraTransform *cam_transform)
+void ICP::ReduceEquation(PoseBuffer *pose, int level)
 {
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, residuals_buffer);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, matrix_buffer);
 
 	glUseProgram(reduce_program);
-	glUniform1ui(reduce_residuals_count_uniform, static_cast<GLuint>(residuals_count));
+	glUniform1ui(reduce_block_count_uniform, static_cast<GLuint>(block_count));
+	glUniform1i(reduce_level_uniform, level);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 3, pose->GetBuffer());
 
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-	glDispatchCompute(MATRIX_COLUMNS, MATRIX_ROWS, 1);
+	glDispatchCompute(REDUCE_VALUES, 1, 1);
+}
+
+void ICP::SolveMatrix(PoseBuffer *pose, int level)
+{
+	ReduceEquation(pose, level);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, matrix_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, pose->GetBuffer());
+
+	glUseProgram(solve_program);
+	glUniform1f(solve_det_threshold_uniform, ICPSolver::DeterminantThreshold(level));
+	glUniform1i(solve_level_uniform, level);
+	glUniform1f(solve_min_rot_delta_uniform, convergence_criteria.min_rot_delta);
+	glUniform1f(solve_min_translation_delta_uniform, convergence_criteria.min_translation_delta);
+	glUniform1f(solve_min_residual_reduction_uniform, convergence_criteria.min_residual_reduction);
+
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	glDispatchCompute(1, 1, 1);
+	glMemoryBarrier(GL_UNIFORM_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void ICP::SolveMatrix(CameraTransform *cam_transform, int level)
+{
+	if(converged[level])
+		return;
+
+	ReduceEquation(&current_pose, level);
 
 	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
-	Eigen::Matrix<float, MATRIX_ROWS, MATRIX_COLUMNS> matrix;
+	float equation[REDUCE_VALUES];
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, matrix_buffer);
-	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(float) * MATRIX_COLUMNS * MATRIX_ROWS, matrix.data());
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(equation), equation);
 
-	Eigen::Matrix<float, MATRIX_ROWS, MATRIX_ROWS> A = matrix.block<MATRIX_ROWS, MATRIX_ROWS>(0, 0);
-	Eigen::Matrix<float, MATRIX_ROWS, 1> b = matrix.col(6);
+	float error_prev = error[level];
+	error[level] = ICPSolver::MeanError(equation);
+	iterations[level]++;
 
-	// TODO: learn what this actually means, currently copied from https://github.com/chrdiller/KinectFusionLib/blob/master/src/pose_estimation.cpp#L54
-	if(A.determinant() < 100000 /*1e-15*/ || std::isnan(A.determinant()))
+	// a system that can't be solved now won't be in the next iterations either, as the pose stays the same
+	Eigen::Vector3f rot_delta, translation_delta;
+	if(!ICPSolver::Solve(equation, level, &rot_delta, &translation_delta))
+	{
+		converged[level] = true;
 		return;
+	}
 
-	Eigen::Matrix<float, MATRIX_ROWS, 1> result = A.colPivHouseholderQr().solve(b);
-
-	last_rot_delta = result.head<3>();
-	last_translation_delta = result.tail<3>();
+	last_rot_delta = rot_delta;
+	last_translation_delta = translation_delta;
 
 	Eigen::Affine3f transform = cam_transform->GetTransform();
-	auto rot_delta =
-			Eigen::AngleAxisf(result(2), Eigen::Vector3f::UnitZ()) *
-			Eigen::AngleAxisf(result(1), Eigen::Vector3f::UnitY()) *
-			Eigen::AngleAxisf(result(0), Eigen::Vector3f::UnitX());
-	transform.translation() = rot_delta * transform.translation() + result.tail<3>();
-	transform.linear() = rot_delta * transform.rotation();
+	ICPSolver::ApplyDelta(&transform, rot_delta, translation_delta);
 	cam_transform->SetTransform(transform);
+
+	converged[level] = ICPSolver::Converged(convergence_criteria, error_prev, error[level], rot_delta, translation_delta);
+}
+
+void ICP::ResetConvergence()
+{
+	for(int level=0; level<FRAME_PYRAMID_LEVELS; level++)
+	{
+		error[level] = 0.0f;
+		iterations[level] = 0;
+		converged[level] = false;
+	}
+}
+
+void ICP::ResetConvergence(PoseBuffer *pose)
+{
+	pose->ResetICPState();
 }
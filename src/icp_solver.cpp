@@ -0,0 +1,46 @@
+
+#include "icp_solver.h"
+
+#include <cmath>
+
+#include <Eigen/Dense>
+
+// TODO: learn what this actually means, currently copied from https://github.com/chrdiller/KinectFusionLib/blob/master/src/pose_estimation.cpp#L54
+// A sums over all correspondences, so its determinant shrinks by 4^6 with every pyramid level
+float ICPSolver::DeterminantThreshold(int level)
+{
+	return 100000.0f /*1e-15*/ / std::pow(4096.0f, (float)level);
+}
+
+bool ICPSolver::Solve(const float *equation, int level, Eigen::Vector3f *rot_delta, Eigen::Vector3f *translation_delta)
+{
+	Eigen::Matrix<float, ICP_MATRIX_ROWS, ICP_MATRIX_ROWS> A;
+	Eigen::Matrix<float, ICP_MATRIX_ROWS, 1> b;
+	int value = 0;
+	for(int row=0; row<ICP_MATRIX_ROWS; row++)
+	{
+		for(int col=row; col<ICP_MATRIX_ROWS; col++)
+			A(row, col) = A(col, row) = equation[value++];
+	}
+	for(int row=0; row<ICP_MATRIX_ROWS; row++)
+		b(row) = equation[value++];
+
+	float det = A.determinant();
+	if(det < DeterminantThreshold(level) || std::isnan(det))
+		return false;
+
+	Eigen::Matrix<float, ICP_MATRIX_ROWS, 1> result = A.colPivHouseholderQr().solve(b);
+	*rot_delta = result.head<3>();
+	*translation_delta = result.tail<3>();
+	return true;
+}
+
+void ICPSolver::ApplyDelta(Eigen::Affine3f *transform, const Eigen::Vector3f &rot_delta, const Eigen::Vector3f &translation_delta)
+{
+	auto rot =
+			Eigen::AngleAxisf(rot_delta.z(), Eigen::Vector3f::UnitZ()) *
+			Eigen::AngleAxisf(rot_delta.y(), Eigen::Vector3f::UnitY()) *
+			Eigen::AngleAxisf(rot_delta.x(), Eigen::Vector3f::UnitX());
+	transform->translation() = rot * transform->translation() + translation_delta;
+	transform->linear() = rot * transform->rotation();
+}
@@ -4,6 +4,8 @@
 #ifdef ENABLE_INPUT_REALSENSE
 #include "realsense_input.h"
 #endif
+#include "sequence_input.h"
+#include "async_input.h"
 
 #include "frame.h"
 
@@ -13,8 +15,13 @@
 #include "camera_transform.h"
 #include "pc_integrator.h"
 #include "icp.h"
-#include "marching_cubes.h"
+#include "pose_predictor.h"
+#include "gl_marching_cubes.h"
+#include "mesh_writer.h"
+#include "rolling_volume.h"
 #include <chrono>
+#include <iostream>
+#include <string>
 
 //#include <pcl/visualization/cloud_viewer.h>
 //#include <pcl/filters/passthrough.h>
@@ -25,27 +32,74 @@ int main(int argc, char *argv[])
 {
 	Window window("Scanner", 1280, 720);
 
-	Input *input;
+	std::string input_file;
+	std::string record_file;
+	bool replay_fast = false;
+	bool capture_async = true;
+	bool packed_voxels = false;
+	for(int i=1; i<argc; i++)
+	{
+		std::string arg = argv[i];
+		if(arg == "--fast")
+			replay_fast = true;
+		else if(arg == "--sync")
+			capture_async = false;
+		else if(arg == "--packed")
+			packed_voxels = true;
+		else if(arg == "--record" && i + 1 < argc)
+			record_file = argv[++i];
+		else
+			input_file = arg;
+	}
+
+	Input *input = nullptr;
+	SequenceInput *sequence_input = nullptr;
 
+	// recorded sequences replay without any camera runtime, everything else goes to the camera backend
+	auto EndsWith = [](const std::string &s, const std::string &suffix) {
+		return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+	};
+	if(EndsWith(input_file, ".seq"))
+	{
+		sequence_input = new SequenceInput(input_file);
+		sequence_input->SetRealtime(!replay_fast);
+		input = sequence_input;
+	}
+	else
+	{
 #if defined(ENABLE_INPUT_REALSENSE)
-	rs2::config rs_config;
-	if(argc >= 2)
-		rs_config.enable_device_from_file(std::string(argv[1]));
-	input = new RealSenseInput(rs_config);
-	input->setColorActive(true);
+		rs2::config rs_config;
+		if(!input_file.empty())
+			rs_config.enable_device_from_file(input_file);
+		RealSenseInput *realsense_input = new RealSenseInput(rs_config);
+		realsense_input->setColorActive(true);
+		if(!record_file.empty())
+			realsense_input->StartRecording(record_file);
+		input = realsense_input;
 #if defined(ENABLE_INPUT_KINECT)
 //#warning "Building with both RealSense and Kinect. Using RealSense."
 #endif
 #elif defined(ENABLE_INPUT_KINECT)
-	// TODO: input = ... for kinect
-#else
-#error "Build with no input!"
+		// TODO: input = ... for kinect
 #endif
+	}
+
+	if(!input)
+	{
+		std::cerr << "No input available. Pass a recorded sequence (.seq) to run without a camera." << std::endl;
+		return 1;
+	}
+	input->setColorActive(true);
+
+	// capture on a separate thread, so waiting for the sensor overlaps with processing
+	AsyncInput *async_input = nullptr;
+	if(capture_async)
+		input = async_input = new AsyncInput(input);
 
 	Frame frame;
 
 #define RES 256
-	GLModel gl_model(RES, RES, RES, 4.0f / RES, 0.3f, -0.1f, true);
+	GLModel gl_model(RES, RES, RES, 4.0f / RES, 0.3f, -0.1f, true, packed_voxels);
 #undef RES
 
 	Renderer renderer(&window);
@@ -57,13 +111,33 @@ int main(int argc, char *argv[])
 	reset_transform.translate(Eigen::Vector3f(0.0f, 0.0f, 1.0f));
 	camera_transform.SetTransform(reset_transform);
 
+	// with gpu_pose, tracking, integration and rendering read the pose from here
+	// and camera_transform only follows it through fenced readbacks
+	bool gpu_pose = true;
+	PoseBuffer camera_pose;
+	camera_pose.Upload(reset_transform);
+	Eigen::Vector3f rot_delta = Eigen::Vector3f::Zero();
+	Eigen::Vector3f translation_delta = Eigen::Vector3f::Zero();
+
 	ICP icp;
 
+	// seeds ICP with the motion since the last frame
+	bool enable_motion_prediction = true;
+	PosePredictor pose_predictor;
+	uint64_t last_timestamp = 0;
+
 	PC_Integrator integrator(&gl_model);
 
+	// moves the volume along with the camera, the slices left behind are meshed in the background
+	bool enable_rolling = false;
+	RollingVolume rolling_volume(&gl_model, 0.5f);
+
 	bool enable_perf_measure = false;
 	bool enable_tracking = true;
-	int icp_passes = 5;
+	// maximum ICP iterations per pyramid level, run from the coarsest level to the full resolution
+	int icp_level_passes[FRAME_PYRAMID_LEVELS] = { 4, 6, 8 };
+	// iterations the last frame actually needed until ICP converged
+	unsigned int icp_level_iterations[FRAME_PYRAMID_LEVELS] = {};
 
 	bool render_color = false;
 	bool render_lighting = true;
@@ -109,41 +183,99 @@ int main(int argc, char *argv[])
 
 		if (enable_tracking)
 		{
-			if(enable_perf_measure)
+			if(enable_motion_prediction)
 			{
-				time_icp_corr.resize(static_cast<unsigned long>(icp_passes));
-				time_icp_solve.resize(static_cast<unsigned long>(icp_passes));
+				Eigen::Affine3f motion = pose_predictor.PredictMotion(last_timestamp, frame.GetTimestamp());
+				if(gpu_pose)
+					camera_pose.Transform(motion);
+				else
+					camera_transform.SetTransform(camera_transform.GetTransform() * motion);
 			}
-			for(int i=0; i<icp_passes; i++)
+
+			time_icp_corr.clear();
+			time_icp_solve.clear();
+			if(gpu_pose)
+				icp.ResetConvergence(&camera_pose);
+			else
+				icp.ResetConvergence();
+			for(int level=frame.GetPyramidLevels()-1; level>=0; level--)
 			{
-				icp.SearchCorrespondences(&frame, &renderer, camera_transform);
-				if(enable_perf_measure)
-				{
-					glFinish();
-					time_icp_corr[i] = clock::now();
-				}
-				icp.SolveMatrix(&camera_transform);
-				if(enable_perf_measure)
+				// with gpu_pose, the GPU skips the iterations after convergence by itself
+				for(int i=0; i<icp_level_passes[level] && (gpu_pose || !icp.GetConverged(level)); i++)
 				{
-					glFinish();
-					time_icp_solve[i] = clock::now();
+					if(gpu_pose)
+						icp.SearchCorrespondences(&frame, &renderer, &camera_pose, level);
+					else
+						icp.SearchCorrespondences(&frame, &renderer, camera_transform, level);
+					if(enable_perf_measure)
+					{
+						glFinish();
+						time_icp_corr.push_back(clock::now());
+					}
+					if(gpu_pose)
+						icp.SolveMatrix(&camera_pose, level);
+					else
+						icp.SolveMatrix(&camera_transform, level);
+					if(enable_perf_measure)
+					{
+						glFinish();
+						time_icp_solve.push_back(clock::now());
+					}
 				}
 			}
 		}
 
 		MeasureTime(time_icp);
 
-		integrator.integrate(&frame, &camera_transform);
+		last_timestamp = frame.GetTimestamp();
+
+		if(gpu_pose)
+			integrator.integrate(&frame, &camera_pose);
+		else
+			integrator.integrate(&frame, &camera_transform);
 
 		MeasureTime(time_integrate);
 
 		window.BeginRender();
 		renderer.SetEnableColor(render_color);
 		renderer.SetEnableLighting(render_lighting);
-		renderer.Render(&gl_model, &frame, &camera_transform);
+		if(gpu_pose)
+			renderer.Render(&gl_model, &frame, &camera_pose);
+		else
+			renderer.Render(&gl_model, &frame, &camera_transform);
 
 		MeasureTime(time_render);
 
+		if(gpu_pose)
+		{
+			camera_pose.RequestReadback(frame.GetTimestamp());
+			PoseReadback readback;
+			if(camera_pose.FetchReadback(&readback))
+			{
+				camera_transform.SetTransform(readback.transform);
+				if(enable_tracking)
+					pose_predictor.AddPose(readback.timestamp_us, readback.transform);
+				rot_delta = readback.rot_delta;
+				translation_delta = readback.translation_delta;
+				for(int level=0; level<FRAME_PYRAMID_LEVELS; level++)
+					icp_level_iterations[level] = readback.icp_iterations[level];
+			}
+		}
+		else
+		{
+			if(enable_tracking)
+				pose_predictor.AddPose(frame.GetTimestamp(), camera_transform.GetTransform());
+			rot_delta = icp.GetLastRotDelta();
+			translation_delta = icp.GetLastTranslationDelta();
+			for(int level=0; level<FRAME_PYRAMID_LEVELS; level++)
+				icp_level_iterations[level] = icp.GetIterations(level);
+		}
+
+		if(enable_rolling)
+		{
+			rolling_volume.Update(camera_transform.GetTransform().translation());
+			rolling_volume.Poll();
+		}
 
 		window.BeginGUI();
 		ImGui::Begin("Settings");
@@ -151,31 +283,82 @@ int main(int argc, char *argv[])
 		if(ImGui::Button("Reset Model and Transform"))
 		{
 			gl_model.Reset();
+			rolling_volume.Reset();
 			camera_transform.SetTransform(reset_transform);
+			camera_pose.Upload(reset_transform);
+			pose_predictor.Reset();
 		}
 		if(ImGui::Button("Export Mesh"))
 		{
-			CPUModel *cpu_model = new CPUModel(
-					gl_model.GetResolutionX(), 
-					gl_model.GetResolutionY(),
-					gl_model.GetResolutionZ(),
-					gl_model.GetCellSize(),
-					gl_model.GetMaxTruncation(),
-					gl_model.GetMinTruncation(),
-					gl_model.GetModelOrigin(),
-					gl_model.GetColorsActive());
-			gl_model.CopyTo(cpu_model);
-			
-			// export the mesh with marching cubes
-			Marching_Cubes mc(cpu_model);
-			mc.process_mc("/home/florian/mesh.off");
-			delete cpu_model;
+			if(enable_rolling)
+			{
+				// the slices that left the volume are already meshed in world space
+				if(!rolling_volume.ExportMesh("/home/florian/mesh.off"))
+					std::cerr << "Failed to write mesh." << std::endl;
+			}
+			else
+			{
+				// marching cubes on the GPU, read back and written one slab at a time
+				GLMarchingCubes mc(&gl_model);
+				MeshWriter writer("/home/florian/mesh.off", gl_model.GetColorsActive());
+				if(writer.Begin())
+					mc.StreamMesh(0.0, &writer);
+				if(!writer.Close())
+					std::cerr << "Failed to write mesh." << std::endl;
+			}
+		}
+
+		if(ImGui::TreeNode("Input"))
+		{
+			if(async_input)
+			{
+				bool latest_frame_wins = async_input->GetLatestFrameWins();
+				ImGui::Checkbox("Latest Frame Wins", &latest_frame_wins);
+				async_input->SetLatestFrameWins(latest_frame_wins);
+				ImGui::Text("Captured: %llu, Dropped: %llu, Queued: %u",
+						(unsigned long long)async_input->GetCapturedFrames(),
+						(unsigned long long)async_input->GetDroppedFrames(),
+						(unsigned int)async_input->GetQueuedFrames());
+			}
+			if(sequence_input)
+			{
+				ImGui::Text("Sequence Frame %u of %u", (unsigned int)sequence_input->GetCurrentFrame(), sequence_input->GetFrameCount());
+				bool realtime = sequence_input->GetRealtime();
+				ImGui::Checkbox("Realtime Playback", &realtime);
+				if(realtime != sequence_input->GetRealtime())
+					sequence_input->SetRealtime(realtime);
+				if(ImGui::Button("Rewind"))
+				{
+					sequence_input->Rewind();
+					pose_predictor.Reset();
+				}
+			}
+			ImGui::TreePop();
 		}
 
 		if(ImGui::TreeNode("ICP"))
 		{
 			ImGui::Checkbox("Enable Tracking", &enable_tracking);
-			ImGui::SliderInt("Iterations", &icp_passes, 1, 10);
+			ImGui::Checkbox("Motion Prediction", &enable_motion_prediction);
+			bool gpu_pose_new = gpu_pose;
+			ImGui::Checkbox("Keep Pose on GPU", &gpu_pose_new);
+			if(gpu_pose_new && !gpu_pose)
+				camera_pose.Upload(camera_transform.GetTransform());
+			else if(!gpu_pose_new && gpu_pose)
+			{
+				camera_pose.RequestReadback();
+				PoseReadback readback;
+				if(camera_pose.FetchReadback(&readback, true))
+					camera_transform.SetTransform(readback.transform);
+			}
+			gpu_pose = gpu_pose_new;
+			for(int level=0; level<FRAME_PYRAMID_LEVELS; level++)
+				ImGui::SliderInt(("Max Iterations (Level " + std::to_string(level) + ")").c_str(), &icp_level_passes[level], 0, 20);
+			ICPConvergenceCriteria convergence = icp.GetConvergenceCriteria();
+			ImGui::SliderFloat("Min Rotation Delta", &convergence.min_rot_delta, 0.0f, 0.01f, "%.5f");
+			ImGui::SliderFloat("Min Translation Delta", &convergence.min_translation_delta, 0.0f, 0.01f, "%.5f");
+			ImGui::SliderFloat("Min Residual Reduction", &convergence.min_residual_reduction, 0.0f, 0.5f, "%.3f");
+			icp.SetConvergenceCriteria(convergence);
 			float v = icp.GetDistanceThreshold();
 			ImGui::SliderFloat("Distance Threshold", &v, 0.0f, 1.0f, "%.3f");
 			icp.SetDistanceThreshold(v);
@@ -189,10 +372,10 @@ int main(int argc, char *argv[])
 			renderer.SetDriftCorrection(drift_corr);
 			ImGui::Text("Rotation (delta):");
 			ImGui::SameLine(200.0f);
-			ImGui::Text("%11.8f, %11.8f, %11.8f", icp.GetLastRotDelta().x(), icp.GetLastRotDelta().y(), icp.GetLastRotDelta().z());
+			ImGui::Text("%11.8f, %11.8f, %11.8f", rot_delta.x(), rot_delta.y(), rot_delta.z());
 			ImGui::Text("Translation (delta):");
 			ImGui::SameLine(200.0f);
-			ImGui::Text("%11.8f, %11.8f, %11.8f", icp.GetLastTranslationDelta().x(), icp.GetLastTranslationDelta().y(), icp.GetLastTranslationDelta().z());
+			ImGui::Text("%11.8f, %11.8f, %11.8f", translation_delta.x(), translation_delta.y(), translation_delta.z());
 			ImGui::TreePop();
 		}
 
@@ -201,6 +384,23 @@ int main(int argc, char *argv[])
 			int max_weight = integrator.GetMaxWeight();
 			ImGui::SliderInt("Max Weight", &max_weight, 0, 255);
 			integrator.SetMaxWeight((unsigned int)max_weight);
+
+			IntegrationKernel kernel_prev = integrator.GetKernel();
+			IntegrationKernel kernel = kernel_prev;
+			ImGui::SliderInt("Local Size Z", &kernel.local_size_z, 1, 16);
+			ImGui::SliderInt("Voxels per Invocation", &kernel.voxels_per_invocation, 1, 16);
+			ImGui::Checkbox("Incremental Z", &kernel.incremental_z);
+			if(kernel.local_size_z != kernel_prev.local_size_z
+					|| kernel.voxels_per_invocation != kernel_prev.voxels_per_invocation
+					|| kernel.incremental_z != kernel_prev.incremental_z)
+				integrator.SetKernel(kernel);
+
+			if(ImGui::Checkbox("Rolling Volume", &enable_rolling))
+				gl_model.SetRolling(enable_rolling);
+			float threshold = rolling_volume.GetThreshold();
+			ImGui::SliderFloat("Shift Threshold", &threshold, 0.05f, 1.5f);
+			rolling_volume.SetThreshold(threshold);
+			ImGui::Text("Pending Slabs: %d, Triangles: %d", (int)rolling_volume.GetPendingSlabs(), (int)rolling_volume.GetTriangleCount());
 			ImGui::TreePop();
 		}
 
@@ -226,7 +426,9 @@ int main(int argc, char *argv[])
 
 				RenderDuration("Process Frame", time_begin, time_process_frame);
 				RenderDuration("ICP (total)", time_process_frame, time_icp);
-				for(int i=0; i<icp_passes; i++)
+				for(int level=FRAME_PYRAMID_LEVELS-1; level>=0; level--)
+					ImGui::Text("  level %d iterations: %u of %d", level, icp_level_iterations[level], icp_level_passes[level]);
+				for(size_t i=0; i<time_icp_corr.size(); i++)
 				{
 					RenderDuration(("  pass " + std::to_string(i) + " corr").c_str(), i > 0 ? time_icp_solve[i-1] : time_process_frame, time_icp_corr[i]);
 					RenderDuration(("  pass " + std::to_string(i) + " solve").c_str(), time_icp_corr[i], time_icp_solve[i]);
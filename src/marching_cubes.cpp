@@ -1,14 +1,23 @@
 #include <marching_cubes.h>
+#include "thread_pool.h"
+
+#include <algorithm>
 
 using namespace std;
 using namespace Eigen;
 
-Marching_Cubes::Marching_Cubes(CPUModel* model)
+Marching_Cubes::Marching_Cubes(CPUModel* model, ThreadPool* thread_pool)
 {
 	this->model = model;
-	this->resolutionX = model->GetResolutionX();
-	this->resolutionY = model->GetResolutionY();
-	this->resolutionZ = model->GetResolutionZ();
+	this->hash_model = nullptr;
+	this->thread_pool = thread_pool;
+}
+
+Marching_Cubes::Marching_Cubes(VoxelHashModel* hash_model)
+{
+	this->model = nullptr;
+	this->hash_model = hash_model;
+	this->thread_pool = nullptr;
 }
 
 Marching_Cubes::~Marching_Cubes()
@@ -33,6 +42,26 @@ Marching_Cubes::~Marching_Cubes()
 			Vector3f ev0[8];
 		};
 
+		// cell corner offsets in the order of ProcessVolumeCell()
+		static const int cell_corners[8][3] = {
+			{ 1, 0, 0 }, { 0, 0, 0 }, { 0, 1, 0 }, { 1, 1, 0 },
+			{ 1, 0, 1 }, { 0, 0, 1 }, { 0, 1, 1 }, { 1, 1, 1 }
+		};
+
+		// corners at the ends of each edge of edgeTable
+		static const int edge_corners[12][2] = {
+			{ 0, 1 }, { 1, 2 }, { 2, 3 }, { 3, 0 }, { 4, 5 }, { 5, 6 },
+			{ 6, 7 }, { 7, 4 }, { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 }
+		};
+
+		// The lattice edge behind each edge of a cell as offset x, y, plane z and axis of its lower corner.
+		// Plane 0 is the cache of the cell's lower z plane, plane 1 the one above.
+		static const int edge_lattice[12][4] = {
+			{ 0, 0, 0, 0 }, { 0, 0, 0, 1 }, { 0, 1, 0, 0 }, { 1, 0, 0, 1 },
+			{ 0, 0, 1, 0 }, { 0, 0, 1, 1 }, { 0, 1, 1, 0 }, { 1, 0, 1, 1 },
+			{ 1, 0, 0, 2 }, { 0, 0, 0, 2 }, { 0, 1, 0, 2 }, { 1, 1, 0, 2 }
+		};
+
 		int edgeTable[256] = {
 			0x0  , 0x109, 0x203, 0x30a, 0x406, 0x50f, 0x605, 0x70c,
 			0x80c, 0x905, 0xa0f, 0xb06, 0xc0a, 0xd03, 0xe09, 0xf00,
@@ -346,7 +375,7 @@ Marching_Cubes::~Marching_Cubes()
 	0 will be returned if the grid cell is either totally above
 	or totally below the isolevel.
 	*/
-	int Marching_Cubes::Polygonise(MC_Gridcell grid, double isolevel, MC_Triangle* triangles) {
+	int Marching_Cubes::Polygonise(const MC_Gridcell& grid, double isolevel, MC_Triangle* triangles) {
 
 		int ntriang;
 		int cubeindex;
@@ -409,6 +438,25 @@ Marching_Cubes::~Marching_Cubes()
 	{
 		MC_Gridcell cell;
 
+		float* tdsf = model->GetData();
+
+		// cell corner values
+		cell.val[0] = tdsf[model->IDX(x+1, y, z)];
+		cell.val[1] = tdsf[model->IDX(x, y, z)];
+		cell.val[2] = tdsf[model->IDX(x, y+1, z)];
+		cell.val[3] = tdsf[model->IDX(x+1, y+1, z)];
+		cell.val[4] = tdsf[model->IDX(x+1, y, z+1)];
+		cell.val[5] = tdsf[model->IDX(x, y, z+1)];
+		cell.val[6] = tdsf[model->IDX(x, y+1, z+1)];
+		cell.val[7] = tdsf[model->IDX(x+1, y+1, z+1)];
+
+		// most cells are entirely in front of or behind the surface
+		int cubeindex = 0;
+		for (int i = 0; i < 8; i++)
+			if (cell.val[i] < iso)
+				cubeindex |= 1 << i;
+		if (edgeTable[cubeindex] == 0)
+			return false;
 
 		Vector3f tmp;
 
@@ -430,22 +478,6 @@ Marching_Cubes::~Marching_Cubes()
 		tmp = model->TexelToGrid(Eigen::Vector3i(x + 1, y + 1, z + 1));
 		cell.p[7] = Vector3f(tmp[0], tmp[1], tmp[2]);
 
-		const int dx = model->GetResolutionX();
-		const int dy = model->GetResolutionY();
-		const int dz = model->GetResolutionZ();
-
-		float* tdsf = model->GetData();
-
-		// cell corner values
-		cell.val[0] = tdsf[IDX(x+1, y, z)];
-		cell.val[1] = tdsf[IDX(x, y, z)];
-		cell.val[2] = tdsf[IDX(x, y+1, z)];
-		cell.val[3] = tdsf[IDX(x+1, y+1, z)];
-		cell.val[4] = tdsf[IDX(x+1, y, z+1)];
-		cell.val[5] = tdsf[IDX(x, y, z+1)];
-		cell.val[6] = tdsf[IDX(x, y+1, z+1)];
-		cell.val[7] = tdsf[IDX(x+1, y+1, z+1)];
-
 		int face_color[3] = { 0,0,0 };
 
 		if (model->GetColorsActive())	// color active?
@@ -453,7 +485,7 @@ Marching_Cubes::~Marching_Cubes()
 			// get color
 			uint8_t* colors = model->GetColor();
 			int cell_colors[8][4];
-			int idx = 4 * IDX(x, y, z);
+			size_t idx = 4 * model->IDX(x, y, z);
 			for (int i = 0; i < 8; i++)
 			{
 				for (int j = 0; j < 4; j++)
@@ -520,27 +552,327 @@ Marching_Cubes::~Marching_Cubes()
 
 	}
 
+	// Cells of one VoxelHashModel block, the corners past its +x/+y/+z faces come from the neighbor blocks.
+	// Cells with a corner that is not allocated or was never observed are skipped.
+	bool Marching_Cubes::ProcessHashBlock(int index, double iso, Mesh* mesh)
+	{
+		const Vector3i block = hash_model->GetBlockCoords(index);
+		const float cell_size = hash_model->GetCellSize();
+		const bool color_active = hash_model->GetColorsActive();
+
+		// indexed by x | y << 1 | z << 2 for the neighbor in +x, +y and +z
+		int neighbors[8];
+		for (int i = 0; i < 8; i++)
+			neighbors[i] = i == 0 ? index : hash_model->FindBlock(block + Vector3i(i & 1, (i >> 1) & 1, (i >> 2) & 1));
+
+		bool found = false;
+		for (int z = 0; z < VOXEL_BLOCK_SIZE; z++)
+		{
+			for (int y = 0; y < VOXEL_BLOCK_SIZE; y++)
+			{
+				for (int x = 0; x < VOXEL_BLOCK_SIZE; x++)
+				{
+					MC_Gridcell cell;
+					int face_color[3] = { 0,0,0 };
+					bool valid = true;
+
+					for (int c = 0; c < 8 && valid; c++)
+					{
+						Vector3i local(x + cell_corners[c][0], y + cell_corners[c][1], z + cell_corners[c][2]);
+						int neighbor = (local.x() >= VOXEL_BLOCK_SIZE ? 1 : 0) | (local.y() >= VOXEL_BLOCK_SIZE ? 2 : 0) | (local.z() >= VOXEL_BLOCK_SIZE ? 4 : 0);
+						int block_index = neighbors[neighbor];
+						if (block_index < 0)
+						{
+							valid = false;
+							break;
+						}
+
+						cell.p[c] = (block * VOXEL_BLOCK_SIZE + local).cast<float>() * cell_size;
+						local -= Vector3i(neighbor & 1, (neighbor >> 1) & 1, (neighbor >> 2) & 1) * VOXEL_BLOCK_SIZE;
+						int voxel = VoxelHashModel::VoxelIndex(local.x(), local.y(), local.z());
+						if (hash_model->GetBlockWeights(block_index)[voxel] == 0)
+							valid = false;
+						cell.val[c] = hash_model->GetBlockTSDF(block_index)[voxel];
+
+						if (color_active)
+						{
+							const uint8_t* color = hash_model->GetBlockColor(block_index) + voxel * 4;
+							for (int j = 0; j < 3; j++)
+								face_color[j] += color[j];
+						}
+					}
+
+					if (!valid)
+						continue;
+
+					for (int j = 0; j < 3; j++)
+						face_color[j] /= 8;
+
+					MC_Triangle tris[6];
+					int numTris = Polygonise(cell, iso, tris);
+
+					for (int i1 = 0; i1 < numTris; i1++)
+					{
+						unsigned int vhandle[3];
+						vhandle[0] = mesh->AddVertex(tris[i1].p[0]);
+						vhandle[1] = mesh->AddVertex(tris[i1].p[1]);
+						vhandle[2] = mesh->AddVertex(tris[i1].p[2]);
+
+						mesh->AddFace(vhandle[0], vhandle[1], vhandle[2], face_color);
+						found = true;
+					}
+				}
+			}
+		}
+
+		return found;
+	}
+
 // process marching cubes
 void Marching_Cubes::process_mc(const std::string &filename)
 {
-	// extract the zero iso-surface using marching cubes
-	Mesh mesh;
-	for (unsigned int x = 0; x < model->GetResolutionX() - 1; x++)
+	// extract the zero iso-surface using marching cubes, streamed to the file
+	MeshWriter writer(filename, hash_model ? hash_model->GetColorsActive() : model->GetColorsActive());
+	if (!writer.Begin())
 	{
-		std::cerr << "Marching Cubes on slice " << x << " of " << model->GetResolutionX() << std::endl;
+		std::cout << "ERROR: unable to write output file!" << std::endl;
+		return;
+	}
 
-		for (unsigned int y = 0; y < model->GetResolutionY() - 1; y++)
+	if (hash_model)
+	{
+		// the vertices of each block are its own, the blocks are written in chunks
+		std::vector<int> blocks;
+		hash_model->GetBlocks(&blocks);
+		Mesh chunk;
+		std::vector<unsigned int> indices;
+		auto WriteChunk = [&]() {
+			indices.resize(chunk.GetVertices().size());
+			for (size_t v = 0; v < indices.size(); v++)
+				indices[v] = (unsigned int)(writer.GetVertexCount() + v);
+			writer.WriteChunk(chunk, indices);
+			chunk.Clear();
+		};
+		for (int index : blocks)
 		{
-			for (unsigned int z = 0; z < model->GetResolutionZ() - 1; z++)
+			ProcessHashBlock(index, 0.00f, &chunk);
+			if (chunk.GetVertices().size() >= MC_STREAM_CHUNK_VERTICES)
+				WriteChunk();
+		}
+		WriteChunk();
+	}
+	else
+		StreamMesh(0.00f, &writer);
+
+	if (!writer.Close())
+	{
+		std::cout << "ERROR: unable to write output file!" << std::endl;
+	}
+}
+
+static const unsigned int no_vertex = ~0u;
+
+void Marching_Cubes::ExtractSlab(int z_begin, int z_end, double iso, bool observed_only, Mesh* mesh, std::vector<unsigned int>* bottom, std::vector<unsigned int>* top)
+{
+	const int rx = model->GetResolutionX();
+	const int ry = model->GetResolutionY();
+	const float* tsdf = model->GetData();
+	const uint8_t* weights = model->GetWeights();
+	const uint8_t* colors = model->GetColorsActive() ? model->GetColor() : nullptr;
+
+	// The bricks of a layer whose summary allows a crossing, the cells of all others are skipped.
+	const int bricks_x = model->GetBricksX();
+	const int bricks_y = model->GetBricksY();
+	auto ActiveBricks = [&](int bz, std::vector<char>& active) {
+		active.resize((size_t)bricks_x * bricks_y);
+		for (int by = 0; by < bricks_y; by++)
+			for (int bx = 0; bx < bricks_x; bx++)
+			{
+				const BrickSummary& brick = model->GetBrickSummary(bx, by, bz);
+				active[(size_t)by * bricks_x + bx] = brick.min < iso && brick.max >= iso && (brick.observed || !observed_only);
+			}
+	};
+	std::vector<char> active_below, active_above;
+
+	// The tsdf of the planes z and z + 1 in linear order, so every voxel is looked up once.
+	// Only the voxels of active bricks of the slices on either side of the plane are loaded.
+	std::vector<float> values[2];
+	auto LoadValues = [&](int z, std::vector<float>& plane) {
+		const int layer_below = std::max(z - 1, z_begin) / CPU_MODEL_BRICK_SIZE;
+		const int layer_above = std::min(z, z_end - 1) / CPU_MODEL_BRICK_SIZE;
+		ActiveBricks(layer_below, active_below);
+		if (layer_above != layer_below)
+			ActiveBricks(layer_above, active_above);
+		plane.resize((size_t)rx * ry);
+		for (int by = 0; by < bricks_y; by++)
+			for (int bx = 0; bx < bricks_x; bx++)
+			{
+				const size_t brick = (size_t)by * bricks_x + bx;
+				if (!active_below[brick] && !(layer_above != layer_below && active_above[brick]))
+					continue;
+				const int y_end = std::min((by + 1) * CPU_MODEL_BRICK_SIZE + 1, ry);
+				const int x_end = std::min((bx + 1) * CPU_MODEL_BRICK_SIZE + 1, rx);
+				for (int y = by * CPU_MODEL_BRICK_SIZE; y < y_end; y++)
+					for (int x = bx * CPU_MODEL_BRICK_SIZE; x < x_end; x++)
+						plane[(size_t)y * rx + x] = tsdf[model->IDX(x, y, z)];
+			}
+	};
+	LoadValues(z_begin, values[1]);
+
+	std::vector<char> active;
+
+	// the vertices on the x, y and z edges starting at each voxel of the planes z and z + 1
+	std::vector<unsigned int> planes[2];
+	planes[0].assign((size_t)rx * ry * 3, no_vertex);
+	planes[1].assign((size_t)rx * ry * 3, no_vertex);
+
+	for (int z = z_begin; z < z_end; z++)
+	{
+		std::swap(values[0], values[1]);
+		LoadValues(z + 1, values[1]);
+		if (z == z_begin || z % CPU_MODEL_BRICK_SIZE == 0)
+			ActiveBricks(z / CPU_MODEL_BRICK_SIZE, active);
+
+		for (int y = 0; y < ry - 1; y++)
+		{
+			const char* active_row = active.data() + (size_t)(y / CPU_MODEL_BRICK_SIZE) * bricks_x;
+			for (int x = 0; x < rx - 1; x++)
 			{
-				ProcessVolumeCell(model, x, y, z, 0.00f, &mesh);
+				if (!active_row[x / CPU_MODEL_BRICK_SIZE])
+				{
+					x = (x / CPU_MODEL_BRICK_SIZE + 1) * CPU_MODEL_BRICK_SIZE - 1;
+					continue;
+				}
+
+				double val[8];
+				int cubeindex = 0;
+				for (int c = 0; c < 8; c++)
+				{
+					val[c] = values[cell_corners[c][2]][(size_t)(y + cell_corners[c][1]) * rx + x + cell_corners[c][0]];
+					if (val[c] < iso)
+						cubeindex |= 1 << c;
+				}
+				const int edges = edgeTable[cubeindex];
+				if (edges == 0)
+					continue;
+
+				size_t voxels[8];
+				for (int c = 0; c < 8; c++)
+					voxels[c] = model->IDX(x + cell_corners[c][0], y + cell_corners[c][1], z + cell_corners[c][2]);
+				if (observed_only && std::any_of(voxels, voxels + 8, [&](size_t v) { return weights[v] == 0; }))
+					continue;
+
+				unsigned int vertices[12];
+				for (int e = 0; e < 12; e++)
+				{
+					if (!(edges & (1 << e)))
+						continue;
+					const int* lattice = edge_lattice[e];
+					unsigned int& vertex = planes[lattice[2]][((size_t)(y + lattice[1]) * rx + x + lattice[0]) * 3 + lattice[3]];
+					if (vertex == no_vertex)
+					{
+						const int* a = cell_corners[edge_corners[e][0]];
+						const int* b = cell_corners[edge_corners[e][1]];
+						Vertex v = VertexInterp(iso,
+								model->TexelToGrid(Vector3i(x + a[0], y + a[1], z + a[2])),
+								model->TexelToGrid(Vector3i(x + b[0], y + b[1], z + b[2])),
+								val[edge_corners[e][0]], val[edge_corners[e][1]]);
+						vertex = mesh->AddVertex(v);
+					}
+					vertices[e] = vertex;
+				}
+
+				// the color of the cell's voxel at x, y, z
+				int face_color[3] = { 0,0,0 };
+				if (colors)
+					for (int j = 0; j < 3; j++)
+						face_color[j] = colors[voxels[1] * 4 + j];
+
+				for (int i = 0; triTable[cubeindex][i] != -1; i += 3)
+					mesh->AddFace(vertices[triTable[cubeindex][i]], vertices[triTable[cubeindex][i + 1]], vertices[triTable[cubeindex][i + 2]], face_color);
 			}
 		}
+
+		if (z == z_begin)
+			*bottom = planes[0];
+		std::swap(planes[0], planes[1]);
+		std::fill(planes[1].begin(), planes[1].end(), no_vertex);
 	}
-	bool color_active = model->GetColorsActive();
-	// write mesh to file
-	if (!mesh.WriteMesh(filename, color_active))
+	*top = std::move(planes[0]);
+}
+
+void Marching_Cubes::ExtractSlabs(double iso, bool observed_only, int grain, int window, const function<void(Mesh&, vector<unsigned int>&)>& emit)
+{
+	const int slices = model->GetResolutionZ() - 1;
+	if (slices <= 0)
+		return;
+
+	const int count = (slices + grain - 1) / grain;
+	std::vector<Mesh> slabs(std::min(count, window));
+	std::vector<std::vector<unsigned int>> bottoms(slabs.size()), tops(slabs.size());
+
+	// The slabs are emitted in z order. The vertices on the plane between two slabs were made by both,
+	// the ones of the upper slab are replaced by those of the lower.
+	std::vector<unsigned int> previous_top;
+	unsigned int vertex_count = 0;
+	for (int first = 0; first < count; first += window)
 	{
-		std::cout << "ERROR: unable to write output file!" << std::endl;
+		const int begin = first * grain;
+		const int end = std::min(begin + window * grain, slices);
+		auto Run = [&](int slab_begin, int slab_end, unsigned int) {
+			const int slab = (slab_begin - begin) / grain;
+			ExtractSlab(slab_begin, slab_end, iso, observed_only, &slabs[slab], &bottoms[slab], &tops[slab]);
+		};
+		if (thread_pool)
+			thread_pool->ParallelFor(begin, end, grain, Run);
+		else
+			for (int slab_begin = begin; slab_begin < end; slab_begin += grain)
+				Run(slab_begin, std::min(slab_begin + grain, end), 0);
+
+		for (int i = 0; i < (end - begin + grain - 1) / grain; i++)
+		{
+			std::vector<unsigned int> remap(slabs[i].GetVertices().size(), no_vertex);
+			if (first + i > 0)
+			{
+				for (size_t j = 0; j < bottoms[i].size(); j++)
+					if (bottoms[i][j] != no_vertex && previous_top[j] != no_vertex)
+						remap[bottoms[i][j]] = previous_top[j];
+			}
+			for (auto& v : remap)
+				if (v == no_vertex)
+					v = vertex_count++;
+			emit(slabs[i], remap);
+
+			previous_top = std::move(tops[i]);
+			for (auto& v : previous_top)
+				if (v != no_vertex)
+					v = remap[v];
+			slabs[i].Clear();
+		}
 	}
 }
+
+void Marching_Cubes::ExtractMesh(double iso, Mesh* mesh, bool observed_only)
+{
+	// a few slabs per thread for load balance, all at once
+	const int slices = std::max(model->GetResolutionZ() - 1, 1);
+	const int grain = thread_pool ? std::max(1, slices / (int)(thread_pool->GetThreadCount() * 4)) : slices;
+	const unsigned int base = (unsigned int)mesh->GetVertices().size();
+	ExtractSlabs(iso, observed_only, grain, slices, [&](Mesh& slab, vector<unsigned int>& remap) {
+		std::vector<Vertex>& vertices = slab.GetVertices();
+		for (size_t v = 0; v < vertices.size(); v++)
+			if (base + remap[v] == mesh->GetVertices().size())
+				mesh->AddVertex(vertices[v]);
+		for (auto& t : slab.GetTriangles())
+			mesh->AddFace(base + remap[t.idx0], base + remap[t.idx1], base + remap[t.idx2], t.color);
+	});
+}
+
+void Marching_Cubes::StreamMesh(double iso, MeshWriter* writer, bool observed_only)
+{
+	// Thin slabs, only as many in memory as there are threads. The writer never holds more than its buffers.
+	const int threads = thread_pool ? (int)thread_pool->GetThreadCount() : 1;
+	ExtractSlabs(iso, observed_only, MC_STREAM_SLAB_SLICES, threads, [&](Mesh& slab, vector<unsigned int>& remap) {
+		writer->WriteChunk(slab, remap);
+	});
+}
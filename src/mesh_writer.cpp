@@ -0,0 +1,411 @@
+
+#include "mesh_writer.h"
+#include "mesh.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+
+#define MESH_WRITER_BUFFER_SIZE (4 << 20)
+
+// longest number written by the formatters below
+#define MAX_NUMBER_CHARS 32
+
+// width of the counts in a header that is patched later
+#define COUNT_WIDTH 10
+
+static char *FormatUInt(char *out, uint64_t value)
+{
+	char digits[20];
+	int count = 0;
+	do
+	{
+		digits[count++] = (char)('0' + value % 10);
+		value /= 10;
+	} while(value);
+	while(count)
+		*out++ = digits[--count];
+	return out;
+}
+
+// Fixed point with up to 6 decimals, enough for vertices in meters or in grid cells,
+// anything that doesn't fit goes through printf.
+static char *FormatFloat(char *out, float value)
+{
+	if(!std::isfinite(value) || std::abs(value) >= 1e9f)
+		return out + snprintf(out, MAX_NUMBER_CHARS, "%g", value);
+
+	uint64_t scaled = (uint64_t)(std::abs((double)value) * 1e6 + 0.5);
+	if(value < 0.0f && scaled)
+		*out++ = '-';
+	out = FormatUInt(out, scaled / 1000000);
+
+	uint32_t fraction = (uint32_t)(scaled % 1000000);
+	if(fraction)
+	{
+		*out++ = '.';
+		int digits = 6;
+		while(fraction % 10 == 0)
+		{
+			fraction /= 10;
+			digits--;
+		}
+		for(int i=digits-1; i>=0; i--)
+		{
+			out[i] = (char)('0' + fraction % 10);
+			fraction /= 10;
+		}
+		out += digits;
+	}
+	return out;
+}
+
+static std::string FormatCount(size_t count, bool padded)
+{
+	std::string text = std::to_string(count);
+	if(padded && text.size() < COUNT_WIDTH)
+		text.insert(0, COUNT_WIDTH - text.size(), '0');
+	return text;
+}
+
+// sums of the colors of the faces around each vertex and their count
+static void SumColors(Mesh &mesh, std::vector<uint32_t> *color_sums)
+{
+	color_sums->assign(mesh.GetVertices().size() * 4, 0);
+	for(const Triangle &t : mesh.GetTriangles())
+	{
+		for(unsigned int idx : { t.idx0, t.idx1, t.idx2 })
+		{
+			uint32_t *sum = &(*color_sums)[idx * 4];
+			for(int j=0; j<3; j++)
+				sum[j] += (uint32_t)std::min(std::max(t.color[j], 0), 255);
+			sum[3]++;
+		}
+	}
+}
+
+MeshWriter::MeshWriter(const std::string &filename, bool color_active) :
+	format(FormatFromFilename(filename)),
+	color_active(color_active),
+	buffer(MESH_WRITER_BUFFER_SIZE),
+	used(0),
+	face_file(nullptr),
+	face_used(0),
+	face_error(false),
+	streaming(false),
+	vertex_count(0),
+	face_count(0),
+	vertex_count_offset(0),
+	face_count_offset(0)
+{
+	file.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+}
+
+MeshWriter::~MeshWriter()
+{
+	Close();
+}
+
+MeshWriter::Format MeshWriter::FormatFromFilename(const std::string &filename)
+{
+	size_t dot = filename.rfind('.');
+	if(dot == std::string::npos)
+		return FORMAT_OFF;
+	std::string extension = filename.substr(dot + 1);
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+	if(extension == "ply")
+		return FORMAT_PLY;
+	if(extension == "stl")
+		return FORMAT_STL;
+	return FORMAT_OFF;
+}
+
+void MeshWriter::Flush()
+{
+	if(used)
+		file.write(buffer.data(), (std::streamsize)used);
+	used = 0;
+}
+
+void MeshWriter::FlushFaces()
+{
+	if(face_used && fwrite(face_buffer.data(), 1, face_used, face_file) != face_used)
+		face_error = true;
+	face_used = 0;
+}
+
+char *MeshWriter::Reserve(size_t bytes)
+{
+	if(used + bytes > buffer.size())
+	{
+		Flush();
+		if(bytes > buffer.size())
+			buffer.resize(bytes);
+	}
+	char *out = buffer.data() + used;
+	used += bytes;
+	return out;
+}
+
+char *MeshWriter::ReserveFace(size_t bytes)
+{
+	if(!face_file)
+		return Reserve(bytes);
+	if(face_used + bytes > face_buffer.size())
+		FlushFaces();
+	char *out = face_buffer.data() + face_used;
+	face_used += bytes;
+	return out;
+}
+
+void MeshWriter::Put(const void *data, size_t bytes)
+{
+	memcpy(Reserve(bytes), data, bytes);
+}
+
+void MeshWriter::PutHeader(size_t vertices, size_t faces)
+{
+	std::string header;
+	if(format == FORMAT_STL)
+	{
+		// must not start with "solid", that marks ASCII STL
+		char text[80] = {};
+		strncpy(text, "binary STL", sizeof(text));
+		const uint32_t count = (uint32_t)faces;
+		Put(text, sizeof(text));
+		face_count_offset = (std::streamoff)sizeof(text);
+		Put(&count, sizeof(count));
+		return;
+	}
+
+	if(format == FORMAT_PLY)
+	{
+		header = "ply\nformat binary_little_endian 1.0\nelement vertex ";
+		vertex_count_offset = (std::streamoff)header.size();
+		header += FormatCount(vertices, streaming) + "\n";
+		header += "property float x\nproperty float y\nproperty float z\n";
+		if(color_active)
+			header += "property uchar red\nproperty uchar green\nproperty uchar blue\n";
+		header += "element face ";
+		face_count_offset = (std::streamoff)header.size();
+		header += FormatCount(faces, streaming) + "\n";
+		header += "property list uchar uint vertex_indices\nend_header\n";
+	}
+	else
+	{
+		header = "OFF\n";
+		vertex_count_offset = (std::streamoff)header.size();
+		header += FormatCount(vertices, streaming) + " ";
+		face_count_offset = (std::streamoff)header.size();
+		header += FormatCount(faces, streaming) + " 0\n";
+	}
+	Put(header.data(), header.size());
+}
+
+void MeshWriter::PutVertex(const float *position, const uint32_t *color_sum)
+{
+	if(format == FORMAT_PLY)
+	{
+		// the binary records are copied as is, all supported hosts are little endian
+		char *out = Reserve(3 * sizeof(float) + (color_active ? 3 : 0));
+		memcpy(out, position, 3 * sizeof(float));
+		if(color_active)
+			for(int j=0; j<3; j++)
+				out[3 * sizeof(float) + j] = (char)(color_sum[3] ? color_sum[j] / color_sum[3] : 0);
+		return;
+	}
+
+	char line[3 * MAX_NUMBER_CHARS];
+	char *out = line;
+	for(int j=0; j<3; j++)
+	{
+		out = FormatFloat(out, position[j]);
+		*out++ = j < 2 ? ' ' : '\n';
+	}
+	Put(line, out - line);
+}
+
+void MeshWriter::PutFace(const unsigned int *indices, const int *color)
+{
+	if(format == FORMAT_PLY)
+	{
+		char *out = ReserveFace(1 + 3 * sizeof(uint32_t));
+		out[0] = 3;
+		memcpy(out + 1, indices, 3 * sizeof(uint32_t));
+		return;
+	}
+
+	char line[7 * MAX_NUMBER_CHARS];
+	char *out = line;
+	*out++ = '3';
+	for(int j=0; j<3; j++)
+	{
+		*out++ = ' ';
+		out = FormatUInt(out, indices[j]);
+	}
+	if(color_active)
+	{
+		for(int j=0; j<3; j++)
+		{
+			*out++ = ' ';
+			out = FormatUInt(out, (uint64_t)std::max(color[j], 0));
+		}
+	}
+	*out++ = '\n';
+	memcpy(ReserveFace(out - line), line, out - line);
+}
+
+void MeshWriter::PutSTLFace(const float *v0, const float *v1, const float *v2)
+{
+	const Eigen::Map<const Eigen::Vector3f> p0(v0), p1(v1), p2(v2);
+	Eigen::Vector3f normal = (p1 - p0).cross(p2 - p0);
+	float length = normal.norm();
+	if(length > 0.0f)
+		normal /= length;
+
+	char *out = Reserve(50);
+	memcpy(out, normal.data(), 3 * sizeof(float));
+	memcpy(out + 12, v0, 3 * sizeof(float));
+	memcpy(out + 24, v1, 3 * sizeof(float));
+	memcpy(out + 36, v2, 3 * sizeof(float));
+	memset(out + 48, 0, 2);
+}
+
+bool MeshWriter::Write(Mesh &mesh)
+{
+	if(!file.is_open() || streaming)
+		return false;
+
+	const std::vector<Vertex> &vertices = mesh.GetVertices();
+	const std::vector<Triangle> &triangles = mesh.GetTriangles();
+	vertex_count = vertices.size();
+	face_count = triangles.size();
+	PutHeader(vertices.size(), triangles.size());
+
+	if(format == FORMAT_STL)
+	{
+		for(const Triangle &t : triangles)
+			PutSTLFace(vertices[t.idx0].data(), vertices[t.idx1].data(), vertices[t.idx2].data());
+		return (bool)file;
+	}
+
+	std::vector<uint32_t> color_sums;
+	if(format == FORMAT_PLY && color_active)
+		SumColors(mesh, &color_sums);
+	for(size_t i=0; i<vertices.size(); i++)
+		PutVertex(vertices[i].data(), color_sums.empty() ? nullptr : &color_sums[i * 4]);
+
+	for(const Triangle &t : triangles)
+	{
+		const unsigned int indices[3] = { t.idx0, t.idx1, t.idx2 };
+		PutFace(indices, t.color);
+	}
+	return (bool)file;
+}
+
+bool MeshWriter::Begin()
+{
+	if(!file.is_open() || streaming)
+		return false;
+
+	streaming = true;
+	vertex_count = 0;
+	face_count = 0;
+	if(format != FORMAT_STL)
+	{
+		face_file = std::tmpfile();
+		if(!face_file)
+			return false;
+		face_buffer.resize(MESH_WRITER_BUFFER_SIZE);
+	}
+	PutHeader(0, 0);
+	return (bool)file;
+}
+
+bool MeshWriter::WriteChunk(Mesh &chunk, const std::vector<unsigned int> &indices)
+{
+	if(!streaming || (format != FORMAT_STL && !face_file))
+		return false;
+
+	const std::vector<Vertex> &vertices = chunk.GetVertices();
+	const std::vector<Triangle> &triangles = chunk.GetTriangles();
+
+	if(format == FORMAT_STL)
+	{
+		for(const Triangle &t : triangles)
+			PutSTLFace(vertices[t.idx0].data(), vertices[t.idx1].data(), vertices[t.idx2].data());
+		face_count += triangles.size();
+		return (bool)file;
+	}
+
+	std::vector<uint32_t> color_sums;
+	if(format == FORMAT_PLY && color_active)
+		SumColors(chunk, &color_sums);
+	for(size_t i=0; i<vertices.size(); i++)
+	{
+		if(indices[i] < vertex_count)
+			continue;
+		PutVertex(vertices[i].data(), color_sums.empty() ? nullptr : &color_sums[i * 4]);
+		vertex_count++;
+	}
+
+	for(const Triangle &t : triangles)
+	{
+		const unsigned int face[3] = { indices[t.idx0], indices[t.idx1], indices[t.idx2] };
+		PutFace(face, t.color);
+	}
+	face_count += triangles.size();
+	return (bool)file && !face_error;
+}
+
+bool MeshWriter::Close()
+{
+	if(!file.is_open())
+		return false;
+
+	if(streaming)
+	{
+		// the spooled faces go after the vertices in chunks of the buffer size
+		if(face_file)
+		{
+			FlushFaces();
+			std::rewind(face_file);
+			size_t read;
+			while((read = fread(buffer.data() + used, 1, buffer.size() - used, face_file)) > 0)
+			{
+				used += read;
+				Flush();
+			}
+			if(ferror(face_file))
+				face_error = true;
+			std::fclose(face_file);
+			face_file = nullptr;
+			face_buffer.clear();
+			face_buffer.shrink_to_fit();
+		}
+		Flush();
+
+		if(format == FORMAT_STL)
+		{
+			const uint32_t count = (uint32_t)face_count;
+			file.seekp(face_count_offset);
+			file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+		}
+		else
+		{
+			const std::string vertices = FormatCount(vertex_count, true);
+			const std::string faces = FormatCount(face_count, true);
+			file.seekp(vertex_count_offset);
+			file.write(vertices.data(), (std::streamsize)vertices.size());
+			file.seekp(face_count_offset);
+			file.write(faces.data(), (std::streamsize)faces.size());
+		}
+		streaming = false;
+	}
+
+	Flush();
+	bool ok = (bool)file && !face_error;
+	file.close();
+	return ok;
+}
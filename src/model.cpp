@@ -1,9 +1,17 @@
 #include <stdio.h>
 #include "model.h"
 #include "implicit.h"
+#include "camera_transform.h"
+#include "thread_pool.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 
+// rows per thread pool chunk in Raycast()
+#define CPU_MODEL_ROW_GRAIN 8
+
 
 void Model::Init(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation)
 {
@@ -77,16 +85,40 @@ Eigen::Vector3f Model::TexelToGrid(Eigen::Vector3i pos)
 			Eigen::Vector3f(1.0f / (float)resolutionX, 1.0f / (float)resolutionY, 1.0f / (float)resolutionZ));
 }
 
+// these must convert exactly like GL does for GL_RG16_SNORM
+
+float Model::GetPackedTSDFScale()
+{
+	return std::max(max_truncation, -min_truncation);
+}
+
+PackedVoxel Model::PackVoxel(float tsdf, uint8_t weight)
+{
+	PackedVoxel voxel;
+	voxel.tsdf = (int16_t)std::lround(std::min(std::max(tsdf / GetPackedTSDFScale(), -1.0f), 1.0f) * 32767.0f);
+	voxel.weight = (int16_t)weight;
+	return voxel;
+}
 
+float Model::UnpackTSDF(PackedVoxel voxel)
+{
+	return std::max((float)voxel.tsdf / 32767.0f, -1.0f) * GetPackedTSDFScale();
+}
 
-CPUModel::CPUModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, bool colorsActive)
-	: Model(resolutionX, resolutionY, resolutionZ, cellSize, max_truncation, min_truncation, colorsActive)
+uint8_t Model::UnpackWeight(PackedVoxel voxel)
+{
+	return (uint8_t)std::min(std::max((int)voxel.weight, 0), 255);
+}
+
+
+CPUModel::CPUModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, bool colorsActive, bool bricked)
+	: Model(resolutionX, resolutionY, resolutionZ, cellSize, max_truncation, min_truncation, colorsActive), bricked(bricked)
 {
 	Init();
 }
 
-CPUModel::CPUModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, Eigen::Vector3f modelOrigin, bool colorsActive)
-	: Model(resolutionX, resolutionY, resolutionZ, cellSize, max_truncation, min_truncation, modelOrigin, colorsActive)
+CPUModel::CPUModel(int resolutionX, int resolutionY, int resolutionZ, float cellSize, float max_truncation, float min_truncation, Eigen::Vector3f modelOrigin, bool colorsActive, bool bricked)
+	: Model(resolutionX, resolutionY, resolutionZ, cellSize, max_truncation, min_truncation, modelOrigin, colorsActive), bricked(bricked)
 {
 	Init();
 }
@@ -104,29 +136,38 @@ CPUModel::~CPUModel()
 
 void CPUModel::Reset()
 {
-	for (int x = 0; x < resolutionX*resolutionY*resolutionZ; x++)
+	for (size_t x = 0; x < voxelCount; x++)
 	{
 		tsdf[x] = max_truncation;
 		weights[x] = 0;
 	}
 	if (colorsActive)
 	{
-		for (int x = 0; x < resolutionX*resolutionY*resolutionZ * 4; x++)
+		for (size_t x = 0; x < voxelCount * 4; x++)
 		{
 			color[x] = 0;
 		}
 	}
-	
+	BrickSummary empty = { max_truncation, max_truncation, false };
+	summary.assign((size_t)bricksX * bricksY * bricksZ, empty);
 }
 
 void CPUModel::Init()
 {
-	tsdf = new float[resolutionX*resolutionY*resolutionZ];
-	weights = new uint8_t[resolutionX*resolutionY*resolutionZ];
+	bricksX = (resolutionX + CPU_MODEL_BRICK_SIZE - 1) / CPU_MODEL_BRICK_SIZE;
+	bricksY = (resolutionY + CPU_MODEL_BRICK_SIZE - 1) / CPU_MODEL_BRICK_SIZE;
+	bricksZ = (resolutionZ + CPU_MODEL_BRICK_SIZE - 1) / CPU_MODEL_BRICK_SIZE;
+	if (bricked)
+		voxelCount = (size_t)bricksX * bricksY * bricksZ * CPU_MODEL_BRICK_VOXELS;
+	else
+		voxelCount = (size_t)resolutionX * resolutionY * resolutionZ;
+
+	tsdf = new float[voxelCount];
+	weights = new uint8_t[voxelCount];
 
 	if (colorsActive)
 	{
-		color = new uint8_t[resolutionX*resolutionY*resolutionZ * 4];
+		color = new uint8_t[voxelCount * 4];
 	}
 	Reset();
 }
@@ -144,11 +185,11 @@ void CPUModel::GenerateSphere(float radius, Eigen::Vector3f center)
 				Eigen::Vector3f grid_pos = TexelToGrid(Eigen::Vector3i(x, y, z));
 				Eigen::Vector3f world_pos = GridToWorld(grid_pos);
 				float eval = sphere.sdf(world_pos.x(), world_pos.y(), world_pos.z());
-				int cellIndex = IDX(x, y, z);
+				size_t cellIndex = IDX(x, y, z);
 				tsdf[cellIndex] = eval;
 				if (colorsActive)
 				{
-					int idx = 4 * IDX(x, y, z);
+					size_t idx = 4 * cellIndex;
 					color[idx] = uint8_t(255);
 					color[idx+1] = uint8_t(0);
 					color[idx+2] = uint8_t(0);
@@ -157,6 +198,215 @@ void CPUModel::GenerateSphere(float radius, Eigen::Vector3f center)
 			}
 		}
 	}
+	UpdateSummary();
+}
+
+// Calls copy(index, linear index, count) for the runs of voxels that are contiguous in both layouts,
+// whole rows without bricks and the rows of a brick with them.
+template<typename F>
+static void ForEachRun(CPUModel *model, F copy)
+{
+	const int rx = model->GetResolutionX();
+	const int ry = model->GetResolutionY();
+	const int run = model->GetBricked() ? CPU_MODEL_BRICK_SIZE : rx;
+	for (int z = 0; z < model->GetResolutionZ(); z++)
+		for (int y = 0; y < ry; y++)
+			for (int x = 0; x < rx; x += run)
+				copy(model->IDX(x, y, z), ((size_t)z * ry + y) * rx + x, (size_t)std::min(run, rx - x));
+}
+
+void CPUModel::FromLinear(const float *linear_tsdf, const uint8_t *linear_weights, const uint8_t *linear_color)
+{
+	ForEachRun(this, [&](size_t i, size_t l, size_t count) {
+		memcpy(tsdf + i, linear_tsdf + l, count * sizeof(float));
+		memcpy(weights + i, linear_weights + l, count);
+		if (colorsActive)
+			memcpy(color + i * 4, linear_color + l * 4, count * 4);
+	});
+	UpdateSummary();
+}
+
+void CPUModel::ToLinear(float *linear_tsdf, uint8_t *linear_weights, uint8_t *linear_color)
+{
+	ForEachRun(this, [&](size_t i, size_t l, size_t count) {
+		memcpy(linear_tsdf + l, tsdf + i, count * sizeof(float));
+		memcpy(linear_weights + l, weights + i, count);
+		if (colorsActive)
+			memcpy(linear_color + l * 4, color + i * 4, count * 4);
+	});
+}
+
+void CPUModel::Pack(PackedVoxel *voxels)
+{
+	for (int z = 0; z < resolutionZ; z++)
+		for (int y = 0; y < resolutionY; y++)
+			for (int x = 0; x < resolutionX; x++)
+			{
+				const size_t i = IDX(x, y, z);
+				*voxels++ = PackVoxel(tsdf[i], weights[i]);
+			}
+}
+
+void CPUModel::Unpack(const PackedVoxel *voxels)
+{
+	for (int z = 0; z < resolutionZ; z++)
+		for (int y = 0; y < resolutionY; y++)
+			for (int x = 0; x < resolutionX; x++)
+			{
+				const size_t i = IDX(x, y, z);
+				tsdf[i] = UnpackTSDF(*voxels);
+				weights[i] = UnpackWeight(*voxels++);
+			}
+	UpdateSummary();
+}
+
+void CPUModel::UpdateBrickSummary(int bx, int by, int bz)
+{
+	BrickSummary brick = { max_truncation, max_truncation, false };
+	bool first = true;
+	const int x_end = std::min((bx + 1) * CPU_MODEL_BRICK_SIZE + 1, resolutionX);
+	const int y_end = std::min((by + 1) * CPU_MODEL_BRICK_SIZE + 1, resolutionY);
+	const int z_end = std::min((bz + 1) * CPU_MODEL_BRICK_SIZE + 1, resolutionZ);
+	for (int z = bz * CPU_MODEL_BRICK_SIZE; z < z_end; z++)
+	{
+		for (int y = by * CPU_MODEL_BRICK_SIZE; y < y_end; y++)
+		{
+			for (int x = bx * CPU_MODEL_BRICK_SIZE; x < x_end; x++)
+			{
+				const size_t i = IDX(x, y, z);
+				brick.min = first ? tsdf[i] : std::min(brick.min, tsdf[i]);
+				brick.max = first ? tsdf[i] : std::max(brick.max, tsdf[i]);
+				brick.observed = brick.observed || weights[i] != 0;
+				first = false;
+			}
+		}
+	}
+	summary[((size_t)bz * bricksY + by) * bricksX + bx] = brick;
+}
+
+void CPUModel::UpdateSummary(ThreadPool *thread_pool)
+{
+	UpdateSummary(Eigen::Vector3i::Zero(), Eigen::Vector3i(resolutionX, resolutionY, resolutionZ), thread_pool);
+}
+
+void CPUModel::UpdateSummary(const Eigen::Vector3i &begin, const Eigen::Vector3i &end, ThreadPool *thread_pool)
+{
+	if ((end - begin).minCoeff() <= 0)
+		return;
+
+	// a voxel on a brick border is also covered by the brick before it
+	Eigen::Vector3i brick_begin, brick_end;
+	for (int i = 0; i < 3; i++)
+	{
+		brick_begin[i] = std::max(begin[i] - 1, 0) / CPU_MODEL_BRICK_SIZE;
+		brick_end[i] = (end[i] - 1) / CPU_MODEL_BRICK_SIZE + 1;
+	}
+
+	auto func = [&](int bz_begin, int bz_end, unsigned int) {
+		for (int bz = bz_begin; bz < bz_end; bz++)
+			for (int by = brick_begin.y(); by < brick_end.y(); by++)
+				for (int bx = brick_begin.x(); bx < brick_end.x(); bx++)
+					UpdateBrickSummary(bx, by, bz);
+	};
+	if (thread_pool)
+		thread_pool->ParallelFor(brick_begin.z(), brick_end.z(), 1, func);
+	else
+		func(brick_begin.z(), brick_end.z(), 0);
+}
+
+void CPUModel::Raycast(const CameraTransform &camera_transform, int width, int height, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center,
+		float depth_scale, float max_depth, uint16_t *depth, ThreadPool *thread_pool)
+{
+	auto func = [&](int y_begin, int y_end, unsigned int) {
+		RaycastRows(camera_transform.GetTransform(), width, focal_length, center, depth_scale, max_depth, depth, y_begin, y_end);
+	};
+	if (thread_pool)
+		thread_pool->ParallelFor(0, height, CPU_MODEL_ROW_GRAIN, func);
+	else
+		func(0, height, 0);
+}
+
+// Like VoxelHashModel::RaycastRows(), the ray parameter s is the camera space depth.
+// A brick without a crossing is only sampled where the ray enters and leaves it,
+// so a crossing into or out of it is still found, and skipped entirely if nothing in it was observed.
+void CPUModel::RaycastRows(const Eigen::Affine3f &transform, int width, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center,
+		float depth_scale, float max_depth, uint16_t *depth, int y_begin, int y_end)
+{
+	// in voxel units, voxel centers are at integer positions
+	const Eigen::Vector3f origin = (transform.translation() - modelOrigin) / cellSize;
+	const Eigen::Vector3f box_max((float)resolutionX - 0.5f, (float)resolutionY - 0.5f, (float)resolutionZ - 0.5f);
+
+	for (int y = y_begin; y < y_end; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const Eigen::Vector3f dir = transform.linear() * Eigen::Vector3f((x - center.x()) / focal_length.x(), -(y - center.y()) / focal_length.y(), -1.0f) / cellSize;
+			const float voxels_per_s = dir.norm();
+
+			// the part of the ray inside the volume
+			float s = 0.0f;
+			float s_end = max_depth;
+			for (int i = 0; i < 3; i++)
+			{
+				if (dir[i] == 0.0f)
+				{
+					if (origin[i] < -0.5f || origin[i] > box_max[i])
+						s_end = -1.0f;
+					continue;
+				}
+				float s0 = (-0.5f - origin[i]) / dir[i];
+				float s1 = (box_max[i] - origin[i]) / dir[i];
+				s = std::max(s, std::min(s0, s1));
+				s_end = std::min(s_end, std::max(s0, s1));
+			}
+
+			float s_prev = 0.0f;
+			float sdf_prev = -1.0f;
+			float hit = 0.0f;
+
+			while (s < s_end)
+			{
+				Eigen::Vector3f p = origin + dir * s;
+				Eigen::Vector3i voxel((int)std::floor(p.x() + 0.5f), (int)std::floor(p.y() + 0.5f), (int)std::floor(p.z() + 0.5f));
+				voxel = voxel.cwiseMax(0).cwiseMin(Eigen::Vector3i(resolutionX - 1, resolutionY - 1, resolutionZ - 1));
+				const Eigen::Vector3i brick = voxel / CPU_MODEL_BRICK_SIZE;
+				const BrickSummary &summary = GetBrickSummary(brick.x(), brick.y(), brick.z());
+
+				float s_exit = s_end;
+				for (int i = 0; i < 3; i++)
+				{
+					if (dir[i] == 0.0f)
+						continue;
+					float bound = (float)((brick[i] + (dir[i] > 0.0f ? 1 : 0)) * CPU_MODEL_BRICK_SIZE) - 0.5f;
+					s_exit = std::min(s_exit, (bound - origin[i]) / dir[i]);
+				}
+
+				const size_t i = IDX(voxel.x(), voxel.y(), voxel.z());
+				if (weights[i] == 0)
+				{
+					s = summary.observed ? s + 1.0f / voxels_per_s : std::max(s_exit, s) + 0.01f / voxels_per_s;
+					sdf_prev = -1.0f;
+					continue;
+				}
+
+				float sdf = tsdf[i];
+				if (sdf <= 0.0f && sdf_prev > 0.0f)
+				{
+					hit = s_prev + (s - s_prev) * sdf_prev / (sdf_prev - sdf);
+					break;
+				}
+				s_prev = s;
+				sdf_prev = sdf;
+
+				float step = std::max(sdf / cellSize, 1.0f) / voxels_per_s;
+				if (summary.min > 0.0f || summary.max <= 0.0f)
+					step = std::max(step, s_exit - 1.0f / voxels_per_s - s);
+				s += step;
+			}
+
+			depth[y * width + x] = (uint16_t)std::min(65535.0f, std::round(hit / depth_scale));
+		}
+	}
 }
 
 void CPUModel::DebugToLog()
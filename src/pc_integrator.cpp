@@ -1,10 +1,92 @@
 #include "pc_integrator.h"
 #include "camera_transform.h"
+#include "shader_common.h"
 #include "GL/glew.h"
 
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 
+#include <string>
+
+#define STRHELPER(x) #x
+#define TOSTR(x) STRHELPER(x)
+
+// dispatch indirect command for the integration followed by the voxel box it covers
+#define INTEGRATE_BOX_SIZE (4 * sizeof(GLuint) + 2 * 4 * sizeof(GLint))
+
+// both shaders are prefixed with the version and the IntegrationKernel defines, see PC_Integrator::SetKernel()
+static const char *bounds_shader_code =
+#include "glsl_common_grid.inl"
+#include "glsl_common_projection.inl"
+#include "glsl_common_pose.inl"
+R"glsl(
+
+layout(local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
+
+uniform float min_truncation;
+
+layout(std430, binding = 0) buffer depth_range_in
+{
+	uint max_depth_bits;
+};
+
+layout(std430, binding = 1) buffer integrate_box_out
+{
+	uint num_groups[3];
+	ivec4 box_min;
+	ivec4 box_max;
+};
+
+// Voxel space AABB of everything the integration shader can touch: the depth frustum from the camera
+// up to the largest depth in the frame, plus the truncation behind it.
+// The near side is not clipped, free space in front of the surfaces is integrated too.
+// Without a processed frame the depth range is unknown and the whole grid is covered.
+void main()
+{
+	float far = uintBitsToFloat(max_depth_bits) - min_truncation;
+
+	// the integration shader truncates projected coordinates, so anything in (-1, res + 1) may hit a pixel
+	vec2 image_min = vec2(-1.0);
+	vec2 image_max = vec2(camera_intrinsics.res) + 1.0;
+	vec3 corners[5] = vec3[](
+		vec3(0.0),
+		DeprojectImageToCamera(vec2(image_min.x, image_min.y), far),
+		DeprojectImageToCamera(vec2(image_max.x, image_min.y), far),
+		DeprojectImageToCamera(vec2(image_min.x, image_max.y), far),
+		DeprojectImageToCamera(vec2(image_max.x, image_max.y), far));
+
+	vec3 world_min = vec3(1.0 / 0.0);
+	vec3 world_max = vec3(-1.0 / 0.0);
+	for(int i=0; i<5; i++)
+	{
+		vec3 p = (camera_pose.transform * vec4(corners[i], 1.0)).xyz;
+		world_min = min(world_min, p);
+		world_max = max(world_max, p);
+	}
+
+	// voxel i is at origin + i * cell_size, one voxel of margin against rounding
+	ivec3 res = ivec3(grid_params.res);
+	ivec3 lo = clamp(ivec3(floor((world_min - grid_params.origin) / grid_params.cell_size)) - 1, ivec3(0), res);
+	ivec3 hi = clamp(ivec3(ceil((world_max - grid_params.origin) / grid_params.cell_size)) + 2, ivec3(0), res);
+	if(max_depth_bits == 0u)
+		hi = lo;
+	if(isinf(far))
+	{
+		lo = ivec3(0);
+		hi = res;
+	}
+
+	ivec3 size = max(hi - lo, ivec3(0));
+	ivec3 group_size = ivec3(LOCAL_SIZE_X, LOCAL_SIZE_Y, LOCAL_SIZE_Z * VOXELS_PER_INVOCATION);
+	uvec3 groups = uvec3((size + group_size - 1) / group_size);
+	num_groups[0] = groups.x;
+	num_groups[1] = groups.y;
+	num_groups[2] = groups.z;
+	box_min = ivec4(lo, 0);
+	box_max = ivec4(hi, 0);
+}
+)glsl";
+
 template<class T>
 Eigen::Matrix<T, 4, 4> PerspectiveMatrix(T fovy, T aspect, T near_clip, T far_clip)
 {
@@ -30,35 +112,72 @@ PC_Integrator::PC_Integrator(GLModel* glModel)
 
 	max_weight = 255;
 
-	this->computeHandle = genComputeProg();
+	computeHandle = 0;
+	bounds_program = 0;
+	SetKernel(IntegrationKernel());
+
+	glGenBuffers(1, &integrate_box_buffer);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, integrate_box_buffer);
+	glBufferStorage(GL_DISPATCH_INDIRECT_BUFFER, INTEGRATE_BOX_SIZE, nullptr, 0);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+	glObjectLabel(GL_BUFFER, integrate_box_buffer, -1, "PC_Integrator::integrate_box_buffer");
 }
 
 PC_Integrator::~PC_Integrator()
 {
+	glDeleteProgram(computeHandle);
+	glDeleteProgram(bounds_program);
+	glDeleteBuffers(1, &integrate_box_buffer);
+}
+
+void PC_Integrator::SetKernel(const IntegrationKernel &kernel)
+{
+	this->kernel = kernel;
+
+	std::string header = "#version 450 core\n";
+	header += "#define LOCAL_SIZE_X " + std::to_string(kernel.local_size_x) + "\n";
+	header += "#define LOCAL_SIZE_Y " + std::to_string(kernel.local_size_y) + "\n";
+	header += "#define LOCAL_SIZE_Z " + std::to_string(kernel.local_size_z) + "\n";
+	header += "#define VOXELS_PER_INVOCATION " + std::to_string(kernel.voxels_per_invocation) + "\n";
+	if(kernel.incremental_z)
+		header += "#define INCREMENTAL_Z\n";
+	if(glModel->GetPackedVoxels())
+		header += "#define PACKED_VOXELS\n#define PACKED_WEIGHT_SCALE " TOSTR(PACKED_WEIGHT_SCALE) "\n";
+
+	glDeleteProgram(computeHandle);
+	glDeleteProgram(bounds_program);
+
+	computeHandle = genComputeProg(header);
+	glObjectLabel(GL_PROGRAM, computeHandle, -1, "PC_Integrator::computeHandle");
+
+	bounds_program = CreateComputeShader((header + bounds_shader_code).c_str());
+	bounds_min_truncation_uniform = glGetUniformLocation(bounds_program, "min_truncation");
+	glObjectLabel(GL_PROGRAM, bounds_program, -1, "PC_Integrator::bounds_program");
 }
 
-GLuint PC_Integrator::genComputeProg()
+GLuint PC_Integrator::genComputeProg(const std::string &header)
 {
 	GLuint progHandle = glCreateProgram();
 	GLuint cs = glCreateShader(GL_COMPUTE_SHADER);
 
 	static const char *csSrc =
-		"#version 450 core\n"
 		#include "glsl_common_grid.inl"
 		#include "glsl_common_depth.inl"
 		#include "glsl_common_projection.inl"
+		#include "glsl_common_pose.inl"
 		R"glsl(
 
+	#ifdef PACKED_VOXELS
+		// tsdf and weight, see PackedVoxel
+		layout(rg16_snorm, binding = 0) uniform image3D  voxel_tex;
+	#else
 		layout(r32f, binding = 0) uniform image3D  tsdf_tex;
 		layout(r8ui, binding = 1) uniform uimage3D  weight_tex;
+	#endif
 		layout(rgba8, binding = 2) uniform image3D color_tex;
 		layout(binding = 0) uniform usampler2D depth_map;
 		layout(binding = 1) uniform sampler2D color_map;
 
-		uniform mat4 cam_modelview;
-		uniform vec3 cam_pos;
-		uniform vec3 cam_dir;
-
 		uniform float cellSize;
 		uniform float depth_scale;
 
@@ -68,21 +187,55 @@ GLuint PC_Integrator::genComputeProg()
 
 		uniform int activateColors;
 
-		layout (local_size_x = 1, local_size_y = 1, local_size_z=1) in;
+		// written by bounds_shader_code
+		layout(std430, binding = 0) buffer integrate_box_in
+		{
+			uint num_groups[3];
+			ivec4 box_min;
+			ivec4 box_max;
+		};
+
+		// A workgroup covers LOCAL_SIZE_X * LOCAL_SIZE_Y columns, LOCAL_SIZE_Z * VOXELS_PER_INVOCATION voxels deep.
+		// The voxels of one invocation are LOCAL_SIZE_Z apart, so neighboring invocations touch neighboring voxels.
+		layout (local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y, local_size_z = LOCAL_SIZE_Z) in;
 		void main() {
-			for(uint z=0; z<grid_params.res.z; z++)
+			ivec3 first_xyz = box_min.xyz + ivec3(gl_GlobalInvocationID.xy,
+					gl_WorkGroupID.z * LOCAL_SIZE_Z * VOXELS_PER_INVOCATION + gl_LocalInvocationID.z);
+			if(any(greaterThanEqual(first_xyz, box_max.xyz)))
+				return;
+
+			vec3 cam_pos = CameraPosition();
+			vec3 cam_dir = CameraDirection();
+			ivec2 depth_res = textureSize(depth_map, 0);
+
+		#ifdef INCREMENTAL_Z
+			vec4 v_g_next = vec4(GridToWorld(TexelToGrid(first_xyz)), 1.0);
+			vec4 v_next = camera_pose.modelview * v_g_next;
+			vec4 v_g_step = vec4(0.0, 0.0, grid_params.cell_size * LOCAL_SIZE_Z, 0.0);
+			vec4 v_step = camera_pose.modelview * v_g_step;
+		#endif
+
+			for(int i=0; i<VOXELS_PER_INVOCATION; i++)
 			{
-				ivec3 xyz = ivec3(gl_GlobalInvocationID.xy, z);
-
+				ivec3 xyz = first_xyz + ivec3(0, 0, i * LOCAL_SIZE_Z);
+				if(xyz.z >= box_max.z)
+					break;
+
+		#ifdef INCREMENTAL_Z
+				vec4 v_g = v_g_next;
+				vec4 v = v_next;
+				v_g_next += v_g_step;
+				v_next += v_step;
+		#else
 				vec3 gridPos = TexelToGrid(xyz);
 
 				vec4 v_g = vec4(GridToWorld(gridPos),1.0f);
 
-				vec4 v = cam_modelview * v_g;
+				vec4 v = camera_pose.modelview * v_g;
+		#endif
 
 				ivec2 p = ivec2(ProjectCameraToImage(v.xyz));
 
-				ivec2 depth_res = textureSize(depth_map, 0);
 				if( p.x < 0 || p.x > depth_res.x || p.y < 0 || p.y > depth_res.y || v.z > 0.0 )
 				{
 					continue;
@@ -107,8 +260,15 @@ GLuint PC_Integrator::genComputeProg()
 				
 				const int add_weight = 1;
 
-				uint w_last = imageLoad(weight_tex, xyz).x;
-				float tsdf_last = imageLoad(tsdf_tex, xyz).x;
+				ivec3 tex_xyz = TexelToTexture(xyz);
+		#ifdef PACKED_VOXELS
+				vec2 voxel_last = imageLoad(voxel_tex, tex_xyz).xy;
+				uint w_last = uint(round(voxel_last.y * PACKED_WEIGHT_SCALE));
+				float tsdf_last = voxel_last.x * grid_params.tsdf_scale;
+		#else
+				uint w_last = imageLoad(weight_tex, tex_xyz).x;
+				float tsdf_last = imageLoad(tsdf_tex, tex_xyz).x;
+		#endif
 
 				float tsdf_avg = (tsdf_last * w_last + tsdf * add_weight) / (w_last + add_weight);
 
@@ -133,19 +293,24 @@ GLuint PC_Integrator::genComputeProg()
 
 						float w = float(weight) / 255.0f;
 						color = vec4(color.xyz, w);
-						imageStore(color_tex, xyz, color);
+						imageStore(color_tex, tex_xyz, color);
 					}
 				}
 
 				uint w_now = min(max_weight, w_last + add_weight);
 
-				imageStore(tsdf_tex, xyz, vec4(tsdf_avg,0.0,0.0,0.0));
-				imageStore(weight_tex, xyz, uvec4(w_now,0.0,0.0,0.0));
+		#ifdef PACKED_VOXELS
+				imageStore(voxel_tex, tex_xyz, vec4(tsdf_avg / grid_params.tsdf_scale, float(w_now) / PACKED_WEIGHT_SCALE, 0.0, 0.0));
+		#else
+				imageStore(tsdf_tex, tex_xyz, vec4(tsdf_avg,0.0,0.0,0.0));
+				imageStore(weight_tex, tex_xyz, uvec4(w_now,0.0,0.0,0.0));
+		#endif
 			}
 		}		
 	    )glsl";
 
-	glShaderSource(cs, 1, &csSrc, NULL);
+	const char *sources[] = { header.c_str(), csSrc };
+	glShaderSource(cs, 2, sources, NULL);
 	glCompileShader(cs);
 	int rvalue;
 	glGetShaderiv(cs, GL_COMPILE_STATUS, &rvalue);
@@ -172,9 +337,6 @@ GLuint PC_Integrator::genComputeProg()
 	}
 	glUseProgram(progHandle);
 
-	cam_modelview_uniform = glGetUniformLocation(progHandle, "cam_modelview");
-	cam_pos_uniform = glGetUniformLocation(progHandle, "cam_pos");
-	cam_dir_uniform = glGetUniformLocation(progHandle, "cam_dir");
 	tsdf_tex_uniform = glGetUniformLocation(progHandle, "tsdf_tex");
 	weight_tex_uniform = glGetUniformLocation(progHandle, "weight_tex");
 	color_tex_uniform = glGetUniformLocation(progHandle, "color_tex");
@@ -192,6 +354,12 @@ GLuint PC_Integrator::genComputeProg()
 }
 
 void PC_Integrator::integrate(Frame *frame, CameraTransform *camera_transform)
+{
+	camera_pose.Upload(camera_transform->GetTransform());
+	integrate(frame, &camera_pose);
+}
+
+void PC_Integrator::integrate(Frame *frame, PoseBuffer *pose)
 {
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, frame->GetDepthTex());
@@ -199,32 +367,41 @@ void PC_Integrator::integrate(Frame *frame, CameraTransform *camera_transform)
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, frame->GetColorTex());
 
-	
-
-	Eigen::Vector3f cam_pos = camera_transform->GetTransform().translation();
-	Eigen::Vector3f cam_dir = camera_transform->GetTransform().rotation() * Eigen::Vector3f(0.0f, 0.0f, -1.0f);
-	cam_dir.normalize();
-	Eigen::Matrix4f modelview = camera_transform->GetModelView();
-
 	glUseProgram(this->computeHandle);
 
 	// UNIFORMS
-	glUniform3fv(cam_pos_uniform, 1, cam_pos.data());
-	glUniform3fv(cam_dir_uniform, 1, cam_dir.data());
-	glUniformMatrix4fv(cam_modelview_uniform, 1, GL_FALSE, modelview.data());
 	glUniform1f(depth_scale_uniform, frame->GetDepthScale());
 	glUniform1f(max_truncation_uniform, glModel->GetMaxTruncation());
 	glUniform1f(min_truncation_uniform, glModel->GetMinTruncation());
 	glUniform1ui(max_weight_uniform, max_weight);
 	glUniform1i(activateColors_uniform, this->glModel->GetColorsActive());
-	glBindImageTexture(0, glModel->GetTSDFTex(), 0, GL_TRUE, 0, GL_READ_WRITE, GL_R32F);
-	glBindImageTexture(1, glModel->GetWeightTex(), 0, GL_TRUE, 0, GL_READ_WRITE, GL_R8UI);
+	if(glModel->GetPackedVoxels())
+		glBindImageTexture(0, glModel->GetTSDFTex(), 0, GL_TRUE, 0, GL_READ_WRITE, GL_RG16_SNORM);
+	else
+	{
+		glBindImageTexture(0, glModel->GetTSDFTex(), 0, GL_TRUE, 0, GL_READ_WRITE, GL_R32F);
+		glBindImageTexture(1, glModel->GetWeightTex(), 0, GL_TRUE, 0, GL_READ_WRITE, GL_R8UI);
+	}
 	glBindImageTexture(2, glModel->GetColorTex(), 0, GL_TRUE, 0, GL_READ_WRITE, GL_RGBA8);
 	glBindBufferBase(GL_UNIFORM_BUFFER, 0, this->glModel->GetParamsBuffer());
 	glBindBufferBase(GL_UNIFORM_BUFFER, 1, frame->GetCameraIntrinsicsBuffer());
 	glBindBufferBase(GL_UNIFORM_BUFFER, 2, frame->GetCameraIntrinsicsColorBuffer());
+	glBindBufferBase(GL_UNIFORM_BUFFER, 3, pose->GetBuffer());
 
-	glDispatchCompute(resolutionX, resolutionY, 1);
+	// only the part of the volume inside the depth frustum is dispatched, the size is decided on the GPU
+	glUseProgram(bounds_program);
+	glUniform1f(bounds_min_truncation_uniform, glModel->GetMinTruncation());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, frame->GetDepthRangeBuffer());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, integrate_box_buffer);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_UNIFORM_BARRIER_BIT);
+	glDispatchCompute(1, 1, 1);
+
+	glUseProgram(this->computeHandle);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, integrate_box_buffer);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, integrate_box_buffer);
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+	glDispatchComputeIndirect(0);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
 
 }
 
@@ -0,0 +1,98 @@
+
+#include "pixel_upload_ring.h"
+
+#include <cstdint>
+
+// keeps every slot aligned for any pixel type
+#define PIXEL_UPLOAD_RING_ALIGNMENT 256
+
+PixelUploadRing::~PixelUploadRing()
+{
+	Release();
+}
+
+void PixelUploadRing::Release()
+{
+	for(auto &fence : fences)
+	{
+		if(fence)
+		{
+			glDeleteSync(fence);
+			fence = nullptr;
+		}
+	}
+
+	if(buffer)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
+	}
+
+	mapped = nullptr;
+	slot_size = 0;
+	mapped_slot_pending = false;
+}
+
+void PixelUploadRing::WaitForSlot(unsigned int slot)
+{
+	GLsync &fence = fences[slot];
+	if(!fence)
+		return;
+
+	GLenum result = glClientWaitSync(fence, 0, 0);
+	while(result == GL_TIMEOUT_EXPIRED)
+		result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+
+	glDeleteSync(fence);
+	fence = nullptr;
+}
+
+void *PixelUploadRing::Map(size_t size)
+{
+	size = (size + PIXEL_UPLOAD_RING_ALIGNMENT - 1) & ~(size_t)(PIXEL_UPLOAD_RING_ALIGNMENT - 1);
+
+	if(size > slot_size)
+	{
+		// the GPU may still read from the old buffer, wait for all slots before dropping it
+		for(unsigned int i=0; i<fences.size(); i++)
+			WaitForSlot(i);
+		Release();
+
+		slot_size = size;
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, slot_size * fences.size(), nullptr, flags);
+		mapped = static_cast<uint8_t *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, slot_size * fences.size(), flags));
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glObjectLabel(GL_BUFFER, buffer, -1, "PixelUploadRing::buffer");
+		current_slot = 0;
+	}
+	else if(mapped_slot_pending)
+	{
+		// the previously mapped slot was never uploaded, hand it out again
+		return mapped + current_slot * slot_size;
+	}
+	else
+		current_slot = (current_slot + 1) % fences.size();
+
+	WaitForSlot(current_slot);
+	mapped_slot_pending = true;
+	return mapped + current_slot * slot_size;
+}
+
+const void *PixelUploadRing::BeginUpload()
+{
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+	return reinterpret_cast<const void *>(current_slot * slot_size);
+}
+
+void PixelUploadRing::EndUpload()
+{
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	fences[current_slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	mapped_slot_pending = false;
+}
@@ -0,0 +1,193 @@
+
+#include "pose_buffer.h"
+#include "shader_common.h"
+
+#include <cstring>
+
+// see glsl_common_pose.inl
+#define POSE_ICP_STATE_OFFSET (16 + 16 + 4 + 4)
+#define POSE_FLOATS (POSE_ICP_STATE_OFFSET + 3 * POSE_ICP_LEVELS)
+#define POSE_SIZE (POSE_FLOATS * sizeof(float))
+
+static const char *transform_shader_code =
+"#version 450 core\n"
+#include "glsl_common_pose.inl"
+R"glsl(
+
+layout(local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
+
+uniform mat4 motion;
+
+layout(std430, binding = 2) buffer pose_out
+{
+	CameraPose pose;
+};
+
+void main()
+{
+	mat4 transform = pose.transform * motion;
+	mat3 rot_inv = transpose(mat3(transform));
+	pose.transform = transform;
+	pose.modelview = mat4(vec4(rot_inv[0], 0.0), vec4(rot_inv[1], 0.0), vec4(rot_inv[2], 0.0), vec4(-(rot_inv * transform[3].xyz), 1.0));
+}
+)glsl";
+
+PoseBuffer::PoseBuffer()
+{
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferStorage(GL_UNIFORM_BUFFER, POSE_SIZE, nullptr, GL_DYNAMIC_STORAGE_BIT);
+	glObjectLabel(GL_BUFFER, buffer, -1, "PoseBuffer::buffer");
+
+	GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &readback_buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, readback_buffer);
+	glBufferStorage(GL_COPY_WRITE_BUFFER, POSE_SIZE * POSE_READBACK_SLOTS, nullptr, flags);
+	readback_mapped = static_cast<const uint8_t *>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, POSE_SIZE * POSE_READBACK_SLOTS, flags));
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glObjectLabel(GL_BUFFER, readback_buffer, -1, "PoseBuffer::readback_buffer");
+
+	readback_next = 0;
+	readback_pending = 0;
+
+	Upload(Eigen::Affine3f::Identity());
+}
+
+PoseBuffer::~PoseBuffer()
+{
+	DropReadbacks();
+	glBindBuffer(GL_COPY_WRITE_BUFFER, readback_buffer);
+	glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glDeleteBuffers(1, &readback_buffer);
+	glDeleteBuffers(1, &buffer);
+	if(transform_program)
+		glDeleteProgram(transform_program);
+}
+
+void PoseBuffer::DropReadbacks()
+{
+	for(auto &fence : readback_fences)
+	{
+		if(fence)
+		{
+			glDeleteSync(fence);
+			fence = nullptr;
+		}
+	}
+	readback_pending = 0;
+}
+
+void PoseBuffer::Upload(const Eigen::Affine3f &transform)
+{
+	DropReadbacks();
+
+	float data[POSE_FLOATS] = {};
+	Eigen::Map<Eigen::Matrix4f> transform_data(data);
+	Eigen::Map<Eigen::Matrix4f> modelview_data(data + 16);
+	transform_data = transform.matrix();
+	modelview_data = transform.inverse().matrix();
+
+	// the pose may have been written by a shader before
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(data), data);
+}
+
+void PoseBuffer::ResetICPState()
+{
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glClearNamedBufferSubData(buffer, GL_R32UI, POSE_ICP_STATE_OFFSET * sizeof(float), (POSE_FLOATS - POSE_ICP_STATE_OFFSET) * sizeof(float),
+			GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+}
+
+void PoseBuffer::CopyFrom(PoseBuffer *other)
+{
+	DropReadbacks();
+
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glCopyNamedBufferSubData(other->buffer, buffer, 0, 0, POSE_SIZE);
+}
+
+void PoseBuffer::Transform(const Eigen::Affine3f &motion)
+{
+	if(!transform_program)
+	{
+		transform_program = CreateComputeShader(transform_shader_code);
+		transform_motion_uniform = glGetUniformLocation(transform_program, "motion");
+		glObjectLabel(GL_PROGRAM, transform_program, -1, "PoseBuffer::transform_program");
+	}
+
+	glUseProgram(transform_program);
+	glUniformMatrix4fv(transform_motion_uniform, 1, GL_FALSE, motion.matrix().data());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, buffer);
+
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	glDispatchCompute(1, 1, 1);
+	glMemoryBarrier(GL_UNIFORM_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void PoseBuffer::RequestReadback(uint64_t timestamp_us)
+{
+	unsigned int slot = readback_next;
+	if(readback_fences[slot])
+	{
+		// the CPU fell behind by POSE_READBACK_SLOTS frames, the oldest readback is overwritten
+		glDeleteSync(readback_fences[slot]);
+		readback_pending--;
+	}
+
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glCopyNamedBufferSubData(buffer, readback_buffer, 0, slot * POSE_SIZE, POSE_SIZE);
+	readback_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	readback_timestamps[slot] = timestamp_us;
+
+	readback_next = (readback_next + 1) % POSE_READBACK_SLOTS;
+	readback_pending++;
+}
+
+bool PoseBuffer::FetchReadback(PoseReadback *readback, bool wait)
+{
+	int newest = -1;
+	while(readback_pending > 0)
+	{
+		unsigned int slot = (readback_next + POSE_READBACK_SLOTS - readback_pending) % POSE_READBACK_SLOTS;
+		GLsync &fence = readback_fences[slot];
+
+		GLenum result = glClientWaitSync(fence, 0, 0);
+		if(wait)
+		{
+			while(result == GL_TIMEOUT_EXPIRED)
+				result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		}
+		if(result == GL_TIMEOUT_EXPIRED)
+			break;
+
+		glDeleteSync(fence);
+		fence = nullptr;
+		readback_pending--;
+		newest = static_cast<int>(slot);
+	}
+
+	if(newest < 0)
+		return false;
+
+	float data[POSE_FLOATS];
+	memcpy(data, readback_mapped + newest * POSE_SIZE, sizeof(data));
+	readback->timestamp_us = readback_timestamps[newest];
+	readback->transform.matrix() = Eigen::Map<Eigen::Matrix4f>(data);
+	readback->rot_delta = Eigen::Map<Eigen::Vector3f>(data + 32);
+	readback->translation_delta = Eigen::Map<Eigen::Vector3f>(data + 36);
+
+	const float *icp_state = data + POSE_ICP_STATE_OFFSET;
+	for(int level=0; level<POSE_ICP_LEVELS; level++)
+	{
+		uint32_t iterations, converged;
+		memcpy(&iterations, icp_state + POSE_ICP_LEVELS + level, sizeof(iterations));
+		memcpy(&converged, icp_state + 2 * POSE_ICP_LEVELS + level, sizeof(converged));
+		readback->icp_error[level] = icp_state[level];
+		readback->icp_iterations[level] = iterations;
+		readback->icp_converged[level] = converged != 0;
+	}
+	return true;
+}
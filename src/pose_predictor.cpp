@@ -0,0 +1,56 @@
+
+#include "pose_predictor.h"
+
+#include <algorithm>
+
+PosePredictor::PosePredictor(size_t history_size) :
+	history_size(std::max(history_size, (size_t)2))
+{
+}
+
+void PosePredictor::AddPose(uint64_t timestamp_us, const Eigen::Affine3f &transform)
+{
+	if(!history.empty() && timestamp_us == history.back().timestamp_us)
+		return;
+
+	// the input restarted, e.g. a replay looped or was rewound
+	if(!history.empty() && timestamp_us < history.back().timestamp_us)
+		history.clear();
+
+	// anything older than the gap would only average over a stall
+	if(!history.empty() && timestamp_us - history.back().timestamp_us > POSE_PREDICTOR_MAX_GAP_US)
+		history.clear();
+
+	history.push_back({ timestamp_us, transform });
+	while(history.size() > history_size)
+		history.pop_front();
+}
+
+Eigen::Affine3f PosePredictor::PredictMotion(uint64_t from_us, uint64_t to_us) const
+{
+	if(history.size() < 2 || to_us <= from_us || to_us - from_us > POSE_PREDICTOR_MAX_GAP_US)
+		return Eigen::Affine3f::Identity();
+
+	const Sample &oldest = history.front();
+	const Sample &newest = history.back();
+	float t = (float)(to_us - from_us) / (float)(newest.timestamp_us - oldest.timestamp_us);
+
+	// motion over the whole history, scaled to the requested duration,
+	// the rotation is slerped from the identity (extended to t > 1 by scaling the angle)
+	Eigen::Affine3f motion = oldest.transform.inverse() * newest.transform;
+	Eigen::AngleAxisf rot(motion.rotation());
+	rot.angle() *= t;
+
+	Eigen::Affine3f result = Eigen::Affine3f::Identity();
+	result.linear() = rot.toRotationMatrix();
+	result.translation() = motion.translation() * t;
+	return result;
+}
+
+Eigen::Affine3f PosePredictor::Predict(uint64_t timestamp_us) const
+{
+	if(history.empty())
+		return Eigen::Affine3f::Identity();
+	const Sample &newest = history.back();
+	return newest.transform * PredictMotion(newest.timestamp_us, timestamp_us);
+}
@@ -2,7 +2,9 @@
 #ifdef ENABLE_INPUT_REALSENSE
 #include "frame.h"
 #include "realsense_input.h"
+#include "sequence_input.h"
 
+#include <cstring>
 #include <iostream>
 
 RealSenseInput::RealSenseInput(const rs2::config &config)
@@ -24,11 +26,30 @@ RealSenseInput::RealSenseInput(const rs2::config &config)
 
 RealSenseInput::~RealSenseInput()
 {
+	StopRecording();
 	pipe.stop();
 }
 
+void RealSenseInput::StartRecording(const std::string &filename)
+{
+	StopRecording();
+	recorder = new SequenceWriter(filename, intrinsics.width, intrinsics.height, depth_scale,
+			Eigen::Vector2f(intrinsics.fx, intrinsics.fy), Eigen::Vector2f(intrinsics.ppx, intrinsics.ppy));
+	if(color_active)
+	{
+		recorder->SetColorFormat(IntrinsicsColor.width, IntrinsicsColor.height,
+				Eigen::Vector2f(IntrinsicsColor.fx, IntrinsicsColor.fy), Eigen::Vector2f(IntrinsicsColor.ppx, IntrinsicsColor.ppy));
+	}
+}
 
-bool RealSenseInput::WaitForFrame(Frame *frame)
+void RealSenseInput::StopRecording()
+{
+	delete recorder;
+	recorder = nullptr;
+}
+
+
+bool RealSenseInput::CaptureFrames(rs2::frame &depth_out, rs2::frame &color_out, uint64_t *timestamp_us)
 {
 	try
 	{
@@ -50,9 +71,9 @@ bool RealSenseInput::WaitForFrame(Frame *frame)
 			depth = temp_filter.process(depth);
 			
 		}
-		frame->SetDepthMap(depth.get_width(), depth.get_height(), (GLushort *)depth.get_data(), depth_scale,
-				Eigen::Vector2f(intrinsics.fx, intrinsics.fy), Eigen::Vector2f(intrinsics.ppx, intrinsics.ppy));
+		depth_out = depth;
 
+		const uint8_t *color_data = nullptr;
 		if (color_active)
 		{
 			auto color = frames.get_color_frame();
@@ -61,11 +82,22 @@ bool RealSenseInput::WaitForFrame(Frame *frame)
 				std::cerr << "Frame from RealSense has invalid stream type or format." << std::endl;
 				return false;
 			}
-			frame->SetColorMap(color.get_width(), color.get_height(), (GLushort *)color.get_data(),
-				Eigen::Vector2f(IntrinsicsColor.fx, IntrinsicsColor.fy), Eigen::Vector2f(IntrinsicsColor.ppx, IntrinsicsColor.ppy));
+			color_out = color;
+			color_data = (const uint8_t *)color.get_data();
+		}
+		else
+			color_out = rs2::frame();
+
+		*timestamp_us = static_cast<uint64_t>(frames.get_timestamp() * 1000.0);
+
+		if (recorder)
+		{
+			if (!recorder->WriteFrame(*timestamp_us, (const uint16_t *)depth.get_data(), color_data))
+			{
+				std::cerr << "Failed to write frame to sequence, stopping recording." << std::endl;
+				StopRecording();
+			}
 		}
-		
-		
 	}
 	catch(const rs2::error &e)
 	{
@@ -73,6 +105,30 @@ bool RealSenseInput::WaitForFrame(Frame *frame)
 		return false;
 	}
 
+	return true;
+}
+
+bool RealSenseInput::WaitForFrame(Frame *frame)
+{
+	rs2::frame depth_frame;
+	rs2::frame color_frame;
+	uint64_t timestamp_us;
+	if (!CaptureFrames(depth_frame, color_frame, &timestamp_us))
+		return false;
+
+	frame->SetTimestamp(timestamp_us);
+
+	rs2::video_frame depth(depth_frame);
+	frame->SetDepthMap(depth.get_width(), depth.get_height(), (GLushort *)depth.get_data(), depth_scale,
+			Eigen::Vector2f(intrinsics.fx, intrinsics.fy), Eigen::Vector2f(intrinsics.ppx, intrinsics.ppy));
+
+	if (color_frame)
+	{
+		rs2::video_frame color(color_frame);
+		frame->SetColorMap(color.get_width(), color.get_height(), (GLushort *)color.get_data(),
+			Eigen::Vector2f(IntrinsicsColor.fx, IntrinsicsColor.fy), Eigen::Vector2f(IntrinsicsColor.ppx, IntrinsicsColor.ppy));
+	}
+
 	/*auto color = frames.get_color_frame();
 	// For cameras that don't have RGB sensor, we'll map the pointcloud to infrared instead of color
 	if (!color)
@@ -86,6 +142,43 @@ bool RealSenseInput::WaitForFrame(Frame *frame)
 	return true;
 }
 
+bool RealSenseInput::GrabFrame(InputFrame *frame)
+{
+	rs2::frame depth_frame;
+	rs2::frame color_frame;
+	if (!CaptureFrames(depth_frame, color_frame, &frame->timestamp_us))
+		return false;
+
+	// librealsense recycles its frame memory, so the data is copied, into upload memory if the frame has some
+	rs2::video_frame depth(depth_frame);
+	frame->depth_width = depth.get_width();
+	frame->depth_height = depth.get_height();
+	frame->depth_scale = depth_scale;
+	frame->depth_focal_length = Eigen::Vector2f(intrinsics.fx, intrinsics.fy);
+	frame->depth_center = Eigen::Vector2f(intrinsics.ppx, intrinsics.ppy);
+	const size_t depth_count = (size_t)frame->depth_width * frame->depth_height;
+	uint16_t *depth_data = frame->WritableDepth(depth_count);
+	memcpy(depth_data, depth.get_data(), depth_count * sizeof(uint16_t));
+	frame->depth = depth_data;
+
+	if (color_frame)
+	{
+		rs2::video_frame color(color_frame);
+		frame->color_width = color.get_width();
+		frame->color_height = color.get_height();
+		frame->color_focal_length = Eigen::Vector2f(IntrinsicsColor.fx, IntrinsicsColor.fy);
+		frame->color_center = Eigen::Vector2f(IntrinsicsColor.ppx, IntrinsicsColor.ppy);
+		const size_t color_size = (size_t)frame->color_width * frame->color_height * 3;
+		uint8_t *color_data = frame->WritableColor(color_size);
+		memcpy(color_data, color.get_data(), color_size);
+		frame->color = color_data;
+	}
+	else
+		frame->color = nullptr;
+
+	return true;
+}
+
 
 /*void PointsToPCL(const rs2::points& points, pcl::PointCloud<pcl::PointXYZ>::Ptr &cloud);
 void PointsToPCL(const rs2::points& points, pcl::PointCloud<pcl::PointXYZ>::Ptr &cloud)
@@ -4,9 +4,11 @@
 #include "gl_model.h"
 #include "camera_transform.h"
 #include "frame.h"
+#include "shader_common.h"
 
 #include <stdio.h>
 #include <exception>
+#include <algorithm>
 
 #include <Eigen/Core>
 #include <Eigen/Geometry>
@@ -44,13 +46,16 @@ Eigen::Matrix4f CameraIntrinsicsMatrix(Eigen::Vector2f f, Eigen::Vector2f center
 
 #define ATTRIBUTE_VERTEX_POS 0
 
+#define STRHELPER(x) #x
+#define TOSTR(x) STRHELPER(x)
+
 static const char *vertex_shader_code =
 "#version 450 core\n"
 #include "glsl_common_grid.inl"
+#include "glsl_common_pose.inl"
 R"glsl(
 
-uniform mat4 mvp_matrix;
-uniform vec3 cam_pos;
+uniform mat4 projection_matrix;
 uniform int activate_colors;
 
 
@@ -62,22 +67,19 @@ out vec3 world_dir;
 void main()
 {
 	world_pos = (vertex_pos * 0.5 + 0.5) * GridExtent() + grid_params.origin;
-	world_dir = world_pos - cam_pos;
-	gl_Position = mvp_matrix * vec4(world_pos, 1.0);
+	world_dir = world_pos - CameraPosition();
+	gl_Position = projection_matrix * camera_pose.modelview * vec4(world_pos, 1.0);
 }
 )glsl";
 
 static const char *fragment_shader_code =
 "#version 450 core\n"
 #include "glsl_common_grid.inl"
+#include "glsl_common_pose.inl"
 R"glsl(
 layout(binding = 0) uniform sampler3D tsdf_tex;
 layout(binding = 1) uniform sampler3D color_grid_tex;
 
-uniform mat4 modelview_matrix;
-
-uniform vec3 cam_pos;
-
 uniform bool enable_color;
 uniform bool enable_lighting;
 
@@ -92,7 +94,7 @@ layout(location = 2) out vec3 normal_out;
 
 float SDF(vec3 grid_pos)
 {
-	return texture(tsdf_tex, grid_pos + drift_correction).x;
+	return texture(tsdf_tex, GridToTexture(grid_pos + drift_correction)).x * grid_params.tsdf_scale;
 }
 
 vec3 Normal(vec3 world_pos, float epsilon)
@@ -162,6 +164,7 @@ float RayBoxIntersection(vec3 origin, vec3 dir, in vec3 box_min, in vec3 box_max
 
 void main()
 {
+	vec3 cam_pos = CameraPosition();
 	float dist = RayBoxIntersection(cam_pos, world_dir, GridBoxWorldMin(), GridBoxWorldMax());
 	vec3 world_pos_cur = cam_pos + world_dir * max(dist, 0.0001);
 
@@ -171,7 +174,7 @@ void main()
 
 	vec3 color = vec3(1.0);
 	if(enable_color)
-		color = (texture(color_grid_tex, WorldToGrid(world_pos_cur), 0)).xyz;
+		color = (texture(color_grid_tex, GridToTexture(WorldToGrid(world_pos_cur)), 0)).xyz;
 
 	vec3 l = color;
 	if(enable_lighting)
@@ -190,9 +193,10 @@ void main()
 static const char *box_vertex_shader_code =
 "#version 450 core\n"
 #include "glsl_common_grid.inl"
+#include "glsl_common_pose.inl"
 R"glsl(
 
-uniform mat4 mvp_matrix;
+uniform mat4 projection_matrix;
 
 layout(location = 0) in vec3 vertex_pos;
 
@@ -202,7 +206,7 @@ void main()
 {
 	grid_pos = vertex_pos * 0.5 + 0.5;
 	vec3 world_pos = (grid_pos) * GridExtent() + grid_params.origin;
-	gl_Position = mvp_matrix * vec4(world_pos, 1.0);
+	gl_Position = projection_matrix * camera_pose.modelview * vec4(world_pos, 1.0);
 }
 )glsl";
 
@@ -229,6 +233,60 @@ void main()
 )glsl";
 
 
+static const char *downsample_shader_code =
+"#version 450 core\n"
+"#define MAX_DIFF " TOSTR(FRAME_PYRAMID_MAX_DIFF) "\n"
+R"glsl(
+
+layout(local_size_x = 16, local_size_y = 16, local_size_z = 1) in;
+
+uniform int level;
+
+layout(binding = 0) uniform sampler2D vertex_tex;
+layout(binding = 1) uniform sampler2D normal_tex;
+
+layout(rgba32f, binding = 0) uniform image2D vertex_out;
+layout(rgba32f, binding = 1) uniform image2D normal_out;
+
+// averages the vertices of a 2x2 block that are close to the first valid one, like the depth pyramid in Frame
+void main()
+{
+	ivec2 coords = ivec2(gl_GlobalInvocationID.xy);
+	if(any(greaterThanEqual(coords, imageSize(vertex_out))))
+		return;
+
+	ivec2 src_size = textureSize(vertex_tex, level - 1);
+	vec3 first = vec3(0.0);
+	vec3 vertex_sum = vec3(0.0);
+	vec3 normal_sum = vec3(0.0);
+	float count = 0.0;
+	for(int i=0; i<4; i++)
+	{
+		ivec2 c = min(coords * 2 + ivec2(i & 1, i >> 1), src_size - ivec2(1));
+		vec3 v = texelFetch(vertex_tex, c, level - 1).xyz;
+		if(isinf(v.x))
+			continue;
+		if(count == 0.0)
+			first = v;
+		else if(distance(v, first) > MAX_DIFF)
+			continue;
+		vertex_sum += v;
+		normal_sum += texelFetch(normal_tex, c, level - 1).xyz;
+		count += 1.0;
+	}
+
+	if(count == 0.0)
+	{
+		imageStore(vertex_out, coords, vec4(1.0 / 0.0));
+		imageStore(normal_out, coords, vec4(1.0 / 0.0));
+		return;
+	}
+
+	imageStore(vertex_out, coords, vec4(vertex_sum / count, 1.0));
+	imageStore(normal_out, coords, vec4(normalize(normal_sum), 1.0));
+}
+)glsl";
+
 Renderer::Renderer(Window *window)
 {
 	this->window = window;
@@ -241,6 +299,8 @@ Renderer::~Renderer()
 	glDeleteBuffers(1, &ibo);
 	glDeleteVertexArrays(1, &vao);
 	glDeleteProgram(program);
+	glDeleteProgram(box_program);
+	glDeleteProgram(downsample_program);
 	glDeleteFramebuffers(1, &fbo);
 	glDeleteTextures(1, &color_tex);
 	glDeleteTextures(1, &depth_tex);
@@ -328,9 +388,7 @@ void Renderer::InitResources()
 
 	glObjectLabel(GL_PROGRAM, program, -1, "Renderer::program");
 
-	mvp_matrix_uniform = glGetUniformLocation(program, "mvp_matrix");
-	modelview_matrix_uniform = glGetUniformLocation(program, "modelview_matrix");
-	cam_pos_uniform = glGetUniformLocation(program, "cam_pos");
+	projection_matrix_uniform = glGetUniformLocation(program, "projection_matrix");
 	tsdf_tex_uniform = glGetUniformLocation(program, "tsdf_tex");
 	enable_color_uniform = glGetUniformLocation(program, "enable_color");
 	enable_lighting_uniform = glGetUniformLocation(program, "enable_lighting");
@@ -372,7 +430,11 @@ void Renderer::InitResources()
 
 	glObjectLabel(GL_PROGRAM, box_program, -1, "Renderer::box_program");
 
-	box_mvp_matrix_uniform = glGetUniformLocation(box_program, "mvp_matrix");
+	box_projection_matrix_uniform = glGetUniformLocation(box_program, "projection_matrix");
+
+	downsample_program = CreateComputeShader(downsample_shader_code);
+	downsample_level_uniform = glGetUniformLocation(downsample_program, "level");
+	glObjectLabel(GL_PROGRAM, downsample_program, -1, "Renderer::downsample_program");
 
 	fbo_width = fbo_height = -1;
 	glCreateFramebuffers(1, &fbo);
@@ -390,7 +452,8 @@ void Renderer::InitResources()
 	glGenTextures(1, &vertex_tex);
 	glBindTexture(GL_TEXTURE_2D, vertex_tex);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, FRAME_PYRAMID_LEVELS - 1);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, vertex_tex, 0);
@@ -399,7 +462,8 @@ void Renderer::InitResources()
 	glGenTextures(1, &normal_tex);
 	glBindTexture(GL_TEXTURE_2D, normal_tex);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, FRAME_PYRAMID_LEVELS - 1);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, normal_tex, 0);
@@ -420,6 +484,12 @@ void Renderer::InitResources()
 }
 
 void Renderer::Render(GLModel *model, Frame *frame, CameraTransform *camera_transform)
+{
+	camera_pose.Upload(camera_transform->GetTransform());
+	Render(model, frame, &camera_pose);
+}
+
+void Renderer::Render(GLModel *model, Frame *frame, PoseBuffer *pose)
 {
 	int width = frame->GetDepthWidth();
 	int height = frame->GetDepthHeight();
@@ -430,10 +500,15 @@ void Renderer::Render(GLModel *model, Frame *frame, CameraTransform *camera_tran
 		fbo_height = height;
 		glBindTexture(GL_TEXTURE_2D, color_tex);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
-		glBindTexture(GL_TEXTURE_2D, vertex_tex);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
-		glBindTexture(GL_TEXTURE_2D, normal_tex);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, width, height, 0, GL_RGB, GL_FLOAT, nullptr);
+		for(int level=0; level<FRAME_PYRAMID_LEVELS; level++)
+		{
+			int level_width = std::max(1, width >> level);
+			int level_height = std::max(1, height >> level);
+			glBindTexture(GL_TEXTURE_2D, vertex_tex);
+			glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA32F, level_width, level_height, 0, GL_RGBA, GL_FLOAT, nullptr);
+			glBindTexture(GL_TEXTURE_2D, normal_tex);
+			glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA32F, level_width, level_height, 0, GL_RGBA, GL_FLOAT, nullptr);
+		}
 		glBindTexture(GL_TEXTURE_2D, depth_tex);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
 	}
@@ -476,8 +551,6 @@ void Renderer::Render(GLModel *model, Frame *frame, CameraTransform *camera_tran
 	glClearColor(0.0, 0.0, 0.0, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	Eigen::Vector3f cam_pos = camera_transform->GetTransform().translation();
-	modelview_matrix = camera_transform->GetModelView();
 	projection_matrix = CameraIntrinsicsMatrix(
 			frame->GetIntrinsicsFocalLength(),
 			frame->GetIntrinsicsCenter(),
@@ -485,7 +558,6 @@ void Renderer::Render(GLModel *model, Frame *frame, CameraTransform *camera_tran
 			0.1f, 100.0f);
 	//projection = PerspectiveMatrix<float>(80.0f, (float)width / (float)height, 0.1f, 100.0f);
 	//std::cout << "projection:\n" << projection << std::endl;
-	Eigen::Matrix4f mvp_matrix = projection_matrix * modelview_matrix;
 
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_FRONT);
@@ -496,18 +568,17 @@ void Renderer::Render(GLModel *model, Frame *frame, CameraTransform *camera_tran
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
 	glBindBufferBase(GL_UNIFORM_BUFFER, 0, model->GetParamsBuffer());
 	glBindBufferBase(GL_UNIFORM_BUFFER, 1, frame->GetCameraIntrinsicsBuffer());
+	glBindBufferBase(GL_UNIFORM_BUFFER, 3, pose->GetBuffer());
 
 	glUseProgram(box_program);
-	glUniformMatrix4fv(box_mvp_matrix_uniform, 1, GL_FALSE, mvp_matrix.data());
+	glUniformMatrix4fv(box_projection_matrix_uniform, 1, GL_FALSE, projection_matrix.data());
 	glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, nullptr);
 
 	GLenum draw_buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
 	glDrawBuffers(3, draw_buffers);
 
 	glUseProgram(program);
-	glUniformMatrix4fv(mvp_matrix_uniform, 1, GL_FALSE, mvp_matrix.data());
-	glUniformMatrix4fv(modelview_matrix_uniform, 1, GL_FALSE, modelview_matrix.data());
-	glUniform3fv(cam_pos_uniform, 1, cam_pos.data());
+	glUniformMatrix4fv(projection_matrix_uniform, 1, GL_FALSE, projection_matrix.data());
 	glUniform1i(enable_color_uniform, enable_color);
 	glUniform1i(enable_lighting_uniform, enable_lighting);
 
@@ -523,6 +594,9 @@ void Renderer::Render(GLModel *model, Frame *frame, CameraTransform *camera_tran
 	}
 	glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, nullptr);
 
+	DownsamplePrediction();
+	prediction_pose.CopyFrom(pose);
+
 	glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
 	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 	glReadBuffer(GL_COLOR_ATTACHMENT0);
@@ -550,3 +624,24 @@ void Renderer::Render(GLModel *model, Frame *frame, CameraTransform *camera_tran
 	glViewport(0, 0, window_width, window_height);
 }
 
+void Renderer::DownsamplePrediction()
+{
+	glUseProgram(downsample_program);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, vertex_tex);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, normal_tex);
+
+	for(int level=1; level<FRAME_PYRAMID_LEVELS; level++)
+	{
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+		glUniform1i(downsample_level_uniform, level);
+		glBindImageTexture(0, vertex_tex, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+		glBindImageTexture(1, normal_tex, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+		glDispatchCompute(
+				(static_cast<GLuint>(std::max(1, fbo_width >> level)) + 15) / 16,
+				(static_cast<GLuint>(std::max(1, fbo_height >> level)) + 15) / 16,
+				1);
+	}
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
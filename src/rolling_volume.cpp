@@ -0,0 +1,322 @@
+
+#include "rolling_volume.h"
+#include "marching_cubes.h"
+#include "gl_marching_cubes.h"
+#include "mesh_writer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+RollingVolume::RollingVolume(GLModel *model, float threshold) :
+	model(model),
+	threshold(threshold),
+	running(true),
+	busy(false),
+	spool(std::tmpfile()),
+	spool_error(false),
+	triangle_count(0)
+{
+	worker = std::thread(&RollingVolume::WorkerLoop, this);
+}
+
+RollingVolume::~RollingVolume()
+{
+	for(auto &readback : readbacks)
+	{
+		glDeleteSync(readback.fence);
+		glDeleteBuffers(1, &readback.buffer);
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		running = false;
+	}
+	cond.notify_all();
+	worker.join();
+
+	for(auto slab : slabs)
+		delete slab;
+	if(spool)
+		std::fclose(spool);
+}
+
+size_t RollingVolume::VoxelSize()
+{
+	return model->GetPackedVoxels() ? sizeof(PackedVoxel) : sizeof(float) + 1;
+}
+
+bool RollingVolume::Update(const Eigen::Vector3f &camera_position)
+{
+	const float cell_size = model->GetCellSize();
+	const Eigen::Vector3f res((float)model->GetResolutionX(), (float)model->GetResolutionY(), (float)model->GetResolutionZ());
+	const Eigen::Vector3f center = model->GetModelOrigin() + res * cell_size * 0.5f;
+	const Eigen::Vector3f delta = camera_position - center;
+
+	bool shifted = false;
+	for(int axis=0; axis<3; axis++)
+	{
+		if(std::abs(delta[axis]) <= threshold)
+			continue;
+		int voxels = (int)std::lround(delta[axis] / cell_size);
+		if(voxels == 0)
+			continue;
+		ShiftAxis(axis, voxels);
+		shifted = true;
+	}
+	return shifted;
+}
+
+void RollingVolume::ShiftAxis(int axis, int voxels)
+{
+	const Eigen::Vector3i res(model->GetResolutionX(), model->GetResolutionY(), model->GetResolutionZ());
+	const int count = std::min(std::abs(voxels), res[axis]);
+
+	// The leaving slices are read back together with the first slice that stays,
+	// so the cells between them are meshed now and the rest of the volume doesn't overlap.
+	Eigen::Vector3i begin = Eigen::Vector3i::Zero();
+	Eigen::Vector3i end = res;
+	if(voxels > 0)
+		end[axis] = std::min(count + 1, res[axis]);
+	else
+		begin[axis] = std::max(res[axis] - count - 1, 0);
+
+	Readback readback;
+	readback.size = end - begin;
+	readback.origin = model->GetModelOrigin() + begin.cast<float>() * model->GetCellSize();
+
+	const size_t slab_voxels = (size_t)readback.size.x() * readback.size.y() * readback.size.z();
+	const size_t voxel_bytes = slab_voxels * VoxelSize();
+	const size_t bytes = voxel_bytes + (model->GetColorsActive() ? slab_voxels * 4 : 0);
+	glGenBuffers(1, &readback.buffer);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+	glBufferStorage(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_MAP_READ_BIT);
+	glObjectLabel(GL_BUFFER, readback.buffer, -1, "RollingVolume::readback.buffer");
+	uint8_t *offset = nullptr;
+	uint8_t *color = model->GetColorsActive() ? offset + voxel_bytes : nullptr;
+	if(model->GetPackedVoxels())
+		model->ReadPackedVoxels(begin, end, reinterpret_cast<PackedVoxel *>(offset), color);
+	else
+		model->ReadVoxels(begin, end, reinterpret_cast<float *>(offset), offset + slab_voxels * sizeof(float), color);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	readbacks.push_back(readback);
+
+	// the texels of the leaving slices become the new slices on the other side
+	Eigen::Vector3i shift = Eigen::Vector3i::Zero();
+	shift[axis] = voxels;
+	model->Shift(shift);
+
+	Eigen::Vector3i clear_begin = Eigen::Vector3i::Zero();
+	Eigen::Vector3i clear_end = res;
+	if(voxels > 0)
+		clear_begin[axis] = res[axis] - count;
+	else
+		clear_end[axis] = count;
+	model->ClearVoxels(clear_begin, clear_end);
+}
+
+void RollingVolume::Poll()
+{
+	while(!readbacks.empty())
+	{
+		GLenum result = glClientWaitSync(readbacks.front().fence, 0, 0);
+		if(result == GL_TIMEOUT_EXPIRED)
+			break;
+		FinishReadback(readbacks.front());
+		readbacks.pop_front();
+	}
+}
+
+void RollingVolume::FinishReadback(const Readback &readback)
+{
+	glDeleteSync(readback.fence);
+
+	CPUModel *slab = new CPUModel(readback.size.x(), readback.size.y(), readback.size.z(), model->GetCellSize(),
+			model->GetMaxTruncation(), model->GetMinTruncation(), readback.origin, model->GetColorsActive());
+
+	const size_t slab_voxels = (size_t)readback.size.x() * readback.size.y() * readback.size.z();
+	const size_t voxel_bytes = slab_voxels * VoxelSize();
+	const size_t bytes = voxel_bytes + (model->GetColorsActive() ? slab_voxels * 4 : 0);
+	const uint8_t *mapped = static_cast<const uint8_t *>(glMapNamedBufferRange(readback.buffer, 0, bytes, GL_MAP_READ_BIT));
+	if(model->GetPackedVoxels())
+		slab->Unpack(reinterpret_cast<const PackedVoxel *>(mapped));
+	else
+	{
+		memcpy(slab->GetData(), mapped, slab_voxels * sizeof(float));
+		memcpy(slab->GetWeights(), mapped + slab_voxels * sizeof(float), slab_voxels);
+		slab->UpdateSummary();
+	}
+	if(model->GetColorsActive())
+		memcpy(slab->GetColor(), mapped + voxel_bytes, slab_voxels * 4);
+	glUnmapNamedBuffer(readback.buffer);
+	glDeleteBuffers(1, &readback.buffer);
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		slabs.push_back(slab);
+	}
+	cond.notify_all();
+}
+
+void RollingVolume::WorkerLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while(true)
+	{
+		cond.wait(lock, [this] { return !running || !slabs.empty(); });
+		if(!running)
+			return;
+
+		CPUModel *slab = slabs.front();
+		slabs.pop_front();
+		busy = true;
+		lock.unlock();
+
+		Mesh slab_mesh;
+		ExtractMesh(slab, &slab_mesh);
+		delete slab;
+
+		if(!SpoolMesh(slab_mesh))
+			spool_error = true;
+
+		lock.lock();
+		triangle_count += slab_mesh.GetTriangles().size();
+		busy = false;
+		cond.notify_all();
+	}
+}
+
+void RollingVolume::ExtractMesh(CPUModel *slab, Mesh *out)
+{
+	// Cells with a corner that was never observed are skipped like in Marching_Cubes::ProcessHashBlock(),
+	// otherwise the cleared voxels next to a slab that was already extracted would close the surface there.
+	Marching_Cubes mc(slab);
+	mc.ExtractMesh(0.0, out, true);
+
+	// marching cubes works in grid space
+	for(auto &v : out->GetVertices())
+		v = slab->GridToWorld(v);
+}
+
+bool RollingVolume::SpoolMesh(Mesh &slab_mesh)
+{
+	const std::vector<Vertex> &vertices = slab_mesh.GetVertices();
+	const std::vector<Triangle> &triangles = slab_mesh.GetTriangles();
+	if(!spool)
+		return false;
+	if(triangles.empty())
+		return true;
+
+	const uint32_t counts[2] = { (uint32_t)vertices.size(), (uint32_t)triangles.size() };
+	std::vector<uint32_t> records(triangles.size() * 6);
+	for(size_t i=0; i<triangles.size(); i++)
+	{
+		const Triangle &t = triangles[i];
+		const uint32_t record[6] = { t.idx0, t.idx1, t.idx2, (uint32_t)t.color[0], (uint32_t)t.color[1], (uint32_t)t.color[2] };
+		memcpy(&records[i * 6], record, sizeof(record));
+	}
+	return std::fwrite(counts, sizeof(counts), 1, spool) == 1
+		&& std::fwrite(vertices.data(), sizeof(Vertex), vertices.size(), spool) == vertices.size()
+		&& std::fwrite(records.data(), sizeof(uint32_t), records.size(), spool) == records.size();
+}
+
+bool RollingVolume::ReplaySpool(MeshWriter *writer)
+{
+	if(!spool || spool_error || std::fflush(spool) != 0)
+		return false;
+
+	const long end = std::ftell(spool);
+	std::rewind(spool);
+	bool ok = true;
+	Mesh chunk;
+	std::vector<uint32_t> records;
+	std::vector<unsigned int> indices;
+	while(ok && std::ftell(spool) < end)
+	{
+		uint32_t counts[2];
+		ok = std::fread(counts, sizeof(counts), 1, spool) == 1;
+		if(!ok)
+			break;
+
+		chunk.Clear();
+		chunk.GetVertices().resize(counts[0]);
+		records.resize((size_t)counts[1] * 6);
+		ok = std::fread(chunk.GetVertices().data(), sizeof(Vertex), counts[0], spool) == counts[0]
+			&& std::fread(records.data(), sizeof(uint32_t), records.size(), spool) == records.size();
+		if(!ok)
+			break;
+		chunk.GetTriangles().reserve(counts[1]);
+		for(size_t i=0; i<counts[1]; i++)
+		{
+			const uint32_t *record = &records[i * 6];
+			int color[3] = { (int)record[3], (int)record[4], (int)record[5] };
+			chunk.AddFace(record[0], record[1], record[2], color);
+		}
+
+		// every slab has its own vertices
+		indices.resize(counts[0]);
+		for(size_t i=0; i<indices.size(); i++)
+			indices[i] = (unsigned int)(writer->GetVertexCount() + i);
+		ok = writer->WriteChunk(chunk, indices);
+	}
+
+	// the worker appends at the end again
+	std::fseek(spool, 0, SEEK_END);
+	return ok;
+}
+
+void RollingVolume::Flush()
+{
+	for(auto &readback : readbacks)
+	{
+		GLenum result = glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		while(result == GL_TIMEOUT_EXPIRED)
+			result = glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		FinishReadback(readback);
+	}
+	readbacks.clear();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	cond.wait(lock, [this] { return slabs.empty() && !busy; });
+}
+
+void RollingVolume::Reset()
+{
+	Flush();
+	if(spool)
+		std::fclose(spool);
+	spool = std::tmpfile();
+	spool_error = false;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	triangle_count = 0;
+}
+
+size_t RollingVolume::GetPendingSlabs()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	return readbacks.size() + slabs.size() + (busy ? 1 : 0);
+}
+
+size_t RollingVolume::GetTriangleCount()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	return triangle_count;
+}
+
+bool RollingVolume::ExportMesh(const std::string &filename)
+{
+	Flush();
+
+	MeshWriter writer(filename, model->GetColorsActive());
+	bool ok = writer.Begin() && ReplaySpool(&writer);
+
+	// the current volume is meshed on the GPU, skipping unobserved cells like ExtractMesh()
+	if(ok)
+	{
+		GLMarchingCubes mc(model);
+		mc.StreamMesh(0.0, &writer, true);
+	}
+	return writer.Close() && ok;
+}
@@ -0,0 +1,295 @@
+
+#include "frame.h"
+#include "sequence_input.h"
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+SequenceInput::SequenceInput(const std::string &filename)
+{
+#ifdef _WIN32
+	file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if(file_handle == INVALID_HANDLE_VALUE)
+	{
+		file_handle = nullptr;
+		throw std::runtime_error("Failed to open sequence " + filename);
+	}
+	LARGE_INTEGER size;
+	GetFileSizeEx(file_handle, &size);
+	data_size = static_cast<size_t>(size.QuadPart);
+	mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if(mapping_handle)
+		data = static_cast<const uint8_t *>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+#else
+	fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error("Failed to open sequence " + filename);
+	struct stat st;
+	fstat(fd, &st);
+	data_size = static_cast<size_t>(st.st_size);
+	void *ptr = mmap(nullptr, data_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(ptr != MAP_FAILED)
+	{
+		data = static_cast<const uint8_t *>(ptr);
+		// frames are consumed front to back, let the kernel read ahead
+		madvise(ptr, data_size, MADV_SEQUENTIAL);
+	}
+#endif
+
+	if(!data)
+	{
+		Unmap();
+		throw std::runtime_error("Failed to map sequence " + filename);
+	}
+
+	if(data_size < sizeof(SequenceHeader))
+	{
+		Unmap();
+		throw std::runtime_error("Sequence " + filename + " is truncated.");
+	}
+
+	memcpy(&header, data, sizeof(header));
+	if(memcmp(header.magic, SEQUENCE_MAGIC, sizeof(header.magic)) != 0 || header.version != SEQUENCE_VERSION)
+	{
+		Unmap();
+		throw std::runtime_error("File " + filename + " is not a supported sequence.");
+	}
+
+	size_t frames_available = (data_size - sizeof(SequenceHeader)) / header.FrameStride();
+	if(frames_available < header.frame_count)
+	{
+		std::cerr << "Sequence " << filename << " is truncated, replaying "
+			<< frames_available << " of " << header.frame_count << " frames." << std::endl;
+		header.frame_count = static_cast<uint32_t>(frames_available);
+	}
+}
+
+SequenceInput::~SequenceInput()
+{
+	Unmap();
+}
+
+void SequenceInput::Unmap()
+{
+#ifdef _WIN32
+	if(data)
+		UnmapViewOfFile(data);
+	if(mapping_handle)
+		CloseHandle(mapping_handle);
+	if(file_handle)
+		CloseHandle(file_handle);
+	mapping_handle = nullptr;
+	file_handle = nullptr;
+#else
+	if(data)
+		munmap(const_cast<uint8_t *>(data), data_size);
+	if(fd >= 0)
+		close(fd);
+	fd = -1;
+#endif
+	data = nullptr;
+}
+
+void SequenceInput::SetRealtime(bool v)
+{
+	std::lock_guard<std::mutex> lock(playback_mutex);
+	realtime = v;
+	playback_started = false;
+}
+
+void SequenceInput::Rewind()
+{
+	std::lock_guard<std::mutex> lock(playback_mutex);
+	current_frame = 0;
+	playback_started = false;
+}
+
+const uint8_t *SequenceInput::NextRecord(uint64_t *timestamp)
+{
+	const uint8_t *record;
+	bool wait = false;
+	clock::time_point due;
+	{
+		std::lock_guard<std::mutex> lock(playback_mutex);
+		if(current_frame >= header.frame_count)
+		{
+			if(!loop || header.frame_count == 0)
+				return nullptr;
+			current_frame = 0;
+			playback_started = false;
+		}
+
+		record = data + sizeof(SequenceHeader) + current_frame * header.FrameStride();
+		memcpy(timestamp, record, sizeof(*timestamp));
+
+		if(realtime)
+		{
+			if(!playback_started || *timestamp < playback_start_timestamp)
+			{
+				playback_started = true;
+				playback_start = clock::now();
+				playback_start_timestamp = *timestamp;
+			}
+			else
+			{
+				wait = true;
+				due = playback_start + std::chrono::microseconds(*timestamp - playback_start_timestamp);
+			}
+		}
+
+		current_frame++;
+	}
+
+	// without the lock, so the GUI isn't blocked meanwhile
+	if(wait)
+		std::this_thread::sleep_until(due);
+	return record;
+}
+
+bool SequenceInput::WaitForFrame(Frame *frame)
+{
+	uint64_t timestamp;
+	const uint8_t *record = NextRecord(&timestamp);
+	if(!record)
+		return false;
+
+	frame->SetTimestamp(timestamp);
+
+	// copied once from the mapping into the upload buffer of the frame
+	const uint8_t *depth = record + sizeof(uint64_t);
+	frame->SetDepthMap(header.depth_width, header.depth_height, (GLushort *)depth, header.depth_scale,
+			Eigen::Vector2f(header.depth_fx, header.depth_fy), Eigen::Vector2f(header.depth_ppx, header.depth_ppy));
+
+	if(color_active)
+	{
+		const uint8_t *color = depth + header.DepthSize();
+		frame->SetColorMap(header.color_width, header.color_height, (GLushort *)color,
+				Eigen::Vector2f(header.color_fx, header.color_fy), Eigen::Vector2f(header.color_ppx, header.color_ppy));
+	}
+
+	return true;
+}
+
+bool SequenceInput::GrabFrame(InputFrame *frame)
+{
+	uint64_t timestamp;
+	const uint8_t *record = NextRecord(&timestamp);
+	if(!record)
+		return false;
+
+	// The mapping stays valid for the lifetime of this input, so the frame can point right into it.
+	// Upload memory given by the frame is filled here instead, which keeps the copy off the consumer's thread.
+	frame->timestamp_us = timestamp;
+	frame->depth_width = header.depth_width;
+	frame->depth_height = header.depth_height;
+	frame->depth_scale = header.depth_scale;
+	frame->depth_focal_length = Eigen::Vector2f(header.depth_fx, header.depth_fy);
+	frame->depth_center = Eigen::Vector2f(header.depth_ppx, header.depth_ppy);
+	frame->depth = (const uint16_t *)(record + sizeof(uint64_t));
+	if(frame->depth_buffer && header.DepthSize() <= frame->depth_buffer_size)
+	{
+		memcpy(frame->depth_buffer, frame->depth, header.DepthSize());
+		frame->depth = frame->depth_buffer;
+	}
+
+	if(color_active)
+	{
+		frame->color_width = header.color_width;
+		frame->color_height = header.color_height;
+		frame->color_focal_length = Eigen::Vector2f(header.color_fx, header.color_fy);
+		frame->color_center = Eigen::Vector2f(header.color_ppx, header.color_ppy);
+		frame->color = record + sizeof(uint64_t) + header.DepthSize();
+		if(frame->color_buffer && header.ColorSize() <= frame->color_buffer_size)
+		{
+			memcpy(frame->color_buffer, frame->color, header.ColorSize());
+			frame->color = frame->color_buffer;
+		}
+	}
+	else
+		frame->color = nullptr;
+
+	return true;
+}
+
+SequenceWriter::SequenceWriter(const std::string &filename, int depth_width, int depth_height, float depth_scale,
+		const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center)
+{
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SEQUENCE_MAGIC, sizeof(header.magic));
+	header.version = SEQUENCE_VERSION;
+	header.depth_width = static_cast<uint32_t>(depth_width);
+	header.depth_height = static_cast<uint32_t>(depth_height);
+	header.depth_scale = depth_scale;
+	header.depth_fx = focal_length.x();
+	header.depth_fy = focal_length.y();
+	header.depth_ppx = center.x();
+	header.depth_ppy = center.y();
+
+	file = fopen(filename.c_str(), "wb");
+	if(!file)
+		throw std::runtime_error("Failed to create sequence " + filename);
+	fwrite(&header, sizeof(header), 1, file);
+}
+
+SequenceWriter::~SequenceWriter()
+{
+	// patch the final frame count into the header
+	fseek(file, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, file);
+	fclose(file);
+}
+
+void SequenceWriter::SetColorFormat(int width, int height, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center)
+{
+	if(header.frame_count > 0)
+		throw std::logic_error("The color format of a sequence must be set before writing frames.");
+
+	header.color_width = static_cast<uint32_t>(width);
+	header.color_height = static_cast<uint32_t>(height);
+	header.color_fx = focal_length.x();
+	header.color_fy = focal_length.y();
+	header.color_ppx = center.x();
+	header.color_ppy = center.y();
+}
+
+bool SequenceWriter::WriteFrame(uint64_t timestamp_us, const uint16_t *depth, const uint8_t *color)
+{
+	static const uint8_t padding[8] = {};
+
+	size_t written = fwrite(&timestamp_us, sizeof(timestamp_us), 1, file);
+	written += fwrite(depth, header.DepthSize(), 1, file);
+	size_t expected = 2;
+	if(header.ColorSize() > 0)
+	{
+		if(color)
+			written += fwrite(color, header.ColorSize(), 1, file);
+		else
+		{
+			// keep the stride intact if a color frame is missing
+			for(size_t i=0; i<header.ColorSize(); i++)
+				fputc(0, file);
+			written++;
+		}
+		expected++;
+	}
+	size_t padding_size = header.FrameStride() - (sizeof(uint64_t) + header.DepthSize() + header.ColorSize());
+	if(padding_size > 0)
+		fwrite(padding, padding_size, 1, file);
+
+	if(written != expected)
+		return false;
+
+	header.frame_count++;
+	return true;
+}
@@ -0,0 +1,89 @@
+
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned int thread_count)
+	: job_next(0)
+{
+	if(thread_count == 0)
+		thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+	for(unsigned int i=1; i<thread_count; i++)
+		workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		terminate = true;
+	}
+	job_available.notify_all();
+	for(auto &worker : workers)
+		worker.join();
+}
+
+void ThreadPool::WorkerLoop(unsigned int thread_index)
+{
+	uint64_t generation_seen = 0;
+	while(true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			job_available.wait(lock, [&] { return terminate || job_generation != generation_seen; });
+			if(terminate)
+				return;
+			generation_seen = job_generation;
+		}
+
+		RunChunks(thread_index);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			workers_busy--;
+		}
+		job_done.notify_one();
+	}
+}
+
+void ThreadPool::RunChunks(unsigned int thread_index)
+{
+	while(true)
+	{
+		int chunk_begin = job_next.fetch_add(job_grain);
+		if(chunk_begin >= job_end)
+			return;
+		(*job_func)(chunk_begin, std::min(chunk_begin + job_grain, job_end), thread_index);
+	}
+}
+
+void ThreadPool::ParallelFor(int begin, int end, int grain, const RangeFunc &func)
+{
+	if(end <= begin)
+		return;
+	grain = std::max(grain, 1);
+
+	if(workers.empty() || end - begin <= grain)
+	{
+		func(begin, end, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job_func = &func;
+		job_end = end;
+		job_grain = grain;
+		job_next = begin;
+		workers_busy = static_cast<unsigned int>(workers.size());
+		job_generation++;
+	}
+	job_available.notify_all();
+
+	RunChunks(0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	job_done.wait(lock, [&] { return workers_busy == 0; });
+	job_func = nullptr;
+}
@@ -0,0 +1,323 @@
+
+#include "voxel_hash_model.h"
+#include "cpu_frame.h"
+#include "camera_transform.h"
+#include "thread_pool.h"
+#include "brick_store.h"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+
+// rows per thread pool chunk
+#define VOXEL_HASH_ROW_GRAIN 8
+
+// fraction of the pool evicted at once when it is full
+#define VOXEL_HASH_EVICT_DIVISOR 8
+
+VoxelHashModel::VoxelHashModel(float cell_size, float max_truncation, float min_truncation, bool colors_active, int max_blocks, ThreadPool *thread_pool) :
+	thread_pool(thread_pool),
+	brick_store(nullptr),
+	cell_size(cell_size),
+	max_truncation(max_truncation),
+	min_truncation(min_truncation),
+	colors_active(colors_active),
+	max_blocks(max_blocks),
+	allocation_count(0)
+{
+}
+
+void VoxelHashModel::Reset()
+{
+	blocks.clear();
+	block_coords.clear();
+	free_blocks.clear();
+	last_used.clear();
+	tsdf.clear();
+	weights.clear();
+	color.clear();
+}
+
+size_t VoxelHashModel::GetMemorySize()
+{
+	return tsdf.capacity() * sizeof(float) + weights.capacity() + color.capacity() + block_coords.capacity() * sizeof(Eigen::Vector3i);
+}
+
+Eigen::Vector3i VoxelHashModel::VoxelToBlock(const Eigen::Vector3i &voxel)
+{
+	// rounds towards negative infinity
+	return Eigen::Vector3i(
+			voxel.x() >= 0 ? voxel.x() / VOXEL_BLOCK_SIZE : (voxel.x() + 1) / VOXEL_BLOCK_SIZE - 1,
+			voxel.y() >= 0 ? voxel.y() / VOXEL_BLOCK_SIZE : (voxel.y() + 1) / VOXEL_BLOCK_SIZE - 1,
+			voxel.z() >= 0 ? voxel.z() / VOXEL_BLOCK_SIZE : (voxel.z() + 1) / VOXEL_BLOCK_SIZE - 1);
+}
+
+int VoxelHashModel::FindBlock(const Eigen::Vector3i &block)
+{
+	auto it = blocks.find(block);
+	return it != blocks.end() ? it->second : -1;
+}
+
+int VoxelHashModel::AllocateBlock(const Eigen::Vector3i &block)
+{
+	auto it = blocks.find(block);
+	if(it != blocks.end())
+	{
+		last_used[it->second] = allocation_count;
+		return it->second;
+	}
+
+	if(free_blocks.empty() && (int)block_coords.size() >= max_blocks && !(brick_store && EvictBlocks()))
+		return -1;
+
+	int index;
+	if(!free_blocks.empty())
+	{
+		index = free_blocks.back();
+		free_blocks.pop_back();
+		block_coords[index] = block;
+		last_used[index] = allocation_count;
+	}
+	else
+	{
+		index = (int)block_coords.size();
+		block_coords.push_back(block);
+		last_used.push_back(allocation_count);
+		tsdf.resize(tsdf.size() + VOXEL_BLOCK_VOXELS);
+		weights.resize(weights.size() + VOXEL_BLOCK_VOXELS);
+		if(colors_active)
+			color.resize(color.size() + VOXEL_BLOCK_VOXELS * 4);
+	}
+
+	if(!brick_store || !brick_store->Read(block, GetBlockTSDF(index), GetBlockWeights(index), GetBlockColor(index)))
+	{
+		// same as CPUModel::Reset()
+		std::fill_n(GetBlockTSDF(index), VOXEL_BLOCK_VOXELS, max_truncation);
+		std::fill_n(GetBlockWeights(index), VOXEL_BLOCK_VOXELS, 0);
+		if(colors_active)
+			std::fill_n(GetBlockColor(index), VOXEL_BLOCK_VOXELS * 4, 0);
+	}
+
+	blocks.emplace(block, index);
+	return index;
+}
+
+bool VoxelHashModel::EvictBlocks()
+{
+	// blocks of the current AllocateBlocks() call must stay
+	std::vector<std::pair<uint64_t, int>> candidates;
+	candidates.reserve(blocks.size());
+	for(const auto &b : blocks)
+	{
+		if(last_used[b.second] < allocation_count)
+			candidates.emplace_back(last_used[b.second], b.second);
+	}
+	if(candidates.empty())
+		return false;
+
+	size_t count = std::min(candidates.size(), (size_t)std::max(1, max_blocks / VOXEL_HASH_EVICT_DIVISOR));
+	std::nth_element(candidates.begin(), candidates.begin() + (count - 1), candidates.end());
+	for(size_t i=0; i<count; i++)
+	{
+		int index = candidates[i].second;
+		Eigen::Vector3i block = block_coords[index];
+		brick_store->Write(block, GetBlockTSDF(index), GetBlockWeights(index), GetBlockColor(index));
+		FreeBlock(block);
+	}
+	return true;
+}
+
+void VoxelHashModel::WriteToBrickStore()
+{
+	if(!brick_store)
+		return;
+	for(const auto &b : blocks)
+		brick_store->Write(b.first, GetBlockTSDF(b.second), GetBlockWeights(b.second), GetBlockColor(b.second));
+}
+
+void VoxelHashModel::Prefetch(const Eigen::Affine3f &pose, int width, int height, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center, float max_depth)
+{
+	if(!brick_store)
+		return;
+
+	// samples the frustum at one block spacing, layer by layer from near to far
+	const float step = cell_size * VOXEL_BLOCK_SIZE;
+	std::vector<Eigen::Vector3i> requested;
+	std::unordered_set<Eigen::Vector3i, VoxelBlockHash> seen;
+	for(float z = step * 0.5f; z < max_depth; z += step)
+	{
+		const float stride_x = std::max(1.0f, step * focal_length.x() / z);
+		const float stride_y = std::max(1.0f, step * focal_length.y() / z);
+		for(float y=0.0f; y<(float)height+stride_y; y+=stride_y)
+		{
+			for(float x=0.0f; x<(float)width+stride_x; x+=stride_x)
+			{
+				Eigen::Vector3f dir((std::min(x, (float)width) - center.x()) / focal_length.x(), -(std::min(y, (float)height) - center.y()) / focal_length.y(), -1.0f);
+				Eigen::Vector3f p = pose * (dir * z) / cell_size;
+				Eigen::Vector3i voxel((int)std::floor(p.x() + 0.5f), (int)std::floor(p.y() + 0.5f), (int)std::floor(p.z() + 0.5f));
+				Eigen::Vector3i block = VoxelToBlock(voxel);
+				if(blocks.find(block) != blocks.end() || !seen.insert(block).second)
+					continue;
+				requested.push_back(block);
+			}
+		}
+	}
+	brick_store->Prefetch(requested);
+}
+void VoxelHashModel::FreeBlock(const Eigen::Vector3i &block)
+{
+	auto it = blocks.find(block);
+	if(it == blocks.end())
+		return;
+	free_blocks.push_back(it->second);
+	blocks.erase(it);
+}
+
+void VoxelHashModel::GetBlocks(std::vector<int> *indices)
+{
+	indices->clear();
+	indices->reserve(blocks.size());
+	for(const auto &block : blocks)
+		indices->push_back(block.second);
+}
+
+bool VoxelHashModel::AllocateBlocks(CPUFrame *frame, const Eigen::Affine3f &transform)
+{
+	const int width = frame->GetDepthWidth();
+	const int height = frame->GetDepthHeight();
+	const uint16_t *depth = frame->GetDepthMap();
+	const float depth_scale = frame->GetDepthScale();
+	const Eigen::Vector2f focal_length = frame->GetIntrinsicsFocalLength();
+	const Eigen::Vector2f center = frame->GetIntrinsicsCenter();
+
+	allocation_count++;
+
+	// blocks touched by the rays of each thread, consecutive duplicates removed
+	std::vector<std::vector<Eigen::Vector3i>> touched(thread_pool ? thread_pool->GetThreadCount() : 1);
+
+	auto func = [&](int y_begin, int y_end, unsigned int thread_index) {
+		std::vector<Eigen::Vector3i> &out = touched[thread_index];
+		for(int y=y_begin; y<y_end; y++)
+		{
+			for(int x=0; x<width; x++)
+			{
+				float d = (float)depth[y * width + x] * depth_scale;
+				if(d == 0.0f)
+					continue;
+
+				// the integration changes voxels with depth - z in [min_truncation, max_truncation]
+				Eigen::Vector3f dir((x - center.x()) / focal_length.x(), -(y - center.y()) / focal_length.y(), -1.0f);
+				float z_begin = std::max(d - max_truncation, 0.0f);
+				float z_end = d - min_truncation;
+				int steps = std::max(1, (int)std::ceil((z_end - z_begin) * dir.norm() / cell_size));
+				for(int i=0; i<=steps; i++)
+				{
+					float z = z_begin + (z_end - z_begin) * (float)i / (float)steps;
+					Eigen::Vector3f p = transform * (dir * z) / cell_size;
+					Eigen::Vector3i voxel((int)std::floor(p.x() + 0.5f), (int)std::floor(p.y() + 0.5f), (int)std::floor(p.z() + 0.5f));
+					Eigen::Vector3i block = VoxelToBlock(voxel);
+					if(out.empty() || out.back() != block)
+						out.push_back(block);
+				}
+			}
+		}
+	};
+	if(thread_pool)
+		thread_pool->ParallelFor(0, height, VOXEL_HASH_ROW_GRAIN, func);
+	else
+		func(0, height, 0);
+
+	std::vector<Eigen::Vector3i> all;
+	for(auto &v : touched)
+		all.insert(all.end(), v.begin(), v.end());
+	auto less = [](const Eigen::Vector3i &a, const Eigen::Vector3i &b) {
+		return std::lexicographical_compare(a.data(), a.data() + 3, b.data(), b.data() + 3);
+	};
+	std::sort(all.begin(), all.end(), less);
+	all.erase(std::unique(all.begin(), all.end()), all.end());
+
+	bool ok = true;
+	for(const auto &block : all)
+		ok = AllocateBlock(block) >= 0 && ok;
+	return ok;
+}
+
+void VoxelHashModel::Raycast(const CameraTransform &camera_transform, int width, int height, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center,
+		float depth_scale, float max_depth, uint16_t *depth)
+{
+	auto func = [&](int y_begin, int y_end, unsigned int) {
+		RaycastRows(camera_transform.GetTransform(), width, focal_length, center, depth_scale, max_depth, depth, y_begin, y_end);
+	};
+	if(thread_pool)
+		thread_pool->ParallelFor(0, height, VOXEL_HASH_ROW_GRAIN, func);
+	else
+		func(0, height, 0);
+}
+
+// Like TraceRay() in the renderer, stepping by the tsdf, but only a crossing from positive to negative counts as a hit.
+// The ray parameter s is the camera space depth.
+void VoxelHashModel::RaycastRows(const Eigen::Affine3f &transform, int width, const Eigen::Vector2f &focal_length, const Eigen::Vector2f &center,
+		float depth_scale, float max_depth, uint16_t *depth, int y_begin, int y_end)
+{
+	const Eigen::Vector3f origin = transform.translation() / cell_size;
+	const float block_extent = (float)VOXEL_BLOCK_SIZE;
+
+	for(int y=y_begin; y<y_end; y++)
+	{
+		for(int x=0; x<width; x++)
+		{
+			// in voxel units
+			const Eigen::Vector3f dir = transform.linear() * Eigen::Vector3f((x - center.x()) / focal_length.x(), -(y - center.y()) / focal_length.y(), -1.0f) / cell_size;
+			const float voxels_per_s = dir.norm();
+
+			float s = 0.0f;
+			float s_prev = 0.0f;
+			float sdf_prev = -1.0f;
+			float hit = 0.0f;
+
+			while(s < max_depth)
+			{
+				Eigen::Vector3f p = origin + dir * s;
+				Eigen::Vector3i voxel((int)std::floor(p.x() + 0.5f), (int)std::floor(p.y() + 0.5f), (int)std::floor(p.z() + 0.5f));
+				Eigen::Vector3i block = VoxelToBlock(voxel);
+				int index = FindBlock(block);
+				if(index < 0)
+				{
+					// skip to where the ray leaves the block, voxel centers are at integer positions
+					float s_exit = max_depth;
+					for(int i=0; i<3; i++)
+					{
+						if(dir[i] == 0.0f)
+							continue;
+						float bound = ((float)block[i] + (dir[i] > 0.0f ? 1.0f : 0.0f)) * block_extent - 0.5f;
+						s_exit = std::min(s_exit, (bound - origin[i]) / dir[i]);
+					}
+					s = std::max(s_exit, s) + 0.01f / voxels_per_s;
+					sdf_prev = -1.0f;
+					continue;
+				}
+
+				Eigen::Vector3i local = voxel - block * VOXEL_BLOCK_SIZE;
+				int i = VoxelIndex(local.x(), local.y(), local.z());
+				if(GetBlockWeights(index)[i] == 0)
+				{
+					s += 1.0f / voxels_per_s;
+					sdf_prev = -1.0f;
+					continue;
+				}
+
+				float sdf = GetBlockTSDF(index)[i];
+				if(sdf <= 0.0f && sdf_prev > 0.0f)
+				{
+					hit = s_prev + (s - s_prev) * sdf_prev / (sdf_prev - sdf);
+					break;
+				}
+				s_prev = s;
+				sdf_prev = sdf;
+				s += std::max(sdf / cell_size, 1.0f) / voxels_per_s;
+			}
+
+			depth[y * width + x] = (uint16_t)std::min(65535.0f, std::round(hit / depth_scale));
+		}
+	}
+}
@@ -0,0 +1,129 @@
+#include "cpu_frame.h"
+#include "cpu_icp.h"
+#include "camera_transform.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+static const int width = 424;
+static const int height = 240;
+static const float depth_scale = 0.001f;
+static const Eigen::Vector2f focal_length(300.0f, 300.0f);
+static const Eigen::Vector2f center(211.5f, 119.5f);
+
+static const float inf = std::numeric_limits<float>::infinity();
+
+static float RaySphere(const Eigen::Vector3f &origin, const Eigen::Vector3f &dir, const Eigen::Vector3f &sphere_center, float radius)
+{
+	Eigen::Vector3f oc = origin - sphere_center;
+	float b = oc.dot(dir);
+	float disc = b * b - oc.dot(oc) + radius * radius;
+	if(disc < 0.0f)
+		return inf;
+	float t = -b - std::sqrt(disc);
+	return t > 0.0f ? t : inf;
+}
+
+static float RayPlane(const Eigen::Vector3f &origin, const Eigen::Vector3f &dir, const Eigen::Vector3f &normal, float offset)
+{
+	float dn = dir.dot(normal);
+	if(std::abs(dn) < 1e-6f)
+		return inf;
+	float t = (offset - origin.dot(normal)) / dn;
+	return t > 0.0f ? t : inf;
+}
+
+// a few spheres in a corner, seen from pose
+static std::vector<uint16_t> RenderDepth(const Eigen::Affine3f &pose)
+{
+	std::vector<uint16_t> depth(width * height);
+	for(int y=0; y<height; y++)
+	{
+		for(int x=0; x<width; x++)
+		{
+			Eigen::Vector3f dir_camera((x - center.x()) / focal_length.x(), -(y - center.y()) / focal_length.y(), -1.0f);
+			Eigen::Vector3f dir = (pose.linear() * dir_camera).normalized();
+			Eigen::Vector3f origin = pose.translation();
+			float t = RaySphere(origin, dir, Eigen::Vector3f(0.0f, 0.0f, 0.0f), 0.3f);
+			t = std::min(t, RaySphere(origin, dir, Eigen::Vector3f(0.3f, 0.2f, 0.1f), 0.12f));
+			t = std::min(t, RaySphere(origin, dir, Eigen::Vector3f(-0.35f, -0.15f, 0.05f), 0.1f));
+			t = std::min(t, RayPlane(origin, dir, Eigen::Vector3f(0.0f, 0.0f, 1.0f), -0.5f));
+			t = std::min(t, RayPlane(origin, dir, Eigen::Vector3f(0.0f, 1.0f, 0.0f), -0.45f));
+			if(t == inf)
+			{
+				depth[y * width + x] = 0;
+				continue;
+			}
+			float z = -(pose.inverse() * (origin + dir * t)).z();
+			depth[y * width + x] = z < 3.0f ? (uint16_t)std::lround(z / depth_scale) : 0;
+		}
+	}
+	return depth;
+}
+
+static void PoseError(const Eigen::Affine3f &expected, const Eigen::Affine3f &actual, float *rot, float *translation)
+{
+	Eigen::Affine3f error = expected.inverse() * actual;
+	*rot = Eigen::AngleAxisf(error.linear()).angle();
+	*translation = error.translation().norm();
+}
+
+// tracks a known camera motion with CPUICP, frame to frame, without any GL context
+int main(int argc, char *argv[])
+{
+	std::cout << "CPU ICP Test \n";
+
+	Eigen::Affine3f pose_prev = Eigen::Affine3f::Identity();
+	pose_prev.translate(Eigen::Vector3f(0.0f, 0.0f, 1.0f));
+	Eigen::Affine3f pose_current = pose_prev
+			* Eigen::AngleAxisf(0.04f, Eigen::Vector3f(0.3f, 1.0f, 0.2f).normalized())
+			* Eigen::Translation3f(0.03f, -0.02f, 0.02f);
+
+	std::vector<uint16_t> depth_prev = RenderDepth(pose_prev);
+	std::vector<uint16_t> depth_current = RenderDepth(pose_current);
+
+	ThreadPool thread_pool;
+
+	CPUFrame prediction(&thread_pool);
+	prediction.SetDepthMap(width, height, depth_prev.data(), depth_scale, focal_length, center);
+	prediction.ProcessFrame();
+
+	CPUFrame frame(&thread_pool);
+	frame.SetDepthMap(width, height, depth_current.data(), depth_scale, focal_length, center);
+	frame.ProcessFrame();
+
+	const int max_iterations = 20;
+	bool ok = true;
+
+	for(ThreadPool *pool : { (ThreadPool *)nullptr, &thread_pool })
+	{
+		CPUICP icp(pool);
+		CameraTransform camera_transform;
+		camera_transform.SetTransform(pose_prev);
+
+		auto begin = std::chrono::steady_clock::now();
+		for(int i=0; i<max_iterations && !icp.GetConverged(); i++)
+		{
+			icp.SearchCorrespondences(&frame, &prediction, pose_prev, camera_transform);
+			icp.SolveMatrix(&camera_transform);
+		}
+		auto end = std::chrono::steady_clock::now();
+
+		float rot_error, translation_error;
+		PoseError(pose_current, camera_transform.GetTransform(), &rot_error, &translation_error);
+
+		std::cout << "threads: " << (pool ? pool->GetThreadCount() : 1) << "\n";
+		std::cout << "iterations: " << icp.GetIterations() << (icp.GetConverged() ? " (converged)" : "") << "\n";
+		std::cout << "time per iteration: " << std::chrono::duration<double, std::milli>(end - begin).count() / icp.GetIterations() << " ms\n";
+		std::cout << "rotation error: " << rot_error << ", translation error: " << translation_error << "\n";
+
+		ok = ok && icp.GetConverged() && rot_error < 0.002f && translation_error < 0.002f;
+	}
+
+	std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+#include "cpu_frame.h"
+#include "cpu_integrator.h"
+#include "camera_transform.h"
+#include "model.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+static const int width = 424;
+static const int height = 240;
+static const float depth_scale = 0.001f;
+static const Eigen::Vector2f focal_length(300.0f, 300.0f);
+static const Eigen::Vector2f center(211.5f, 119.5f);
+
+static const int resolution = 128;
+static const float cell_size = 2.0f / resolution;
+static const float max_truncation = 0.05f;
+static const float min_truncation = -0.03f;
+
+// integrates a wall parallel to the image plane and compares the tsdf along the optical axis
+// with the distance to it, then checks that the thread pool and the bricked layout give the same volume
+// and that a raycast from the camera finds the wall
+int main(int argc, char *argv[])
+{
+	std::cout << "CPU Integration Test \n";
+
+	const float wall_depth = 1.0f;
+	std::vector<uint16_t> depth(width * height, (uint16_t)std::lround(wall_depth / depth_scale));
+
+	CPUFrame frame;
+	frame.SetDepthMap(width, height, depth.data(), depth_scale, focal_length, center);
+
+	// camera at z = 1 looking down -z, the wall is at z = 0
+	CameraTransform camera_transform;
+	Eigen::Affine3f t = Eigen::Affine3f::Identity();
+	t.translate(Eigen::Vector3f(0.0f, 0.0f, 1.0f));
+	camera_transform.SetTransform(t);
+
+	ThreadPool thread_pool;
+	CPUModel model(resolution, resolution, resolution, cell_size, max_truncation, min_truncation, false);
+	CPUModel model_pool(resolution, resolution, resolution, cell_size, max_truncation, min_truncation, false);
+	CPUIntegrator integrator(&model);
+	CPUIntegrator integrator_pool(&model_pool, &thread_pool);
+
+	auto begin = std::chrono::steady_clock::now();
+	integrator.Integrate(&frame, camera_transform);
+	auto end = std::chrono::steady_clock::now();
+	integrator_pool.Integrate(&frame, camera_transform);
+	auto end_pool = std::chrono::steady_clock::now();
+
+	std::cout << "time: " << std::chrono::duration<double, std::milli>(end - begin).count() << " ms, "
+			<< thread_pool.GetThreadCount() << " threads: " << std::chrono::duration<double, std::milli>(end_pool - end).count() << " ms\n";
+
+	bool ok = true;
+
+	// the voxel column through the optical axis
+	const int x = resolution / 2;
+	const int y = resolution / 2;
+	for(int z=0; z<resolution; z++)
+	{
+		size_t index = ((size_t)z * resolution + y) * resolution + x;
+		float world_z = model.GridToWorld(model.TexelToGrid(Eigen::Vector3i(x, y, z))).z();
+		float sdf = wall_depth - (1.0f - world_z);
+		if(sdf < min_truncation)
+		{
+			if(model.GetWeights()[index] != 0)
+			{
+				std::cout << "voxel " << z << " behind the wall was integrated\n";
+				ok = false;
+			}
+			continue;
+		}
+
+		float expected = std::min(std::max(sdf, min_truncation), max_truncation);
+		if(model.GetWeights()[index] != 1 || std::abs(model.GetData()[index] - expected) > 1e-5f)
+		{
+			std::cout << "voxel " << z << ": tsdf " << model.GetData()[index] << ", expected " << expected << "\n";
+			ok = false;
+		}
+	}
+
+	size_t count = (size_t)resolution * resolution * resolution;
+	if(memcmp(model.GetData(), model_pool.GetData(), count * sizeof(float)) != 0
+			|| memcmp(model.GetWeights(), model_pool.GetWeights(), count) != 0)
+	{
+		std::cout << "thread pool result differs\n";
+		ok = false;
+	}
+
+	CPUModel model_bricked(resolution, resolution, resolution, cell_size, max_truncation, min_truncation, false, true);
+	CPUIntegrator integrator_bricked(&model_bricked, &thread_pool);
+	integrator_bricked.Integrate(&frame, camera_transform);
+	std::vector<float> tsdf_linear(count);
+	std::vector<uint8_t> weights_linear(count);
+	model_bricked.ToLinear(tsdf_linear.data(), weights_linear.data(), nullptr);
+	if(memcmp(model.GetData(), tsdf_linear.data(), count * sizeof(float)) != 0
+			|| memcmp(model.GetWeights(), weights_linear.data(), count) != 0)
+	{
+		std::cout << "bricked result differs\n";
+		ok = false;
+	}
+
+	{
+		std::vector<uint16_t> raycast(width * height);
+		model_bricked.Raycast(camera_transform, width, height, focal_length, center, depth_scale, 3.0f, raycast.data(), &thread_pool);
+		int hits = 0;
+		double error = 0.0;
+		for(int i=0; i<width*height; i++)
+		{
+			if(raycast[i] == 0)
+				continue;
+			hits++;
+			error = std::max(error, std::abs((double)raycast[i] - (double)depth[i]) * depth_scale);
+		}
+		std::cout << "raycast hits: " << hits << " of " << width * height << ", max error: " << error << "\n";
+		ok = ok && hits > width * height * 0.95 && error < cell_size;
+	}
+
+	std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+#include "frame.h"
+#include "cpu_frame.h"
+#include "thread_pool.h"
+#include "window.h"
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+// compares CPUFrame::ProcessFrame() against the compute shader in Frame::ProcessFrame()
+int main(int argc, char *argv[])
+{
+	std::cout << "Frame Parity Test \n";
+
+	const int width = 640;
+	const int height = 480;
+	const float depth_scale = 0.001f;
+	const Eigen::Vector2f focal_length(600.0f, 600.0f);
+	const Eigen::Vector2f center(319.5f, 239.5f);
+
+	// sphere in front of a wall, with a few holes
+	std::vector<uint16_t> depth(width * height);
+	for(int y=0; y<height; y++)
+	{
+		for(int x=0; x<width; x++)
+		{
+			float dx = (float)(x - width / 2);
+			float dy = (float)(y - height / 2);
+			float r2 = dx * dx + dy * dy;
+			uint16_t d = 1500;
+			if(r2 < 150.0f * 150.0f)
+				d = (uint16_t)(1000.0f - std::sqrt(150.0f * 150.0f - r2));
+			if((x / 7 + y / 5) % 23 == 0)
+				d = 0;
+			depth[y * width + x] = d;
+		}
+	}
+
+	Window window("Frame Parity Test", 64, 64);
+
+	Frame frame;
+	frame.SetDepthMap(width, height, depth.data(), depth_scale, focal_length, center);
+	frame.ProcessFrame();
+
+	std::vector<float> gpu_vertex(width * height * 4);
+	std::vector<float> gpu_normal(width * height * 4);
+	glGetTextureImage(frame.GetVertexTex(), 0, GL_RGBA, GL_FLOAT, (GLsizei)(gpu_vertex.size() * sizeof(float)), gpu_vertex.data());
+	glGetTextureImage(frame.GetNormalTex(), 0, GL_RGBA, GL_FLOAT, (GLsizei)(gpu_normal.size() * sizeof(float)), gpu_normal.data());
+
+	ThreadPool thread_pool;
+	CPUFrame cpu_frame(&thread_pool);
+	cpu_frame.SetDepthMap(width, height, depth.data(), depth_scale, focal_length, center);
+	cpu_frame.ProcessFrame();
+
+	const float *cpu_vertex[3] = { cpu_frame.GetVertexX(), cpu_frame.GetVertexY(), cpu_frame.GetVertexZ() };
+	const float *cpu_normal[3] = { cpu_frame.GetNormalX(), cpu_frame.GetNormalY(), cpu_frame.GetNormalZ() };
+
+	float max_vertex_error = 0.0f;
+	float max_normal_error = 0.0f;
+	int mismatches = 0;
+	for(int i=0; i<width * height; i++)
+	{
+		for(int c=0; c<3; c++)
+		{
+			float gv = gpu_vertex[i * 4 + c];
+			float gn = gpu_normal[i * 4 + c];
+			if(std::isinf(gv) != std::isinf(cpu_vertex[c][i]) || std::isinf(gn) != std::isinf(cpu_normal[c][i]))
+			{
+				mismatches++;
+				continue;
+			}
+			if(std::isinf(gv))
+				continue;
+			max_vertex_error = std::max(max_vertex_error, std::abs(gv - cpu_vertex[c][i]));
+			max_normal_error = std::max(max_normal_error, std::abs(gn - cpu_normal[c][i]));
+		}
+	}
+
+	std::cout << "threads: " << thread_pool.GetThreadCount() << "\n";
+	std::cout << "max vertex error: " << max_vertex_error << "\n";
+	std::cout << "max normal error: " << max_normal_error << "\n";
+	std::cout << "missing depth mismatches: " << mismatches << "\n";
+
+	bool ok = mismatches == 0 && max_vertex_error < 1e-5f && max_normal_error < 1e-3f;
+	std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,129 @@
+#include "gl_marching_cubes.h"
+#include "gl_model.h"
+#include "marching_cubes.h"
+#include "mesh_writer.h"
+#include "model.h"
+#include "window.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static const int res = 96;
+static const float cell_size = 1.0f / 64.0f;
+
+// compares GLMarchingCubes against Marching_Cubes::ExtractMesh() on a sphere,
+// triangle by triangle since both emit the triangles of the cells in the same order
+static bool Compare(CPUModel *cpu_model, Mesh &gpu_mesh, bool observed_only)
+{
+	Marching_Cubes mc(cpu_model);
+	Mesh cpu_mesh;
+	mc.ExtractMesh(0.0, &cpu_mesh, observed_only);
+
+	std::cout << (observed_only ? "observed only, " : "") << "vertices: " << gpu_mesh.GetVertices().size() << " (cpu " << cpu_mesh.GetVertices().size()
+			<< "), triangles: " << gpu_mesh.GetTriangles().size() << " (cpu " << cpu_mesh.GetTriangles().size() << ")\n";
+	if(gpu_mesh.GetVertices().size() != cpu_mesh.GetVertices().size() || gpu_mesh.GetTriangles().size() != cpu_mesh.GetTriangles().size())
+		return false;
+
+	float max_error = 0.0f;
+	int color_mismatches = 0;
+	for(size_t i=0; i<gpu_mesh.GetTriangles().size(); i++)
+	{
+		const Triangle &gpu = gpu_mesh.GetTriangles()[i];
+		const Triangle &cpu = cpu_mesh.GetTriangles()[i];
+		const unsigned int gpu_indices[3] = { gpu.idx0, gpu.idx1, gpu.idx2 };
+		const unsigned int cpu_indices[3] = { cpu.idx0, cpu.idx1, cpu.idx2 };
+		for(int j=0; j<3; j++)
+		{
+			Eigen::Vector3f cpu_vertex = cpu_model->GridToWorld(cpu_mesh.GetVertices()[cpu_indices[j]]);
+			max_error = std::max(max_error, (gpu_mesh.GetVertices()[gpu_indices[j]] - cpu_vertex).norm());
+			if(gpu.color[j] != cpu.color[j])
+				color_mismatches++;
+		}
+	}
+	std::cout << "max vertex distance: " << max_error << ", color mismatches: " << color_mismatches << "\n";
+	return max_error < cell_size * 1e-3f && color_mismatches == 0;
+}
+
+// the file without its first two lines, the streamed header has padded counts
+static std::string ReadBody(const std::string &filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	std::string line;
+	std::getline(file, line);
+	std::getline(file, line);
+	std::stringstream body;
+	body << file.rdbuf();
+	return body.str();
+}
+
+// GLMarchingCubes::StreamMesh() must write the same vertices and faces as ExtractMesh()
+static bool CompareStream(GLMarchingCubes *gl_mc, Mesh &mesh, bool observed_only)
+{
+	const std::string extracted_filename = "glmarchingcubestest_extracted.off";
+	const std::string streamed_filename = "glmarchingcubestest_streamed.off";
+	MeshWriter extracted(extracted_filename, true);
+	bool ok = extracted.Write(mesh);
+	ok = extracted.Close() && ok;
+
+	MeshWriter streamed(streamed_filename, true);
+	ok = streamed.Begin() && ok;
+	gl_mc->StreamMesh(0.0, &streamed, observed_only);
+	ok = streamed.Close() && ok;
+
+	const std::string extracted_body = ReadBody(extracted_filename);
+	const bool same = ok && !extracted_body.empty() && extracted_body == ReadBody(streamed_filename);
+	std::cout << "streamed mesh " << (same ? "matches" : "differs") << "\n";
+	std::remove(extracted_filename.c_str());
+	std::remove(streamed_filename.c_str());
+	return same;
+}
+
+int main(int argc, char *argv[])
+{
+	std::cout << "GL Marching Cubes Test \n";
+
+	Window window("GL Marching Cubes Test", 64, 64);
+
+	const Eigen::Vector3f origin(-0.75f, -0.75f, -0.75f);
+	CPUModel cpu_model(res, res, res, cell_size, 0.3f, -0.3f, origin, true);
+	cpu_model.GenerateSphere(0.5f, Eigen::Vector3f(0.0f, 0.0f, 0.0f));
+	// weights of 0 below the equator and colors that differ between neighboring voxels
+	for(int z=0; z<res; z++)
+	{
+		for(int y=0; y<res; y++)
+		{
+			for(int x=0; x<res; x++)
+			{
+				size_t index = cpu_model.IDX(x, y, z);
+				cpu_model.GetWeights()[index] = y < res / 2 ? 0 : 1;
+				cpu_model.GetColor()[index * 4 + 0] = (uint8_t)(x * 7);
+				cpu_model.GetColor()[index * 4 + 1] = (uint8_t)(y * 5);
+				cpu_model.GetColor()[index * 4 + 2] = (uint8_t)(z * 3);
+			}
+		}
+	}
+	cpu_model.UpdateSummary();
+
+	GLModel gl_model(res, res, res, cell_size, 0.3f, -0.3f, origin, true);
+	gl_model.CopyFrom(&cpu_model);
+	GLMarchingCubes gl_mc(&gl_model);
+
+	bool ok = true;
+	for(bool observed_only : { false, true })
+	{
+		Mesh mesh;
+		auto begin = std::chrono::steady_clock::now();
+		gl_mc.ExtractMesh(0.0, &mesh, observed_only);
+		auto end = std::chrono::steady_clock::now();
+		std::cout << "time: " << std::chrono::duration<double, std::milli>(end - begin).count() << " ms\n";
+		ok = Compare(&cpu_model, mesh, observed_only) && !mesh.GetTriangles().empty() && ok;
+		ok = CompareStream(&gl_mc, mesh, observed_only) && ok;
+	}
+
+	std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+	return ok ? 0 : 1;
+}
@@ -1,5 +1,6 @@
 #include "model.h"
 #include "marching_cubes.h"
+#include "thread_pool.h"
 #include <stdio.h>
 
 int main(int argc, char *argv[])
@@ -9,7 +10,8 @@ int main(int argc, char *argv[])
 	CPUModel model(64, 64, 64, 1.0f / 64.0f, 0.3f, -0.3f, true);
 	model.GenerateSphere(0.3f, Eigen::Vector3f(0.0f, 0.0f, 0.0f));
 	
-	Marching_Cubes mc(&model);
+	ThreadPool thread_pool;
+	Marching_Cubes mc(&model, &thread_pool);
 	mc.process_mc("C:/Users/ospoe/3dscanning/testresult.off");	
 
 	return 0;
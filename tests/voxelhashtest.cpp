@@ -0,0 +1,187 @@
+#include "brick_store.h"
+#include "cpu_frame.h"
+#include "cpu_integrator.h"
+#include "camera_transform.h"
+#include "marching_cubes.h"
+#include "thread_pool.h"
+#include "voxel_hash_model.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+static const int width = 424;
+static const int height = 240;
+static const float depth_scale = 0.001f;
+static const Eigen::Vector2f focal_length(300.0f, 300.0f);
+static const Eigen::Vector2f center(211.5f, 119.5f);
+
+static const float sphere_radius = 0.3f;
+static const float cell_size = 0.005f;
+
+static const float inf = std::numeric_limits<float>::infinity();
+
+// a sphere at the origin, seen from pose
+static std::vector<uint16_t> RenderDepth(const Eigen::Affine3f &pose)
+{
+	std::vector<uint16_t> depth(width * height);
+	for(int y=0; y<height; y++)
+	{
+		for(int x=0; x<width; x++)
+		{
+			Eigen::Vector3f dir_camera((x - center.x()) / focal_length.x(), -(y - center.y()) / focal_length.y(), -1.0f);
+			Eigen::Vector3f dir = (pose.linear() * dir_camera).normalized();
+			Eigen::Vector3f origin = pose.translation();
+			float b = origin.dot(dir);
+			float disc = b * b - origin.dot(origin) + sphere_radius * sphere_radius;
+			float t = disc >= 0.0f ? -b - std::sqrt(disc) : inf;
+			if(t == inf || t <= 0.0f)
+			{
+				depth[y * width + x] = 0;
+				continue;
+			}
+			float z = -(pose.inverse() * (origin + dir * t)).z();
+			depth[y * width + x] = (uint16_t)std::lround(z / depth_scale);
+		}
+	}
+	return depth;
+}
+
+static Eigen::Affine3f ViewPose(float angle)
+{
+	Eigen::Affine3f pose = Eigen::Affine3f::Identity();
+	pose.rotate(Eigen::AngleAxisf(angle, Eigen::Vector3f::UnitY()));
+	pose.translate(Eigen::Vector3f(0.0f, 0.0f, 1.0f));
+	return pose;
+}
+
+// fuses a sphere from a few views into a VoxelHashModel at 5 mm,
+// then checks the memory use, a raycast against the input depth and the marching cubes surface
+int main(int argc, char *argv[])
+{
+	std::cout << "Voxel Hash Test \n";
+
+	ThreadPool thread_pool;
+	VoxelHashModel model(cell_size, 4.0f * cell_size, -2.0f * cell_size, false, 1 << 16, &thread_pool);
+	CPUIntegrator integrator(&model, &thread_pool);
+	CPUFrame frame;
+
+	bool ok = true;
+
+	auto begin = std::chrono::steady_clock::now();
+	const int views = 6;
+	for(int i=0; i<views; i++)
+	{
+		std::vector<uint16_t> depth = RenderDepth(ViewPose(2.0f * (float)M_PI * i / views));
+		frame.SetDepthMap(width, height, depth.data(), depth_scale, focal_length, center);
+		CameraTransform camera_transform;
+		camera_transform.SetTransform(ViewPose(2.0f * (float)M_PI * i / views));
+		ok = integrator.Integrate(&frame, camera_transform) && ok;
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	// a dense grid around the sphere at the same resolution
+	int dense_res = (int)std::ceil(2.0f * sphere_radius / cell_size);
+	size_t dense_size = (size_t)dense_res * dense_res * dense_res * (sizeof(float) + 1);
+	std::cout << "blocks: " << model.GetBlockCount() << ", " << model.GetMemorySize() / 1024 << " KiB, dense: " << dense_size / 1024 << " KiB\n";
+	std::cout << "integration time per frame: " << std::chrono::duration<double, std::milli>(end - begin).count() / views << " ms\n";
+	if(model.GetMemorySize() >= dense_size)
+	{
+		std::cout << "sparse model is not smaller than a dense grid\n";
+		ok = false;
+	}
+
+	// raycast from one of the integrated views
+	{
+		Eigen::Affine3f pose = ViewPose(2.0f * (float)M_PI / views);
+		std::vector<uint16_t> expected = RenderDepth(pose);
+		std::vector<uint16_t> raycast(width * height);
+		CameraTransform camera_transform;
+		camera_transform.SetTransform(pose);
+		model.Raycast(camera_transform, width, height, focal_length, center, depth_scale, 3.0f, raycast.data());
+
+		int count = 0, hits = 0;
+		double error = 0.0;
+		for(int i=0; i<width*height; i++)
+		{
+			if(expected[i] == 0)
+				continue;
+			count++;
+			if(raycast[i] == 0)
+				continue;
+			hits++;
+			error += std::abs((double)raycast[i] - (double)expected[i]) * depth_scale;
+		}
+		error /= std::max(hits, 1);
+		std::cout << "raycast hits: " << hits << " of " << count << ", mean error: " << error << "\n";
+		ok = ok && hits > count * 0.95 && error < cell_size;
+	}
+
+	// the extracted surface is on the sphere
+	{
+		Marching_Cubes mc(&model);
+		Mesh mesh;
+		std::vector<int> blocks;
+		model.GetBlocks(&blocks);
+		for(int index : blocks)
+			mc.ProcessHashBlock(index, 0.0, &mesh);
+
+		float max_error = 0.0f;
+		for(auto &v : mesh.GetVertices())
+			max_error = std::max(max_error, std::abs(v.norm() - sphere_radius));
+		std::cout << "triangles: " << mesh.GetTriangles().size() << ", max distance to the sphere: " << max_error << "\n";
+		ok = ok && !mesh.GetTriangles().empty() && max_error < cell_size;
+	}
+
+	// the same views with a pool of half the blocks, paged out to a brick store
+	{
+		const int pool_blocks = model.GetBlockCount() / 2;
+		const std::string filename = "voxelhashtest_bricks.bin";
+		BrickStore store(filename, false);
+		VoxelHashModel paged(cell_size, 4.0f * cell_size, -2.0f * cell_size, false, pool_blocks, &thread_pool);
+		paged.SetBrickStore(&store);
+		CPUIntegrator paged_integrator(&paged, &thread_pool);
+
+		for(int i=0; i<views; i++)
+		{
+			Eigen::Affine3f pose = ViewPose(2.0f * (float)M_PI * i / views);
+			std::vector<uint16_t> depth = RenderDepth(pose);
+			frame.SetDepthMap(width, height, depth.data(), depth_scale, focal_length, center);
+			CameraTransform camera_transform;
+			camera_transform.SetTransform(pose);
+			ok = paged_integrator.Integrate(&frame, camera_transform) && ok;
+			ok = ok && paged.GetBlockCount() <= pool_blocks;
+		}
+		paged.WriteToBrickStore();
+		std::cout << "paged blocks: " << paged.GetBlockCount() << " resident, " << store.GetBlockCount() << " stored, "
+				<< store.GetBytesRead() / 1024 << " KiB read, " << store.GetBytesWritten() / 1024 << " KiB written\n";
+		ok = ok && (int)store.GetBlockCount() == model.GetBlockCount();
+
+		// everything read back into one model is still on the sphere
+		VoxelHashModel loaded(cell_size, 4.0f * cell_size, -2.0f * cell_size, false, 1 << 16, &thread_pool);
+		loaded.SetBrickStore(&store);
+		std::vector<int> blocks;
+		model.GetBlocks(&blocks);
+		for(int index : blocks)
+			loaded.AllocateBlock(model.GetBlockCoords(index));
+
+		Marching_Cubes mc(&loaded);
+		Mesh mesh;
+		loaded.GetBlocks(&blocks);
+		for(int index : blocks)
+			mc.ProcessHashBlock(index, 0.0, &mesh);
+		float max_error = 0.0f;
+		for(auto &v : mesh.GetVertices())
+			max_error = std::max(max_error, std::abs(v.norm() - sphere_radius));
+		std::cout << "paged triangles: " << mesh.GetTriangles().size() << ", max distance to the sphere: " << max_error << "\n";
+		ok = ok && !mesh.GetTriangles().empty() && max_error < cell_size;
+
+		std::remove(filename.c_str());
+	}
+
+	std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+	return ok ? 0 : 1;
+}